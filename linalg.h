@@ -0,0 +1,458 @@
+/**
+ * @file linalg.h
+ * @author FeltonCD20@gcc.edu, AllarassemJJ20@gcc.edu
+ * @brief Declarations shared by linalg.c and its parallel counterpart
+ *        parlinalg.c. Link against exactly one of the two.
+ * @date 2022-02-25
+ */
+
+#ifndef LINALG_H
+#define LINALG_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief A dense matrix stored as an array of row pointers
+ */
+typedef struct {
+    size_t nrows; /* The number of rows in the matrix */
+    size_t ncols; /* The number of columns in the matrix */
+    double** vals; /* vals[i][j] is the entry in row i, column j */
+} Matrix;
+
+/**
+ * @brief A lazily evaluated Kronecker product A (x) B
+ *
+ * The factors are borrowed, not copied, so they must outlive the operator.
+ */
+typedef struct {
+    Matrix* A; /* The left factor */
+    Matrix* B; /* The right factor */
+    size_t nrows; /* A.nrows * B.nrows */
+    size_t ncols; /* A.ncols * B.ncols */
+} Kronecker;
+
+/**
+ * @brief A matrix stored as a grid of tiles
+ *
+ * Each tile is a Matrix whose rows share one contiguous block of memory. Tiles
+ * on the bottom and right edges are smaller when the tile size does not divide
+ * the matrix size. Tiles belong to the TiledMatrix and must not be passed to
+ * deinit_Matrix or delete_Matrix.
+ */
+typedef struct {
+    size_t nrows; /* The number of rows in the whole matrix */
+    size_t ncols; /* The number of columns in the whole matrix */
+    size_t tile_rows; /* The number of rows in a full tile */
+    size_t tile_cols; /* The number of columns in a full tile */
+    size_t grid_rows; /* The number of tiles down the matrix */
+    size_t grid_cols; /* The number of tiles across the matrix */
+    Matrix* tiles; /* Tile (bi, bj) is tiles[bi*grid_cols + bj] */
+} TiledMatrix;
+
+/**
+ * @brief A square-tiled matrix whose tiles are stored in Morton (Z) order
+ *
+ * The matrix is padded with zeros to a grid of side by side tiles, where side
+ * is a power of two, so every quadrant at every level of recursion is one
+ * contiguous run of vals. Each tile is stored row-major.
+ */
+typedef struct {
+    size_t nrows; /* The number of rows in the matrix, excluding padding */
+    size_t ncols; /* The number of columns in the matrix, excluding padding */
+    size_t tile; /* The number of rows and columns in a tile */
+    size_t side; /* The number of tiles along each side of the padded grid */
+    double* vals; /* side*side tiles of tile*tile values each */
+} ZMatrix;
+
+/**
+ * @brief A batch of equally sized small matrices stored interleaved
+ *
+ * Entry (i, j) of every matrix in the batch is stored next to each other, so
+ * kernels can vectorize across the batch rather than within one matrix.
+ */
+typedef struct {
+    size_t count; /* The number of matrices in the batch */
+    size_t nrows; /* The number of rows in each matrix */
+    size_t ncols; /* The number of columns in each matrix */
+    double* vals; /* Entry (i, j) of matrix b is vals[(i*ncols + j)*count + b] */
+} MatrixBatch;
+
+/**
+ * @brief A dense tensor with any number of dimensions
+ *
+ * Values are stored contiguously in row-major order, i.e. the last index
+ * varies fastest. A tensor with no dimensions holds a single value.
+ */
+typedef struct {
+    size_t ndims; /* The number of dimensions */
+    size_t* dims; /* The extent of each dimension */
+    double* vals; /* The values, last index fastest */
+} Tensor;
+
+/**
+ * @brief A precomputed evaluation order for an einsum expression
+ *
+ * The contents are private to the library; see new_EinsumPlan.
+ */
+typedef struct EinsumPlan EinsumPlan;
+
+/**
+ * @brief A sparse matrix in compressed sparse row (CSR) form
+ *
+ * The entries of each row are stored together, sorted by column, with no
+ * column repeated within a row.
+ */
+typedef struct {
+    size_t nrows; /* The number of rows in the matrix */
+    size_t ncols; /* The number of columns in the matrix */
+    size_t nnz; /* The number of stored entries */
+    size_t* rowptr; /* Row i is stored at positions rowptr[i] to rowptr[i+1]-1 */
+    size_t* colind; /* The column of each stored entry */
+    double* vals; /* The value of each stored entry */
+} SparseMatrix;
+
+/**
+ * @brief A hypersparse matrix in doubly compressed sparse row (DCSR) form
+ *
+ * Like SparseMatrix, but only the non-empty rows are listed, so no array is
+ * as long as the number of rows. Each listed row has at least one entry.
+ */
+typedef struct {
+    size_t nrows; /* The number of rows in the matrix */
+    size_t ncols; /* The number of columns in the matrix */
+    size_t nzrows; /* The number of non-empty rows */
+    size_t nnz; /* The number of stored entries */
+    size_t* rowind; /* The index of each non-empty row, in increasing order */
+    size_t* rowptr; /* Non-empty row r is stored at positions rowptr[r] to rowptr[r+1]-1 */
+    size_t* colind; /* The column of each stored entry */
+    double* vals; /* The value of each stored entry */
+} HypersparseMatrix;
+
+/**
+ * @brief A sparse Cholesky factorization stored by supernodes
+ *
+ * The contents are private to the library; see new_SparseCholesky.
+ */
+typedef struct SparseCholesky SparseCholesky;
+
+/**
+ * @brief A sparse LU factorization with row pivoting
+ *
+ * The contents are private to the library; see new_SparseLU.
+ */
+typedef struct SparseLU SparseLU;
+
+/**
+ * @brief A smoothed-aggregation algebraic multigrid hierarchy
+ *
+ * The contents are private to the library; see new_AMG.
+ */
+typedef struct AMG AMG;
+
+/**
+ * @brief A thin singular value decomposition kept for repeated solves
+ *
+ * The contents are private to the library; see new_SVD.
+ */
+typedef struct SVD SVD;
+
+/**
+ * @brief A function applied by Matrix_map to a batch of n entries
+ *
+ * It sets y[t] from x[t] for each t < n; n is at most MATRIX_MAP_CHUNK.
+ */
+typedef void (*MatrixMapFunc)(const double* x, double* y, size_t n, void* ctx);
+
+/**
+ * @brief A function applied by Matrix_zip_map to a batch of n pairs of entries
+ *
+ * It sets z[t] from x[t] and y[t] for each t < n; n is at most
+ * MATRIX_MAP_CHUNK.
+ */
+typedef void (*MatrixZipMapFunc)(const double* x, const double* y, double* z, size_t n, void* ctx);
+
+/**
+ * @brief A function applied by Matrix_map_reduce to a batch of n entries
+ *
+ * It returns the reduction of its map of x[t] over t < n; n is at most
+ * MATRIX_MAP_CHUNK.
+ */
+typedef double (*MatrixMapReduceFunc)(const double* x, size_t n, void* ctx);
+
+//Creation and deletion of matrices.
+Matrix* new_Matrix(size_t nrows, size_t ncols);
+void init_Matrix(Matrix* M, size_t nrows, size_t ncols);
+void deinit_Matrix(Matrix* M);
+void delete_Matrix(Matrix* M);
+
+//Access to individual entries.
+double Matrix_get(Matrix* M, size_t i, size_t j);
+int Matrix_put(Matrix* M, size_t i, size_t j, double val);
+
+//Basic operations.
+Matrix* Matrix_add(Matrix* A, Matrix* B);
+double Matrix_l1(Matrix* A);
+double Matrix_l2(Matrix* A);
+Matrix* Matrix_mult(Matrix* A, Matrix* B);
+int Matrix_gemm(double alpha, Matrix* A, bool transA, Matrix* B, bool transB,
+                double beta, Matrix* C);
+
+//Kronecker products.
+Matrix* Matrix_kron(Matrix* A, Matrix* B);
+Kronecker* new_Kronecker(Matrix* A, Matrix* B);
+void delete_Kronecker(Kronecker* K);
+Matrix* Kronecker_mult_vec(Kronecker* K, Matrix* x);
+
+//Tiled matrices.
+TiledMatrix* new_TiledMatrix(size_t nrows, size_t ncols, size_t tile_rows, size_t tile_cols);
+void init_TiledMatrix(TiledMatrix* T, size_t nrows, size_t ncols, size_t tile_rows, size_t tile_cols);
+void deinit_TiledMatrix(TiledMatrix* T);
+void delete_TiledMatrix(TiledMatrix* T);
+Matrix* TiledMatrix_tile(TiledMatrix* T, size_t bi, size_t bj);
+TiledMatrix* Matrix_to_TiledMatrix(Matrix* M, size_t tile_rows, size_t tile_cols);
+Matrix* TiledMatrix_to_Matrix(TiledMatrix* T);
+TiledMatrix* TiledMatrix_add(TiledMatrix* A, TiledMatrix* B);
+TiledMatrix* TiledMatrix_mult(TiledMatrix* A, TiledMatrix* B);
+double TiledMatrix_l1(TiledMatrix* A);
+double TiledMatrix_l2(TiledMatrix* A);
+void TiledMatrix_foreach(TiledMatrix* T, void (*fn)(Matrix* tile, size_t bi, size_t bj, void* arg), void* arg);
+
+//Morton-ordered matrices.
+ZMatrix* new_ZMatrix(size_t nrows, size_t ncols, size_t tile);
+void init_ZMatrix(ZMatrix* Z, size_t nrows, size_t ncols, size_t tile);
+void deinit_ZMatrix(ZMatrix* Z);
+void delete_ZMatrix(ZMatrix* Z);
+ZMatrix* Matrix_to_ZMatrix(Matrix* M, size_t tile);
+Matrix* ZMatrix_to_Matrix(ZMatrix* Z);
+ZMatrix* ZMatrix_mult(ZMatrix* A, ZMatrix* B);
+ZMatrix* ZMatrix_transpose(ZMatrix* A);
+
+//Batches of small matrices.
+MatrixBatch* new_MatrixBatch(size_t count, size_t nrows, size_t ncols);
+void init_MatrixBatch(MatrixBatch* A, size_t count, size_t nrows, size_t ncols);
+void deinit_MatrixBatch(MatrixBatch* A);
+void delete_MatrixBatch(MatrixBatch* A);
+double MatrixBatch_get(MatrixBatch* A, size_t b, size_t i, size_t j);
+int MatrixBatch_put(MatrixBatch* A, size_t b, size_t i, size_t j, double val);
+MatrixBatch* MatrixBatch_add(MatrixBatch* A, MatrixBatch* B);
+MatrixBatch* MatrixBatch_mult(MatrixBatch* A, MatrixBatch* B);
+int MatrixBatch_det(MatrixBatch* A, double* det);
+MatrixBatch* MatrixBatch_inverse(MatrixBatch* A);
+int MatrixBatch_lu(MatrixBatch* A, size_t* piv);
+int MatrixBatch_lu_solve(MatrixBatch* LU, size_t* piv, MatrixBatch* B);
+int MatrixBatch_cholesky(MatrixBatch* A);
+int MatrixBatch_cholesky_solve(MatrixBatch* L, MatrixBatch* B);
+
+//Tensors.
+Tensor* new_Tensor(size_t ndims, const size_t* dims);
+void init_Tensor(Tensor* T, size_t ndims, const size_t* dims);
+void deinit_Tensor(Tensor* T);
+void delete_Tensor(Tensor* T);
+size_t Tensor_size(Tensor* T);
+double Tensor_get(Tensor* T, const size_t* idx);
+int Tensor_put(Tensor* T, const size_t* idx, double val);
+Tensor* Matrix_stack(Matrix** Ms, size_t count);
+Matrix* Tensor_slice(Tensor* T, size_t b);
+Tensor* Tensor_batched_mult(Tensor* A, Tensor* B);
+Tensor* Tensor_contract(Tensor* A, const size_t* axesA, Tensor* B, const size_t* axesB, size_t naxes);
+
+//Einsum expressions.
+EinsumPlan* new_EinsumPlan(const char* spec, Tensor** operands, size_t noperands);
+void delete_EinsumPlan(EinsumPlan* P);
+double EinsumPlan_cost(EinsumPlan* P);
+Tensor* EinsumPlan_execute(EinsumPlan* P, Tensor** operands);
+Tensor* Tensor_einsum(const char* spec, Tensor** operands, size_t noperands);
+
+//Convolution.
+Matrix* Matrix_conv2d(Matrix* A, Matrix* K, size_t pad, size_t stride);
+Matrix* Matrix_correlate2d(Matrix* A, Matrix* K, size_t pad, size_t stride);
+Matrix* Matrix_conv2d_fft(Matrix* A, Matrix* K, size_t pad, size_t stride);
+
+//Stencil sweeps.
+int Matrix_jacobi(Matrix* U, Matrix* F, double center, double neighbor, size_t nsteps);
+int Matrix_gauss_seidel(Matrix* U, Matrix* F, double center, double neighbor, size_t nsweeps);
+
+//Sparse matrices.
+SparseMatrix* new_SparseMatrix(size_t nrows, size_t ncols, size_t nnz);
+void init_SparseMatrix(SparseMatrix* S, size_t nrows, size_t ncols, size_t nnz);
+void deinit_SparseMatrix(SparseMatrix* S);
+void delete_SparseMatrix(SparseMatrix* S);
+SparseMatrix* SparseMatrix_from_triplets(size_t nrows, size_t ncols, size_t nnz,
+                                         const size_t* rows, const size_t* cols, const double* vals);
+SparseMatrix* Matrix_to_SparseMatrix(Matrix* M);
+Matrix* SparseMatrix_to_Matrix(SparseMatrix* S);
+double SparseMatrix_get(SparseMatrix* S, size_t i, size_t j);
+Matrix* SparseMatrix_mult_vec(SparseMatrix* A, Matrix* x);
+SparseMatrix* SparseMatrix_transpose(SparseMatrix* A);
+Matrix* SparseMatrix_mult_vec_trans(SparseMatrix* A, Matrix* x);
+
+//Sparse reordering.
+size_t* SparseMatrix_rcm(SparseMatrix* A);
+size_t* SparseMatrix_nested_dissection(SparseMatrix* A);
+SparseMatrix* SparseMatrix_permute(SparseMatrix* A, const size_t* rowperm, const size_t* colperm);
+size_t SparseMatrix_bandwidth(SparseMatrix* A);
+size_t SparseMatrix_profile(SparseMatrix* A);
+
+//Sparse Cholesky factorization.
+SparseCholesky* new_SparseCholesky(SparseMatrix* A, const size_t* perm);
+void delete_SparseCholesky(SparseCholesky* F);
+int SparseCholesky_factor(SparseCholesky* F, SparseMatrix* A);
+Matrix* SparseCholesky_solve(SparseCholesky* F, Matrix* B);
+size_t SparseCholesky_nnz(SparseCholesky* F);
+
+//Sparse LU factorization.
+SparseLU* new_SparseLU(SparseMatrix* A, const size_t* perm, double tol);
+void delete_SparseLU(SparseLU* F);
+Matrix* SparseLU_solve(SparseLU* F, Matrix* B);
+size_t SparseLU_nnz(SparseLU* F);
+
+//Sparse products and iterative solvers.
+SparseMatrix* SparseMatrix_mult(SparseMatrix* A, SparseMatrix* B);
+Matrix* SparseMatrix_mult_matrix(SparseMatrix* A, Matrix* X);
+SparseMatrix* SparseMatrix_sddmm(SparseMatrix* S, Matrix* A, Matrix* B);
+AMG* new_AMG(SparseMatrix* A, double theta);
+void delete_AMG(AMG* M);
+Matrix* AMG_apply(AMG* M, Matrix* b);
+size_t AMG_levels(AMG* M);
+int SparseMatrix_cg(SparseMatrix* A, Matrix* b, Matrix* x, AMG* M, double tol, size_t maxiter, size_t* iters);
+int SparseMatrix_block_cg(SparseMatrix* A, Matrix* B, Matrix* X, AMG* M, double tol, size_t maxiter, size_t* iters);
+int SparseMatrix_block_gmres(SparseMatrix* A, Matrix* B, Matrix* X, AMG* M, size_t restart,
+                             double tol, size_t maxiter, size_t* iters);
+
+//QR factorization with column pivoting.
+int Matrix_qrcp(Matrix* A, double* tau, size_t* perm, double tol, size_t* rank);
+Matrix* Matrix_lstsq(Matrix* A, Matrix* B, double tol, size_t* rank);
+
+//Hypersparse matrices.
+HypersparseMatrix* new_HypersparseMatrix(size_t nrows, size_t ncols, size_t nzrows, size_t nnz);
+void init_HypersparseMatrix(HypersparseMatrix* H, size_t nrows, size_t ncols, size_t nzrows, size_t nnz);
+void deinit_HypersparseMatrix(HypersparseMatrix* H);
+void delete_HypersparseMatrix(HypersparseMatrix* H);
+HypersparseMatrix* SparseMatrix_to_HypersparseMatrix(SparseMatrix* S);
+SparseMatrix* HypersparseMatrix_to_SparseMatrix(HypersparseMatrix* H);
+Matrix* HypersparseMatrix_mult_vec(HypersparseMatrix* H, Matrix* x);
+HypersparseMatrix* HypersparseMatrix_mult(HypersparseMatrix* A, HypersparseMatrix* B);
+
+//Eigenvalues.
+int Matrix_hessenberg(Matrix* A, Matrix* Q);
+int Matrix_eig(Matrix* A, double* wr, double* wi, Matrix* T, Matrix* Z, Matrix* V);
+
+//Sylvester and Lyapunov equations.
+int Matrix_sylvester_schur(Matrix* R, Matrix* S, Matrix* F);
+Matrix* Matrix_sylvester(Matrix* A, Matrix* B, Matrix* C);
+Matrix* Matrix_lyapunov(Matrix* A, Matrix* C);
+
+//Singular value decomposition.
+int Matrix_svd(Matrix* A, double* s, Matrix* U, Matrix* V);
+Matrix* Matrix_pinv(Matrix* A, double tol);
+SVD* new_SVD(Matrix* A);
+void delete_SVD(SVD* F);
+const double* SVD_values(SVD* F);
+Matrix* SVD_solve(SVD* F, Matrix* B, double lambda, double tol);
+Matrix* SVD_ridge_path(SVD* F, Matrix* b, const double* lambda, size_t count);
+
+//Nonnegative matrix factorization.
+int Matrix_nmf(Matrix* X, Matrix* W, Matrix* H, bool hals, double tol, size_t maxiter, size_t* iters);
+int SparseMatrix_nmf(SparseMatrix* X, Matrix* W, Matrix* H, bool hals, double tol, size_t maxiter, size_t* iters);
+
+//Element-wise math functions.
+Matrix* Matrix_exp(Matrix* A, bool fast);
+Matrix* Matrix_log(Matrix* A, bool fast);
+Matrix* Matrix_sqrt(Matrix* A, bool fast);
+Matrix* Matrix_tanh(Matrix* A, bool fast);
+
+//Element-wise maps and reductions.
+Matrix* Matrix_map(Matrix* A, MatrixMapFunc f, void* ctx);
+Matrix* Matrix_zip_map(Matrix* A, Matrix* B, MatrixZipMapFunc f, void* ctx);
+double Matrix_map_reduce(Matrix* A, MatrixMapReduceFunc f, double (*combine)(double, double), double init,
+                         void* ctx);
+
+/**
+ * @brief The most entries passed to a map callback at once
+ */
+#define MATRIX_MAP_CHUNK 1024
+
+/**
+ * @brief Expands to a pragma when compiled with OpenMP, and to nothing otherwise
+ */
+#ifdef _OPENMP
+#define LINALG_PRAGMA(x) _Pragma(#x)
+#else
+#define LINALG_PRAGMA(x)
+#endif
+
+/**
+ * @brief Sets B(i,j) to expr for every entry, x standing for A(i,j) in expr
+ *
+ * The inline counterpart of Matrix_map: expr is expanded into the loop, so
+ * there is no call per entry and the compiler can vectorize it. B must
+ * already have the shape of A, and may be A itself. The rows are split
+ * between threads when the caller is compiled with OpenMP.
+ */
+#define MATRIX_MAP(B, A, x, expr) do { \
+    Matrix* linalg_a_ = (A), * linalg_b_ = (B); \
+    LINALG_PRAGMA(omp parallel for num_threads(2)) \
+    for (size_t linalg_i_ = 0; linalg_i_ < linalg_a_->nrows; linalg_i_++) { \
+        const double* linalg_x_ = linalg_a_->vals[linalg_i_]; \
+        double* linalg_y_ = linalg_b_->vals[linalg_i_]; \
+        LINALG_PRAGMA(omp simd) \
+        for (size_t linalg_j_ = 0; linalg_j_ < linalg_a_->ncols; linalg_j_++) { \
+            double x = linalg_x_[linalg_j_]; \
+            linalg_y_[linalg_j_] = (expr); \
+        } \
+    } \
+} while (0)
+
+/**
+ * @brief Sets C(i,j) to expr for every entry, x and y standing for A(i,j)
+ *        and B(i,j) in expr
+ *
+ * The inline counterpart of Matrix_zip_map; see MATRIX_MAP. A, B and C must
+ * have the same shape, and C may be A or B.
+ */
+#define MATRIX_ZIP_MAP(C, A, B, x, y, expr) do { \
+    Matrix* linalg_a_ = (A), * linalg_b_ = (B), * linalg_c_ = (C); \
+    LINALG_PRAGMA(omp parallel for num_threads(2)) \
+    for (size_t linalg_i_ = 0; linalg_i_ < linalg_a_->nrows; linalg_i_++) { \
+        const double* linalg_x_ = linalg_a_->vals[linalg_i_]; \
+        const double* linalg_y_ = linalg_b_->vals[linalg_i_]; \
+        double* linalg_z_ = linalg_c_->vals[linalg_i_]; \
+        LINALG_PRAGMA(omp simd) \
+        for (size_t linalg_j_ = 0; linalg_j_ < linalg_a_->ncols; linalg_j_++) { \
+            double x = linalg_x_[linalg_j_], y = linalg_y_[linalg_j_]; \
+            linalg_z_[linalg_j_] = (expr); \
+        } \
+    } \
+} while (0)
+
+/**
+ * @brief Sets sum to the total of expr over every entry, x standing for
+ *        A(i,j) in expr
+ *
+ * The inline counterpart of Matrix_map_reduce for sums; see MATRIX_MAP.
+ * Unlike Matrix_map_reduce, the order of the additions depends on the
+ * number of threads.
+ */
+#define MATRIX_MAP_SUM(sum, A, x, expr) do { \
+    Matrix* linalg_a_ = (A); \
+    double linalg_s_ = 0.0; \
+    LINALG_PRAGMA(omp parallel for num_threads(2) reduction(+: linalg_s_)) \
+    for (size_t linalg_i_ = 0; linalg_i_ < linalg_a_->nrows; linalg_i_++) { \
+        const double* linalg_x_ = linalg_a_->vals[linalg_i_]; \
+        LINALG_PRAGMA(omp simd reduction(+: linalg_s_)) \
+        for (size_t linalg_j_ = 0; linalg_j_ < linalg_a_->ncols; linalg_j_++) { \
+            double x = linalg_x_[linalg_j_]; \
+            linalg_s_ += (expr); \
+        } \
+    } \
+    (sum) = linalg_s_; \
+} while (0)
+
+//Random matrices.
+int Matrix_random_uniform(Matrix* A, double lo, double hi, uint64_t seed);
+int Matrix_random_normal(Matrix* A, double mean, double sd, uint64_t seed);
+
+#endif
@@ -11,6 +11,9 @@
 #include <math.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
 
 #include "linalg.h"
 
@@ -278,4 +281,10885 @@ Matrix* Matrix_mult(Matrix* A, Matrix* B) {
 
     //Now return the result.
     return ret;
+}
+
+/**
+ * @brief Computes C = alpha*op(A)*op(B) + beta*C in place.
+ *
+ * op(X) is X itself or its transpose depending on the matching trans flag, so
+ * transposed products never need an explicit transposed copy. Unlike
+ * Matrix_mult, any conforming shapes are accepted. The product is computed in
+ * cache-sized blocks: a block of op(B) and a block of op(A) are copied into
+ * contiguous buffers, and the innermost loop runs along a row of C.
+ *
+ * @param alpha the scale applied to op(A)*op(B)
+ * @param A the matrix on the left hand side of the product
+ * @param transA whether op(A) is the transpose of A
+ * @param B the matrix on the right hand side of the product
+ * @param transB whether op(B) is the transpose of B
+ * @param beta the scale applied to C before the product is added
+ * @param C the matrix that receives the result
+ * @return 0 if the operation was successful, otherwise 1
+ */
+int Matrix_gemm(double alpha, Matrix* A, bool transA, Matrix* B, bool transB,
+                double beta, Matrix* C) {
+    const size_t MB = 64; /* Rows of C per block */
+    const size_t KB = 128; /* Depth of the product per block */
+    const size_t NB = 256; /* Columns of C per block */
+    size_t m, n, k; /* op(A) is m by k, op(B) is k by n */
+    size_t kB; /* The number of rows of op(B) */
+    double* Bp; /* Contiguous copy of the current block of op(B) */
+
+    //If the arguments are invalid, return 1.
+    if (A == NULL || B == NULL || C == NULL || A->vals == NULL || B->vals == NULL || C->vals == NULL) {
+        return 1;
+    }
+    m = transA ? A->ncols : A->nrows;
+    k = transA ? A->nrows : A->ncols;
+    kB = transB ? B->ncols : B->nrows;
+    n = transB ? B->nrows : B->ncols;
+    if (k != kB || C->nrows != m || C->ncols != n) {
+        return 1;
+    }
+
+    //Scale C first. beta == 0 overwrites so that NaNs already in C do not survive.
+#   pragma omp parallel for num_threads(2)
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) {
+            C->vals[i][j] = (beta == 0.0) ? 0.0 : beta * C->vals[i][j];
+        }
+    }
+    if (alpha == 0.0 || k == 0) {
+        return 0;
+    }
+
+    Bp = (double*) malloc(sizeof(double) * KB * NB);
+    for (size_t j0 = 0; j0 < n; j0 += NB) {
+        size_t nb = (n - j0 < NB) ? n - j0 : NB; /* Columns in this block */
+        for (size_t k0 = 0; k0 < k; k0 += KB) {
+            size_t kb = (k - k0 < KB) ? k - k0 : KB; /* Depth of this block */
+
+            //Pack the block of op(B) so its rows are contiguous.
+            for (size_t p = 0; p < kb; p++) {
+                for (size_t j = 0; j < nb; j++) {
+                    Bp[p * nb + j] = transB ? B->vals[j0 + j][k0 + p] : B->vals[k0 + p][j0 + j];
+                }
+            }
+
+            //Every block of rows of C is updated independently of the others.
+#           pragma omp parallel for num_threads(2) schedule(dynamic)
+            for (size_t i0 = 0; i0 < m; i0 += MB) {
+                size_t mb = (m - i0 < MB) ? m - i0 : MB; /* Rows in this block */
+                double* Ap = (double*) malloc(sizeof(double) * MB * KB); /* Packed, scaled op(A) */
+                for (size_t i = 0; i < mb; i++) {
+                    for (size_t p = 0; p < kb; p++) {
+                        Ap[i * kb + p] = alpha * (transA ? A->vals[k0 + p][i0 + i] : A->vals[i0 + i][k0 + p]);
+                    }
+                }
+                for (size_t i = 0; i < mb; i++) {
+                    double* crow = C->vals[i0 + i] + j0; /* The part of row i of C in this block */
+                    for (size_t p = 0; p < kb; p++) {
+                        double a = Ap[i * kb + p];
+                        const double* brow = Bp + p * nb;
+                        if (a == 0.0) {
+                            continue;
+                        }
+                        for (size_t j = 0; j < nb; j++) {
+                            crow[j] += a * brow[j];
+                        }
+                    }
+                }
+                free(Ap);
+            }
+        }
+    }
+    free(Bp);
+
+    return 0;
+}
+
+/**
+ * @brief Computes the Kronecker product A (x) B explicitly
+ *
+ * The result has A.nrows*B.nrows rows and A.ncols*B.ncols columns, and entry
+ * [i*B.nrows + r, j*B.ncols + s] is A[i,j]*B[r,s]. Prefer a Kronecker operator
+ * (see new_Kronecker) when only products with vectors are needed.
+ *
+ * @param A the left factor
+ * @param B the right factor
+ * @return Matrix* representing A (x) B or NULL if either matrix is invalid
+ */
+Matrix* Matrix_kron(Matrix* A, Matrix* B) {
+    Matrix* ret; /* The Kronecker product that will be returned */
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || B == NULL || A->vals == NULL || B->vals == NULL) {
+        return NULL;
+    }
+
+    //Assign ret to a new Matrix of the proper dimensions.
+    ret = new_Matrix(A->nrows * B->nrows, A->ncols * B->ncols);
+
+    //Each row of ret is one row of B scaled by the entries of one row of A.
+#   pragma omp parallel for num_threads(2) collapse(2)
+    for (size_t i = 0; i < A->nrows; i++) {
+        for (size_t r = 0; r < B->nrows; r++) {
+            double* row = ret->vals[i * B->nrows + r]; /* The row of ret being filled */
+            for (size_t j = 0; j < A->ncols; j++) {
+                double a = A->vals[i][j];
+                for (size_t s = 0; s < B->ncols; s++) {
+                    row[j * B->ncols + s] = a * B->vals[r][s];
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Creates an operator that represents A (x) B without forming it
+ *
+ * A and B are borrowed: they are not copied, and delete_Kronecker does not
+ * free them.
+ *
+ * @param A the left factor
+ * @param B the right factor
+ * @return Kronecker* the new operator or NULL if either matrix is invalid
+ */
+Kronecker* new_Kronecker(Matrix* A, Matrix* B) {
+    Kronecker* K; /* The operator to return */
+
+    //If the factors are invalid, return NULL.
+    if (A == NULL || B == NULL || A->vals == NULL || B->vals == NULL) {
+        return NULL;
+    }
+
+    K = (Kronecker*) malloc(sizeof(Kronecker));
+    K->A = A;
+    K->B = B;
+    K->nrows = A->nrows * B->nrows;
+    K->ncols = A->ncols * B->ncols;
+    return K;
+}
+
+/**
+ * @brief Frees a Kronecker operator created by new_Kronecker
+ *
+ * The factors are left untouched.
+ *
+ * @param K the operator to be deleted
+ */
+void delete_Kronecker(Kronecker* K) {
+    free(K);
+}
+
+/**
+ * @brief Computes the product (A (x) B)x of a Kronecker operator and a vector
+ *
+ * This uses the identity (A (x) B)vec(X) = vec(B X A^T), where vec stacks the
+ * columns of a matrix, so the cost is two products with the factors instead of
+ * one with the full operator. The two products are done in whichever order
+ * needs fewer multiplications.
+ *
+ * @param K the operator
+ * @param x a column vector (K.ncols by 1)
+ * @return Matrix* the column vector (A (x) B)x or NULL if the operation is invalid
+ */
+Matrix* Kronecker_mult_vec(Kronecker* K, Matrix* x) {
+    Matrix* ret; /* The product that will be returned */
+    Matrix X; /* x reshaped to B.ncols by A.ncols */
+    Matrix T; /* The intermediate product */
+    Matrix Y; /* B X A^T, which is ret reshaped to B.nrows by A.nrows */
+    size_t m, n, p, q; /* A is m by n and B is p by q */
+
+    //If the operation is invalid, return NULL.
+    if (K == NULL || x == NULL || x->vals == NULL || x->nrows != K->ncols || x->ncols != 1) {
+        return NULL;
+    }
+    m = K->A->nrows;
+    n = K->A->ncols;
+    p = K->B->nrows;
+    q = K->B->ncols;
+
+    //Unstack the columns of X from x.
+    init_Matrix(&X, q, n);
+    for (size_t j = 0; j < n; j++) {
+        for (size_t s = 0; s < q; s++) {
+            X.vals[s][j] = x->vals[j * q + s][0];
+        }
+    }
+
+    //Multiply in the cheaper order.
+    init_Matrix(&Y, p, m);
+    if (p * n * (q + m) <= q * m * (n + p)) {
+        init_Matrix(&T, p, n);
+        Matrix_gemm(1.0, K->B, false, &X, false, 0.0, &T);
+        Matrix_gemm(1.0, &T, false, K->A, true, 0.0, &Y);
+    } else {
+        init_Matrix(&T, q, m);
+        Matrix_gemm(1.0, &X, false, K->A, true, 0.0, &T);
+        Matrix_gemm(1.0, K->B, false, &T, false, 0.0, &Y);
+    }
+
+    //Stack the columns of Y into the result.
+    ret = new_Matrix(K->nrows, 1);
+    for (size_t i = 0; i < m; i++) {
+        for (size_t r = 0; r < p; r++) {
+            ret->vals[i * p + r][0] = Y.vals[r][i];
+        }
+    }
+
+    deinit_Matrix(&X);
+    deinit_Matrix(&T);
+    deinit_Matrix(&Y);
+    return ret;
+}
+
+/**
+ * @brief Initialize a tile so that all of its rows share one block of memory
+ *
+ * Tiles made here must be cleaned up with deinit_tile, not deinit_Matrix.
+ *
+ * @param M the tile to be initialized
+ * @param nrows the number of rows in the tile (must be > 0)
+ * @param ncols the number of columns in the tile (must be > 0)
+ */
+static void init_tile(Matrix* M, size_t nrows, size_t ncols) {
+    double* block = (double*) calloc(nrows * ncols, sizeof(double)); /* Storage for every row */
+
+    M->nrows = nrows;
+    M->ncols = ncols;
+    M->vals = (double**) malloc(sizeof(double*) * nrows);
+    for (size_t i = 0; i < nrows; i++) {
+        M->vals[i] = block + i * ncols;
+    }
+}
+
+/**
+ * @brief Clean up the memory allocated by init_tile
+ *
+ * @param M the tile to be cleaned
+ */
+static void deinit_tile(Matrix* M) {
+    if (M->vals == NULL) {
+        return;
+    }
+    free(M->vals[0]);
+    free(M->vals);
+    M->vals = NULL;
+    M->nrows = 0;
+    M->ncols = 0;
+}
+
+/**
+ * @brief Allocate memory and initialize a new tiled matrix of requested size
+ *
+ * @param nrows the number of rows in the new matrix
+ * @param ncols the number of columns in the new matrix
+ * @param tile_rows the number of rows in each full tile
+ * @param tile_cols the number of columns in each full tile
+ * @return TiledMatrix* a pointer to the newly created matrix
+ */
+TiledMatrix* new_TiledMatrix(size_t nrows, size_t ncols, size_t tile_rows, size_t tile_cols) {
+    //Create and return the matrix.
+    TiledMatrix* T = (TiledMatrix*) malloc(sizeof(TiledMatrix)); /* The matrix to return. */
+    init_TiledMatrix(T, nrows, ncols, tile_rows, tile_cols);
+    return T;
+}
+
+/**
+ * @brief Initialize a tiled matrix of the specified size, filled with zeros
+ *
+ * If any of the sizes is 0 then tiles will be set to NULL.
+ *
+ * @param T the tiled matrix to be initialized
+ * @param nrows the number of rows in the matrix (must be > 0)
+ * @param ncols the number of columns in the matrix (must be > 0)
+ * @param tile_rows the number of rows in each full tile (must be > 0)
+ * @param tile_cols the number of columns in each full tile (must be > 0)
+ */
+void init_TiledMatrix(TiledMatrix* T, size_t nrows, size_t ncols, size_t tile_rows, size_t tile_cols) {
+    //If T is NULL, nothing else can be done.
+    if (T == NULL) {
+        return;
+    }
+
+    T->nrows = nrows;
+    T->ncols = ncols;
+    T->tile_rows = tile_rows;
+    T->tile_cols = tile_cols;
+
+    //If any of the sizes are 0, tiles must be NULL.
+    if (nrows == 0 || ncols == 0 || tile_rows == 0 || tile_cols == 0) {
+        T->grid_rows = 0;
+        T->grid_cols = 0;
+        T->tiles = NULL;
+        return;
+    }
+
+    //Create every tile, trimming the ones on the bottom and right edges.
+    T->grid_rows = (nrows + tile_rows - 1) / tile_rows;
+    T->grid_cols = (ncols + tile_cols - 1) / tile_cols;
+    T->tiles = (Matrix*) malloc(sizeof(Matrix) * T->grid_rows * T->grid_cols);
+    for (size_t bi = 0; bi < T->grid_rows; bi++) {
+        for (size_t bj = 0; bj < T->grid_cols; bj++) {
+            size_t r = (nrows - bi * tile_rows < tile_rows) ? nrows - bi * tile_rows : tile_rows;
+            size_t c = (ncols - bj * tile_cols < tile_cols) ? ncols - bj * tile_cols : tile_cols;
+            init_tile(&T->tiles[bi * T->grid_cols + bj], r, c);
+        }
+    }
+}
+
+/**
+ * @brief Clean up any dynamic memory allocated by init_TiledMatrix
+ *
+ * This function does nothing if T or T.tiles is NULL
+ *
+ * @param T the tiled matrix to be cleaned in preparation for deletion
+ */
+void deinit_TiledMatrix(TiledMatrix* T) {
+    //If the matrix or its tiles are null, do nothing.
+    if (T == NULL || T->tiles == NULL) {
+        return;
+    }
+
+    for (size_t t = 0; t < T->grid_rows * T->grid_cols; t++) {
+        deinit_tile(&T->tiles[t]);
+    }
+    free(T->tiles);
+    T->tiles = NULL;
+    T->nrows = 0;
+    T->ncols = 0;
+    T->grid_rows = 0;
+    T->grid_cols = 0;
+}
+
+/**
+ * @brief Frees dynamic memory and deletes a TiledMatrix created by new_TiledMatrix
+ *
+ * @param T the tiled matrix to be deleted safely
+ */
+void delete_TiledMatrix(TiledMatrix* T) {
+    //Do nothing if T is NULL.
+    if (T == NULL) {
+        return;
+    }
+
+    deinit_TiledMatrix(T);
+    free(T);
+}
+
+/**
+ * @brief Retrieves tile (bi, bj) of a tiled matrix
+ *
+ * The tile is a view into T. Its values may be read and changed, but it must
+ * not be deinitialized or deleted.
+ *
+ * @param T the tiled matrix
+ * @param bi the tile row index
+ * @param bj the tile column index
+ * @return Matrix* the tile or NULL if the index was invalid
+ */
+Matrix* TiledMatrix_tile(TiledMatrix* T, size_t bi, size_t bj) {
+    if (T == NULL || T->tiles == NULL || bi >= T->grid_rows || bj >= T->grid_cols) {
+        return NULL;
+    }
+    return &T->tiles[bi * T->grid_cols + bj];
+}
+
+/**
+ * @brief Copies a matrix into a new tiled matrix
+ *
+ * @param M the matrix to copy
+ * @param tile_rows the number of rows in each full tile
+ * @param tile_cols the number of columns in each full tile
+ * @return TiledMatrix* the tiled copy of M or NULL if the arguments are invalid
+ */
+TiledMatrix* Matrix_to_TiledMatrix(Matrix* M, size_t tile_rows, size_t tile_cols) {
+    TiledMatrix* T; /* The tiled copy to return */
+
+    //If the arguments are invalid, return NULL.
+    if (M == NULL || M->vals == NULL || tile_rows == 0 || tile_cols == 0) {
+        return NULL;
+    }
+    T = new_TiledMatrix(M->nrows, M->ncols, tile_rows, tile_cols);
+
+    //Copy every tile independently.
+#   pragma omp parallel for num_threads(2) collapse(2)
+    for (size_t bi = 0; bi < T->grid_rows; bi++) {
+        for (size_t bj = 0; bj < T->grid_cols; bj++) {
+            Matrix* tile = &T->tiles[bi * T->grid_cols + bj]; /* The tile being filled */
+            for (size_t i = 0; i < tile->nrows; i++) {
+                for (size_t j = 0; j < tile->ncols; j++) {
+                    tile->vals[i][j] = M->vals[bi * tile_rows + i][bj * tile_cols + j];
+                }
+            }
+        }
+    }
+
+    return T;
+}
+
+/**
+ * @brief Copies a tiled matrix back into an ordinary matrix
+ *
+ * @param T the tiled matrix to copy
+ * @return Matrix* the copy of T or NULL if T is invalid
+ */
+Matrix* TiledMatrix_to_Matrix(TiledMatrix* T) {
+    Matrix* ret; /* The copy to return */
+
+    //If the argument is invalid, return NULL.
+    if (T == NULL || T->tiles == NULL) {
+        return NULL;
+    }
+    ret = new_Matrix(T->nrows, T->ncols);
+
+    //Copy every tile independently.
+#   pragma omp parallel for num_threads(2) collapse(2)
+    for (size_t bi = 0; bi < T->grid_rows; bi++) {
+        for (size_t bj = 0; bj < T->grid_cols; bj++) {
+            Matrix* tile = &T->tiles[bi * T->grid_cols + bj]; /* The tile being copied */
+            for (size_t i = 0; i < tile->nrows; i++) {
+                for (size_t j = 0; j < tile->ncols; j++) {
+                    ret->vals[bi * T->tile_rows + i][bj * T->tile_cols + j] = tile->vals[i][j];
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Compute the sum of two tiled matrices A and B i.e. A+B
+ *
+ * This function will return NULL if the matrices do not have the same size and
+ * the same tile size.
+ *
+ * @param A The first matrix to include in the sum
+ * @param B The second matrix to include in the sum
+ * @return TiledMatrix* representing A+B or NULL if the operation is invalid
+ */
+TiledMatrix* TiledMatrix_add(TiledMatrix* A, TiledMatrix* B) {
+    TiledMatrix* ret; /* The sum of A and B that will be returned */
+
+    //If the operation is invalid, return NULL.
+    //This is split into two if statements for readability.
+    if (A == NULL || B == NULL || A->tiles == NULL || B->tiles == NULL) {
+        return NULL;
+    }
+    if (A->nrows != B->nrows || A->ncols != B->ncols || A->tile_rows != B->tile_rows || A->tile_cols != B->tile_cols) {
+        return NULL;
+    }
+    ret = new_TiledMatrix(A->nrows, A->ncols, A->tile_rows, A->tile_cols);
+
+    //Add tile by tile. Each tile is contiguous, so it is added as one long row.
+#   pragma omp parallel for num_threads(2) schedule(dynamic)
+    for (size_t t = 0; t < ret->grid_rows * ret->grid_cols; t++) {
+        size_t len = ret->tiles[t].nrows * ret->tiles[t].ncols; /* Values in this tile */
+        const double* a = A->tiles[t].vals[0];
+        const double* b = B->tiles[t].vals[0];
+        double* c = ret->tiles[t].vals[0];
+        for (size_t k = 0; k < len; k++) {
+            c[k] = a[k] + b[k];
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Computes the product AB of two tiled matrices
+ *
+ * This operation is only defined if A.ncols == B.nrows and the tiles line up,
+ * i.e. A.tile_cols == B.tile_rows. Tile (i, j) of the result is the sum over k
+ * of the products of tiles (i, k) of A and (k, j) of B, and every tile of the
+ * result is computed independently.
+ *
+ * @param A the matrix on the left hand side of the product
+ * @param B the matrix on the right hand side of the product
+ * @return TiledMatrix* representing AB or NULL if the operation is invalid
+ */
+TiledMatrix* TiledMatrix_mult(TiledMatrix* A, TiledMatrix* B) {
+    TiledMatrix* ret; /* The product of A and B that will be returned */
+
+    //If the operation is invalid, return NULL.
+    //This is split into two if statements for readability.
+    if (A == NULL || B == NULL || A->tiles == NULL || B->tiles == NULL) {
+        return NULL;
+    }
+    if (A->ncols != B->nrows || A->tile_cols != B->tile_rows) {
+        return NULL;
+    }
+    ret = new_TiledMatrix(A->nrows, B->ncols, A->tile_rows, B->tile_cols);
+
+    //Every tile of the result is a sum of tile products.
+#   pragma omp parallel for num_threads(2) collapse(2) schedule(dynamic)
+    for (size_t bi = 0; bi < ret->grid_rows; bi++) {
+        for (size_t bj = 0; bj < ret->grid_cols; bj++) {
+            Matrix* C = &ret->tiles[bi * ret->grid_cols + bj]; /* The tile being computed */
+            for (size_t bk = 0; bk < A->grid_cols; bk++) {
+                Matrix_gemm(1.0, &A->tiles[bi * A->grid_cols + bk], false,
+                            &B->tiles[bk * B->grid_cols + bj], false, 1.0, C);
+            }
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Compute the entry-wise L1 norm of a tiled matrix A
+ *
+ * @param A the matrix for which the L1 norm should be computed
+ * @return double the entry-wise L1 norm of A
+ */
+double TiledMatrix_l1(TiledMatrix* A) {
+    double result = 0; /* The result to return */
+
+    //First, check for errors.
+    if (A == NULL || A->tiles == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    //Each tile is contiguous, so it is summed as one long row.
+#   pragma omp parallel for num_threads(2) reduction(+: result)
+    for (size_t t = 0; t < A->grid_rows * A->grid_cols; t++) {
+        size_t len = A->tiles[t].nrows * A->tiles[t].ncols; /* Values in this tile */
+        const double* a = A->tiles[t].vals[0];
+        for (size_t k = 0; k < len; k++) {
+            result += fabs(a[k]);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * @brief Compute the entry-wise L2 norm of a tiled matrix A
+ *
+ * @param A the matrix for which the L2 norm should be computed
+ * @return double the entry-wise L2 norm of A
+ */
+double TiledMatrix_l2(TiledMatrix* A) {
+    double ret = 0; /* Holds the sum of squares */
+
+    //If A is null, return 0.
+    if (A == NULL || A->tiles == NULL) {
+        return 0;
+    }
+
+    //Each tile is contiguous, so it is summed as one long row.
+#   pragma omp parallel for num_threads(2) reduction(+: ret)
+    for (size_t t = 0; t < A->grid_rows * A->grid_cols; t++) {
+        size_t len = A->tiles[t].nrows * A->tiles[t].ncols; /* Values in this tile */
+        const double* a = A->tiles[t].vals[0];
+        for (size_t k = 0; k < len; k++) {
+            ret += a[k] * a[k];
+        }
+    }
+
+    return sqrt(ret);
+}
+
+/**
+ * @brief Calls fn once for every tile of T
+ *
+ * Tiles are handed out to threads one at a time as threads become free, so
+ * tiles that take different amounts of work still keep every thread busy. fn
+ * may be called for several tiles at once and must only modify the tile it
+ * is given.
+ *
+ * @param T the tiled matrix
+ * @param fn the function to call with each tile and its tile row and column
+ * @param arg passed through to fn unchanged
+ */
+void TiledMatrix_foreach(TiledMatrix* T, void (*fn)(Matrix* tile, size_t bi, size_t bj, void* arg), void* arg) {
+    //If the arguments are invalid, do nothing.
+    if (T == NULL || T->tiles == NULL || fn == NULL) {
+        return;
+    }
+
+#   pragma omp parallel for num_threads(2) collapse(2) schedule(dynamic)
+    for (size_t bi = 0; bi < T->grid_rows; bi++) {
+        for (size_t bj = 0; bj < T->grid_cols; bj++) {
+            fn(&T->tiles[bi * T->grid_cols + bj], bi, bj, arg);
+        }
+    }
+}
+
+/**
+ * @brief Computes the Morton (Z-order) index of tile (bi, bj)
+ *
+ * The bits of bi and bj are interleaved with the bits of bi in the higher
+ * position, so the quadrants of any aligned block come in the order top left,
+ * top right, bottom left, bottom right.
+ *
+ * @param bi the tile row index
+ * @param bj the tile column index
+ * @return size_t the position of the tile in Morton order
+ */
+static size_t morton_index(size_t bi, size_t bj) {
+    size_t ret = 0; /* The interleaved index */
+
+    for (size_t b = 0; (bi >> b) != 0 || (bj >> b) != 0; b++) {
+        ret |= ((bj >> b) & 1) << (2 * b);
+        ret |= ((bi >> b) & 1) << (2 * b + 1);
+    }
+    return ret;
+}
+
+/**
+ * @brief Allocate memory and initialize a new Morton-ordered matrix
+ *
+ * @param nrows the number of rows in the new matrix
+ * @param ncols the number of columns in the new matrix
+ * @param tile the number of rows and columns in each tile
+ * @return ZMatrix* a pointer to the newly created matrix
+ */
+ZMatrix* new_ZMatrix(size_t nrows, size_t ncols, size_t tile) {
+    //Create and return the matrix.
+    ZMatrix* Z = (ZMatrix*) malloc(sizeof(ZMatrix)); /* The matrix to return. */
+    init_ZMatrix(Z, nrows, ncols, tile);
+    return Z;
+}
+
+/**
+ * @brief Initialize a Morton-ordered matrix of the specified size, filled with zeros
+ *
+ * If any of the sizes is 0 then vals will be set to NULL.
+ *
+ * @param Z the matrix to be initialized
+ * @param nrows the number of rows in the matrix (must be > 0)
+ * @param ncols the number of columns in the matrix (must be > 0)
+ * @param tile the number of rows and columns in each tile (must be > 0)
+ */
+void init_ZMatrix(ZMatrix* Z, size_t nrows, size_t ncols, size_t tile) {
+    size_t need; /* The number of tiles needed along the longer side */
+
+    //If Z is NULL, nothing else can be done.
+    if (Z == NULL) {
+        return;
+    }
+
+    Z->nrows = nrows;
+    Z->ncols = ncols;
+    Z->tile = tile;
+
+    //If any of the sizes are 0, vals must be NULL.
+    if (nrows == 0 || ncols == 0 || tile == 0) {
+        Z->side = 0;
+        Z->vals = NULL;
+        return;
+    }
+
+    //Pad the grid of tiles up to a power of two on each side.
+    need = ((nrows > ncols ? nrows : ncols) + tile - 1) / tile;
+    Z->side = 1;
+    while (Z->side < need) {
+        Z->side *= 2;
+    }
+    Z->vals = (double*) calloc(Z->side * Z->side * tile * tile, sizeof(double));
+}
+
+/**
+ * @brief Clean up any dynamic memory allocated by init_ZMatrix
+ *
+ * This function does nothing if Z or Z.vals is NULL
+ *
+ * @param Z the matrix to be cleaned in preparation for deletion
+ */
+void deinit_ZMatrix(ZMatrix* Z) {
+    //If the matrix or its vals field are null, do nothing.
+    if (Z == NULL || Z->vals == NULL) {
+        return;
+    }
+
+    free(Z->vals);
+    Z->vals = NULL;
+    Z->nrows = 0;
+    Z->ncols = 0;
+    Z->side = 0;
+}
+
+/**
+ * @brief Frees dynamic memory and deletes a ZMatrix created by new_ZMatrix
+ *
+ * @param Z the matrix to be deleted safely
+ */
+void delete_ZMatrix(ZMatrix* Z) {
+    //Do nothing if Z is NULL.
+    if (Z == NULL) {
+        return;
+    }
+
+    deinit_ZMatrix(Z);
+    free(Z);
+}
+
+/**
+ * @brief Copies a matrix into a new Morton-ordered matrix
+ *
+ * @param M the matrix to copy
+ * @param tile the number of rows and columns in each tile
+ * @return ZMatrix* the copy of M or NULL if the arguments are invalid
+ */
+ZMatrix* Matrix_to_ZMatrix(Matrix* M, size_t tile) {
+    ZMatrix* Z; /* The copy to return */
+
+    //If the arguments are invalid, return NULL.
+    if (M == NULL || M->vals == NULL || tile == 0) {
+        return NULL;
+    }
+    Z = new_ZMatrix(M->nrows, M->ncols, tile);
+
+    //Copy each row of tiles independently, one tile row segment at a time.
+#   pragma omp parallel for num_threads(2)
+    for (size_t i = 0; i < M->nrows; i++) {
+        for (size_t j0 = 0; j0 < M->ncols; j0 += tile) {
+            size_t len = (M->ncols - j0 < tile) ? M->ncols - j0 : tile; /* Values in this segment */
+            double* dst = Z->vals + morton_index(i / tile, j0 / tile) * tile * tile + (i % tile) * tile;
+            for (size_t j = 0; j < len; j++) {
+                dst[j] = M->vals[i][j0 + j];
+            }
+        }
+    }
+
+    return Z;
+}
+
+/**
+ * @brief Copies a Morton-ordered matrix back into an ordinary matrix
+ *
+ * @param Z the matrix to copy
+ * @return Matrix* the copy of Z without its padding or NULL if Z is invalid
+ */
+Matrix* ZMatrix_to_Matrix(ZMatrix* Z) {
+    Matrix* ret; /* The copy to return */
+    size_t tile; /* Shorthand for Z.tile */
+
+    //If the argument is invalid, return NULL.
+    if (Z == NULL || Z->vals == NULL) {
+        return NULL;
+    }
+    tile = Z->tile;
+    ret = new_Matrix(Z->nrows, Z->ncols);
+
+#   pragma omp parallel for num_threads(2)
+    for (size_t i = 0; i < Z->nrows; i++) {
+        for (size_t j0 = 0; j0 < Z->ncols; j0 += tile) {
+            size_t len = (Z->ncols - j0 < tile) ? Z->ncols - j0 : tile; /* Values in this segment */
+            const double* src = Z->vals + morton_index(i / tile, j0 / tile) * tile * tile + (i % tile) * tile;
+            for (size_t j = 0; j < len; j++) {
+                ret->vals[i][j0 + j] = src[j];
+            }
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Finds one quadrant of a Morton-ordered block
+ *
+ * A block whose side is smaller than the current level stands for the top left
+ * corner of a larger block that is zero everywhere else, so only its first
+ * quadrant exists. NULL stands for a block of zeros.
+ *
+ * @param X the block, or NULL for zeros
+ * @param sx the side of X in tiles
+ * @param s the side of the current level in tiles (sx <= s)
+ * @param q the quadrant, 0 to 3 in Morton order
+ * @param qsize the number of values in a quadrant of the current level
+ * @param sq receives the side of the quadrant in tiles
+ * @return double* the quadrant or NULL if it is all zeros
+ */
+static double* morton_quadrant(double* X, size_t sx, size_t s, int q, size_t qsize, size_t* sq) {
+    if (X == NULL) {
+        *sq = 0;
+        return NULL;
+    }
+    if (sx < s) {
+        *sq = sx;
+        return (q == 0) ? X : NULL;
+    }
+    *sq = s / 2;
+    return X + q * qsize;
+}
+
+/**
+ * @brief Recursively adds the product of two Morton-ordered blocks into a third
+ *
+ * At each level the blocks are split into quadrants, which are contiguous, and
+ * the eight quadrant products are accumulated; single tiles are multiplied
+ * directly. The four quadrants of C are independent, so near the top of the
+ * recursion they are computed as separate tasks.
+ *
+ * @param C the block that receives the product, or NULL to discard it
+ * @param sc the side of C in tiles
+ * @param A the left block, or NULL for zeros
+ * @param sa the side of A in tiles
+ * @param B the right block, or NULL for zeros
+ * @param sb the side of B in tiles
+ * @param s the side of the current level in tiles
+ * @param tile the number of rows and columns in a tile
+ * @param depth the current depth of recursion
+ */
+static void morton_mult(double* C, size_t sc, double* A, size_t sa, double* B, size_t sb,
+                        size_t s, size_t tile, int depth) {
+    size_t qsize; /* The number of values in a quadrant of this level */
+    double* Cq[4]; /* The quadrants of C */
+    double* Aq[4]; /* The quadrants of A */
+    double* Bq[4]; /* The quadrants of B */
+    size_t scq, saq, sbq; /* The sides of the quadrants */
+
+    if (C == NULL || A == NULL || B == NULL) {
+        return;
+    }
+
+    //Multiply single tiles directly, running along rows of C and B.
+    if (s == 1) {
+        for (size_t i = 0; i < tile; i++) {
+            double* crow = C + i * tile;
+            for (size_t k = 0; k < tile; k++) {
+                double a = A[i * tile + k];
+                const double* brow = B + k * tile;
+                for (size_t j = 0; j < tile; j++) {
+                    crow[j] += a * brow[j];
+                }
+            }
+        }
+        return;
+    }
+
+    //Split every block into quadrants.
+    qsize = (s / 2) * (s / 2) * tile * tile;
+    for (int q = 0; q < 4; q++) {
+        Cq[q] = morton_quadrant(C, sc, s, q, qsize, &scq);
+        Aq[q] = morton_quadrant(A, sa, s, q, qsize, &saq);
+        Bq[q] = morton_quadrant(B, sb, s, q, qsize, &sbq);
+    }
+
+    //C[r][c] += A[r][0]*B[0][c] + A[r][1]*B[1][c] for each quadrant of C.
+    for (int r = 0; r < 2; r++) {
+        for (int c = 0; c < 2; c++) {
+#           pragma omp task if(depth < 3) firstprivate(r, c)
+            {
+                morton_mult(Cq[2 * r + c], scq, Aq[2 * r], saq, Bq[c], sbq, s / 2, tile, depth + 1);
+                morton_mult(Cq[2 * r + c], scq, Aq[2 * r + 1], saq, Bq[2 + c], sbq, s / 2, tile, depth + 1);
+            }
+        }
+    }
+#   pragma omp taskwait
+}
+
+/**
+ * @brief Computes the product AB of two Morton-ordered matrices
+ *
+ * This operation is only defined if A.ncols == B.nrows and both matrices use
+ * the same tile size. The matrices do not need the same padding: a smaller
+ * grid is treated as the top left corner of a larger one.
+ *
+ * @param A the matrix on the left hand side of the product
+ * @param B the matrix on the right hand side of the product
+ * @return ZMatrix* representing AB or NULL if the operation is invalid
+ */
+ZMatrix* ZMatrix_mult(ZMatrix* A, ZMatrix* B) {
+    ZMatrix* ret; /* The product of A and B that will be returned */
+    size_t s; /* The side of the largest grid in tiles */
+
+    //If the operation is invalid, return NULL.
+    //This is split into two if statements for readability.
+    if (A == NULL || B == NULL || A->vals == NULL || B->vals == NULL) {
+        return NULL;
+    }
+    if (A->ncols != B->nrows || A->tile != B->tile) {
+        return NULL;
+    }
+    ret = new_ZMatrix(A->nrows, B->ncols, A->tile);
+
+    s = ret->side;
+    if (A->side > s) {
+        s = A->side;
+    }
+    if (B->side > s) {
+        s = B->side;
+    }
+
+#   pragma omp parallel num_threads(2)
+#   pragma omp single
+    {
+        morton_mult(ret->vals, ret->side, A->vals, A->side, B->vals, B->side, s, A->tile, 0);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Recursively transposes a Morton-ordered block into another
+ *
+ * The transpose swaps the two off-diagonal quadrants and transposes every
+ * quadrant in place of itself, so each level only reorders contiguous runs.
+ *
+ * @param dst the block that receives the transpose
+ * @param src the block to transpose
+ * @param s the side of both blocks in tiles
+ * @param tile the number of rows and columns in a tile
+ * @param depth the current depth of recursion
+ */
+static void morton_transpose(double* dst, const double* src, size_t s, size_t tile, int depth) {
+    size_t qsize; /* The number of values in a quadrant of this level */
+    const int swap[4] = {0, 2, 1, 3}; /* The quadrant of src that lands in each quadrant of dst */
+
+    //Transpose single tiles directly.
+    if (s == 1) {
+        for (size_t i = 0; i < tile; i++) {
+            for (size_t j = 0; j < tile; j++) {
+                dst[j * tile + i] = src[i * tile + j];
+            }
+        }
+        return;
+    }
+
+    qsize = (s / 2) * (s / 2) * tile * tile;
+    for (int q = 0; q < 4; q++) {
+#       pragma omp task if(depth < 3) firstprivate(q)
+        morton_transpose(dst + q * qsize, src + swap[q] * qsize, s / 2, tile, depth + 1);
+    }
+#   pragma omp taskwait
+}
+
+/**
+ * @brief Computes the transpose of a Morton-ordered matrix
+ *
+ * @param A the matrix to transpose
+ * @return ZMatrix* the transpose of A or NULL if A is invalid
+ */
+ZMatrix* ZMatrix_transpose(ZMatrix* A) {
+    ZMatrix* ret; /* The transpose that will be returned */
+
+    //If the argument is invalid, return NULL.
+    if (A == NULL || A->vals == NULL) {
+        return NULL;
+    }
+    ret = new_ZMatrix(A->ncols, A->nrows, A->tile);
+
+#   pragma omp parallel num_threads(2)
+#   pragma omp single
+    {
+        morton_transpose(ret->vals, A->vals, A->side, A->tile, 0);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Allocate memory and initialize a new batch of matrices
+ *
+ * @param count the number of matrices in the batch
+ * @param nrows the number of rows in each matrix
+ * @param ncols the number of columns in each matrix
+ * @return MatrixBatch* a pointer to the newly created batch
+ */
+MatrixBatch* new_MatrixBatch(size_t count, size_t nrows, size_t ncols) {
+    //Create and return the batch.
+    MatrixBatch* A = (MatrixBatch*) malloc(sizeof(MatrixBatch)); /* The batch to return. */
+    init_MatrixBatch(A, count, nrows, ncols);
+    return A;
+}
+
+/**
+ * @brief Initialize a batch of zero matrices of the specified size
+ *
+ * If any of the sizes is 0 then vals will be set to NULL.
+ *
+ * @param A the batch to be initialized
+ * @param count the number of matrices in the batch (must be > 0)
+ * @param nrows the number of rows in each matrix (must be > 0)
+ * @param ncols the number of columns in each matrix (must be > 0)
+ */
+void init_MatrixBatch(MatrixBatch* A, size_t count, size_t nrows, size_t ncols) {
+    //If A is NULL, nothing else can be done.
+    if (A == NULL) {
+        return;
+    }
+
+    A->count = count;
+    A->nrows = nrows;
+    A->ncols = ncols;
+
+    //If any of the sizes are 0, vals must be NULL.
+    if (count == 0 || nrows == 0 || ncols == 0) {
+        A->vals = NULL;
+        return;
+    }
+    A->vals = (double*) calloc(count * nrows * ncols, sizeof(double));
+}
+
+/**
+ * @brief Clean up any dynamic memory allocated by init_MatrixBatch
+ *
+ * This function does nothing if A or A.vals is NULL
+ *
+ * @param A the batch to be cleaned in preparation for deletion
+ */
+void deinit_MatrixBatch(MatrixBatch* A) {
+    //If the batch or its vals field are null, do nothing.
+    if (A == NULL || A->vals == NULL) {
+        return;
+    }
+
+    free(A->vals);
+    A->vals = NULL;
+    A->count = 0;
+    A->nrows = 0;
+    A->ncols = 0;
+}
+
+/**
+ * @brief Frees dynamic memory and deletes a MatrixBatch created by new_MatrixBatch
+ *
+ * @param A the batch to be deleted safely
+ */
+void delete_MatrixBatch(MatrixBatch* A) {
+    //Do nothing if A is NULL.
+    if (A == NULL) {
+        return;
+    }
+
+    deinit_MatrixBatch(A);
+    free(A);
+}
+
+/**
+ * @brief Retrieves entry [i,j] of matrix b in a batch
+ *
+ * @param A the batch
+ * @param b the index of the matrix in the batch
+ * @param i the row index of the desired value
+ * @param j the column index of the desired value
+ * @return double the value stored in that entry or 0.0 if invalid
+ *         ** if the index was invalid, errno should be set to EINVAL **
+ */
+double MatrixBatch_get(MatrixBatch* A, size_t b, size_t i, size_t j) {
+    //If the arguments are invalid, set errno and return 0.0.
+    if (A == NULL || A->vals == NULL || b >= A->count || i >= A->nrows || j >= A->ncols) {
+        errno = EINVAL;
+        return 0.0;
+    }
+
+    return A->vals[(i * A->ncols + j) * A->count + b];
+}
+
+/**
+ * @brief Store val in entry [i,j] of matrix b in a batch
+ *
+ * @param A the batch to be modified
+ * @param b the index of the matrix in the batch
+ * @param i the row index where val will be stored
+ * @param j the column index where val will be stored
+ * @param val the value to be stored
+ * @return 0 if the operation was successful, otherwise 1
+ */
+int MatrixBatch_put(MatrixBatch* A, size_t b, size_t i, size_t j, double val) {
+    //If the arguments are invalid, return 1.
+    if (A == NULL || A->vals == NULL || b >= A->count || i >= A->nrows || j >= A->ncols) {
+        return 1;
+    }
+
+    A->vals[(i * A->ncols + j) * A->count + b] = val;
+    return 0;
+}
+
+/**
+ * @brief Compute the sum A+B of every pair of matrices in two batches
+ *
+ * This function will return NULL if the batches do not have the same count
+ * and matrix size.
+ *
+ * @param A The first batch to include in the sum
+ * @param B The second batch to include in the sum
+ * @return MatrixBatch* representing A+B or NULL if the operation is invalid
+ */
+MatrixBatch* MatrixBatch_add(MatrixBatch* A, MatrixBatch* B) {
+    MatrixBatch* ret; /* The sum of A and B that will be returned */
+    size_t len; /* The number of values in each batch */
+
+    //If the operation is invalid, return NULL.
+    //This is split into two if statements for readability.
+    if (A == NULL || B == NULL || A->vals == NULL || B->vals == NULL) {
+        return NULL;
+    }
+    if (A->count != B->count || A->nrows != B->nrows || A->ncols != B->ncols) {
+        return NULL;
+    }
+    ret = new_MatrixBatch(A->count, A->nrows, A->ncols);
+
+    //The layout is the same for all three batches, so this is one long loop.
+    len = A->count * A->nrows * A->ncols;
+#   pragma omp parallel for simd num_threads(2)
+    for (size_t k = 0; k < len; k++) {
+        ret->vals[k] = A->vals[k] + B->vals[k];
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Computes the product AB of every pair of matrices in two batches
+ *
+ * This operation is only defined if the batches have the same count and
+ * A.ncols == B.nrows. The batch is split into chunks; for each chunk the usual
+ * triple loop runs over the entries and the innermost loop runs across the
+ * matrices of the chunk, which are contiguous.
+ *
+ * @param A the batch on the left hand side of the product
+ * @param B the batch on the right hand side of the product
+ * @return MatrixBatch* representing AB or NULL if the operation is invalid
+ */
+MatrixBatch* MatrixBatch_mult(MatrixBatch* A, MatrixBatch* B) {
+    const size_t CHUNK = 256; /* Matrices handled together by one thread */
+    MatrixBatch* ret; /* The product of A and B that will be returned */
+    size_t count; /* Shorthand for the batch count */
+
+    //If the operation is invalid, return NULL.
+    //This is split into two if statements for readability.
+    if (A == NULL || B == NULL || A->vals == NULL || B->vals == NULL) {
+        return NULL;
+    }
+    if (A->count != B->count || A->ncols != B->nrows) {
+        return NULL;
+    }
+    count = A->count;
+    ret = new_MatrixBatch(count, A->nrows, B->ncols);
+
+#   pragma omp parallel for num_threads(2)
+    for (size_t lo = 0; lo < count; lo += CHUNK) {
+        size_t hi = (count - lo < CHUNK) ? count : lo + CHUNK; /* End of this chunk */
+        for (size_t i = 0; i < A->nrows; i++) {
+            for (size_t j = 0; j < B->ncols; j++) {
+                double* c = ret->vals + (i * B->ncols + j) * count; /* Entry (i, j) of every product */
+                for (size_t k = 0; k < A->ncols; k++) {
+                    const double* a = A->vals + (i * A->ncols + k) * count;
+                    const double* b = B->vals + (k * B->ncols + j) * count;
+#                   pragma omp simd
+                    for (size_t l = lo; l < hi; l++) {
+                        c[l] += a[l] * b[l];
+                    }
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Computes the determinant of every matrix in a batch
+ *
+ * Matrices of size 1, 2 and 3 use closed forms that vectorize across the
+ * batch. Larger matrices are factored with MatrixBatch_lu.
+ *
+ * @param A the batch of square matrices
+ * @param det receives the determinant of matrix b in det[b] (A.count values)
+ * @return 0 if the operation was successful, otherwise 1
+ */
+int MatrixBatch_det(MatrixBatch* A, double* det) {
+    size_t count; /* Shorthand for the batch count */
+    size_t n; /* The size of every matrix */
+    const double* a; /* Shorthand for A.vals */
+
+    //If the arguments are invalid, return 1.
+    if (A == NULL || A->vals == NULL || det == NULL || A->nrows != A->ncols) {
+        return 1;
+    }
+    count = A->count;
+    n = A->nrows;
+    a = A->vals;
+
+    if (n == 1) {
+#       pragma omp parallel for simd num_threads(2)
+        for (size_t b = 0; b < count; b++) {
+            det[b] = a[b];
+        }
+    } else if (n == 2) {
+#       pragma omp parallel for simd num_threads(2)
+        for (size_t b = 0; b < count; b++) {
+            det[b] = a[b] * a[3 * count + b] - a[count + b] * a[2 * count + b];
+        }
+    } else if (n == 3) {
+        //Expand along the first row.
+#       pragma omp parallel for simd num_threads(2)
+        for (size_t b = 0; b < count; b++) {
+            double a00 = a[b], a01 = a[count + b], a02 = a[2 * count + b];
+            double a10 = a[3 * count + b], a11 = a[4 * count + b], a12 = a[5 * count + b];
+            double a20 = a[6 * count + b], a21 = a[7 * count + b], a22 = a[8 * count + b];
+            det[b] = a00 * (a11 * a22 - a12 * a21)
+                   - a01 * (a10 * a22 - a12 * a20)
+                   + a02 * (a10 * a21 - a11 * a20);
+        }
+    } else {
+        //Factor a copy of the batch; the determinant is the signed product of the pivots.
+        MatrixBatch LU; /* The factors of every matrix */
+        size_t* piv = (size_t*) malloc(sizeof(size_t) * n * count); /* The row swaps */
+        init_MatrixBatch(&LU, count, n, n);
+#       pragma omp parallel for simd num_threads(2)
+        for (size_t k = 0; k < count * n * n; k++) {
+            LU.vals[k] = a[k];
+        }
+        MatrixBatch_lu(&LU, piv);
+#       pragma omp parallel for simd num_threads(2)
+        for (size_t b = 0; b < count; b++) {
+            double d = 1.0;
+            for (size_t k = 0; k < n; k++) {
+                d *= (piv[k * count + b] == k) ? LU.vals[(k * n + k) * count + b] : -LU.vals[(k * n + k) * count + b];
+            }
+            det[b] = d;
+        }
+        deinit_MatrixBatch(&LU);
+        free(piv);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Computes the inverse of every matrix in a batch
+ *
+ * Matrices of size 1, 2 and 3 are inverted with closed forms (the adjugate
+ * divided by the determinant) that vectorize across the batch. Larger matrices
+ * are factored with MatrixBatch_lu and solved against the identity. A singular
+ * matrix produces infinite or NaN entries in its inverse without affecting the
+ * rest of the batch.
+ *
+ * @param A the batch of square matrices
+ * @return MatrixBatch* the batch of inverses or NULL if the operation is invalid
+ */
+MatrixBatch* MatrixBatch_inverse(MatrixBatch* A) {
+    MatrixBatch* ret; /* The inverses that will be returned */
+    size_t count; /* Shorthand for the batch count */
+    size_t n; /* The size of every matrix */
+    const double* a; /* Shorthand for A.vals */
+    double* r; /* Shorthand for ret.vals */
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || A->vals == NULL || A->nrows != A->ncols) {
+        return NULL;
+    }
+    count = A->count;
+    n = A->nrows;
+    ret = new_MatrixBatch(count, n, n);
+    a = A->vals;
+    r = ret->vals;
+
+    if (n == 1) {
+#       pragma omp parallel for simd num_threads(2)
+        for (size_t b = 0; b < count; b++) {
+            r[b] = 1.0 / a[b];
+        }
+    } else if (n == 2) {
+#       pragma omp parallel for simd num_threads(2)
+        for (size_t b = 0; b < count; b++) {
+            double a00 = a[b], a01 = a[count + b], a10 = a[2 * count + b], a11 = a[3 * count + b];
+            double s = 1.0 / (a00 * a11 - a01 * a10);
+            r[b] = a11 * s;
+            r[count + b] = -a01 * s;
+            r[2 * count + b] = -a10 * s;
+            r[3 * count + b] = a00 * s;
+        }
+    } else if (n == 3) {
+#       pragma omp parallel for simd num_threads(2)
+        for (size_t b = 0; b < count; b++) {
+            double a00 = a[b], a01 = a[count + b], a02 = a[2 * count + b];
+            double a10 = a[3 * count + b], a11 = a[4 * count + b], a12 = a[5 * count + b];
+            double a20 = a[6 * count + b], a21 = a[7 * count + b], a22 = a[8 * count + b];
+            double c00 = a11 * a22 - a12 * a21; /* Cofactors of the first row */
+            double c01 = a12 * a20 - a10 * a22;
+            double c02 = a10 * a21 - a11 * a20;
+            double s = 1.0 / (a00 * c00 + a01 * c01 + a02 * c02);
+            r[b] = c00 * s;
+            r[count + b] = (a02 * a21 - a01 * a22) * s;
+            r[2 * count + b] = (a01 * a12 - a02 * a11) * s;
+            r[3 * count + b] = c01 * s;
+            r[4 * count + b] = (a00 * a22 - a02 * a20) * s;
+            r[5 * count + b] = (a02 * a10 - a00 * a12) * s;
+            r[6 * count + b] = c02 * s;
+            r[7 * count + b] = (a01 * a20 - a00 * a21) * s;
+            r[8 * count + b] = (a00 * a11 - a01 * a10) * s;
+        }
+    } else {
+        //Factor a copy of the batch and solve against the identity.
+        MatrixBatch LU; /* The factors of every matrix */
+        size_t* piv = (size_t*) malloc(sizeof(size_t) * n * count); /* The row swaps */
+        init_MatrixBatch(&LU, count, n, n);
+#       pragma omp parallel for simd num_threads(2)
+        for (size_t k = 0; k < count * n * n; k++) {
+            LU.vals[k] = a[k];
+            r[k] = ((k / count) % (n + 1) == 0) ? 1.0 : 0.0;
+        }
+        MatrixBatch_lu(&LU, piv);
+        MatrixBatch_lu_solve(&LU, piv, ret);
+        deinit_MatrixBatch(&LU);
+        free(piv);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Factors matrices lo to hi-1 of a batch as PA = LU in place
+ *
+ * Entry (i, j) of every matrix is a contiguous run of the batch, so apart from
+ * the row swaps every step is a loop across the matrices. Callers pass n as a
+ * literal so that the compiler can specialize and fully unroll the loops over
+ * the rows and columns for each small size.
+ *
+ * @param a the interleaved values of the batch
+ * @param piv receives the row swapped with row k of matrix l in piv[k*count + l]
+ * @param count the number of matrices in the whole batch
+ * @param n the size of every matrix
+ * @param lo the first matrix to factor
+ * @param hi one past the last matrix to factor
+ */
+static inline void batch_lu_kernel(double* a, size_t* piv, size_t count, size_t n, size_t lo, size_t hi) {
+    double best[hi - lo]; /* The largest entry found so far in the pivot column */
+    size_t p[hi - lo]; /* The row holding that entry */
+
+    for (size_t k = 0; k < n; k++) {
+        //Find the pivot of every matrix at once.
+        const double* akk = a + (k * n + k) * count;
+        for (size_t l = lo; l < hi; l++) {
+            best[l - lo] = fabs(akk[l]);
+            p[l - lo] = k;
+        }
+        for (size_t i = k + 1; i < n; i++) {
+            const double* aik = a + (i * n + k) * count;
+            for (size_t l = lo; l < hi; l++) {
+                double v = fabs(aik[l]);
+                p[l - lo] = (v > best[l - lo]) ? i : p[l - lo];
+                best[l - lo] = (v > best[l - lo]) ? v : best[l - lo];
+            }
+        }
+
+        //Swap each matrix's pivot row up. The rows differ from matrix to matrix.
+        for (size_t l = lo; l < hi; l++) {
+            size_t r = p[l - lo];
+            piv[k * count + l] = r;
+            if (r == k) {
+                continue;
+            }
+            for (size_t j = 0; j < n; j++) {
+                double t = a[(k * n + j) * count + l];
+                a[(k * n + j) * count + l] = a[(r * n + j) * count + l];
+                a[(r * n + j) * count + l] = t;
+            }
+        }
+
+        //Eliminate below the pivot in every matrix.
+        for (size_t l = lo; l < hi; l++) {
+            best[l - lo] = 1.0 / a[(k * n + k) * count + l];
+        }
+        for (size_t i = k + 1; i < n; i++) {
+            double* aik = a + (i * n + k) * count;
+            for (size_t l = lo; l < hi; l++) {
+                aik[l] *= best[l - lo];
+            }
+            for (size_t j = k + 1; j < n; j++) {
+                double* aij = a + (i * n + j) * count;
+                const double* akj = a + (k * n + j) * count;
+                for (size_t l = lo; l < hi; l++) {
+                    aij[l] -= aik[l] * akj[l];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Solves LUx = Pb for matrices lo to hi-1 of a factored batch
+ *
+ * @param a the interleaved factors from batch_lu_kernel
+ * @param piv the pivots from batch_lu_kernel
+ * @param bv the interleaved right hand sides, overwritten with the solutions
+ * @param count the number of matrices in the whole batch
+ * @param n the size of every matrix
+ * @param nrhs the number of right hand sides per matrix
+ * @param lo the first matrix to solve with
+ * @param hi one past the last matrix to solve with
+ */
+static inline void batch_lu_solve_kernel(const double* a, const size_t* piv, double* bv, size_t count,
+                                         size_t n, size_t nrhs, size_t lo, size_t hi) {
+    for (size_t c = 0; c < nrhs; c++) {
+        //Apply the row swaps in the order they were made.
+        for (size_t k = 0; k < n; k++) {
+            for (size_t l = lo; l < hi; l++) {
+                size_t r = piv[k * count + l];
+                double t = bv[(k * nrhs + c) * count + l];
+                bv[(k * nrhs + c) * count + l] = bv[(r * nrhs + c) * count + l];
+                bv[(r * nrhs + c) * count + l] = t;
+            }
+        }
+
+        //Forward substitution with the unit lower triangle.
+        for (size_t i = 1; i < n; i++) {
+            double* bi = bv + (i * nrhs + c) * count;
+            for (size_t k = 0; k < i; k++) {
+                const double* aik = a + (i * n + k) * count;
+                const double* bk = bv + (k * nrhs + c) * count;
+                for (size_t l = lo; l < hi; l++) {
+                    bi[l] -= aik[l] * bk[l];
+                }
+            }
+        }
+
+        //Back substitution with the upper triangle.
+        for (size_t i = n; i-- > 0;) {
+            double* bi = bv + (i * nrhs + c) * count;
+            const double* aii = a + (i * n + i) * count;
+            for (size_t k = i + 1; k < n; k++) {
+                const double* aik = a + (i * n + k) * count;
+                const double* bk = bv + (k * nrhs + c) * count;
+                for (size_t l = lo; l < hi; l++) {
+                    bi[l] -= aik[l] * bk[l];
+                }
+            }
+            for (size_t l = lo; l < hi; l++) {
+                bi[l] /= aii[l];
+            }
+        }
+    }
+}
+
+/**
+ * @brief Factors matrices lo to hi-1 of a batch as A = LL^T in place
+ *
+ * Only the lower triangle is read and written. As with batch_lu_kernel,
+ * callers pass n as a literal so each small size gets its own unrolled copy.
+ *
+ * @param a the interleaved values of the batch
+ * @param count the number of matrices in the whole batch
+ * @param n the size of every matrix
+ * @param lo the first matrix to factor
+ * @param hi one past the last matrix to factor
+ */
+static inline void batch_cholesky_kernel(double* a, size_t count, size_t n, size_t lo, size_t hi) {
+    for (size_t j = 0; j < n; j++) {
+        double* ajj = a + (j * n + j) * count;
+        for (size_t k = 0; k < j; k++) {
+            const double* ajk = a + (j * n + k) * count;
+            for (size_t l = lo; l < hi; l++) {
+                ajj[l] -= ajk[l] * ajk[l];
+            }
+        }
+        for (size_t l = lo; l < hi; l++) {
+            ajj[l] = sqrt(ajj[l]);
+        }
+        for (size_t i = j + 1; i < n; i++) {
+            double* aij = a + (i * n + j) * count;
+            for (size_t k = 0; k < j; k++) {
+                const double* aik = a + (i * n + k) * count;
+                const double* ajk = a + (j * n + k) * count;
+                for (size_t l = lo; l < hi; l++) {
+                    aij[l] -= aik[l] * ajk[l];
+                }
+            }
+            for (size_t l = lo; l < hi; l++) {
+                aij[l] /= ajj[l];
+            }
+        }
+    }
+}
+
+/**
+ * @brief Solves LL^Tx = b for matrices lo to hi-1 of a factored batch
+ *
+ * @param a the interleaved factors from batch_cholesky_kernel
+ * @param bv the interleaved right hand sides, overwritten with the solutions
+ * @param count the number of matrices in the whole batch
+ * @param n the size of every matrix
+ * @param nrhs the number of right hand sides per matrix
+ * @param lo the first matrix to solve with
+ * @param hi one past the last matrix to solve with
+ */
+static inline void batch_cholesky_solve_kernel(const double* a, double* bv, size_t count,
+                                               size_t n, size_t nrhs, size_t lo, size_t hi) {
+    for (size_t c = 0; c < nrhs; c++) {
+        //Forward substitution with L.
+        for (size_t i = 0; i < n; i++) {
+            double* bi = bv + (i * nrhs + c) * count;
+            for (size_t k = 0; k < i; k++) {
+                const double* aik = a + (i * n + k) * count;
+                const double* bk = bv + (k * nrhs + c) * count;
+                for (size_t l = lo; l < hi; l++) {
+                    bi[l] -= aik[l] * bk[l];
+                }
+            }
+            for (size_t l = lo; l < hi; l++) {
+                bi[l] /= a[(i * n + i) * count + l];
+            }
+        }
+
+        //Back substitution with L^T.
+        for (size_t i = n; i-- > 0;) {
+            double* bi = bv + (i * nrhs + c) * count;
+            for (size_t k = i + 1; k < n; k++) {
+                const double* aki = a + (k * n + i) * count;
+                const double* bk = bv + (k * nrhs + c) * count;
+                for (size_t l = lo; l < hi; l++) {
+                    bi[l] -= aki[l] * bk[l];
+                }
+            }
+            for (size_t l = lo; l < hi; l++) {
+                bi[l] /= a[(i * n + i) * count + l];
+            }
+        }
+    }
+}
+
+/**
+ * @brief Factors every matrix of a batch as PA = LU with partial pivoting
+ *
+ * A is overwritten with the factors: the unit lower triangle of L below the
+ * diagonal and U on and above it. Sizes up to 8 use kernels specialized for
+ * that size. A singular matrix produces infinite or NaN factors without
+ * affecting the rest of the batch.
+ *
+ * @param A the batch of square matrices to factor in place
+ * @param piv receives the row swapped with row k of matrix b in
+ *        piv[k*A.count + b] (A.nrows*A.count values)
+ * @return 0 if the operation was successful, otherwise 1
+ */
+int MatrixBatch_lu(MatrixBatch* A, size_t* piv) {
+    const size_t CHUNK = 64; /* Matrices handled together by one thread */
+
+    //If the arguments are invalid, return 1.
+    if (A == NULL || A->vals == NULL || piv == NULL || A->nrows != A->ncols) {
+        return 1;
+    }
+
+#   pragma omp parallel for num_threads(2)
+    for (size_t lo = 0; lo < A->count; lo += CHUNK) {
+        size_t hi = (A->count - lo < CHUNK) ? A->count : lo + CHUNK; /* End of this chunk */
+        switch (A->nrows) {
+            case 1: batch_lu_kernel(A->vals, piv, A->count, 1, lo, hi); break;
+            case 2: batch_lu_kernel(A->vals, piv, A->count, 2, lo, hi); break;
+            case 3: batch_lu_kernel(A->vals, piv, A->count, 3, lo, hi); break;
+            case 4: batch_lu_kernel(A->vals, piv, A->count, 4, lo, hi); break;
+            case 5: batch_lu_kernel(A->vals, piv, A->count, 5, lo, hi); break;
+            case 6: batch_lu_kernel(A->vals, piv, A->count, 6, lo, hi); break;
+            case 7: batch_lu_kernel(A->vals, piv, A->count, 7, lo, hi); break;
+            case 8: batch_lu_kernel(A->vals, piv, A->count, 8, lo, hi); break;
+            default: batch_lu_kernel(A->vals, piv, A->count, A->nrows, lo, hi); break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Solves Ax = b for every matrix of a batch factored by MatrixBatch_lu
+ *
+ * @param LU the factored batch from MatrixBatch_lu
+ * @param piv the pivots from MatrixBatch_lu
+ * @param B the right hand sides (same count, LU.nrows rows), overwritten with
+ *        the solutions
+ * @return 0 if the operation was successful, otherwise 1
+ */
+int MatrixBatch_lu_solve(MatrixBatch* LU, size_t* piv, MatrixBatch* B) {
+    const size_t CHUNK = 64; /* Matrices handled together by one thread */
+
+    //If the arguments are invalid, return 1.
+    if (LU == NULL || B == NULL || LU->vals == NULL || B->vals == NULL || piv == NULL) {
+        return 1;
+    }
+    if (LU->nrows != LU->ncols || B->count != LU->count || B->nrows != LU->nrows) {
+        return 1;
+    }
+
+#   pragma omp parallel for num_threads(2)
+    for (size_t lo = 0; lo < LU->count; lo += CHUNK) {
+        size_t hi = (LU->count - lo < CHUNK) ? LU->count : lo + CHUNK; /* End of this chunk */
+        switch (LU->nrows) {
+            case 1: batch_lu_solve_kernel(LU->vals, piv, B->vals, LU->count, 1, B->ncols, lo, hi); break;
+            case 2: batch_lu_solve_kernel(LU->vals, piv, B->vals, LU->count, 2, B->ncols, lo, hi); break;
+            case 3: batch_lu_solve_kernel(LU->vals, piv, B->vals, LU->count, 3, B->ncols, lo, hi); break;
+            case 4: batch_lu_solve_kernel(LU->vals, piv, B->vals, LU->count, 4, B->ncols, lo, hi); break;
+            case 5: batch_lu_solve_kernel(LU->vals, piv, B->vals, LU->count, 5, B->ncols, lo, hi); break;
+            case 6: batch_lu_solve_kernel(LU->vals, piv, B->vals, LU->count, 6, B->ncols, lo, hi); break;
+            case 7: batch_lu_solve_kernel(LU->vals, piv, B->vals, LU->count, 7, B->ncols, lo, hi); break;
+            case 8: batch_lu_solve_kernel(LU->vals, piv, B->vals, LU->count, 8, B->ncols, lo, hi); break;
+            default: batch_lu_solve_kernel(LU->vals, piv, B->vals, LU->count, LU->nrows, B->ncols, lo, hi); break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Factors every matrix of a batch as A = LL^T
+ *
+ * Only the lower triangle of each matrix is read, and it is overwritten with
+ * L; the strict upper triangle is left untouched. Sizes up to 8 use kernels
+ * specialized for that size. A matrix that is not positive definite produces
+ * NaN factors without affecting the rest of the batch.
+ *
+ * @param A the batch of symmetric positive definite matrices to factor in place
+ * @return 0 if the operation was successful, otherwise 1
+ */
+int MatrixBatch_cholesky(MatrixBatch* A) {
+    const size_t CHUNK = 64; /* Matrices handled together by one thread */
+
+    //If the arguments are invalid, return 1.
+    if (A == NULL || A->vals == NULL || A->nrows != A->ncols) {
+        return 1;
+    }
+
+#   pragma omp parallel for num_threads(2)
+    for (size_t lo = 0; lo < A->count; lo += CHUNK) {
+        size_t hi = (A->count - lo < CHUNK) ? A->count : lo + CHUNK; /* End of this chunk */
+        switch (A->nrows) {
+            case 1: batch_cholesky_kernel(A->vals, A->count, 1, lo, hi); break;
+            case 2: batch_cholesky_kernel(A->vals, A->count, 2, lo, hi); break;
+            case 3: batch_cholesky_kernel(A->vals, A->count, 3, lo, hi); break;
+            case 4: batch_cholesky_kernel(A->vals, A->count, 4, lo, hi); break;
+            case 5: batch_cholesky_kernel(A->vals, A->count, 5, lo, hi); break;
+            case 6: batch_cholesky_kernel(A->vals, A->count, 6, lo, hi); break;
+            case 7: batch_cholesky_kernel(A->vals, A->count, 7, lo, hi); break;
+            case 8: batch_cholesky_kernel(A->vals, A->count, 8, lo, hi); break;
+            default: batch_cholesky_kernel(A->vals, A->count, A->nrows, lo, hi); break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Solves Ax = b for every matrix of a batch factored by MatrixBatch_cholesky
+ *
+ * @param L the factored batch from MatrixBatch_cholesky
+ * @param B the right hand sides (same count, L.nrows rows), overwritten with
+ *        the solutions
+ * @return 0 if the operation was successful, otherwise 1
+ */
+int MatrixBatch_cholesky_solve(MatrixBatch* L, MatrixBatch* B) {
+    const size_t CHUNK = 64; /* Matrices handled together by one thread */
+
+    //If the arguments are invalid, return 1.
+    if (L == NULL || B == NULL || L->vals == NULL || B->vals == NULL) {
+        return 1;
+    }
+    if (L->nrows != L->ncols || B->count != L->count || B->nrows != L->nrows) {
+        return 1;
+    }
+
+#   pragma omp parallel for num_threads(2)
+    for (size_t lo = 0; lo < L->count; lo += CHUNK) {
+        size_t hi = (L->count - lo < CHUNK) ? L->count : lo + CHUNK; /* End of this chunk */
+        switch (L->nrows) {
+            case 1: batch_cholesky_solve_kernel(L->vals, B->vals, L->count, 1, B->ncols, lo, hi); break;
+            case 2: batch_cholesky_solve_kernel(L->vals, B->vals, L->count, 2, B->ncols, lo, hi); break;
+            case 3: batch_cholesky_solve_kernel(L->vals, B->vals, L->count, 3, B->ncols, lo, hi); break;
+            case 4: batch_cholesky_solve_kernel(L->vals, B->vals, L->count, 4, B->ncols, lo, hi); break;
+            case 5: batch_cholesky_solve_kernel(L->vals, B->vals, L->count, 5, B->ncols, lo, hi); break;
+            case 6: batch_cholesky_solve_kernel(L->vals, B->vals, L->count, 6, B->ncols, lo, hi); break;
+            case 7: batch_cholesky_solve_kernel(L->vals, B->vals, L->count, 7, B->ncols, lo, hi); break;
+            case 8: batch_cholesky_solve_kernel(L->vals, B->vals, L->count, 8, B->ncols, lo, hi); break;
+            default: batch_cholesky_solve_kernel(L->vals, B->vals, L->count, L->nrows, B->ncols, lo, hi); break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Allocate memory and initialize a new tensor of requested size
+ *
+ * @param ndims the number of dimensions
+ * @param dims the extent of each dimension (ndims values)
+ * @return Tensor* a pointer to the newly created tensor
+ */
+Tensor* new_Tensor(size_t ndims, const size_t* dims) {
+    //Create and return the tensor.
+    Tensor* T = (Tensor*) malloc(sizeof(Tensor)); /* The tensor to return. */
+    init_Tensor(T, ndims, dims);
+    return T;
+}
+
+/**
+ * @brief Initialize a tensor of the specified size, filled with zeros
+ *
+ * If any of the dimensions is 0, or dims is NULL while ndims > 0, then vals
+ * will be set to NULL.
+ *
+ * @param T the tensor to be initialized
+ * @param ndims the number of dimensions
+ * @param dims the extent of each dimension (ndims values, each > 0)
+ */
+void init_Tensor(Tensor* T, size_t ndims, const size_t* dims) {
+    size_t total = 1; /* The number of values */
+
+    //If T is NULL, nothing else can be done.
+    if (T == NULL) {
+        return;
+    }
+
+    T->ndims = ndims;
+    T->dims = (size_t*) malloc(sizeof(size_t) * (ndims > 0 ? ndims : 1));
+    for (size_t d = 0; d < ndims; d++) {
+        T->dims[d] = (dims == NULL) ? 0 : dims[d];
+        total *= T->dims[d];
+    }
+
+    //If any of the dimensions are 0, vals must be NULL.
+    if (total == 0) {
+        T->vals = NULL;
+        return;
+    }
+    T->vals = (double*) calloc(total, sizeof(double));
+}
+
+/**
+ * @brief Clean up any dynamic memory allocated by init_Tensor
+ *
+ * This function does nothing if T is NULL
+ *
+ * @param T the tensor to be cleaned in preparation for deletion
+ */
+void deinit_Tensor(Tensor* T) {
+    //If the tensor is null, do nothing.
+    if (T == NULL) {
+        return;
+    }
+
+    free(T->vals);
+    free(T->dims);
+    T->vals = NULL;
+    T->dims = NULL;
+    T->ndims = 0;
+}
+
+/**
+ * @brief Frees dynamic memory and deletes a Tensor created by new_Tensor
+ *
+ * @param T the tensor to be deleted safely
+ */
+void delete_Tensor(Tensor* T) {
+    //Do nothing if T is NULL.
+    if (T == NULL) {
+        return;
+    }
+
+    deinit_Tensor(T);
+    free(T);
+}
+
+/**
+ * @brief Counts the values stored in a tensor
+ *
+ * @param T the tensor
+ * @return size_t the product of the dimensions, or 0 if T is invalid
+ */
+size_t Tensor_size(Tensor* T) {
+    size_t total = 1; /* The number of values */
+
+    if (T == NULL || T->vals == NULL) {
+        return 0;
+    }
+    for (size_t d = 0; d < T->ndims; d++) {
+        total *= T->dims[d];
+    }
+    return total;
+}
+
+/**
+ * @brief Computes the position of a multi-index in a tensor's values
+ *
+ * @param T the tensor
+ * @param idx one index per dimension
+ * @param offset receives the position
+ * @return 0 if the index is valid, otherwise 1
+ */
+static int tensor_offset(Tensor* T, const size_t* idx, size_t* offset) {
+    if (T == NULL || T->vals == NULL || (idx == NULL && T->ndims > 0)) {
+        return 1;
+    }
+
+    *offset = 0;
+    for (size_t d = 0; d < T->ndims; d++) {
+        if (idx[d] >= T->dims[d]) {
+            return 1;
+        }
+        *offset = *offset * T->dims[d] + idx[d];
+    }
+    return 0;
+}
+
+/**
+ * @brief Retrieves the value stored at a multi-index of a tensor
+ *
+ * @param T the tensor
+ * @param idx one index per dimension
+ * @return double the value stored at that index or 0.0 if invalid
+ *         ** if the index was invalid, errno should be set to EINVAL **
+ */
+double Tensor_get(Tensor* T, const size_t* idx) {
+    size_t offset; /* The position of the value */
+
+    //If the arguments are invalid, set errno and return 0.0.
+    if (tensor_offset(T, idx, &offset) != 0) {
+        errno = EINVAL;
+        return 0.0;
+    }
+    return T->vals[offset];
+}
+
+/**
+ * @brief Store val at a multi-index of a tensor
+ *
+ * @param T the tensor to be modified
+ * @param idx one index per dimension
+ * @param val the value to be stored
+ * @return 0 if the operation was successful, otherwise 1
+ */
+int Tensor_put(Tensor* T, const size_t* idx, double val) {
+    size_t offset; /* The position of the value */
+
+    //If the arguments are invalid, return 1.
+    if (tensor_offset(T, idx, &offset) != 0) {
+        return 1;
+    }
+    T->vals[offset] = val;
+    return 0;
+}
+
+/**
+ * @brief Copies a list of equally sized matrices into one 3-D tensor
+ *
+ * Entry [b, i, j] of the result is entry [i, j] of Ms[b].
+ *
+ * @param Ms the matrices to stack
+ * @param count the number of matrices
+ * @return Tensor* the stacked tensor or NULL if the matrices are invalid or
+ *         differ in size
+ */
+Tensor* Matrix_stack(Matrix** Ms, size_t count) {
+    Tensor* ret; /* The stacked tensor to return */
+    size_t dims[3]; /* count by nrows by ncols */
+
+    //If the arguments are invalid, return NULL.
+    if (Ms == NULL || count == 0 || Ms[0] == NULL) {
+        return NULL;
+    }
+    for (size_t b = 0; b < count; b++) {
+        if (Ms[b] == NULL || Ms[b]->vals == NULL || Ms[b]->nrows != Ms[0]->nrows || Ms[b]->ncols != Ms[0]->ncols) {
+            return NULL;
+        }
+    }
+    dims[0] = count;
+    dims[1] = Ms[0]->nrows;
+    dims[2] = Ms[0]->ncols;
+    ret = new_Tensor(3, dims);
+
+#   pragma omp parallel for num_threads(2) collapse(2)
+    for (size_t b = 0; b < count; b++) {
+        for (size_t i = 0; i < dims[1]; i++) {
+            double* dst = ret->vals + (b * dims[1] + i) * dims[2];
+            for (size_t j = 0; j < dims[2]; j++) {
+                dst[j] = Ms[b]->vals[i][j];
+            }
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Copies one matrix out of a 3-D tensor
+ *
+ * @param T the 3-D tensor
+ * @param b the index along the first dimension
+ * @return Matrix* a copy of T[b, :, :] or NULL if the arguments are invalid
+ */
+Matrix* Tensor_slice(Tensor* T, size_t b) {
+    Matrix* ret; /* The slice to return */
+
+    //If the arguments are invalid, return NULL.
+    if (T == NULL || T->vals == NULL || T->ndims != 3 || b >= T->dims[0]) {
+        return NULL;
+    }
+    ret = new_Matrix(T->dims[1], T->dims[2]);
+
+    for (size_t i = 0; i < T->dims[1]; i++) {
+        const double* src = T->vals + (b * T->dims[1] + i) * T->dims[2];
+        for (size_t j = 0; j < T->dims[2]; j++) {
+            ret->vals[i][j] = src[j];
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Computes C += A*B for matrices described by offset tables
+ *
+ * Entry [i, p] of A is A[arow[i] + acol[p]] and entry [p, j] of B is
+ * B[brow[p] + bcol[j]], so any grouping and ordering of tensor axes can be
+ * read as a matrix without first being copied into that shape. Blocks of A and
+ * B are gathered into contiguous buffers as in Matrix_gemm. C is contiguous and
+ * row-major.
+ *
+ * @param m the number of rows of A and C
+ * @param n the number of columns of B and C
+ * @param k the number of columns of A and rows of B
+ * @param A the values of the left operand
+ * @param arow the offset of each row of A
+ * @param acol the offset of each column of A
+ * @param B the values of the right operand
+ * @param brow the offset of each row of B
+ * @param bcol the offset of each column of B
+ * @param C the m by n result, which is added to
+ */
+static void tensor_gemm(size_t m, size_t n, size_t k,
+                        const double* A, const size_t* arow, const size_t* acol,
+                        const double* B, const size_t* brow, const size_t* bcol, double* C) {
+    const size_t MB = 64; /* Rows of C per block */
+    const size_t KB = 128; /* Depth of the product per block */
+    const size_t NB = 256; /* Columns of C per block */
+    double* Bp = (double*) malloc(sizeof(double) * KB * NB); /* Gathered block of B */
+
+    for (size_t j0 = 0; j0 < n; j0 += NB) {
+        size_t nb = (n - j0 < NB) ? n - j0 : NB; /* Columns in this block */
+        for (size_t k0 = 0; k0 < k; k0 += KB) {
+            size_t kb = (k - k0 < KB) ? k - k0 : KB; /* Depth of this block */
+            for (size_t p = 0; p < kb; p++) {
+                for (size_t j = 0; j < nb; j++) {
+                    Bp[p * nb + j] = B[brow[k0 + p] + bcol[j0 + j]];
+                }
+            }
+
+#           pragma omp parallel for num_threads(2) schedule(dynamic)
+            for (size_t i0 = 0; i0 < m; i0 += MB) {
+                size_t mb = (m - i0 < MB) ? m - i0 : MB; /* Rows in this block */
+                double* Ap = (double*) malloc(sizeof(double) * MB * KB); /* Gathered block of A */
+                for (size_t i = 0; i < mb; i++) {
+                    for (size_t p = 0; p < kb; p++) {
+                        Ap[i * kb + p] = A[arow[i0 + i] + acol[k0 + p]];
+                    }
+                }
+                for (size_t i = 0; i < mb; i++) {
+                    double* crow = C + (i0 + i) * n + j0;
+                    for (size_t p = 0; p < kb; p++) {
+                        double a = Ap[i * kb + p];
+                        const double* bp = Bp + p * nb;
+                        for (size_t j = 0; j < nb; j++) {
+                            crow[j] += a * bp[j];
+                        }
+                    }
+                }
+                free(Ap);
+            }
+        }
+    }
+    free(Bp);
+}
+
+/**
+ * @brief Builds the offset table for a group of tensor axes
+ *
+ * The group's indices are enumerated in row-major order (first listed axis
+ * slowest) and each entry is the position that combination of indices adds to
+ * an offset into the tensor's values.
+ *
+ * @param T the tensor
+ * @param axes the axes in the group
+ * @param naxes the number of axes in the group
+ * @param total receives the number of entries in the table
+ * @return size_t* the offset table, to be freed by the caller
+ */
+static size_t* tensor_axis_offsets(Tensor* T, const size_t* axes, size_t naxes, size_t* total) {
+    size_t* table; /* The table to return */
+    size_t* stride = (size_t*) malloc(sizeof(size_t) * (T->ndims > 0 ? T->ndims : 1)); /* Row-major strides */
+
+    for (size_t d = T->ndims; d-- > 0;) {
+        stride[d] = (d + 1 == T->ndims) ? 1 : stride[d + 1] * T->dims[d + 1];
+    }
+
+    //Each axis multiplies the table built so far by its extent.
+    *total = 1;
+    for (size_t a = 0; a < naxes; a++) {
+        *total *= T->dims[axes[a]];
+    }
+    table = (size_t*) malloc(sizeof(size_t) * *total);
+    table[0] = 0;
+    for (size_t a = 0, len = 1; a < naxes; a++) {
+        size_t ext = T->dims[axes[a]];
+        for (size_t t = len; t-- > 0;) {
+            for (size_t x = ext; x-- > 0;) {
+                table[t * ext + x] = table[t] + x * stride[axes[a]];
+            }
+        }
+        len *= ext;
+    }
+
+    free(stride);
+    return table;
+}
+
+/**
+ * @brief Computes the products A[b]*B[b] of two stacks of matrices
+ *
+ * A is batch by m by k and B is batch by k by n; the result is batch by m by n.
+ * The products are independent, so they are spread across threads.
+ *
+ * @param A the 3-D tensor of left hand sides
+ * @param B the 3-D tensor of right hand sides
+ * @return Tensor* the 3-D tensor of products or NULL if the operation is invalid
+ */
+Tensor* Tensor_batched_mult(Tensor* A, Tensor* B) {
+    Tensor* ret; /* The products that will be returned */
+    size_t dims[3]; /* batch by m by n */
+    size_t m, n, k; /* The sizes of each product */
+    size_t *arow, *acol, *brow, *bcol; /* Offset tables shared by every product */
+
+    //If the operation is invalid, return NULL.
+    //This is split into two if statements for readability.
+    if (A == NULL || B == NULL || A->vals == NULL || B->vals == NULL || A->ndims != 3 || B->ndims != 3) {
+        return NULL;
+    }
+    if (A->dims[0] != B->dims[0] || A->dims[2] != B->dims[1]) {
+        return NULL;
+    }
+    m = A->dims[1];
+    k = A->dims[2];
+    n = B->dims[2];
+    dims[0] = A->dims[0];
+    dims[1] = m;
+    dims[2] = n;
+    ret = new_Tensor(3, dims);
+
+    //Every slice is a contiguous row-major matrix.
+    arow = (size_t*) malloc(sizeof(size_t) * m);
+    acol = (size_t*) malloc(sizeof(size_t) * k);
+    brow = (size_t*) malloc(sizeof(size_t) * k);
+    bcol = (size_t*) malloc(sizeof(size_t) * n);
+    for (size_t i = 0; i < m; i++) {
+        arow[i] = i * k;
+    }
+    for (size_t p = 0; p < k; p++) {
+        acol[p] = p;
+        brow[p] = p * n;
+    }
+    for (size_t j = 0; j < n; j++) {
+        bcol[j] = j;
+    }
+
+#   pragma omp parallel for num_threads(2) if(dims[0] > 1)
+    for (size_t b = 0; b < dims[0]; b++) {
+        tensor_gemm(m, n, k, A->vals + b * m * k, arow, acol,
+                    B->vals + b * k * n, brow, bcol, ret->vals + b * m * n);
+    }
+
+    free(arow);
+    free(acol);
+    free(brow);
+    free(bcol);
+    return ret;
+}
+
+/**
+ * @brief Contracts two tensors over pairs of axes
+ *
+ * Axis axesA[t] of A is summed against axis axesB[t] of B for every t. The
+ * result's axes are the remaining axes of A followed by the remaining axes of
+ * B, each in their original order. The contraction is one matrix product: the
+ * free and contracted axes are read through offset tables, so neither tensor
+ * is transposed or copied into matrix shape first.
+ *
+ * @param A the left tensor
+ * @param axesA the axes of A to contract
+ * @param B the right tensor
+ * @param axesB the matching axes of B
+ * @param naxes the number of axis pairs
+ * @return Tensor* the contracted tensor or NULL if the operation is invalid
+ */
+Tensor* Tensor_contract(Tensor* A, const size_t* axesA, Tensor* B, const size_t* axesB, size_t naxes) {
+    Tensor* ret; /* The contraction that will be returned */
+    size_t* freeA; /* The axes of A that are kept */
+    size_t* freeB; /* The axes of B that are kept */
+    size_t* dims; /* The dimensions of the result */
+    size_t nfA = 0, nfB = 0; /* The number of kept axes of A and B */
+    size_t m, n, k, k2; /* The sizes of the product */
+    size_t *arow, *acol, *brow, *bcol; /* Offset tables */
+    bool valid = true; /* Whether the axes are consistent */
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || B == NULL || A->vals == NULL || B->vals == NULL) {
+        return NULL;
+    }
+    if (naxes > A->ndims || naxes > B->ndims || (naxes > 0 && (axesA == NULL || axesB == NULL))) {
+        return NULL;
+    }
+    for (size_t t = 0; t < naxes && valid; t++) {
+        valid = axesA[t] < A->ndims && axesB[t] < B->ndims && A->dims[axesA[t]] == B->dims[axesB[t]];
+        for (size_t u = 0; u < t && valid; u++) {
+            valid = axesA[u] != axesA[t] && axesB[u] != axesB[t];
+        }
+    }
+    if (!valid) {
+        return NULL;
+    }
+
+    //Find the kept axes of each tensor; they make up the result.
+    freeA = (size_t*) malloc(sizeof(size_t) * (A->ndims + 1));
+    freeB = (size_t*) malloc(sizeof(size_t) * (B->ndims + 1));
+    dims = (size_t*) malloc(sizeof(size_t) * (A->ndims + B->ndims + 1));
+    for (size_t d = 0; d < A->ndims; d++) {
+        bool contracted = false;
+        for (size_t t = 0; t < naxes; t++) {
+            contracted = contracted || axesA[t] == d;
+        }
+        if (!contracted) {
+            dims[nfA] = A->dims[d];
+            freeA[nfA++] = d;
+        }
+    }
+    for (size_t d = 0; d < B->ndims; d++) {
+        bool contracted = false;
+        for (size_t t = 0; t < naxes; t++) {
+            contracted = contracted || axesB[t] == d;
+        }
+        if (!contracted) {
+            dims[nfA + nfB] = B->dims[d];
+            freeB[nfB++] = d;
+        }
+    }
+    ret = new_Tensor(nfA + nfB, dims);
+
+    //Read A as an m by k matrix and B as a k by n matrix.
+    arow = tensor_axis_offsets(A, freeA, nfA, &m);
+    acol = tensor_axis_offsets(A, axesA, naxes, &k);
+    brow = tensor_axis_offsets(B, axesB, naxes, &k2);
+    bcol = tensor_axis_offsets(B, freeB, nfB, &n);
+    tensor_gemm(m, n, k, A->vals, arow, acol, B->vals, brow, bcol, ret->vals);
+
+    free(arow);
+    free(acol);
+    free(brow);
+    free(bcol);
+    free(freeA);
+    free(freeB);
+    free(dims);
+    return ret;
+}
+
+/**
+ * @brief One pairwise (or single-operand) step of an einsum plan
+ *
+ * A binary step computes, for every batch index t, the product of slot a read
+ * as an m by k matrix and slot b read as a k by n matrix into the t-th m by n
+ * block of slot out. A unary step sums slot a over the k offsets in acol for
+ * each of the m offsets in arow.
+ */
+typedef struct {
+    bool unary; /* Whether this step reads only slot a */
+    size_t a; /* The slot of the left (or only) input */
+    size_t b; /* The slot of the right input */
+    size_t out; /* The slot that receives the result */
+    size_t nbatch, m, n, k; /* The sizes of the product */
+    size_t* batchA; /* The offset of each batch index in a */
+    size_t* batchB; /* The offset of each batch index in b */
+    size_t *arow, *acol, *brow, *bcol; /* Offset tables read by tensor_gemm */
+} EinsumStep;
+
+/**
+ * @brief An einsum expression planned for fixed operand shapes
+ *
+ * Slots 0 to noperands-1 are the operands and the remaining slots are the
+ * intermediate results, whose buffers are allocated once when the plan is made
+ * and reused by every call to EinsumPlan_execute.
+ */
+struct EinsumPlan {
+    size_t noperands; /* The number of operands */
+    size_t nslots; /* The number of slots in use */
+    char** labels; /* The index labels of each slot, as a string */
+    size_t** dims; /* The dimensions of each slot */
+    double** bufs; /* The values of each intermediate slot */
+    size_t nsteps; /* The number of steps */
+    EinsumStep* steps; /* The steps, in order */
+    double cost; /* The number of multiply-adds in the plan */
+};
+
+/**
+ * @brief Adds a slot with the given labels to an einsum plan
+ *
+ * @param P the plan
+ * @param labels the labels of the new slot
+ * @param label_dim the extent of every label, indexed by character
+ * @return size_t the index of the new slot
+ */
+static size_t einsum_add_slot(EinsumPlan* P, const char* labels, const size_t* label_dim) {
+    size_t s = P->nslots++; /* The new slot */
+    size_t len = strlen(labels); /* The number of labels */
+
+    P->labels[s] = (char*) malloc(len + 1);
+    strcpy(P->labels[s], labels);
+    P->dims[s] = (size_t*) malloc(sizeof(size_t) * (len + 1));
+    for (size_t d = 0; d < len; d++) {
+        P->dims[s][d] = label_dim[(unsigned char) labels[d]];
+    }
+    P->bufs[s] = NULL;
+    return s;
+}
+
+/**
+ * @brief Builds the offset table for some of the labels of an einsum slot
+ *
+ * @param P the plan
+ * @param s the slot
+ * @param group the labels to enumerate, all of which must be in the slot
+ * @param total receives the number of entries in the table
+ * @return size_t* the offset table, to be freed by the caller
+ */
+static size_t* einsum_offsets(EinsumPlan* P, size_t s, const char* group, size_t* total) {
+    Tensor shape; /* The slot's shape, with no values */
+    size_t naxes = strlen(group); /* The number of labels in the group */
+    size_t* axes = (size_t*) malloc(sizeof(size_t) * (naxes + 1)); /* The position of each label */
+    size_t* table; /* The table to return */
+
+    shape.ndims = strlen(P->labels[s]);
+    shape.dims = P->dims[s];
+    shape.vals = NULL;
+    for (size_t t = 0; t < naxes; t++) {
+        axes[t] = (size_t) (strchr(P->labels[s], group[t]) - P->labels[s]);
+    }
+    table = tensor_axis_offsets(&shape, axes, naxes, total);
+    free(axes);
+    return table;
+}
+
+/**
+ * @brief Appends a step that sums slot a down to the labels in keep
+ *
+ * @param P the plan
+ * @param a the slot to reduce
+ * @param keep the labels to keep, in the order the result should have them
+ * @param label_dim the extent of every label, indexed by character
+ * @return size_t the slot of the result
+ */
+static size_t einsum_add_unary(EinsumPlan* P, size_t a, const char* keep, const size_t* label_dim) {
+    EinsumStep* step = &P->steps[P->nsteps++]; /* The new step */
+    char sum[128]; /* The labels summed away */
+    size_t nsum = 0; /* The number of labels summed away */
+
+    for (const char* c = P->labels[a]; *c != '\0'; c++) {
+        if (strchr(keep, *c) == NULL) {
+            sum[nsum++] = *c;
+        }
+    }
+    sum[nsum] = '\0';
+
+    memset(step, 0, sizeof(EinsumStep));
+    step->unary = true;
+    step->a = a;
+    step->out = einsum_add_slot(P, keep, label_dim);
+    step->nbatch = 1;
+    step->n = 1;
+    step->arow = einsum_offsets(P, a, keep, &step->m);
+    step->acol = einsum_offsets(P, a, sum, &step->k);
+    P->cost += (double) step->m * (double) step->k;
+    return step->out;
+}
+
+/**
+ * @brief Appends a step that contracts slots a and b
+ *
+ * Labels shared by a and b are summed unless kept[label] is set, in which case
+ * they become batch labels. The result's labels are the batch labels, then the
+ * labels only in a, then the labels only in b.
+ *
+ * @param P the plan
+ * @param a the left slot
+ * @param b the right slot
+ * @param kept whether each label, indexed by character, is still needed
+ * @param label_dim the extent of every label, indexed by character
+ * @return size_t the slot of the result
+ */
+static size_t einsum_add_binary(EinsumPlan* P, size_t a, size_t b, const bool* kept, const size_t* label_dim) {
+    EinsumStep* step = &P->steps[P->nsteps++]; /* The new step */
+    char batch[128], con[128], fa[128], fb[128], out[128]; /* Groups of labels */
+    size_t nbatch = 0, ncon = 0, nfa = 0, nfb = 0; /* The size of each group */
+
+    for (const char* c = P->labels[a]; *c != '\0'; c++) {
+        if (strchr(P->labels[b], *c) == NULL) {
+            fa[nfa++] = *c;
+        } else if (kept[(unsigned char) *c]) {
+            batch[nbatch++] = *c;
+        } else {
+            con[ncon++] = *c;
+        }
+    }
+    for (const char* c = P->labels[b]; *c != '\0'; c++) {
+        if (strchr(P->labels[a], *c) == NULL) {
+            fb[nfb++] = *c;
+        }
+    }
+    batch[nbatch] = con[ncon] = fa[nfa] = fb[nfb] = '\0';
+    strcpy(out, batch);
+    strcat(out, fa);
+    strcat(out, fb);
+
+    memset(step, 0, sizeof(EinsumStep));
+    step->unary = false;
+    step->a = a;
+    step->b = b;
+    step->out = einsum_add_slot(P, out, label_dim);
+    step->batchA = einsum_offsets(P, a, batch, &step->nbatch);
+    step->batchB = einsum_offsets(P, b, batch, &step->nbatch);
+    step->arow = einsum_offsets(P, a, fa, &step->m);
+    step->acol = einsum_offsets(P, a, con, &step->k);
+    step->brow = einsum_offsets(P, b, con, &step->k);
+    step->bcol = einsum_offsets(P, b, fb, &step->n);
+    P->cost += (double) step->nbatch * (double) step->m * (double) step->n * (double) step->k;
+    return step->out;
+}
+
+/**
+ * @brief Plans the evaluation of an einsum expression for the given operands
+ *
+ * spec lists the index labels (letters) of each operand separated by commas,
+ * optionally followed by "->" and the labels of the result, e.g.
+ * "ij,jk,kl->il". Without "->" the result has every label that appears exactly
+ * once, in alphabetical order. Labels missing from the result are summed over.
+ * A label may not repeat within one operand.
+ *
+ * Labels used by only one operand are summed away first. Then, until one
+ * intermediate is left, the pair of intermediates whose contraction needs the
+ * fewest multiply-adds is contracted next; each such step is a (batched)
+ * matrix product. Only the operand shapes are used, so the plan can be
+ * executed repeatedly for operands of the same shapes.
+ *
+ * @param spec the einsum expression
+ * @param operands the operands, used only for their shapes
+ * @param noperands the number of operands
+ * @return EinsumPlan* the plan or NULL if the expression or shapes are invalid
+ */
+EinsumPlan* new_EinsumPlan(const char* spec, Tensor** operands, size_t noperands) {
+    EinsumPlan* P; /* The plan to return */
+    char** terms; /* The labels of each operand */
+    char output[128]; /* The labels of the result */
+    size_t label_dim[128] = {0}; /* The extent of each label */
+    size_t label_count[128] = {0}; /* The number of operands using each label */
+    size_t* live; /* The slots not yet consumed */
+    size_t nlive; /* The number of live slots */
+    const char* c; /* The current position in spec */
+    bool explicit_output = false; /* Whether spec names the result's labels */
+    bool valid = true; /* Whether the expression is consistent so far */
+
+    //If the arguments are invalid, return NULL.
+    if (spec == NULL || operands == NULL || noperands == 0) {
+        return NULL;
+    }
+    for (size_t t = 0; t < noperands; t++) {
+        if (operands[t] == NULL || operands[t]->vals == NULL) {
+            return NULL;
+        }
+    }
+
+    //Split spec into one term per operand and the output.
+    terms = (char**) calloc(noperands, sizeof(char*));
+    c = spec;
+    output[0] = '\0';
+    for (size_t t = 0; t < noperands && valid; t++) {
+        size_t len = 0;
+        terms[t] = (char*) malloc(128);
+        while (*c == ' ') {
+            c++;
+        }
+        while ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || *c == ' ') {
+            if (*c != ' ' && len < 127) {
+                terms[t][len++] = *c;
+            }
+            c++;
+        }
+        terms[t][len] = '\0';
+        if (t + 1 < noperands) {
+            valid = (*c == ',');
+            c++;
+        }
+    }
+    if (valid && c[0] == '-' && c[1] == '>') {
+        size_t len = 0;
+        explicit_output = true;
+        for (c += 2; *c != '\0'; c++) {
+            if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z')) {
+                if (len < 127) {
+                    output[len++] = *c;
+                }
+            } else if (*c != ' ') {
+                valid = false;
+            }
+        }
+        output[len] = '\0';
+    } else if (valid) {
+        while (*c == ' ') {
+            c++;
+        }
+        valid = (*c == '\0');
+    }
+
+    //Check the labels against the operands' shapes.
+    for (size_t t = 0; t < noperands && valid; t++) {
+        valid = strlen(terms[t]) == operands[t]->ndims;
+        for (size_t d = 0; d < operands[t]->ndims && valid; d++) {
+            unsigned char l = (unsigned char) terms[t][d];
+            valid = strchr(terms[t] + d + 1, l) == NULL
+                 && (label_dim[l] == 0 || label_dim[l] == operands[t]->dims[d]);
+            label_dim[l] = operands[t]->dims[d];
+            label_count[l]++;
+        }
+    }
+    if (valid && !explicit_output) {
+        size_t len = 0;
+        for (int l = 'A'; l <= 'z'; l++) {
+            if (label_count[l] == 1) {
+                output[len++] = (char) l;
+            }
+        }
+        output[len] = '\0';
+    }
+    for (size_t d = 0; output[d] != '\0' && valid; d++) {
+        valid = label_count[(unsigned char) output[d]] > 0 && strchr(output + d + 1, output[d]) == NULL;
+    }
+    if (!valid) {
+        for (size_t t = 0; t < noperands; t++) {
+            free(terms[t]);
+        }
+        free(terms);
+        return NULL;
+    }
+
+    //At most one reduction per operand, one contraction per pair and a final permutation.
+    P = (EinsumPlan*) malloc(sizeof(EinsumPlan));
+    P->noperands = noperands;
+    P->nslots = 0;
+    P->labels = (char**) malloc(sizeof(char*) * (3 * noperands + 1));
+    P->dims = (size_t**) malloc(sizeof(size_t*) * (3 * noperands + 1));
+    P->bufs = (double**) malloc(sizeof(double*) * (3 * noperands + 1));
+    P->steps = (EinsumStep*) malloc(sizeof(EinsumStep) * (2 * noperands + 1));
+    P->nsteps = 0;
+    P->cost = 0.0;
+    live = (size_t*) malloc(sizeof(size_t) * noperands);
+    nlive = noperands;
+    for (size_t t = 0; t < noperands; t++) {
+        live[t] = einsum_add_slot(P, terms[t], label_dim);
+        free(terms[t]);
+    }
+    free(terms);
+
+    //Sum away labels that only one operand uses and the result does not keep.
+    for (size_t t = 0; t < nlive && nlive > 1; t++) {
+        char keep[128];
+        size_t len = 0;
+        for (const char* l = P->labels[live[t]]; *l != '\0'; l++) {
+            if (label_count[(unsigned char) *l] > 1 || strchr(output, *l) != NULL) {
+                keep[len++] = *l;
+            }
+        }
+        keep[len] = '\0';
+        if (len < strlen(P->labels[live[t]])) {
+            live[t] = einsum_add_unary(P, live[t], keep, label_dim);
+        }
+    }
+
+    //Greedily contract the cheapest pair until one intermediate is left.
+    while (nlive > 1) {
+        size_t besti = 0, bestj = 1; /* The positions in live of the cheapest pair */
+        double best = -1.0; /* The cost of the cheapest pair */
+        bool kept[128]; /* Labels still needed after the chosen pair is contracted */
+
+        for (size_t i = 0; i < nlive; i++) {
+            for (size_t j = i + 1; j < nlive; j++) {
+                double cost = 1.0;
+                for (const char* l = P->labels[live[i]]; *l != '\0'; l++) {
+                    cost *= (double) label_dim[(unsigned char) *l];
+                }
+                for (const char* l = P->labels[live[j]]; *l != '\0'; l++) {
+                    if (strchr(P->labels[live[i]], *l) == NULL) {
+                        cost *= (double) label_dim[(unsigned char) *l];
+                    }
+                }
+                if (best < 0.0 || cost < best) {
+                    best = cost;
+                    besti = i;
+                    bestj = j;
+                }
+            }
+        }
+
+        kept[0] = false;
+        for (int l = 1; l < 128; l++) {
+            kept[l] = (strchr(output, l) != NULL);
+            for (size_t t = 0; t < nlive && !kept[l]; t++) {
+                kept[l] = (t != besti && t != bestj && strchr(P->labels[live[t]], l) != NULL);
+            }
+        }
+        live[besti] = einsum_add_binary(P, live[besti], live[bestj], kept, label_dim);
+        live[bestj] = live[--nlive];
+    }
+
+    //Finish with the result's labels in the requested order.
+    if (P->nsteps == 0 || strcmp(P->labels[live[0]], output) != 0) {
+        einsum_add_unary(P, live[0], output, label_dim);
+    }
+    free(live);
+
+    //Allocate every intermediate once; the last slot is the result itself.
+    for (size_t s = noperands; s + 1 < P->nslots; s++) {
+        size_t total = 1;
+        for (size_t d = 0; P->labels[s][d] != '\0'; d++) {
+            total *= P->dims[s][d];
+        }
+        P->bufs[s] = (double*) malloc(sizeof(double) * total);
+    }
+
+    return P;
+}
+
+/**
+ * @brief Frees an einsum plan and its intermediate buffers
+ *
+ * @param P the plan to be deleted
+ */
+void delete_EinsumPlan(EinsumPlan* P) {
+    //Do nothing if P is NULL.
+    if (P == NULL) {
+        return;
+    }
+
+    for (size_t t = 0; t < P->nsteps; t++) {
+        free(P->steps[t].batchA);
+        free(P->steps[t].batchB);
+        free(P->steps[t].arow);
+        free(P->steps[t].acol);
+        free(P->steps[t].brow);
+        free(P->steps[t].bcol);
+    }
+    for (size_t s = 0; s < P->nslots; s++) {
+        free(P->labels[s]);
+        free(P->dims[s]);
+        free(P->bufs[s]);
+    }
+    free(P->labels);
+    free(P->dims);
+    free(P->bufs);
+    free(P->steps);
+    free(P);
+}
+
+/**
+ * @brief Reports the number of multiply-adds an einsum plan performs
+ *
+ * @param P the plan
+ * @return double the number of multiply-adds, or 0 if P is NULL
+ */
+double EinsumPlan_cost(EinsumPlan* P) {
+    return (P == NULL) ? 0.0 : P->cost;
+}
+
+/**
+ * @brief Evaluates an einsum plan for a set of operands
+ *
+ * The operands must have the shapes the plan was made for. Intermediate
+ * results are written into the plan's buffers, so a plan must not be executed
+ * by two threads at once.
+ *
+ * @param P the plan
+ * @param operands the operands, in the order of the expression
+ * @return Tensor* the result or NULL if the operands do not match the plan
+ */
+Tensor* EinsumPlan_execute(EinsumPlan* P, Tensor** operands) {
+    Tensor* ret; /* The result to return */
+    size_t last; /* The slot of the result */
+    const double** in; /* The values of every slot */
+
+    //If the arguments are invalid, return NULL.
+    if (P == NULL || operands == NULL) {
+        return NULL;
+    }
+    for (size_t t = 0; t < P->noperands; t++) {
+        if (operands[t] == NULL || operands[t]->vals == NULL || operands[t]->ndims != strlen(P->labels[t])) {
+            return NULL;
+        }
+        for (size_t d = 0; d < operands[t]->ndims; d++) {
+            if (operands[t]->dims[d] != P->dims[t][d]) {
+                return NULL;
+            }
+        }
+    }
+
+    last = P->nslots - 1;
+    ret = new_Tensor(strlen(P->labels[last]), P->dims[last]);
+    in = (const double**) malloc(sizeof(double*) * P->nslots);
+    for (size_t s = 0; s < P->nslots; s++) {
+        in[s] = (s < P->noperands) ? operands[s]->vals : P->bufs[s];
+    }
+    in[last] = ret->vals;
+
+    for (size_t t = 0; t < P->nsteps; t++) {
+        EinsumStep* step = &P->steps[t];
+        double* out = (double*) in[step->out];
+        const double* a = in[step->a];
+
+        if (step->unary) {
+            //Sum over the dropped labels for every kept index.
+#           pragma omp parallel for num_threads(2)
+            for (size_t i = 0; i < step->m; i++) {
+                double sum = 0.0;
+                for (size_t p = 0; p < step->k; p++) {
+                    sum += a[step->arow[i] + step->acol[p]];
+                }
+                out[i] = sum;
+            }
+        } else {
+            //One matrix product per batch index, into a cleared buffer.
+            const double* b = in[step->b];
+            size_t block = step->m * step->n; /* The values in one batch of the result */
+#           pragma omp parallel for simd num_threads(2)
+            for (size_t i = 0; i < step->nbatch * block; i++) {
+                out[i] = 0.0;
+            }
+#           pragma omp parallel for num_threads(2) if(step->nbatch > 1)
+            for (size_t bt = 0; bt < step->nbatch; bt++) {
+                tensor_gemm(step->m, step->n, step->k, a + step->batchA[bt], step->arow, step->acol,
+                            b + step->batchB[bt], step->brow, step->bcol, out + bt * block);
+            }
+        }
+    }
+
+    free(in);
+    return ret;
+}
+
+/**
+ * @brief Evaluates an einsum expression once
+ *
+ * This plans the expression with new_EinsumPlan, executes it, and deletes the
+ * plan. Keep the plan instead when the same expression is evaluated
+ * repeatedly for operands of the same shapes.
+ *
+ * @param spec the einsum expression, e.g. "ij,jk->ik"
+ * @param operands the operands, in the order of the expression
+ * @param noperands the number of operands
+ * @return Tensor* the result or NULL if the expression or shapes are invalid
+ */
+Tensor* Tensor_einsum(const char* spec, Tensor** operands, size_t noperands) {
+    EinsumPlan* P = new_EinsumPlan(spec, operands, noperands); /* The plan for this expression */
+    Tensor* ret = EinsumPlan_execute(P, operands); /* The result to return */
+
+    delete_EinsumPlan(P);
+    return ret;
+}
+
+/**
+ * @brief Computes a 2-D correlation or convolution directly
+ *
+ * Entry [i, j] of the result is the sum over [u, v] of K[u, v] times the
+ * zero-padded A at [i*stride + u, j*stride + v]; with flip set, K is rotated
+ * by half a turn first, which gives a convolution. Each kernel entry adds a
+ * scaled run of one row of A to one row of the result, so with stride 1 the
+ * innermost loop is contiguous on both sides.
+ *
+ * @param A the image
+ * @param K the kernel
+ * @param pad the number of zero rows and columns added on every side of A
+ * @param stride the step between neighbouring outputs
+ * @param flip whether to convolve rather than correlate
+ * @return Matrix* the result
+ */
+static Matrix* conv2d_direct(Matrix* A, Matrix* K, size_t pad, size_t stride, bool flip) {
+    size_t orows = (A->nrows + 2 * pad - K->nrows) / stride + 1; /* Rows in the result */
+    size_t ocols = (A->ncols + 2 * pad - K->ncols) / stride + 1; /* Columns in the result */
+    Matrix* ret = new_Matrix(orows, ocols); /* The result to return */
+
+#   pragma omp parallel for num_threads(2) schedule(dynamic)
+    for (size_t i = 0; i < orows; i++) {
+        double* out = ret->vals[i]; /* The row of the result being computed */
+        for (size_t u = 0; u < K->nrows; u++) {
+            size_t r = i * stride + u; /* The padded row of A under kernel row u */
+            const double* arow;
+            if (r < pad || r - pad >= A->nrows) {
+                continue;
+            }
+            arow = A->vals[r - pad];
+            for (size_t v = 0; v < K->ncols; v++) {
+                double w = flip ? K->vals[K->nrows - 1 - u][K->ncols - 1 - v] : K->vals[u][v];
+                size_t jlo, jhi; /* The outputs whose column under v is inside A */
+                if (w == 0.0) {
+                    continue;
+                }
+
+                //Column j reads A at j*stride + v - pad, which must be in [0, A.ncols).
+                jlo = (v >= pad) ? 0 : (pad - v + stride - 1) / stride;
+                jhi = (A->ncols + pad > v) ? (A->ncols + pad - v - 1) / stride + 1 : 0;
+                if (jhi > ocols) {
+                    jhi = ocols;
+                }
+                if (stride == 1) {
+                    for (size_t j = jlo; j < jhi; j++) {
+                        out[j] += w * arow[j + v - pad];
+                    }
+                } else {
+                    for (size_t j = jlo; j < jhi; j++) {
+                        out[j] += w * arow[j * stride + v - pad];
+                    }
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Computes an in-place radix-2 fast Fourier transform
+ *
+ * @param re the real parts of the n values
+ * @param im the imaginary parts of the n values
+ * @param n the number of values, a power of two
+ * @param cs the cosines of 2*pi*t/n for t < n/2
+ * @param sn the sines of 2*pi*t/n for t < n/2
+ * @param inverse whether to compute the (unscaled) inverse transform
+ */
+static void fft_radix2(double* re, double* im, size_t n, const double* cs, const double* sn, bool inverse) {
+    //Put the values in bit-reversed order.
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j |= bit;
+        if (i < j) {
+            double t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+
+    //Combine transforms of doubling length.
+    for (size_t len = 2; len <= n; len *= 2) {
+        size_t step = n / len; /* The stride through the twiddle table */
+        for (size_t i = 0; i < n; i += len) {
+            for (size_t t = 0; t < len / 2; t++) {
+                double wr = cs[t * step];
+                double wi = inverse ? sn[t * step] : -sn[t * step];
+                size_t p = i + t, q = i + t + len / 2;
+                double xr = re[q] * wr - im[q] * wi;
+                double xi = re[q] * wi + im[q] * wr;
+                re[q] = re[p] - xr;
+                im[q] = im[p] - xi;
+                re[p] += xr;
+                im[p] += xi;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Computes an in-place 2-D fast Fourier transform
+ *
+ * Every row is transformed, then every column; rows and columns are handed to
+ * threads independently.
+ *
+ * @param re the real parts, n1 rows of n2 values each
+ * @param im the imaginary parts, laid out like re
+ * @param n1 the number of rows, a power of two
+ * @param n2 the number of columns, a power of two
+ * @param inverse whether to compute the (unscaled) inverse transform
+ */
+static void fft2d(double* re, double* im, size_t n1, size_t n2, bool inverse) {
+    const double TWO_PI = 6.283185307179586477; /* 2*pi */
+    size_t nmax = (n1 > n2) ? n1 : n2; /* The longer side */
+    double* cs = (double*) malloc(sizeof(double) * (nmax / 2 + 1)); /* Twiddle cosines for nmax */
+    double* sn = (double*) malloc(sizeof(double) * (nmax / 2 + 1)); /* Twiddle sines for nmax */
+
+    for (size_t t = 0; t < nmax / 2 + 1; t++) {
+        cs[t] = cos(TWO_PI * (double) t / (double) nmax);
+        sn[t] = sin(TWO_PI * (double) t / (double) nmax);
+    }
+
+    //The tables for a shorter side are every (nmax/n)-th entry of these.
+#   pragma omp parallel num_threads(2)
+    {
+        size_t skip1 = nmax / n1, skip2 = nmax / n2; /* Table strides for each side */
+        double* tc = (double*) malloc(sizeof(double) * (nmax / 2 + 1)); /* This thread's tables */
+        double* ts = (double*) malloc(sizeof(double) * (nmax / 2 + 1));
+        double* cr = (double*) malloc(sizeof(double) * n1); /* One column, copied out */
+        double* ci = (double*) malloc(sizeof(double) * n1);
+
+        for (size_t t = 0; t < n2 / 2; t++) {
+            tc[t] = cs[t * skip2];
+            ts[t] = sn[t * skip2];
+        }
+#       pragma omp for
+        for (size_t i = 0; i < n1; i++) {
+            fft_radix2(re + i * n2, im + i * n2, n2, tc, ts, inverse);
+        }
+
+        for (size_t t = 0; t < n1 / 2; t++) {
+            tc[t] = cs[t * skip1];
+            ts[t] = sn[t * skip1];
+        }
+#       pragma omp for
+        for (size_t j = 0; j < n2; j++) {
+            for (size_t i = 0; i < n1; i++) {
+                cr[i] = re[i * n2 + j];
+                ci[i] = im[i * n2 + j];
+            }
+            fft_radix2(cr, ci, n1, tc, ts, inverse);
+            for (size_t i = 0; i < n1; i++) {
+                re[i * n2 + j] = cr[i];
+                im[i * n2 + j] = ci[i];
+            }
+        }
+
+        free(tc);
+        free(ts);
+        free(cr);
+        free(ci);
+    }
+
+    free(cs);
+    free(sn);
+}
+
+/**
+ * @brief Computes a 2-D correlation or convolution through the FFT
+ *
+ * The full linear convolution of A and K is computed by multiplying their
+ * zero-padded transforms, and the requested (padded, strided) window of it is
+ * copied out. With flip unset K is rotated first, which gives a correlation.
+ *
+ * @param A the image
+ * @param K the kernel
+ * @param pad the number of zero rows and columns added on every side of A
+ * @param stride the step between neighbouring outputs
+ * @param flip whether to convolve rather than correlate
+ * @return Matrix* the result
+ */
+static Matrix* conv2d_fft(Matrix* A, Matrix* K, size_t pad, size_t stride, bool flip) {
+    size_t orows = (A->nrows + 2 * pad - K->nrows) / stride + 1; /* Rows in the result */
+    size_t ocols = (A->ncols + 2 * pad - K->ncols) / stride + 1; /* Columns in the result */
+    size_t frows = A->nrows + K->nrows - 1; /* Rows in the full convolution */
+    size_t fcols = A->ncols + K->ncols - 1; /* Columns in the full convolution */
+    size_t n1 = 1, n2 = 1; /* The transform size */
+    double *are, *aim, *kre, *kim; /* The transforms of A and K */
+    Matrix* ret = new_Matrix(orows, ocols); /* The result to return */
+
+    while (n1 < frows) {
+        n1 *= 2;
+    }
+    while (n2 < fcols) {
+        n2 *= 2;
+    }
+    are = (double*) calloc(n1 * n2, sizeof(double));
+    aim = (double*) calloc(n1 * n2, sizeof(double));
+    kre = (double*) calloc(n1 * n2, sizeof(double));
+    kim = (double*) calloc(n1 * n2, sizeof(double));
+    for (size_t i = 0; i < A->nrows; i++) {
+        for (size_t j = 0; j < A->ncols; j++) {
+            are[i * n2 + j] = A->vals[i][j];
+        }
+    }
+    for (size_t u = 0; u < K->nrows; u++) {
+        for (size_t v = 0; v < K->ncols; v++) {
+            kre[u * n2 + v] = flip ? K->vals[u][v] : K->vals[K->nrows - 1 - u][K->ncols - 1 - v];
+        }
+    }
+
+    //Multiply the transforms and invert, scaling by 1/(n1*n2).
+    fft2d(are, aim, n1, n2, false);
+    fft2d(kre, kim, n1, n2, false);
+#   pragma omp parallel for simd num_threads(2)
+    for (size_t t = 0; t < n1 * n2; t++) {
+        double r = are[t] * kre[t] - aim[t] * kim[t];
+        double m = are[t] * kim[t] + aim[t] * kre[t];
+        are[t] = r / (double) (n1 * n2);
+        aim[t] = m / (double) (n1 * n2);
+    }
+    fft2d(are, aim, n1, n2, true);
+
+    //Output [i, j] is entry [i*stride + K.nrows-1 - pad, j*stride + K.ncols-1 - pad] of the full result.
+#   pragma omp parallel for num_threads(2)
+    for (size_t i = 0; i < orows; i++) {
+        size_t r = i * stride + K->nrows - 1;
+        for (size_t j = 0; j < ocols; j++) {
+            size_t c = j * stride + K->ncols - 1;
+            if (r >= pad && r - pad < frows && c >= pad && c - pad < fcols) {
+                ret->vals[i][j] = are[(r - pad) * n2 + (c - pad)];
+            }
+        }
+    }
+
+    free(are);
+    free(aim);
+    free(kre);
+    free(kim);
+    return ret;
+}
+
+/**
+ * @brief Decides whether a convolution is cheaper through the FFT
+ *
+ * The direct method costs one multiply-add per kernel entry per output, while
+ * the FFT costs three transforms of the padded size whatever the kernel. The
+ * constant (about 8 multiply-adds per value per level for each of the three
+ * transforms) was measured on these kernels.
+ *
+ * @param A the image
+ * @param K the kernel
+ * @param pad the number of zero rows and columns added on every side of A
+ * @param stride the step between neighbouring outputs
+ * @return bool whether to use conv2d_fft
+ */
+static bool conv2d_prefers_fft(Matrix* A, Matrix* K, size_t pad, size_t stride) {
+    double orows = (double) ((A->nrows + 2 * pad - K->nrows) / stride + 1); /* Rows in the result */
+    double ocols = (double) ((A->ncols + 2 * pad - K->ncols) / stride + 1); /* Columns in the result */
+    double n1 = 1, n2 = 1; /* The transform size */
+
+    while (n1 < (double) (A->nrows + K->nrows - 1)) {
+        n1 *= 2;
+    }
+    while (n2 < (double) (A->ncols + K->ncols - 1)) {
+        n2 *= 2;
+    }
+    return orows * ocols * (double) (K->nrows * K->ncols) > 24.0 * n1 * n2 * log2(n1 * n2);
+}
+
+/**
+ * @brief Computes the 2-D convolution of an image with a kernel
+ *
+ * A is padded with pad rows and columns of zeros on every side, and K (flipped
+ * in both directions) is applied at every stride-th position where it fits
+ * entirely, so the result has (A.nrows + 2*pad - K.nrows)/stride + 1 rows and
+ * likewise for columns. Small kernels are applied directly without building an
+ * im2col matrix; kernels large enough that the FFT is estimated to be cheaper
+ * go through Matrix_conv2d_fft.
+ *
+ * @param A the image
+ * @param K the kernel
+ * @param pad the number of zero rows and columns added on every side of A
+ * @param stride the step between neighbouring outputs (must be > 0)
+ * @return Matrix* the convolution or NULL if the operation is invalid
+ */
+Matrix* Matrix_conv2d(Matrix* A, Matrix* K, size_t pad, size_t stride) {
+    //If the operation is invalid, return NULL.
+    //This is split into two if statements for readability.
+    if (A == NULL || K == NULL || A->vals == NULL || K->vals == NULL || stride == 0) {
+        return NULL;
+    }
+    if (A->nrows + 2 * pad < K->nrows || A->ncols + 2 * pad < K->ncols) {
+        return NULL;
+    }
+
+    if (conv2d_prefers_fft(A, K, pad, stride)) {
+        return conv2d_fft(A, K, pad, stride, true);
+    }
+    return conv2d_direct(A, K, pad, stride, true);
+}
+
+/**
+ * @brief Computes the 2-D correlation of an image with a kernel
+ *
+ * This is Matrix_conv2d without flipping the kernel, i.e. entry [i, j] of the
+ * result is the sum of K[u, v] times the padded A at
+ * [i*stride + u, j*stride + v].
+ *
+ * @param A the image
+ * @param K the kernel
+ * @param pad the number of zero rows and columns added on every side of A
+ * @param stride the step between neighbouring outputs (must be > 0)
+ * @return Matrix* the correlation or NULL if the operation is invalid
+ */
+Matrix* Matrix_correlate2d(Matrix* A, Matrix* K, size_t pad, size_t stride) {
+    //If the operation is invalid, return NULL.
+    //This is split into two if statements for readability.
+    if (A == NULL || K == NULL || A->vals == NULL || K->vals == NULL || stride == 0) {
+        return NULL;
+    }
+    if (A->nrows + 2 * pad < K->nrows || A->ncols + 2 * pad < K->ncols) {
+        return NULL;
+    }
+
+    if (conv2d_prefers_fft(A, K, pad, stride)) {
+        return conv2d_fft(A, K, pad, stride, false);
+    }
+    return conv2d_direct(A, K, pad, stride, false);
+}
+
+/**
+ * @brief Computes the 2-D convolution of an image with a kernel through the FFT
+ *
+ * The result is the same as Matrix_conv2d. The cost depends on the image size
+ * but hardly at all on the kernel size, so this wins for large kernels. The
+ * transforms are padded to powers of two.
+ *
+ * @param A the image
+ * @param K the kernel
+ * @param pad the number of zero rows and columns added on every side of A
+ * @param stride the step between neighbouring outputs (must be > 0)
+ * @return Matrix* the convolution or NULL if the operation is invalid
+ */
+Matrix* Matrix_conv2d_fft(Matrix* A, Matrix* K, size_t pad, size_t stride) {
+    //If the operation is invalid, return NULL.
+    //This is split into two if statements for readability.
+    if (A == NULL || K == NULL || A->vals == NULL || K->vals == NULL || stride == 0) {
+        return NULL;
+    }
+    if (A->nrows + 2 * pad < K->nrows || A->ncols + 2 * pad < K->ncols) {
+        return NULL;
+    }
+
+    return conv2d_fft(A, K, pad, stride, true);
+}
+
+/**
+ * @brief Returns one row of a time level inside jacobi_strip
+ *
+ * Level 0 and the two boundary rows are read from U; the other levels live in
+ * a ring of three rows per level.
+ *
+ * @param U the matrix at the start of the pass
+ * @param ring the strip's ring buffers
+ * @param level the time level
+ * @param r the row index
+ * @param lo the first column held by the strip
+ * @param width the number of columns held by the strip
+ * @return double* the row, indexed from column lo
+ */
+static double* jacobi_row(Matrix* U, double* ring, size_t level, size_t r, size_t lo, size_t width) {
+    if (level == 0 || r == 0 || r == U->nrows - 1) {
+        return U->vals[r] + lo;
+    }
+    return ring + ((level - 1) * 3 + r % 3) * width;
+}
+
+/**
+ * @brief Advances one column strip of U by several Jacobi steps
+ *
+ * The rows are swept once. At row i, step 1 is applied to row i, step 2 to row
+ * i-1 and so on, so every step reads rows the previous one has just produced
+ * while they are still in cache. Each step before the last is computed on a
+ * slightly wider strip than [c0, c1) so that the last step needs nothing from
+ * the neighbouring strips.
+ *
+ * @param U the matrix at the start of the pass (only read)
+ * @param F the source term or NULL
+ * @param V receives columns [c0, c1) of the interior after the steps
+ * @param center the weight of the point itself
+ * @param neighbor the weight of each of its four neighbours
+ * @param steps the number of steps, at least 1
+ * @param c0 the first interior column of the strip
+ * @param c1 one past the last interior column of the strip
+ * @param ring scratch for (steps - 1) levels of three rows of the strip
+ */
+static void jacobi_strip(Matrix* U, Matrix* F, Matrix* V, double center, double neighbor, size_t steps,
+                         size_t c0, size_t c1, double* ring) {
+    size_t last = U->nrows - 1; /* The bottom boundary row */
+    size_t lo = (c0 > steps) ? c0 - steps : 0; /* The first column held */
+    size_t hi = (c1 + steps < U->ncols) ? c1 + steps : U->ncols; /* One past the last column held */
+    size_t width = hi - lo;
+
+    for (size_t i = 1; i + 1 < last + steps; i++) {
+        for (size_t s = 1; s <= steps && s <= i; s++) {
+            size_t r = i + 1 - s; /* The row advanced to step s */
+            size_t a, b; /* The columns computed at step s */
+            double* up, * mid, * down, * dst, * f;
+
+            if (r >= last) {
+                continue;
+            }
+            a = (c0 > steps - s) ? c0 - (steps - s) : 1;
+            b = (c1 + steps - s < U->ncols - 1) ? c1 + steps - s : U->ncols - 1;
+            up = jacobi_row(U, ring, s - 1, r - 1, lo, width);
+            mid = jacobi_row(U, ring, s - 1, r, lo, width);
+            down = jacobi_row(U, ring, s - 1, r + 1, lo, width);
+            if (s == steps) {
+                dst = V->vals[r] + lo;
+            }
+            else {
+                //The fixed boundary columns travel with every level.
+                dst = jacobi_row(U, ring, s, r, lo, width);
+                if (lo == 0) {
+                    dst[0] = U->vals[r][0];
+                }
+                if (hi == U->ncols) {
+                    dst[width - 1] = U->vals[r][U->ncols - 1];
+                }
+            }
+
+            if (F == NULL) {
+                for (size_t j = a - lo; j < b - lo; j++) {
+                    dst[j] = center * mid[j] + neighbor * ((up[j] + down[j]) + (mid[j - 1] + mid[j + 1]));
+                }
+            }
+            else {
+                f = F->vals[r] + lo;
+                for (size_t j = a - lo; j < b - lo; j++) {
+                    dst[j] = center * mid[j] + neighbor * ((up[j] + down[j]) + (mid[j - 1] + mid[j + 1])) + f[j];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Applies nsteps Jacobi sweeps of a 5-point stencil to U in place
+ *
+ * Every interior point becomes
+ *     center * u[i][j] + neighbor * (u[i-1][j] + u[i+1][j] + u[i][j-1] + u[i][j+1]) + F[i][j]
+ * using only values from the previous step; the first and last rows and
+ * columns are held fixed. An explicit heat-equation step is center = 1 - 4r,
+ * neighbor = r; Jacobi relaxation of a Poisson problem is center = 0,
+ * neighbor = 1/4 with F = h^2 f / 4.
+ *
+ * The steps are done eight at a time per pass through memory: the columns are
+ * cut into strips with a small overlap, and each strip is swept once while the
+ * steps follow one another a row apart (see jacobi_strip). Strips are handed
+ * to threads independently. The result is identical to sweeping one step at a
+ * time.
+ *
+ * @param U the grid to update
+ * @param F the source term, the same size as U, or NULL for none
+ * @param center the weight of the point itself
+ * @param neighbor the weight of each of its four neighbours
+ * @param nsteps the number of sweeps
+ * @return 0 if the operation was successful, otherwise 1
+ */
+int Matrix_jacobi(Matrix* U, Matrix* F, double center, double neighbor, size_t nsteps) {
+    const size_t TB = 8; /* Steps per pass through memory */
+    const size_t SW = 512; /* Interior columns per strip */
+    Matrix* V; /* The other copy of the grid */
+    Matrix* src, * dst; /* The copies being read and written in a pass */
+    double* rings; /* Ring buffers for every strip */
+    size_t nstrips, ringsize;
+
+    //If the operation is invalid, return 1.
+    if (U == NULL || U->vals == NULL) {
+        return 1;
+    }
+    if (F != NULL && (F->vals == NULL || F->nrows != U->nrows || F->ncols != U->ncols)) {
+        return 1;
+    }
+
+    //Without interior points there is nothing to do.
+    if (U->nrows < 3 || U->ncols < 3 || nsteps == 0) {
+        return 0;
+    }
+
+    nstrips = (U->ncols - 2 + SW - 1) / SW;
+    ringsize = (TB - 1) * 3 * (SW + 2 * TB);
+    V = new_Matrix(U->nrows, U->ncols);
+    rings = (double*) malloc(sizeof(double) * nstrips * ringsize);
+    if (V == NULL || rings == NULL) {
+        delete_Matrix(V);
+        free(rings);
+        return 1;
+    }
+
+    //The boundary never changes, so it is copied into V once.
+    memcpy(V->vals[0], U->vals[0], sizeof(double) * U->ncols);
+    memcpy(V->vals[U->nrows - 1], U->vals[U->nrows - 1], sizeof(double) * U->ncols);
+    for (size_t i = 1; i < U->nrows - 1; i++) {
+        V->vals[i][0] = U->vals[i][0];
+        V->vals[i][U->ncols - 1] = U->vals[i][U->ncols - 1];
+    }
+
+    src = U;
+    dst = V;
+    for (size_t done = 0; done < nsteps; ) {
+        size_t steps = (nsteps - done < TB) ? nsteps - done : TB; /* Steps in this pass */
+        Matrix* tmp;
+
+#       pragma omp parallel for num_threads(2) schedule(dynamic)
+        for (size_t k = 0; k < nstrips; k++) {
+            size_t c0 = 1 + k * SW;
+            size_t c1 = (c0 + SW < U->ncols - 1) ? c0 + SW : U->ncols - 1;
+
+            jacobi_strip(src, F, dst, center, neighbor, steps, c0, c1, rings + k * ringsize);
+        }
+
+        done += steps;
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    //After an odd number of passes the result is in V.
+    if (src != U) {
+        for (size_t i = 1; i < U->nrows - 1; i++) {
+            memcpy(U->vals[i], V->vals[i], sizeof(double) * U->ncols);
+        }
+    }
+
+    delete_Matrix(V);
+    free(rings);
+    return 0;
+}
+
+/**
+ * @brief Updates one colour of one row in a red-black Gauss-Seidel sweep
+ *
+ * @param U the grid
+ * @param F the source term or NULL
+ * @param center the weight of the point itself
+ * @param neighbor the weight of each of its four neighbours
+ * @param r the row
+ * @param parity 0 for the points with even i + j, 1 for the odd ones
+ * @param c0 the first column that may be updated
+ * @param c1 one past the last column that may be updated
+ */
+static void gauss_seidel_row(Matrix* U, Matrix* F, double center, double neighbor, size_t r, size_t parity,
+                             size_t c0, size_t c1) {
+    double* up = U->vals[r - 1], * mid = U->vals[r], * down = U->vals[r + 1];
+    size_t j = c0 + ((r + c0 + parity) & 1); /* The first column of the right colour */
+
+    if (F == NULL) {
+        for (; j < c1; j += 2) {
+            mid[j] = center * mid[j] + neighbor * ((up[j] + down[j]) + (mid[j - 1] + mid[j + 1]));
+        }
+    }
+    else {
+        for (; j < c1; j += 2) {
+            mid[j] = center * mid[j] + neighbor * ((up[j] + down[j]) + (mid[j - 1] + mid[j + 1])) + F->vals[r][j];
+        }
+    }
+}
+
+/**
+ * @brief Applies nsweeps red-black Gauss-Seidel sweeps of a 5-point stencil to U
+ *
+ * The update is the one of Matrix_jacobi, but done in place: each sweep first
+ * updates the points with even i + j, then those with odd i + j using the new
+ * even values. The first and last rows and columns are held fixed.
+ *
+ * Up to eight sweeps are fused into one pass over the rows. At row i the first
+ * sweep updates the even points of row i and the odd points of row i-1, the
+ * second sweep does the same two rows further up, and so on, which gives the
+ * same result as separate sweeps because no point is touched before the values
+ * it reads are final. Within a row the points only depend on rows already
+ * finished, so the columns are split between threads, which meet once per row.
+ *
+ * @param U the grid to update
+ * @param F the source term, the same size as U, or NULL for none
+ * @param center the weight of the point itself
+ * @param neighbor the weight of each of its four neighbours
+ * @param nsweeps the number of sweeps
+ * @return 0 if the operation was successful, otherwise 1
+ */
+int Matrix_gauss_seidel(Matrix* U, Matrix* F, double center, double neighbor, size_t nsweeps) {
+    const size_t TB = 8; /* Sweeps per pass through memory */
+    const size_t CHUNK = 1024; /* Columns per thread's share of a row */
+    size_t last, nchunks;
+
+    //If the operation is invalid, return 1.
+    if (U == NULL || U->vals == NULL) {
+        return 1;
+    }
+    if (F != NULL && (F->vals == NULL || F->nrows != U->nrows || F->ncols != U->ncols)) {
+        return 1;
+    }
+
+    //Without interior points there is nothing to do.
+    if (U->nrows < 3 || U->ncols < 3 || nsweeps == 0) {
+        return 0;
+    }
+
+    last = U->nrows - 1;
+    nchunks = (U->ncols - 2 + CHUNK - 1) / CHUNK;
+    for (size_t done = 0; done < nsweeps; ) {
+        size_t sweeps = (nsweeps - done < TB) ? nsweeps - done : TB; /* Sweeps in this pass */
+
+        //Sweep s trails the previous one by two rows: its even points in row
+        //i - 2s and its odd points in row i - 2s - 1.
+#       pragma omp parallel num_threads(2) if(nchunks > 1)
+        {
+            for (size_t i = 1; i < last + 2 * sweeps; i++) {
+#               pragma omp for schedule(static)
+                for (size_t k = 0; k < nchunks; k++) {
+                    size_t c0 = 1 + k * CHUNK;
+                    size_t c1 = (c0 + CHUNK < U->ncols - 1) ? c0 + CHUNK : U->ncols - 1;
+
+                    for (size_t s = 0; s < sweeps && 2 * s < i; s++) {
+                        size_t r = i - 2 * s; /* The row getting its even points */
+
+                        if (r < last) {
+                            gauss_seidel_row(U, F, center, neighbor, r, 0, c0, c1);
+                        }
+                        if (r > 1 && r - 1 < last) {
+                            gauss_seidel_row(U, F, center, neighbor, r - 1, 1, c0, c1);
+                        }
+                    }
+                }
+            }
+        }
+
+        done += sweeps;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Allocate memory and initialize a new sparse matrix
+ *
+ * @param nrows the number of rows in the new matrix
+ * @param ncols the number of columns in the new matrix
+ * @param nnz the number of entries to make room for
+ * @return SparseMatrix* a pointer to the newly created matrix
+ */
+SparseMatrix* new_SparseMatrix(size_t nrows, size_t ncols, size_t nnz) {
+    //Create and return the matrix.
+    SparseMatrix* S = (SparseMatrix*) malloc(sizeof(SparseMatrix)); /* The matrix to return. */
+    init_SparseMatrix(S, nrows, ncols, nnz);
+    return S;
+}
+
+/**
+ * @brief Initialize a sparse matrix with room for nnz entries
+ *
+ * rowptr is filled with zeros; the caller fills in rowptr, colind and vals.
+ * colind and vals are NULL when nnz is 0.
+ *
+ * @param S the matrix to be initialized
+ * @param nrows the number of rows in the matrix
+ * @param ncols the number of columns in the matrix
+ * @param nnz the number of entries to make room for
+ */
+void init_SparseMatrix(SparseMatrix* S, size_t nrows, size_t ncols, size_t nnz) {
+    //If S is NULL, nothing else can be done.
+    if (S == NULL) {
+        return;
+    }
+
+    S->nrows = nrows;
+    S->ncols = ncols;
+    S->nnz = nnz;
+    S->rowptr = (size_t*) calloc(nrows + 1, sizeof(size_t));
+    S->colind = (nnz > 0) ? (size_t*) malloc(sizeof(size_t) * nnz) : NULL;
+    S->vals = (nnz > 0) ? (double*) malloc(sizeof(double) * nnz) : NULL;
+}
+
+/**
+ * @brief Clean up any dynamic memory allocated by init_SparseMatrix
+ *
+ * This function does nothing if S or S.rowptr is NULL
+ *
+ * @param S the matrix to be cleaned in preparation for deletion
+ */
+void deinit_SparseMatrix(SparseMatrix* S) {
+    //If the matrix or its rowptr field are null, do nothing.
+    if (S == NULL || S->rowptr == NULL) {
+        return;
+    }
+
+    free(S->rowptr);
+    free(S->colind);
+    free(S->vals);
+    S->rowptr = NULL;
+    S->colind = NULL;
+    S->vals = NULL;
+    S->nrows = 0;
+    S->ncols = 0;
+    S->nnz = 0;
+}
+
+/**
+ * @brief Frees dynamic memory and deletes a SparseMatrix created by new_SparseMatrix
+ *
+ * @param S the matrix to be deleted safely
+ */
+void delete_SparseMatrix(SparseMatrix* S) {
+    //Do nothing if S is NULL.
+    if (S == NULL) {
+        return;
+    }
+
+    deinit_SparseMatrix(S);
+    free(S);
+}
+
+/**
+ * @brief Compares two size_t values for qsort
+ */
+static int compare_size(const void* a, const void* b) {
+    size_t x = *(const size_t*) a, y = *(const size_t*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief One entry of a sparse row, used when sorting rows
+ */
+typedef struct {
+    size_t col; /* The column of the entry */
+    double val; /* The value of the entry */
+} SparseEntry;
+
+/**
+ * @brief Compares two sparse entries by column for qsort
+ */
+static int compare_entry(const void* a, const void* b) {
+    size_t x = ((const SparseEntry*) a)->col, y = ((const SparseEntry*) b)->col;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Sorts the entries of one sparse row by column
+ *
+ * Short rows use insertion sort in place; longer ones are sorted as pairs.
+ *
+ * @param cols the columns of the row
+ * @param vals the values of the row, moved along with their columns
+ * @param len the number of entries in the row
+ */
+static void sparse_sort_row(size_t* cols, double* vals, size_t len) {
+    const size_t SHORT = 32; /* The longest row sorted by insertion */
+    SparseEntry* tmp; /* The row as pairs */
+
+    if (len <= SHORT) {
+        for (size_t p = 1; p < len; p++) {
+            size_t c = cols[p];
+            double v = vals[p];
+            size_t q = p;
+            for (; q > 0 && cols[q - 1] > c; q--) {
+                cols[q] = cols[q - 1];
+                vals[q] = vals[q - 1];
+            }
+            cols[q] = c;
+            vals[q] = v;
+        }
+        return;
+    }
+
+    tmp = (SparseEntry*) malloc(sizeof(SparseEntry) * len);
+    for (size_t p = 0; p < len; p++) {
+        tmp[p].col = cols[p];
+        tmp[p].val = vals[p];
+    }
+    qsort(tmp, len, sizeof(SparseEntry), compare_entry);
+    for (size_t p = 0; p < len; p++) {
+        cols[p] = tmp[p].col;
+        vals[p] = tmp[p].val;
+    }
+    free(tmp);
+}
+
+/**
+ * @brief Builds a sparse matrix from a list of (row, column, value) triplets
+ *
+ * The triplets may come in any order; values given for the same position are
+ * added together.
+ *
+ * @param nrows the number of rows in the matrix
+ * @param ncols the number of columns in the matrix
+ * @param nnz the number of triplets
+ * @param rows the row of each triplet
+ * @param cols the column of each triplet
+ * @param vals the value of each triplet
+ * @return SparseMatrix* the matrix or NULL if a triplet is out of range
+ */
+SparseMatrix* SparseMatrix_from_triplets(size_t nrows, size_t ncols, size_t nnz,
+                                         const size_t* rows, const size_t* cols, const double* vals) {
+    SparseMatrix* S; /* The matrix to return */
+    size_t* next; /* The next free position in each row */
+    size_t begin = 0, w = 0; /* The start of the current row before and after merging */
+
+    //If the arguments are invalid, return NULL.
+    if (nnz > 0 && (rows == NULL || cols == NULL || vals == NULL)) {
+        return NULL;
+    }
+    for (size_t k = 0; k < nnz; k++) {
+        if (rows[k] >= nrows || cols[k] >= ncols) {
+            return NULL;
+        }
+    }
+
+    //Bucket the triplets by row.
+    S = new_SparseMatrix(nrows, ncols, nnz);
+    next = (size_t*) malloc(sizeof(size_t) * (nrows + 1));
+    for (size_t k = 0; k < nnz; k++) {
+        S->rowptr[rows[k] + 1]++;
+    }
+    for (size_t i = 0; i < nrows; i++) {
+        S->rowptr[i + 1] += S->rowptr[i];
+    }
+    memcpy(next, S->rowptr, sizeof(size_t) * (nrows + 1));
+    for (size_t k = 0; k < nnz; k++) {
+        size_t p = next[rows[k]]++;
+        S->colind[p] = cols[k];
+        S->vals[p] = vals[k];
+    }
+    free(next);
+
+    //Sort each row and merge repeated columns, closing up the gaps.
+    for (size_t i = 0; i < nrows; i++) {
+        size_t end = S->rowptr[i + 1]; /* The end of the row before merging */
+
+        sparse_sort_row(S->colind + begin, S->vals + begin, end - begin);
+        S->rowptr[i] = w;
+        for (size_t p = begin; p < end; p++) {
+            if (w > S->rowptr[i] && S->colind[w - 1] == S->colind[p]) {
+                S->vals[w - 1] += S->vals[p];
+            }
+            else {
+                S->colind[w] = S->colind[p];
+                S->vals[w] = S->vals[p];
+                w++;
+            }
+        }
+        begin = end;
+    }
+    S->rowptr[nrows] = w;
+    S->nnz = w;
+
+    return S;
+}
+
+/**
+ * @brief Copies the nonzero entries of a matrix into a new sparse matrix
+ *
+ * @param M the matrix to copy
+ * @return SparseMatrix* the copy of M or NULL if M is invalid
+ */
+SparseMatrix* Matrix_to_SparseMatrix(Matrix* M) {
+    SparseMatrix* S; /* The copy to return */
+    size_t nnz = 0; /* The number of nonzero entries */
+
+    //If the arguments are invalid, return NULL.
+    if (M == NULL || M->vals == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < M->nrows; i++) {
+        for (size_t j = 0; j < M->ncols; j++) {
+            nnz += (M->vals[i][j] != 0.0);
+        }
+    }
+
+    S = new_SparseMatrix(M->nrows, M->ncols, nnz);
+    for (size_t i = 0; i < M->nrows; i++) {
+        size_t p = S->rowptr[i]; /* The next free position */
+        for (size_t j = 0; j < M->ncols; j++) {
+            if (M->vals[i][j] != 0.0) {
+                S->colind[p] = j;
+                S->vals[p] = M->vals[i][j];
+                p++;
+            }
+        }
+        S->rowptr[i + 1] = p;
+    }
+
+    return S;
+}
+
+/**
+ * @brief Copies a sparse matrix into a new dense matrix
+ *
+ * @param S the matrix to copy
+ * @return Matrix* the copy of S or NULL if S is invalid
+ */
+Matrix* SparseMatrix_to_Matrix(SparseMatrix* S) {
+    Matrix* ret; /* The copy to return */
+
+    //If the arguments are invalid, return NULL.
+    if (S == NULL || S->rowptr == NULL) {
+        return NULL;
+    }
+
+    ret = new_Matrix(S->nrows, S->ncols);
+#   pragma omp parallel for num_threads(2)
+    for (size_t i = 0; i < S->nrows; i++) {
+        for (size_t p = S->rowptr[i]; p < S->rowptr[i + 1]; p++) {
+            ret->vals[i][S->colind[p]] += S->vals[p];
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Retrieves the value at index S[i,j] of a sparse matrix
+ *
+ * @param S the matrix
+ * @param i the row index of the desired value
+ * @param j the column index of the desired value
+ * @return double the value stored at [i,j], 0.0 if none is stored or if invalid
+ *         ** if the index was invalid, errno should be set to EINVAL **
+ */
+double SparseMatrix_get(SparseMatrix* S, size_t i, size_t j) {
+    size_t lo, hi; /* The part of the row still being searched */
+
+    //If the arguments are invalid, set errno and return 0.0.
+    if (S == NULL || S->rowptr == NULL || i >= S->nrows || j >= S->ncols) {
+        errno = EINVAL;
+        return 0.0;
+    }
+
+    //Binary search the sorted columns of row i.
+    lo = S->rowptr[i];
+    hi = S->rowptr[i + 1];
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (S->colind[mid] < j) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return (lo < S->rowptr[i + 1] && S->colind[lo] == j) ? S->vals[lo] : 0.0;
+}
+
+/**
+ * @brief Computes y = A*x for contiguous vectors
+ *
+ * @param A the sparse matrix
+ * @param x A.ncols values
+ * @param y receives A.nrows values
+ */
+static void sparse_spmv(SparseMatrix* A, const double* x, double* y) {
+#   pragma omp parallel for num_threads(2) schedule(dynamic, 256)
+    for (size_t i = 0; i < A->nrows; i++) {
+        double sum = 0.0;
+        for (size_t p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+            sum += A->vals[p] * x[A->colind[p]];
+        }
+        y[i] = sum;
+    }
+}
+
+/**
+ * @brief Multiplies a sparse matrix by a column vector
+ *
+ * @param A the sparse matrix
+ * @param x a column vector with A.ncols rows
+ * @return Matrix* the column vector A*x or NULL if the operation is invalid
+ */
+Matrix* SparseMatrix_mult_vec(SparseMatrix* A, Matrix* x) {
+    Matrix* ret; /* The product to return */
+    double* xv, * yv; /* x and the product, stored contiguously */
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || A->rowptr == NULL || x == NULL || x->vals == NULL) {
+        return NULL;
+    }
+    if (x->nrows != A->ncols || x->ncols != 1) {
+        return NULL;
+    }
+
+    xv = (double*) malloc(sizeof(double) * (A->ncols + 1));
+    yv = (double*) malloc(sizeof(double) * (A->nrows + 1));
+    for (size_t j = 0; j < A->ncols; j++) {
+        xv[j] = x->vals[j][0];
+    }
+    sparse_spmv(A, xv, yv);
+
+    ret = new_Matrix(A->nrows, 1);
+    for (size_t i = 0; i < A->nrows; i++) {
+        ret->vals[i][0] = yv[i];
+    }
+
+    free(xv);
+    free(yv);
+    return ret;
+}
+
+/**
+ * @brief Turns counts into offsets in place: a[i] becomes a[0] + ... + a[i]
+ *
+ * The two halves are summed separately, so the parallel build can split
+ * them between threads, then the second is shifted by the total of the
+ * first.
+ *
+ * @param a n+1 values; a[0] is normally 0 and a[i+1] the count of item i
+ * @param n the number of items
+ */
+static void sparse_prefix_sum(size_t* a, size_t n) {
+    size_t half = (n + 1) / 2; /* The first index of the second half */
+
+#   pragma omp parallel sections num_threads(2)
+    {
+#       pragma omp section
+        for (size_t i = 1; i < half; i++) {
+            a[i] += a[i - 1];
+        }
+#       pragma omp section
+        for (size_t i = half + 1; i <= n; i++) {
+            a[i] += a[i - 1];
+        }
+    }
+    if (half > 0) {
+#       pragma omp parallel for simd num_threads(2)
+        for (size_t i = half; i <= n; i++) {
+            a[i] += a[half - 1];
+        }
+    }
+}
+
+/**
+ * @brief Transposes a sparse matrix
+ *
+ * Since a matrix in CSC form is its transpose in CSR form, this is also the
+ * conversion from CSR to CSC (and back). The rows are split into one part per
+ * thread, each part counts its entries per column, and the counts are turned
+ * into offsets with a prefix sum, so each part then scatters its entries into
+ * its own slots without synchronization. The rows of the result come out
+ * sorted.
+ *
+ * @param A the matrix
+ * @return SparseMatrix* A^T or NULL if the operation is invalid
+ */
+SparseMatrix* SparseMatrix_transpose(SparseMatrix* A) {
+    const size_t PARTS = 2; /* Matches num_threads(2) */
+    SparseMatrix* T; /* The transpose to return */
+    size_t* count; /* The entries of each part in each column, then their offsets */
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || A->rowptr == NULL) {
+        return NULL;
+    }
+
+    T = new_SparseMatrix(A->ncols, A->nrows, A->rowptr[A->nrows]);
+    count = (size_t*) calloc(PARTS * A->ncols + 1, sizeof(size_t));
+
+#   pragma omp parallel for num_threads(2)
+    for (size_t t = 0; t < PARTS; t++) {
+        size_t* c = count + t * A->ncols;
+        for (size_t p = A->rowptr[t * A->nrows / PARTS]; p < A->rowptr[(t + 1) * A->nrows / PARTS]; p++) {
+            c[A->colind[p]]++;
+        }
+    }
+#   pragma omp parallel for num_threads(2)
+    for (size_t j = 0; j < A->ncols; j++) {
+        for (size_t t = 0; t < PARTS; t++) {
+            T->rowptr[j + 1] += count[t * A->ncols + j];
+        }
+    }
+    sparse_prefix_sum(T->rowptr, A->ncols);
+
+    //Each part starts at its column's offset, after the parts before it.
+#   pragma omp parallel for num_threads(2)
+    for (size_t j = 0; j < A->ncols; j++) {
+        size_t offset = T->rowptr[j];
+        for (size_t t = 0; t < PARTS; t++) {
+            size_t c = count[t * A->ncols + j];
+            count[t * A->ncols + j] = offset;
+            offset += c;
+        }
+    }
+#   pragma omp parallel for num_threads(2)
+    for (size_t t = 0; t < PARTS; t++) {
+        size_t* c = count + t * A->ncols;
+        for (size_t i = t * A->nrows / PARTS; i < (t + 1) * A->nrows / PARTS; i++) {
+            for (size_t p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+                size_t q = c[A->colind[p]]++;
+                T->colind[q] = i;
+                T->vals[q] = A->vals[p];
+            }
+        }
+    }
+
+    free(count);
+    return T;
+}
+
+/**
+ * @brief Multiplies the transpose of a sparse matrix by a column vector
+ *
+ * A^T is never formed: the rows of A are split into one part per thread, each
+ * scattering its contributions into its own copy of the result, and the
+ * copies are added at the end.
+ *
+ * @param A the sparse matrix
+ * @param x a column vector with A.nrows rows
+ * @return Matrix* the column vector A^T*x or NULL if the operation is invalid
+ */
+Matrix* SparseMatrix_mult_vec_trans(SparseMatrix* A, Matrix* x) {
+    const size_t PARTS = 2; /* Matches num_threads(2) */
+    Matrix* ret; /* The product to return */
+    double* y; /* The copy of the product for each part */
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || A->rowptr == NULL || x == NULL || x->vals == NULL) {
+        return NULL;
+    }
+    if (x->nrows != A->nrows || x->ncols != 1) {
+        return NULL;
+    }
+
+    y = (double*) calloc(PARTS * A->ncols + 1, sizeof(double));
+#   pragma omp parallel for num_threads(2)
+    for (size_t t = 0; t < PARTS; t++) {
+        double* yt = y + t * A->ncols;
+        for (size_t i = t * A->nrows / PARTS; i < (t + 1) * A->nrows / PARTS; i++) {
+            double xi = x->vals[i][0];
+            for (size_t p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+                yt[A->colind[p]] += A->vals[p] * xi;
+            }
+        }
+    }
+
+    ret = new_Matrix(A->ncols, 1);
+#   pragma omp parallel for num_threads(2)
+    for (size_t j = 0; j < A->ncols; j++) {
+        double sum = 0.0;
+        for (size_t t = 0; t < PARTS; t++) {
+            sum += y[t * A->ncols + j];
+        }
+        ret->vals[j][0] = sum;
+    }
+
+    free(y);
+    return ret;
+}
+
+/**
+ * @brief Builds the adjacency structure of the graph of A + A^T
+ *
+ * Node v's neighbours are adj[xadj[v]] to adj[xadj[v+1]-1], sorted, without
+ * v itself and without repeats.
+ *
+ * @param A a square sparse matrix
+ * @param xadj receives the n+1 offsets into adj
+ * @param adj receives the neighbour lists
+ * @return 0 if the operation was successful, otherwise 1
+ */
+static int sparse_graph(SparseMatrix* A, size_t** xadj, size_t** adj) {
+    size_t n = A->nrows; /* The number of nodes */
+    size_t* x = (size_t*) calloc(n + 1, sizeof(size_t)); /* The offsets being built */
+    size_t* a, * next; /* The lists being built and the next free slot of each */
+    size_t begin = 0, w = 0; /* The start of the current list before and after merging */
+
+    if (x == NULL) {
+        return 1;
+    }
+
+    //Every off-diagonal entry (i, j) links i to j and j to i.
+    for (size_t i = 0; i < n; i++) {
+        for (size_t p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+            if (A->colind[p] != i) {
+                x[i + 1]++;
+                x[A->colind[p] + 1]++;
+            }
+        }
+    }
+    for (size_t v = 0; v < n; v++) {
+        x[v + 1] += x[v];
+    }
+    a = (size_t*) malloc(sizeof(size_t) * (x[n] + 1));
+    next = (size_t*) malloc(sizeof(size_t) * (n + 1));
+    if (a == NULL || next == NULL) {
+        free(x);
+        free(a);
+        free(next);
+        return 1;
+    }
+    memcpy(next, x, sizeof(size_t) * (n + 1));
+    for (size_t i = 0; i < n; i++) {
+        for (size_t p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+            size_t j = A->colind[p];
+            if (j != i) {
+                a[next[i]++] = j;
+                a[next[j]++] = i;
+            }
+        }
+    }
+    free(next);
+
+    //Sort each list and drop the repeats, closing up the gaps.
+    for (size_t v = 0; v < n; v++) {
+        size_t end = x[v + 1]; /* The end of the list before merging */
+
+        qsort(a + begin, end - begin, sizeof(size_t), compare_size);
+        x[v] = w;
+        for (size_t p = begin; p < end; p++) {
+            if (w == x[v] || a[w - 1] != a[p]) {
+                a[w++] = a[p];
+            }
+        }
+        begin = end;
+    }
+    x[n] = w;
+
+    *xadj = x;
+    *adj = a;
+    return 0;
+}
+
+/**
+ * @brief Runs a breadth-first search over part of a graph
+ *
+ * @param xadj the offsets of the neighbour lists
+ * @param adj the neighbour lists
+ * @param root the node to start from
+ * @param label if not NULL, only nodes v with label[v] == id are visited
+ * @param id the label of the nodes to visit
+ * @param order if true, the nodes found from each node are queued by
+ *        increasing degree, as Cuthill-McKee requires
+ * @param level must be SIZE_MAX for every node that may be visited; receives
+ *        the distance from root of every node reached
+ * @param queue receives the nodes reached, in the order they were visited
+ * @param nlevels receives the number of distinct distances
+ * @return size_t the number of nodes reached
+ */
+static size_t graph_bfs(const size_t* xadj, const size_t* adj, size_t root, const size_t* label, size_t id,
+                        bool order, size_t* level, size_t* queue, size_t* nlevels) {
+    size_t head = 0, tail = 1; /* The ends of the queue */
+
+    queue[0] = root;
+    level[root] = 0;
+    while (head < tail) {
+        size_t v = queue[head++];
+        size_t first = tail; /* Where v's newly found neighbours start */
+
+        for (size_t p = xadj[v]; p < xadj[v + 1]; p++) {
+            size_t w = adj[p];
+            if ((label == NULL || label[w] == id) && level[w] == SIZE_MAX) {
+                level[w] = level[v] + 1;
+                queue[tail++] = w;
+            }
+        }
+
+        //Insertion sort by degree; neighbour lists are short.
+        for (size_t q = first + 1; order && q < tail; q++) {
+            size_t w = queue[q], d = xadj[w + 1] - xadj[w];
+            size_t r = q;
+            for (; r > first && xadj[queue[r - 1] + 1] - xadj[queue[r - 1]] > d; r--) {
+                queue[r] = queue[r - 1];
+            }
+            queue[r] = w;
+        }
+    }
+
+    *nlevels = level[queue[tail - 1]] + 1;
+    return tail;
+}
+
+/**
+ * @brief Finds a pseudo-peripheral node of the part of a graph holding root
+ *
+ * This is the George-Liu search: search from the current node, move to the
+ * lowest-degree node of the last level, and stop once that no longer makes the
+ * level structure deeper. Every level is SIZE_MAX again on return.
+ *
+ * @param xadj the offsets of the neighbour lists
+ * @param adj the neighbour lists
+ * @param root the node to start from
+ * @param label if not NULL, only nodes v with label[v] == id are visited
+ * @param id the label of the nodes to visit
+ * @param level scratch, SIZE_MAX for every node that may be visited
+ * @param queue scratch for as many nodes as may be visited
+ * @return size_t the node found
+ */
+static size_t graph_peripheral(const size_t* xadj, const size_t* adj, size_t root, const size_t* label, size_t id,
+                               size_t* level, size_t* queue) {
+    size_t nlevels, count; /* The depth and size of the current level structure */
+
+    count = graph_bfs(xadj, adj, root, label, id, false, level, queue, &nlevels);
+    for (;;) {
+        size_t cand = queue[count - 1]; /* The lowest-degree node in the last level */
+        size_t depth;
+
+        for (size_t k = count - 1; k > 0 && level[queue[k - 1]] == nlevels - 1; k--) {
+            size_t v = queue[k - 1];
+            if (xadj[v + 1] - xadj[v] < xadj[cand + 1] - xadj[cand]) {
+                cand = v;
+            }
+        }
+        for (size_t k = 0; k < count; k++) {
+            level[queue[k]] = SIZE_MAX;
+        }
+        if (cand == root) {
+            return root;
+        }
+
+        graph_bfs(xadj, adj, cand, label, id, false, level, queue, &depth);
+        if (depth <= nlevels) {
+            for (size_t k = 0; k < count; k++) {
+                level[queue[k]] = SIZE_MAX;
+            }
+            return root;
+        }
+        root = cand;
+        nlevels = depth;
+    }
+}
+
+/**
+ * @brief Computes the reverse Cuthill-McKee ordering of a square sparse matrix
+ *
+ * The ordering is computed on the pattern of A + A^T. Each connected component
+ * is numbered breadth-first from a pseudo-peripheral node, visiting neighbours
+ * in order of increasing degree, and the whole numbering is then reversed. This
+ * keeps the entries close to the diagonal, which reduces bandwidth and profile
+ * and improves the locality of SpMV. Apply it with
+ * SparseMatrix_permute(A, perm, perm).
+ *
+ * @param A the matrix to order
+ * @return size_t* perm, where perm[k] is the row placed k-th (free it with free),
+ *         or NULL if A is invalid, empty or not square
+ */
+size_t* SparseMatrix_rcm(SparseMatrix* A) {
+    size_t n, done = 0; /* The number of nodes and how many are numbered */
+    size_t* xadj, * adj; /* The graph of A + A^T */
+    size_t* perm, * level; /* The ordering and the BFS distances */
+
+    //If the arguments are invalid, return NULL.
+    if (A == NULL || A->rowptr == NULL || A->nrows != A->ncols || A->nrows == 0) {
+        return NULL;
+    }
+    n = A->nrows;
+    if (sparse_graph(A, &xadj, &adj) != 0) {
+        return NULL;
+    }
+    perm = (size_t*) malloc(sizeof(size_t) * n);
+    level = (size_t*) malloc(sizeof(size_t) * n);
+    for (size_t v = 0; v < n; v++) {
+        level[v] = SIZE_MAX;
+    }
+
+    //Nodes keep their level once numbered, which marks them as done.
+    for (size_t s = 0; s < n; s++) {
+        size_t root, nlevels;
+
+        if (level[s] != SIZE_MAX) {
+            continue;
+        }
+        root = graph_peripheral(xadj, adj, s, NULL, 0, level, perm + done);
+        done += graph_bfs(xadj, adj, root, NULL, 0, true, level, perm + done, &nlevels);
+    }
+
+    for (size_t k = 0; k < n / 2; k++) {
+        size_t tmp = perm[k];
+        perm[k] = perm[n - 1 - k];
+        perm[n - 1 - k] = tmp;
+    }
+
+    free(xadj);
+    free(adj);
+    free(level);
+    return perm;
+}
+
+/**
+ * @brief Orders nodes[lo..hi) by nested dissection
+ *
+ * All the nodes in the range carry label lo on entry. Each connected component
+ * is split by a level-set separator: a breadth-first search from a
+ * pseudo-peripheral node, cut at the level where half the nodes have been
+ * reached. Only the nodes of that level with a neighbour beyond it are kept in
+ * the separator. The two sides are ordered first, in parallel, and the
+ * separator last. Small components are ordered by reverse
+ * Cuthill-McKee.
+ *
+ * @param xadj the offsets of the neighbour lists
+ * @param adj the neighbour lists
+ * @param nodes the nodes, reordered in place
+ * @param tmp scratch for the same range as nodes
+ * @param label the part each node belongs to, SIZE_MAX for separators
+ * @param level SIZE_MAX for every node in the range, and restored on return
+ * @param lo the first position of the range
+ * @param hi one past the last position of the range
+ */
+static void nd_order(const size_t* xadj, const size_t* adj, size_t* nodes, size_t* tmp, size_t* label,
+                     size_t* level, size_t lo, size_t hi) {
+    const size_t LEAF = 64; /* The largest component ordered without splitting */
+
+    while (lo < hi) {
+        size_t n = hi - lo, count, nlevels, root;
+        size_t k, n1 = 0, n2 = 0, ns = 0; /* The cut level and the sizes of the parts */
+
+        root = graph_peripheral(xadj, adj, nodes[lo], label, lo, level, tmp + lo);
+        count = graph_bfs(xadj, adj, root, label, lo, true, level, tmp + lo, &nlevels);
+
+        //Split off the component just found and order it separately.
+        if (count < n) {
+            size_t w = lo + count;
+            for (size_t q = lo; q < hi; q++) {
+                if (level[nodes[q]] == SIZE_MAX) {
+                    tmp[w++] = nodes[q];
+                    label[nodes[q]] = lo + count;
+                }
+            }
+            for (size_t q = lo; q < lo + count; q++) {
+                level[tmp[q]] = SIZE_MAX;
+            }
+            memcpy(nodes + lo, tmp + lo, sizeof(size_t) * n);
+#           pragma omp task if(count > 4096)
+            nd_order(xadj, adj, nodes, tmp, label, level, lo, lo + count);
+            lo += count;
+            continue;
+        }
+
+        //Small or very dense components are ordered by reverse Cuthill-McKee.
+        if (n <= LEAF || nlevels < 3) {
+            for (size_t q = 0; q < n; q++) {
+                nodes[lo + q] = tmp[hi - 1 - q];
+                level[tmp[hi - 1 - q]] = SIZE_MAX;
+            }
+            break;
+        }
+
+        //Cut at the level of the middle node, leaving at least one level on
+        //either side. BFS order lists the levels in increasing order.
+        k = level[tmp[lo + n / 2]];
+        k = (k < 1) ? 1 : (k > nlevels - 2) ? nlevels - 2 : k;
+
+        //Nodes of level k with no neighbour beyond it can join the first side.
+        for (size_t q = lo; q < hi; q++) {
+            size_t v = tmp[q];
+            for (size_t p = xadj[v]; level[v] == k && p < xadj[v + 1]; p++) {
+                if (label[adj[p]] == lo && level[adj[p]] == k + 1) {
+                    level[v] = SIZE_MAX - 1;
+                }
+            }
+        }
+
+        //Place the first side, then the second side, then the separator.
+        for (size_t q = lo; q < hi; q++) {
+            if (level[tmp[q]] <= k) {
+                nodes[lo + n1++] = tmp[q];
+            }
+        }
+        for (size_t q = lo; q < hi; q++) {
+            if (level[tmp[q]] > k && level[tmp[q]] < SIZE_MAX - 1) {
+                nodes[lo + n1 + n2++] = tmp[q];
+                label[tmp[q]] = lo + n1;
+            }
+        }
+        for (size_t q = lo; q < hi; q++) {
+            if (level[tmp[q]] == SIZE_MAX - 1) {
+                nodes[lo + n1 + n2 + ns++] = tmp[q];
+                label[tmp[q]] = SIZE_MAX;
+            }
+            level[tmp[q]] = SIZE_MAX;
+        }
+
+        //Order the first side separately and carry on with the second.
+#       pragma omp task if(n1 > 4096)
+        nd_order(xadj, adj, nodes, tmp, label, level, lo, lo + n1);
+        hi = lo + n1 + n2;
+        lo += n1;
+    }
+
+#   pragma omp taskwait
+}
+
+/**
+ * @brief Computes a nested-dissection ordering of a square sparse matrix
+ *
+ * The ordering is computed on the pattern of A + A^T by recursively splitting
+ * the graph with small separators and numbering each separator after the two
+ * parts it separates (see nd_order). Eliminating in this order keeps the fill
+ * of a Cholesky or LU factorization low, and the independent parts can be
+ * factored in parallel. Apply it with SparseMatrix_permute(A, perm, perm).
+ *
+ * @param A the matrix to order
+ * @return size_t* perm, where perm[k] is the row placed k-th (free it with free),
+ *         or NULL if A is invalid, empty or not square
+ */
+size_t* SparseMatrix_nested_dissection(SparseMatrix* A) {
+    size_t n; /* The number of nodes */
+    size_t* xadj, * adj; /* The graph of A + A^T */
+    size_t* nodes, * tmp, * label, * level; /* See nd_order */
+
+    //If the arguments are invalid, return NULL.
+    if (A == NULL || A->rowptr == NULL || A->nrows != A->ncols || A->nrows == 0) {
+        return NULL;
+    }
+    n = A->nrows;
+    if (sparse_graph(A, &xadj, &adj) != 0) {
+        return NULL;
+    }
+    nodes = (size_t*) malloc(sizeof(size_t) * n);
+    tmp = (size_t*) malloc(sizeof(size_t) * n);
+    label = (size_t*) calloc(n, sizeof(size_t));
+    level = (size_t*) malloc(sizeof(size_t) * n);
+    for (size_t v = 0; v < n; v++) {
+        nodes[v] = v;
+        level[v] = SIZE_MAX;
+    }
+
+#   pragma omp parallel num_threads(2)
+#   pragma omp single
+    nd_order(xadj, adj, nodes, tmp, label, level, 0, n);
+
+    free(xadj);
+    free(adj);
+    free(tmp);
+    free(label);
+    free(level);
+    return nodes;
+}
+
+/**
+ * @brief Checks that perm holds every index below n exactly once
+ *
+ * @param perm the permutation, or NULL for the identity
+ * @param n the number of indices
+ * @param inv receives the inverse permutation
+ * @return 0 if perm is a permutation, otherwise 1
+ */
+static int invert_permutation(const size_t* perm, size_t n, size_t* inv) {
+    for (size_t k = 0; k < n; k++) {
+        inv[k] = (perm == NULL) ? k : SIZE_MAX;
+    }
+    for (size_t k = 0; perm != NULL && k < n; k++) {
+        if (perm[k] >= n || inv[perm[k]] != SIZE_MAX) {
+            return 1;
+        }
+        inv[perm[k]] = k;
+    }
+    return 0;
+}
+
+/**
+ * @brief Permutes the rows and columns of a sparse matrix
+ *
+ * Entry (i, j) of the result is entry (rowperm[i], colperm[j]) of A. Passing
+ * the same ordering for both, such as one from SparseMatrix_rcm, renumbers the
+ * unknowns of a system symmetrically.
+ *
+ * @param A the matrix to permute
+ * @param rowperm the row placed at each position, or NULL to keep the rows
+ * @param colperm the column placed at each position, or NULL to keep the columns
+ * @return SparseMatrix* the permuted matrix or NULL if the arguments are invalid
+ */
+SparseMatrix* SparseMatrix_permute(SparseMatrix* A, const size_t* rowperm, const size_t* colperm) {
+    SparseMatrix* ret; /* The matrix to return */
+    size_t* rinv, * cinv; /* The inverse permutations */
+
+    //If the arguments are invalid, return NULL.
+    if (A == NULL || A->rowptr == NULL) {
+        return NULL;
+    }
+    rinv = (size_t*) malloc(sizeof(size_t) * (A->nrows + 1));
+    cinv = (size_t*) malloc(sizeof(size_t) * (A->ncols + 1));
+    if (invert_permutation(rowperm, A->nrows, rinv) != 0 || invert_permutation(colperm, A->ncols, cinv) != 0) {
+        free(rinv);
+        free(cinv);
+        return NULL;
+    }
+
+    ret = new_SparseMatrix(A->nrows, A->ncols, A->rowptr[A->nrows]);
+    for (size_t i = 0; i < A->nrows; i++) {
+        size_t r = (rowperm == NULL) ? i : rowperm[i];
+        ret->rowptr[i + 1] = ret->rowptr[i] + (A->rowptr[r + 1] - A->rowptr[r]);
+    }
+
+    //Each row is copied, renumbered and re-sorted independently.
+#   pragma omp parallel for num_threads(2) schedule(dynamic, 256)
+    for (size_t i = 0; i < A->nrows; i++) {
+        size_t r = (rowperm == NULL) ? i : rowperm[i];
+        size_t q = ret->rowptr[i];
+        for (size_t p = A->rowptr[r]; p < A->rowptr[r + 1]; p++, q++) {
+            ret->colind[q] = cinv[A->colind[p]];
+            ret->vals[q] = A->vals[p];
+        }
+        if (colperm != NULL) {
+            sparse_sort_row(ret->colind + ret->rowptr[i], ret->vals + ret->rowptr[i],
+                            ret->rowptr[i + 1] - ret->rowptr[i]);
+        }
+    }
+
+    free(rinv);
+    free(cinv);
+    return ret;
+}
+
+/**
+ * @brief Computes the bandwidth of a sparse matrix
+ *
+ * @param A the matrix
+ * @return size_t the largest |i - j| over the stored entries (i, j), or 0 if A
+ *         is invalid
+ *         ** if A was invalid, errno should be set to EINVAL **
+ */
+size_t SparseMatrix_bandwidth(SparseMatrix* A) {
+    size_t ret = 0; /* The bandwidth */
+
+    //If the arguments are invalid, set errno and return 0.
+    if (A == NULL || A->rowptr == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    //Columns are sorted, so only the first and last entries of a row matter.
+#   pragma omp parallel for num_threads(2) reduction(max: ret)
+    for (size_t i = 0; i < A->nrows; i++) {
+        if (A->rowptr[i + 1] > A->rowptr[i]) {
+            size_t first = A->colind[A->rowptr[i]], last = A->colind[A->rowptr[i + 1] - 1];
+            size_t lower = (first < i) ? i - first : 0, upper = (last > i) ? last - i : 0;
+            ret = (lower > ret) ? lower : ret;
+            ret = (upper > ret) ? upper : ret;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Computes the profile (envelope size) of a sparse matrix
+ *
+ * The profile is the sum over the rows i of i - f(i), where f(i) is the first
+ * column of row i holding an entry, or i if that comes later. For a symmetric
+ * matrix this is the storage a skyline (envelope) factorization would need
+ * below the diagonal.
+ *
+ * @param A the matrix
+ * @return size_t the profile, or 0 if A is invalid
+ *         ** if A was invalid, errno should be set to EINVAL **
+ */
+size_t SparseMatrix_profile(SparseMatrix* A) {
+    size_t ret = 0; /* The profile */
+
+    //If the arguments are invalid, set errno and return 0.
+    if (A == NULL || A->rowptr == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+#   pragma omp parallel for num_threads(2) reduction(+: ret)
+    for (size_t i = 0; i < A->nrows; i++) {
+        if (A->rowptr[i + 1] > A->rowptr[i] && A->colind[A->rowptr[i]] < i) {
+            ret += i - A->colind[A->rowptr[i]];
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief A sparse Cholesky factorization P A P^T = L L^T split into supernodes
+ *
+ * A supernode is a run of consecutive columns of L with the same pattern below
+ * the diagonal block, so it is stored as one dense Matrix: its rows are the
+ * row indices rowind[rowptr[s]] to rowind[rowptr[s+1]-1] (the supernode's own
+ * columns first) and its columns are the columns super[s] to super[s+1]-1.
+ */
+struct SparseCholesky {
+    size_t n; /* The order of the matrix */
+    size_t nsuper; /* The number of supernodes */
+    size_t* perm; /* perm[k] is the row of A eliminated k-th */
+    size_t* super; /* Supernode s holds columns super[s] to super[s+1]-1 */
+    size_t* sparent; /* The parent of each supernode, SIZE_MAX for roots */
+    size_t* first; /* The first column in the subtree of each supernode */
+    size_t* childptr; /* The children of s are children[childptr[s]..childptr[s+1]-1] */
+    size_t* children;
+    size_t* rowptr; /* The rows of s are rowind[rowptr[s]..rowptr[s+1]-1] */
+    size_t* rowind;
+    size_t annz; /* The number of entries A must have */
+    size_t* amap; /* The position of each entry of A in colval, SIZE_MAX if unused */
+    size_t* colptr; /* Column j of the lower triangle of P A P^T is */
+    size_t* colrow; /* colrow/colval[colptr[j]..colptr[j+1]-1], rows increasing */
+    double* colval;
+    Matrix* L; /* The dense block of each supernode */
+    bool factored; /* Whether L holds a factorization */
+};
+
+/**
+ * @brief Builds the pattern of the lower triangle of P A P^T by rows
+ *
+ * Only the entries of A on or below its diagonal are used. Entry (i, j) lands
+ * in row max(inv[i], inv[j]) at column min(inv[i], inv[j]); the columns of a
+ * row are not sorted.
+ *
+ * @param A the matrix
+ * @param inv the position of each row of A in the ordering
+ * @param rowptr receives n+1 row offsets
+ * @param colind receives the columns, room for nnz(A)
+ * @param src receives the position in A of each entry, or NULL
+ */
+static void cholesky_lower(SparseMatrix* A, const size_t* inv, size_t* rowptr, size_t* colind, size_t* src) {
+    size_t n = A->nrows; /* The order of the matrix */
+
+    memset(rowptr, 0, sizeof(size_t) * (n + 1));
+    for (size_t i = 0; i < n; i++) {
+        for (size_t p = A->rowptr[i]; p < A->rowptr[i + 1] && A->colind[p] <= i; p++) {
+            size_t a = inv[i], b = inv[A->colind[p]];
+            rowptr[((a > b) ? a : b) + 1]++;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        rowptr[i + 1] += rowptr[i];
+    }
+    for (size_t i = 0; i < n; i++) {
+        for (size_t p = A->rowptr[i]; p < A->rowptr[i + 1] && A->colind[p] <= i; p++) {
+            size_t a = inv[i], b = inv[A->colind[p]];
+            size_t r = (a > b) ? a : b;
+            colind[rowptr[r]] = (a > b) ? b : a;
+            if (src != NULL) {
+                src[rowptr[r]] = p;
+            }
+            rowptr[r]++;
+        }
+    }
+    for (size_t i = n; i > 0; i--) {
+        rowptr[i] = rowptr[i - 1];
+    }
+    rowptr[0] = 0;
+}
+
+/**
+ * @brief Computes the elimination tree of a symmetric matrix
+ *
+ * This is Liu's algorithm with path compression. Column j of the Cholesky
+ * factor is needed by its parent, the first later column it updates.
+ *
+ * @param n the order of the matrix
+ * @param rowptr the row offsets of its lower triangle
+ * @param colind the columns of its lower triangle
+ * @param parent receives the parent of each column, SIZE_MAX for roots
+ * @param anc scratch for n values
+ */
+static void sparse_etree(size_t n, const size_t* rowptr, const size_t* colind, size_t* parent, size_t* anc) {
+    for (size_t i = 0; i < n; i++) {
+        parent[i] = SIZE_MAX;
+        anc[i] = SIZE_MAX;
+        for (size_t p = rowptr[i]; p < rowptr[i + 1]; p++) {
+            size_t k = colind[p];
+
+            //Climb from k to the root of its current subtree, pointing the
+            //path at i on the way.
+            while (k < i && anc[k] != SIZE_MAX && anc[k] != i) {
+                size_t next = anc[k];
+                anc[k] = i;
+                k = next;
+            }
+            if (k < i && anc[k] == SIZE_MAX) {
+                anc[k] = i;
+                parent[k] = i;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Computes a postorder of a forest
+ *
+ * @param n the number of nodes
+ * @param parent the parent of each node, SIZE_MAX for roots
+ * @param post receives the nodes in postorder
+ */
+static void tree_postorder(size_t n, const size_t* parent, size_t* post) {
+    size_t* head = (size_t*) malloc(sizeof(size_t) * (n + 1)); /* The first child of each node */
+    size_t* next = (size_t*) malloc(sizeof(size_t) * (n + 1)); /* The next sibling of each node */
+    size_t* stack = (size_t*) malloc(sizeof(size_t) * (n + 1)); /* The path being explored */
+    size_t k = 0; /* The number of nodes placed */
+
+    for (size_t v = 0; v < n; v++) {
+        head[v] = SIZE_MAX;
+    }
+    for (size_t v = n; v > 0; v--) {
+        if (parent[v - 1] != SIZE_MAX) {
+            next[v - 1] = head[parent[v - 1]];
+            head[parent[v - 1]] = v - 1;
+        }
+    }
+
+    //Depth-first from every root, placing a node once its children are done.
+    for (size_t root = 0; root < n; root++) {
+        size_t top = 0;
+
+        if (parent[root] != SIZE_MAX) {
+            continue;
+        }
+        stack[top++] = root;
+        while (top > 0) {
+            size_t v = stack[top - 1];
+            if (head[v] != SIZE_MAX) {
+                size_t c = head[v];
+                head[v] = next[c];
+                stack[top++] = c;
+            }
+            else {
+                top--;
+                post[k++] = v;
+            }
+        }
+    }
+
+    free(head);
+    free(next);
+    free(stack);
+}
+
+/**
+ * @brief Frees everything held by a sparse Cholesky factorization
+ *
+ * @param F the factorization to be deleted
+ */
+void delete_SparseCholesky(SparseCholesky* F) {
+    //Do nothing if F is NULL.
+    if (F == NULL) {
+        return;
+    }
+
+    for (size_t s = 0; F->L != NULL && s < F->nsuper; s++) {
+        deinit_Matrix(&F->L[s]);
+    }
+    free(F->L);
+    free(F->perm);
+    free(F->super);
+    free(F->sparent);
+    free(F->first);
+    free(F->childptr);
+    free(F->children);
+    free(F->rowptr);
+    free(F->rowind);
+    free(F->amap);
+    free(F->colptr);
+    free(F->colrow);
+    free(F->colval);
+    free(F);
+}
+
+/**
+ * @brief Analyses the pattern of a symmetric sparse matrix for Cholesky
+ *
+ * This is the symbolic phase. The ordering (nested dissection when perm is
+ * NULL) is followed by a postorder of its elimination tree, which numbers
+ * every subtree contiguously without changing the fill. The column counts of
+ * L are found by walking the row subtrees, and consecutive columns that form a
+ * chain in the tree with nested patterns are merged into supernodes, whose
+ * row patterns are then built from their children's.
+ *
+ * Only the entries of A on or below the diagonal are used. The result can
+ * factor any matrix with the same pattern; see SparseCholesky_factor.
+ *
+ * @param A a symmetric sparse matrix
+ * @param perm the elimination order, perm[k] being the row eliminated k-th,
+ *        or NULL to use SparseMatrix_nested_dissection
+ * @return SparseCholesky* the analysis or NULL if the arguments are invalid
+ */
+SparseCholesky* new_SparseCholesky(SparseMatrix* A, const size_t* perm) {
+    SparseCholesky* F; /* The analysis to return */
+    size_t n; /* The order of the matrix */
+    size_t* inv, * post, * parent, * work; /* Ordering and tree scratch */
+    size_t* lrowptr, * lcolind, * src; /* The lower triangle of P A P^T by rows */
+    size_t* count, * mark, * nchild; /* Column counts of L, a marker and child counts */
+    size_t ns, total; /* The number of supernodes and rows stored */
+
+    //If the arguments are invalid, return NULL.
+    if (A == NULL || A->rowptr == NULL || A->nrows != A->ncols || A->nrows == 0) {
+        return NULL;
+    }
+    n = A->nrows;
+    F = (SparseCholesky*) calloc(1, sizeof(SparseCholesky));
+    F->n = n;
+    F->annz = A->rowptr[n];
+    F->perm = (size_t*) malloc(sizeof(size_t) * n);
+    inv = (size_t*) malloc(sizeof(size_t) * n);
+    if (perm == NULL) {
+        size_t* nd = SparseMatrix_nested_dissection(A);
+        memcpy(F->perm, nd, sizeof(size_t) * n);
+        free(nd);
+    }
+    else {
+        memcpy(F->perm, perm, sizeof(size_t) * n);
+    }
+    if (invert_permutation(F->perm, n, inv) != 0) {
+        free(inv);
+        delete_SparseCholesky(F);
+        return NULL;
+    }
+
+    post = (size_t*) malloc(sizeof(size_t) * n);
+    parent = (size_t*) malloc(sizeof(size_t) * n);
+    work = (size_t*) malloc(sizeof(size_t) * n);
+    lrowptr = (size_t*) malloc(sizeof(size_t) * (n + 1));
+    lcolind = (size_t*) malloc(sizeof(size_t) * (F->annz + 1));
+    src = (size_t*) malloc(sizeof(size_t) * (F->annz + 1));
+
+    //Follow the ordering by a postorder of its elimination tree.
+    cholesky_lower(A, inv, lrowptr, lcolind, NULL);
+    sparse_etree(n, lrowptr, lcolind, parent, work);
+    tree_postorder(n, parent, post);
+    for (size_t k = 0; k < n; k++) {
+        work[k] = F->perm[post[k]];
+    }
+    memcpy(F->perm, work, sizeof(size_t) * n);
+    invert_permutation(F->perm, n, inv);
+    cholesky_lower(A, inv, lrowptr, lcolind, src);
+    sparse_etree(n, lrowptr, lcolind, parent, work);
+
+    //Row i of L has an entry in every column on the paths from the columns of
+    //row i of A up to i.
+    count = (size_t*) calloc(n, sizeof(size_t));
+    mark = (size_t*) malloc(sizeof(size_t) * n);
+    nchild = (size_t*) calloc(n, sizeof(size_t));
+    for (size_t i = 0; i < n; i++) {
+        mark[i] = i;
+        count[i]++;
+        for (size_t p = lrowptr[i]; p < lrowptr[i + 1]; p++) {
+            for (size_t k = lcolind[p]; mark[k] != i; k = parent[k]) {
+                mark[k] = i;
+                count[k]++;
+            }
+        }
+        if (parent[i] != SIZE_MAX) {
+            nchild[parent[i]]++;
+        }
+    }
+
+    //Column j+1 joins j's supernode when it is j's only child and has the
+    //same pattern below the diagonal.
+    F->super = (size_t*) malloc(sizeof(size_t) * (n + 1));
+    ns = 0;
+    for (size_t j = 0; j < n; j++) {
+        if (j == 0 || parent[j - 1] != j || count[j - 1] != count[j] + 1 || nchild[j] != 1) {
+            F->super[ns++] = j;
+        }
+        work[j] = ns - 1;
+    }
+    F->super[ns] = n;
+    F->nsuper = ns;
+
+    //Supernode tree, subtree extents and child lists.
+    F->sparent = (size_t*) malloc(sizeof(size_t) * ns);
+    F->first = (size_t*) malloc(sizeof(size_t) * ns);
+    F->childptr = (size_t*) calloc(ns + 1, sizeof(size_t));
+    F->children = (size_t*) malloc(sizeof(size_t) * (ns + 1));
+    for (size_t s = 0; s < ns; s++) {
+        size_t last = F->super[s + 1] - 1;
+        F->sparent[s] = (parent[last] == SIZE_MAX) ? SIZE_MAX : work[parent[last]];
+        F->first[s] = F->super[s];
+    }
+    for (size_t s = 0; s < ns; s++) {
+        if (F->sparent[s] != SIZE_MAX) {
+            size_t q = F->sparent[s];
+            F->childptr[q + 1]++;
+            F->first[q] = (F->first[s] < F->first[q]) ? F->first[s] : F->first[q];
+        }
+    }
+    for (size_t s = 0; s < ns; s++) {
+        F->childptr[s + 1] += F->childptr[s];
+    }
+    memcpy(nchild, F->childptr, sizeof(size_t) * ns);
+    for (size_t s = 0; s < ns; s++) {
+        if (F->sparent[s] != SIZE_MAX) {
+            F->children[nchild[F->sparent[s]]++] = s;
+        }
+    }
+
+    //The columns of A, in the new order and with increasing rows.
+    F->colptr = (size_t*) calloc(n + 1, sizeof(size_t));
+    F->colrow = (size_t*) malloc(sizeof(size_t) * (lrowptr[n] + 1));
+    F->colval = (double*) malloc(sizeof(double) * (lrowptr[n] + 1));
+    F->amap = (size_t*) malloc(sizeof(size_t) * (F->annz + 1));
+    for (size_t p = 0; p < lrowptr[n]; p++) {
+        F->colptr[lcolind[p] + 1]++;
+    }
+    for (size_t j = 0; j < n; j++) {
+        F->colptr[j + 1] += F->colptr[j];
+    }
+    memcpy(work, F->colptr, sizeof(size_t) * n);
+    for (size_t p = 0; p < F->annz; p++) {
+        F->amap[p] = SIZE_MAX;
+    }
+    for (size_t i = 0; i < n; i++) {
+        for (size_t p = lrowptr[i]; p < lrowptr[i + 1]; p++) {
+            size_t q = work[lcolind[p]]++;
+            F->colrow[q] = i;
+            F->amap[src[p]] = q;
+        }
+    }
+
+    //The pattern of a supernode is its own columns, the rows of A below them
+    //and the rows its children pass up.
+    F->rowptr = (size_t*) malloc(sizeof(size_t) * (ns + 1));
+    total = 0;
+    for (size_t s = 0; s < ns; s++) {
+        F->rowptr[s] = total;
+        total += count[F->super[s]];
+    }
+    F->rowptr[ns] = total;
+    F->rowind = (size_t*) malloc(sizeof(size_t) * (total + 1));
+    for (size_t j = 0; j < n; j++) {
+        mark[j] = SIZE_MAX;
+    }
+    for (size_t s = 0; s < ns; s++) {
+        size_t f = F->super[s], l = F->super[s + 1]; /* The columns of s */
+        size_t* rows = F->rowind + F->rowptr[s];
+        size_t len = 0;
+
+        for (size_t j = f; j < l; j++) {
+            rows[len++] = j;
+            mark[j] = s;
+        }
+        for (size_t j = f; j < l; j++) {
+            for (size_t p = F->colptr[j]; p < F->colptr[j + 1]; p++) {
+                if (mark[F->colrow[p]] != s) {
+                    mark[F->colrow[p]] = s;
+                    rows[len++] = F->colrow[p];
+                }
+            }
+        }
+        for (size_t c = F->childptr[s]; c < F->childptr[s + 1]; c++) {
+            size_t ch = F->children[c];
+            for (size_t p = F->rowptr[ch]; p < F->rowptr[ch + 1]; p++) {
+                if (F->rowind[p] >= l && mark[F->rowind[p]] != s) {
+                    mark[F->rowind[p]] = s;
+                    rows[len++] = F->rowind[p];
+                }
+            }
+        }
+        qsort(rows + (l - f), len - (l - f), sizeof(size_t), compare_size);
+    }
+
+    F->L = (Matrix*) calloc(ns, sizeof(Matrix));
+    F->factored = false;
+
+    free(inv);
+    free(post);
+    free(parent);
+    free(work);
+    free(lrowptr);
+    free(lcolind);
+    free(src);
+    free(count);
+    free(mark);
+    free(nchild);
+    return F;
+}
+
+/**
+ * @brief Factors one supernode once its children are done
+ *
+ * The supernode's block is assembled from the columns of A and the update
+ * matrices of its children, then factored in place by panels of columns, and
+ * the update matrix U = A22 - L21 L21^T for the parent is computed. Both the
+ * updates within the block and U go through Matrix_gemm; U is computed in
+ * block rows so only its lower triangle is formed.
+ *
+ * @param F the factorization
+ * @param s the supernode
+ * @param U the update matrix of every supernode; the children's are consumed
+ * @return 0 if the block was positive definite, otherwise 1
+ */
+static int cholesky_supernode(SparseCholesky* F, size_t s, Matrix** U) {
+    const size_t NB = 64; /* Columns per panel */
+    const size_t MB = 128; /* Rows of U per call to Matrix_gemm */
+    size_t f = F->super[s], w = F->super[s + 1] - f; /* The first column and width */
+    size_t nr = F->rowptr[s + 1] - F->rowptr[s], m = nr - w; /* All rows and rows below */
+    size_t* rows = F->rowind + F->rowptr[s];
+    Matrix* Ls = &F->L[s];
+    Matrix* Us = NULL;
+    double** panel = (double**) malloc(sizeof(double*) * nr); /* Row pointers offset to a panel */
+    double** right = (double**) malloc(sizeof(double*) * nr); /* Row pointers offset past it */
+    int ret = 0;
+
+    if (Ls->vals == NULL) {
+        init_Matrix(Ls, nr, w);
+    }
+    else {
+        for (size_t i = 0; i < nr; i++) {
+            memset(Ls->vals[i], 0, sizeof(double) * w);
+        }
+    }
+    if (m > 0) {
+        Us = new_Matrix(m, m);
+    }
+
+    //Assemble the columns of A; both row lists are sorted.
+    for (size_t j = 0; j < w; j++) {
+        size_t r = j;
+        for (size_t p = F->colptr[f + j]; p < F->colptr[f + j + 1]; p++) {
+            while (rows[r] < F->colrow[p]) {
+                r++;
+            }
+            Ls->vals[r][j] += F->colval[p];
+        }
+    }
+
+    //Extend-add the children's update matrices.
+    for (size_t c = F->childptr[s]; c < F->childptr[s + 1]; c++) {
+        size_t ch = F->children[c];
+        size_t cw = F->super[ch + 1] - F->super[ch];
+        size_t mc = F->rowptr[ch + 1] - F->rowptr[ch] - cw;
+        size_t* crows = F->rowind + F->rowptr[ch] + cw;
+        size_t* rel = (size_t*) malloc(sizeof(size_t) * (mc + 1)); /* Where each child row lands */
+
+        for (size_t a = 0, r = 0; a < mc; a++) {
+            while (rows[r] < crows[a]) {
+                r++;
+            }
+            rel[a] = r;
+        }
+        for (size_t a = 0; a < mc; a++) {
+            double* urow = U[ch]->vals[a];
+            for (size_t b = 0; b <= a; b++) {
+                if (rel[b] < w) {
+                    Ls->vals[rel[a]][rel[b]] += urow[b];
+                }
+                else {
+                    Us->vals[rel[a] - w][rel[b] - w] += urow[b];
+                }
+            }
+        }
+        free(rel);
+        delete_Matrix(U[ch]);
+        U[ch] = NULL;
+    }
+
+    //Factor the block one panel of columns at a time: Cholesky of the
+    //panel's diagonal block, a triangular solve for the rows below it, then a
+    //Matrix_gemm update of the columns to its right.
+    for (size_t j0 = 0; j0 < w && ret == 0; j0 += NB) {
+        size_t j1 = (j0 + NB < w) ? j0 + NB : w;
+
+        for (size_t i = j0; i < j1 && ret == 0; i++) {
+            double* li = Ls->vals[i];
+            for (size_t j = j0; j <= i; j++) {
+                double* lj = Ls->vals[j];
+                double sum = li[j];
+                for (size_t k = j0; k < j; k++) {
+                    sum -= li[k] * lj[k];
+                }
+                if (j < i) {
+                    li[j] = sum / lj[j];
+                }
+                else if (sum > 0.0) {
+                    li[i] = sqrt(sum);
+                }
+                else {
+                    ret = 1;
+                }
+            }
+        }
+        if (ret != 0) {
+            break;
+        }
+
+#       pragma omp parallel for num_threads(2) if((nr - j1) * (j1 - j0) * (j1 - j0) > 1000000)
+        for (size_t i = j1; i < nr; i++) {
+            double* li = Ls->vals[i];
+            for (size_t j = j0; j < j1; j++) {
+                double* lj = Ls->vals[j];
+                double sum = li[j];
+                for (size_t k = j0; k < j; k++) {
+                    sum -= li[k] * lj[k];
+                }
+                li[j] = sum / lj[j];
+            }
+        }
+
+        if (j1 < w) {
+            Matrix A = {nr - j1, j1 - j0, panel}; /* The panel below its diagonal block */
+            Matrix B = {w - j1, j1 - j0, panel}; /* The panel rows that meet the block */
+            Matrix C = {nr - j1, w - j1, right}; /* The columns to the right */
+            for (size_t i = j1; i < nr; i++) {
+                panel[i - j1] = Ls->vals[i] + j0;
+                right[i - j1] = Ls->vals[i] + j1;
+            }
+            Matrix_gemm(-1.0, &A, false, &B, true, 1.0, &C);
+        }
+    }
+    free(panel);
+    free(right);
+
+    //U = A22 - L21 L21^T, lower triangle only.
+    if (m > 0 && ret == 0) {
+        for (size_t r0 = 0; r0 < m; r0 += MB) {
+            size_t r1 = (r0 + MB < m) ? r0 + MB : m;
+            Matrix C = {r1 - r0, r1, Us->vals + r0}; /* Rows r0..r1 of U, columns 0..r1 */
+            Matrix A = {r1 - r0, w, Ls->vals + w + r0}; /* The matching rows of L21 */
+            Matrix B = {r1, w, Ls->vals + w}; /* The rows of L21 up to r1 */
+            Matrix_gemm(-1.0, &A, false, &B, true, 1.0, &C);
+        }
+    }
+    U[s] = Us;
+
+    return ret;
+}
+
+/**
+ * @brief Factors the subtree of the elimination tree below a supernode
+ *
+ * Sibling subtrees are independent, so each large child subtree becomes a
+ * task of its own.
+ *
+ * @param F the factorization
+ * @param s the root of the subtree
+ * @param U the update matrix of every supernode
+ * @param failed set if some block was not positive definite
+ */
+static void cholesky_subtree(SparseCholesky* F, size_t s, Matrix** U, bool* failed) {
+    //Subtrees of 2048 columns or more get a task of their own.
+    for (size_t c = F->childptr[s]; c < F->childptr[s + 1]; c++) {
+        size_t ch = F->children[c];
+#       pragma omp task if(F->super[ch + 1] - F->first[ch] >= 2048)
+        cholesky_subtree(F, ch, U, failed);
+    }
+#   pragma omp taskwait
+
+    //Several tasks may fail at once, so the store must be atomic.
+    if (cholesky_supernode(F, s, U) != 0) {
+#       pragma omp atomic write
+        *failed = true;
+    }
+}
+
+/**
+ * @brief Computes the numeric Cholesky factorization of a sparse matrix
+ *
+ * A must have the pattern analysed by new_SparseCholesky, and only its entries
+ * on or below the diagonal are read. The factorization can be repeated for
+ * new values with the same pattern. Supernodes are factored bottom-up over
+ * the elimination tree, independent subtrees in parallel.
+ *
+ * @param F the analysis from new_SparseCholesky
+ * @param A the symmetric positive definite matrix to factor
+ * @return 0 if the operation was successful, otherwise 1 (including when A is
+ *         not positive definite)
+ */
+int SparseCholesky_factor(SparseCholesky* F, SparseMatrix* A) {
+    Matrix** U; /* The pending update matrix of every supernode */
+    bool failed = false;
+
+    //If the arguments are invalid, return 1.
+    if (F == NULL || A == NULL || A->rowptr == NULL || A->nrows != F->n || A->ncols != F->n) {
+        return 1;
+    }
+    if (A->rowptr[A->nrows] != F->annz) {
+        return 1;
+    }
+
+    for (size_t p = 0; p < F->annz; p++) {
+        if (F->amap[p] != SIZE_MAX) {
+            F->colval[F->amap[p]] = A->vals[p];
+        }
+    }
+
+    U = (Matrix**) calloc(F->nsuper, sizeof(Matrix*));
+#   pragma omp parallel num_threads(2)
+#   pragma omp single
+    {
+        for (size_t s = 0; s < F->nsuper; s++) {
+            if (F->sparent[s] == SIZE_MAX) {
+#               pragma omp task
+                cholesky_subtree(F, s, U, &failed);
+            }
+        }
+    }
+
+    for (size_t s = 0; s < F->nsuper; s++) {
+        delete_Matrix(U[s]);
+    }
+    free(U);
+
+    F->factored = !failed;
+    return failed ? 1 : 0;
+}
+
+/**
+ * @brief Solves A X = B with a sparse Cholesky factorization
+ *
+ * All the right-hand sides are carried through the forward and backward
+ * substitutions together.
+ *
+ * @param F a factorization from SparseCholesky_factor
+ * @param B the right-hand sides, one per column, with n rows
+ * @return Matrix* the solutions X or NULL if the operation is invalid
+ */
+Matrix* SparseCholesky_solve(SparseCholesky* F, Matrix* B) {
+    Matrix* ret; /* The solutions to return */
+    size_t n, k; /* The order and the number of right-hand sides */
+    double* W; /* The permuted right-hand sides, row-major */
+
+    //If the operation is invalid, return NULL.
+    if (F == NULL || !F->factored || B == NULL || B->vals == NULL || B->nrows != F->n) {
+        return NULL;
+    }
+    n = F->n;
+    k = B->ncols;
+    W = (double*) malloc(sizeof(double) * (n * k + 1));
+    for (size_t i = 0; i < n; i++) {
+        memcpy(W + i * k, B->vals[F->perm[i]], sizeof(double) * k);
+    }
+
+    //Forward: L Y = P B.
+    for (size_t s = 0; s < F->nsuper; s++) {
+        size_t f = F->super[s], w = F->super[s + 1] - f;
+        size_t nr = F->rowptr[s + 1] - F->rowptr[s];
+        size_t* rows = F->rowind + F->rowptr[s];
+        double** L = F->L[s].vals;
+
+        for (size_t j = 0; j < w; j++) {
+            double* wj = W + (f + j) * k;
+            for (size_t t = 0; t < j; t++) {
+                double* wt = W + (f + t) * k;
+                for (size_t c = 0; c < k; c++) {
+                    wj[c] -= L[j][t] * wt[c];
+                }
+            }
+            for (size_t c = 0; c < k; c++) {
+                wj[c] /= L[j][j];
+            }
+        }
+        for (size_t r = w; r < nr; r++) {
+            double* wr = W + rows[r] * k;
+            for (size_t t = 0; t < w; t++) {
+                double* wt = W + (f + t) * k;
+                for (size_t c = 0; c < k; c++) {
+                    wr[c] -= L[r][t] * wt[c];
+                }
+            }
+        }
+    }
+
+    //Backward: L^T Z = Y.
+    for (size_t s = F->nsuper; s-- > 0; ) {
+        size_t f = F->super[s], w = F->super[s + 1] - f;
+        size_t nr = F->rowptr[s + 1] - F->rowptr[s];
+        size_t* rows = F->rowind + F->rowptr[s];
+        double** L = F->L[s].vals;
+
+        for (size_t r = w; r < nr; r++) {
+            double* wr = W + rows[r] * k;
+            for (size_t t = 0; t < w; t++) {
+                double* wt = W + (f + t) * k;
+                for (size_t c = 0; c < k; c++) {
+                    wt[c] -= L[r][t] * wr[c];
+                }
+            }
+        }
+        for (size_t j = w; j-- > 0; ) {
+            double* wj = W + (f + j) * k;
+            for (size_t c = 0; c < k; c++) {
+                wj[c] /= L[j][j];
+            }
+            for (size_t t = 0; t < j; t++) {
+                double* wt = W + (f + t) * k;
+                for (size_t c = 0; c < k; c++) {
+                    wt[c] -= L[j][t] * wj[c];
+                }
+            }
+        }
+    }
+
+    ret = new_Matrix(n, k);
+    for (size_t i = 0; i < n; i++) {
+        memcpy(ret->vals[F->perm[i]], W + i * k, sizeof(double) * k);
+    }
+    free(W);
+    return ret;
+}
+
+/**
+ * @brief Reports the number of entries stored in a sparse Cholesky factor
+ *
+ * @param F the analysis
+ * @return size_t the number of entries on or below the diagonal of L, or 0 if
+ *         F is NULL
+ */
+size_t SparseCholesky_nnz(SparseCholesky* F) {
+    size_t ret = 0; /* The number of entries */
+
+    if (F == NULL) {
+        return 0;
+    }
+    for (size_t s = 0; s < F->nsuper; s++) {
+        size_t w = F->super[s + 1] - F->super[s];
+        size_t nr = F->rowptr[s + 1] - F->rowptr[s];
+        ret += nr * w - w * (w - 1) / 2;
+    }
+    return ret;
+}
+
+/**
+ * @brief Computes a dense LU factorization with partial pivoting in place
+ *
+ * Rows are swapped by exchanging row pointers, so afterwards row i of A holds
+ * row perm[i] of the original, factored as L (unit lower, below the diagonal)
+ * and U (on and above it). The columns are factored in panels, with the
+ * trailing update done by Matrix_gemm.
+ *
+ * @param A a square matrix, overwritten by its factors
+ * @param perm receives the original row of each position
+ * @return 0 if the operation was successful, otherwise 1 (A is singular)
+ */
+static int dense_lu(Matrix* A, size_t* perm) {
+    const size_t NB = 64; /* Columns per panel */
+    size_t n = A->nrows; /* The order of the matrix */
+    double** rows = A->vals;
+    double** panel = (double**) malloc(sizeof(double*) * (n + 1)); /* Row pointers offset to a panel */
+    double** right = (double**) malloc(sizeof(double*) * (n + 1)); /* Row pointers offset past it */
+    int ret = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        perm[i] = i;
+    }
+
+    for (size_t j0 = 0; j0 < n && ret == 0; j0 += NB) {
+        size_t j1 = (j0 + NB < n) ? j0 + NB : n;
+
+        //Factor the panel, updating only its own columns.
+        for (size_t j = j0; j < j1; j++) {
+            size_t p = j; /* The pivot row */
+            double* tmp;
+            size_t t;
+
+            for (size_t i = j + 1; i < n; i++) {
+                if (fabs(rows[i][j]) > fabs(rows[p][j])) {
+                    p = i;
+                }
+            }
+            if (rows[p][j] == 0.0) {
+                ret = 1;
+                break;
+            }
+            tmp = rows[p];
+            rows[p] = rows[j];
+            rows[j] = tmp;
+            t = perm[p];
+            perm[p] = perm[j];
+            perm[j] = t;
+
+            for (size_t i = j + 1; i < n; i++) {
+                double l = rows[i][j] /= rows[j][j];
+                for (size_t c = j + 1; c < j1; c++) {
+                    rows[i][c] -= l * rows[j][c];
+                }
+            }
+        }
+        if (ret != 0 || j1 == n) {
+            break;
+        }
+
+        //The panel's rows of U to the right: L11^-1 A12.
+        for (size_t i = j0 + 1; i < j1; i++) {
+            for (size_t t = j0; t < i; t++) {
+                double l = rows[i][t];
+                for (size_t c = j1; c < n; c++) {
+                    rows[i][c] -= l * rows[t][c];
+                }
+            }
+        }
+
+        //The trailing matrix: A22 -= L21 U12.
+        {
+            Matrix Lv = {n - j1, j1 - j0, panel + j1}; /* L21 */
+            Matrix Uv = {j1 - j0, n - j1, right + j0}; /* U12 */
+            Matrix Cv = {n - j1, n - j1, right + j1}; /* A22 */
+            for (size_t i = j0; i < n; i++) {
+                panel[i] = rows[i] + j0;
+                right[i] = rows[i] + j1;
+            }
+            Matrix_gemm(-1.0, &Lv, false, &Uv, false, 1.0, &Cv);
+        }
+    }
+
+    free(panel);
+    free(right);
+    return ret;
+}
+
+/**
+ * @brief Solves LU X = W in place for a dense factorization from dense_lu
+ *
+ * The rows of W must already be in the factorization's row order.
+ *
+ * @param LU the factors
+ * @param W the right-hand sides, n rows of k values each, row-major
+ * @param k the number of right-hand sides
+ */
+static void dense_lu_solve(Matrix* LU, double* W, size_t k) {
+    size_t n = LU->nrows; /* The order of the matrix */
+
+    for (size_t i = 0; i < n; i++) {
+        double* wi = W + i * k;
+        for (size_t t = 0; t < i; t++) {
+            double l = LU->vals[i][t];
+            for (size_t c = 0; c < k; c++) {
+                wi[c] -= l * W[t * k + c];
+            }
+        }
+    }
+    for (size_t i = n; i-- > 0; ) {
+        double* wi = W + i * k;
+        for (size_t t = i + 1; t < n; t++) {
+            double u = LU->vals[i][t];
+            for (size_t c = 0; c < k; c++) {
+                wi[c] -= u * W[t * k + c];
+            }
+        }
+        for (size_t c = 0; c < k; c++) {
+            wi[c] /= LU->vals[i][i];
+        }
+    }
+}
+
+/**
+ * @brief A sparse LU factorization A(prow, q) = L U
+ *
+ * The first ns steps are stored sparsely by columns; the Schur complement left
+ * after them, once it has become nearly dense, is factored as a dense Matrix.
+ */
+struct SparseLU {
+    size_t n; /* The order of the matrix */
+    size_t ns; /* The number of steps stored sparsely */
+    size_t* q; /* Column q[k] of A is eliminated at step k */
+    size_t* prow; /* Row prow[k] of A is the pivot of step k */
+    size_t* Lp; /* Column k < ns of L is Li/Lx[Lp[k]..Lp[k+1]-1], rows as steps */
+    size_t* Li;
+    double* Lx;
+    size_t* Up; /* Column k of U above the diagonal is Ui/Ux[Up[k]..Up[k+1]-1] */
+    size_t* Ui;
+    double* Ux;
+    double* Udiag; /* The pivots of the sparse steps */
+    Matrix D; /* The dense LU factors of the last n - ns steps */
+};
+
+/**
+ * @brief Frees everything held by a sparse LU factorization
+ *
+ * @param F the factorization to be deleted
+ */
+void delete_SparseLU(SparseLU* F) {
+    //Do nothing if F is NULL.
+    if (F == NULL) {
+        return;
+    }
+
+    free(F->q);
+    free(F->prow);
+    free(F->Lp);
+    free(F->Li);
+    free(F->Lx);
+    free(F->Up);
+    free(F->Ui);
+    free(F->Ux);
+    free(F->Udiag);
+    deinit_Matrix(&F->D);
+    free(F);
+}
+
+/**
+ * @brief Finds the rows reached from row j in the graph of L, depth first
+ *
+ * Row i leads to the rows of column pinv[i] of L once i has been pivoted.
+ * Rows are added to xi[top-1], xi[top-2], ... as they are finished, so
+ * xi[top..n) ends in topological order.
+ *
+ * @param j the row to start from
+ * @param Lp the column offsets of L so far
+ * @param Li the rows of L so far, as rows of A
+ * @param pinv the step at which each row was pivoted, SIZE_MAX if not yet
+ * @param top the current start of the output
+ * @param xi the output at the top, and the search stack at the bottom
+ * @param pstack where the search resumes in each column on the stack
+ * @param mark equals stamp for rows already found
+ * @param stamp the marker of this search
+ * @return size_t the new start of the output
+ */
+static size_t lu_dfs(size_t j, const size_t* Lp, const size_t* Li, const size_t* pinv, size_t top,
+                     size_t* xi, size_t* pstack, size_t* mark, size_t stamp) {
+    size_t depth = 1; /* The height of the stack */
+
+    xi[0] = j;
+    while (depth > 0) {
+        size_t v = xi[depth - 1], col = pinv[v];
+        size_t end = (col == SIZE_MAX) ? 0 : Lp[col + 1];
+        bool done = true;
+
+        if (mark[v] != stamp) {
+            mark[v] = stamp;
+            pstack[depth - 1] = (col == SIZE_MAX) ? 0 : Lp[col];
+        }
+        for (size_t p = pstack[depth - 1]; p < end; p++) {
+            if (mark[Li[p]] != stamp) {
+                pstack[depth - 1] = p + 1;
+                xi[depth++] = Li[p];
+                done = false;
+                break;
+            }
+        }
+        if (done) {
+            depth--;
+            xi[--top] = v;
+        }
+    }
+    return top;
+}
+
+/**
+ * @brief Solves L x = A(:, col) for the sparse columns of L computed so far
+ *
+ * This is the Gilbert-Peierls sparse triangular solve: the nonzero pattern of
+ * x is found first by a depth-first search, then only those entries are
+ * updated, in topological order.
+ *
+ * @param At A stored by columns (the transpose of A in CSR form)
+ * @param col the column of A
+ * @param Lp the column offsets of L so far
+ * @param Li the rows of L so far, as rows of A
+ * @param Lx the values of L so far
+ * @param pinv the step at which each row was pivoted, SIZE_MAX if not yet
+ * @param x dense workspace, zero on entry; receives the solution
+ * @param xi receives the pattern of x in xi[top..n); room for 2n values
+ * @param mark scratch for n markers
+ * @param stamp a marker not used before
+ * @return size_t top
+ */
+static size_t lu_spsolve(SparseMatrix* At, size_t col, const size_t* Lp, const size_t* Li, const double* Lx,
+                         const size_t* pinv, double* x, size_t* xi, size_t* mark, size_t stamp) {
+    size_t n = At->nrows; /* The order of the matrix */
+    size_t top = n; /* The start of the pattern in xi */
+
+    for (size_t p = At->rowptr[col]; p < At->rowptr[col + 1]; p++) {
+        if (mark[At->colind[p]] != stamp) {
+            top = lu_dfs(At->colind[p], Lp, Li, pinv, top, xi, xi + n, mark, stamp);
+        }
+    }
+    for (size_t p = At->rowptr[col]; p < At->rowptr[col + 1]; p++) {
+        x[At->colind[p]] = At->vals[p];
+    }
+    for (size_t t = top; t < n; t++) {
+        size_t i = xi[t], k = pinv[i];
+        if (k != SIZE_MAX) {
+            double xi_val = x[i];
+            for (size_t p = Lp[k]; p < Lp[k + 1]; p++) {
+                x[Li[p]] -= Lx[p] * xi_val;
+            }
+        }
+    }
+    return top;
+}
+
+/**
+ * @brief Makes room for at least need entries in a growing column store
+ *
+ * @param idx the row indices
+ * @param val the values
+ * @param cap the current capacity, updated
+ * @param need the capacity required
+ */
+static void lu_reserve(size_t** idx, double** val, size_t* cap, size_t need) {
+    if (need <= *cap) {
+        return;
+    }
+    while (*cap < need) {
+        *cap *= 2;
+    }
+    *idx = (size_t*) realloc(*idx, sizeof(size_t) * *cap);
+    *val = (double*) realloc(*val, sizeof(double) * *cap);
+}
+
+/**
+ * @brief Computes a sparse LU factorization with threshold partial pivoting
+ *
+ * Columns are eliminated in a fill-reducing order (nested dissection of
+ * A + A^T when perm is NULL) by the left-looking Gilbert-Peierls method: each
+ * column is found by a sparse triangular solve with the columns of L already
+ * computed. The pivot of step k is the entry in row perm[k] when its magnitude
+ * is at least tol times the largest candidate, so the ordering is kept where
+ * that is stable, and the largest candidate otherwise; tol = 1 gives partial
+ * pivoting and smaller values trade stability for less fill (0.1 is common).
+ *
+ * Once the remaining columns turn out nearly dense, the rest of the matrix is
+ * gathered into a dense Matrix and factored with blocked partial pivoting on
+ * Matrix_gemm, which is much faster than continuing sparsely.
+ *
+ * The factorization can then be used for any number of right-hand sides with
+ * SparseLU_solve.
+ *
+ * @param A a square sparse matrix
+ * @param perm the column order, perm[k] being the column eliminated k-th, or
+ *        NULL to use SparseMatrix_nested_dissection
+ * @param tol the pivoting threshold, in (0, 1]
+ * @return SparseLU* the factorization or NULL if the arguments are invalid or A
+ *         is singular
+ */
+SparseLU* new_SparseLU(SparseMatrix* A, const size_t* perm, double tol) {
+    const size_t DENSE_MAX = 4000; /* The largest Schur complement factored densely */
+    SparseLU* F; /* The factorization to return */
+    SparseMatrix* At; /* A stored by columns */
+    size_t n, lcap, ucap; /* The order and the room in L and U */
+    size_t* pinv, * xi, * mark; /* Step of each row, pattern and markers */
+    double* x; /* The dense workspace */
+    size_t k = 0; /* The current step */
+    bool singular = false; /* Whether a step found no pivot */
+
+    //If the arguments are invalid, return NULL.
+    if (A == NULL || A->rowptr == NULL || A->nrows != A->ncols || A->nrows == 0 || !(tol > 0.0 && tol <= 1.0)) {
+        return NULL;
+    }
+    n = A->nrows;
+    F = (SparseLU*) calloc(1, sizeof(SparseLU));
+    F->n = n;
+    F->q = (size_t*) malloc(sizeof(size_t) * n);
+    pinv = (size_t*) malloc(sizeof(size_t) * n);
+    if (perm == NULL) {
+        size_t* nd = SparseMatrix_nested_dissection(A);
+        memcpy(F->q, nd, sizeof(size_t) * n);
+        free(nd);
+    }
+    else {
+        memcpy(F->q, perm, sizeof(size_t) * n);
+    }
+    if (invert_permutation(F->q, n, pinv) != 0) {
+        free(pinv);
+        delete_SparseLU(F);
+        return NULL;
+    }
+
+    //A by columns.
+    At = SparseMatrix_transpose(A);
+
+    lcap = ucap = A->rowptr[n] + n;
+    F->prow = (size_t*) malloc(sizeof(size_t) * n);
+    F->Lp = (size_t*) calloc(n + 1, sizeof(size_t));
+    F->Up = (size_t*) calloc(n + 1, sizeof(size_t));
+    F->Li = (size_t*) malloc(sizeof(size_t) * lcap);
+    F->Lx = (double*) malloc(sizeof(double) * lcap);
+    F->Ui = (size_t*) malloc(sizeof(size_t) * ucap);
+    F->Ux = (double*) malloc(sizeof(double) * ucap);
+    F->Udiag = (double*) malloc(sizeof(double) * n);
+    x = (double*) calloc(n, sizeof(double));
+    xi = (size_t*) malloc(sizeof(size_t) * 2 * n);
+    mark = (size_t*) malloc(sizeof(size_t) * n);
+    for (size_t i = 0; i < n; i++) {
+        pinv[i] = SIZE_MAX;
+        mark[i] = SIZE_MAX;
+    }
+
+    //Sparse steps.
+    for (k = 0; k < n; k++) {
+        size_t col = F->q[k], top, ipiv = SIZE_MAX, nlow = 0;
+        double amax = 0.0;
+
+        top = lu_spsolve(At, col, F->Lp, F->Li, F->Lx, pinv, x, xi, mark, k);
+        for (size_t t = top; t < n; t++) {
+            if (pinv[xi[t]] == SIZE_MAX) {
+                nlow++;
+                if (fabs(x[xi[t]]) > amax) {
+                    amax = fabs(x[xi[t]]);
+                    ipiv = xi[t];
+                }
+            }
+        }
+
+        //Stop here if the rest is better done densely.
+        if (n - k <= DENSE_MAX && n - k > 1 && 10 * nlow >= 3 * (n - k)) {
+            for (size_t t = top; t < n; t++) {
+                x[xi[t]] = 0.0;
+            }
+            break;
+        }
+        if (amax == 0.0) {
+            singular = true;
+            break;
+        }
+        if (pinv[col] == SIZE_MAX && fabs(x[col]) >= tol * amax) {
+            ipiv = col;
+        }
+
+        lu_reserve(&F->Ui, &F->Ux, &ucap, F->Up[k] + (n - top));
+        lu_reserve(&F->Li, &F->Lx, &lcap, F->Lp[k] + nlow);
+        F->Up[k + 1] = F->Up[k];
+        F->Lp[k + 1] = F->Lp[k];
+        F->Udiag[k] = x[ipiv];
+        for (size_t t = top; t < n; t++) {
+            size_t i = xi[t];
+            if (pinv[i] != SIZE_MAX) {
+                F->Ui[F->Up[k + 1]] = pinv[i];
+                F->Ux[F->Up[k + 1]++] = x[i];
+            }
+            else if (i != ipiv) {
+                F->Li[F->Lp[k + 1]] = i;
+                F->Lx[F->Lp[k + 1]++] = x[i] / F->Udiag[k];
+            }
+            x[i] = 0.0;
+        }
+        pinv[ipiv] = k;
+        F->prow[k] = ipiv;
+    }
+    F->ns = k;
+
+    //Dense steps: gather the Schur complement of the rows not yet pivoted.
+    if (k < n && !singular) {
+        size_t m = n - k, r = 0;
+        size_t* drow = (size_t*) malloc(sizeof(size_t) * m); /* The row of A of each dense row */
+        size_t* dpos = (size_t*) malloc(sizeof(size_t) * n); /* The dense row of each row of A */
+        size_t* dperm = (size_t*) malloc(sizeof(size_t) * m); /* The dense pivot order */
+
+        init_Matrix(&F->D, m, m);
+        for (size_t i = 0; i < n; i++) {
+            if (pinv[i] == SIZE_MAX) {
+                drow[r] = i;
+                dpos[i] = r++;
+            }
+        }
+        for (size_t t = 0; t < m; t++) {
+            size_t top = lu_spsolve(At, F->q[k + t], F->Lp, F->Li, F->Lx, pinv, x, xi, mark, n + t);
+
+            lu_reserve(&F->Ui, &F->Ux, &ucap, F->Up[k + t] + (n - top));
+            F->Up[k + t + 1] = F->Up[k + t];
+            for (size_t s = top; s < n; s++) {
+                size_t i = xi[s];
+                if (pinv[i] != SIZE_MAX) {
+                    F->Ui[F->Up[k + t + 1]] = pinv[i];
+                    F->Ux[F->Up[k + t + 1]++] = x[i];
+                }
+                else {
+                    F->D.vals[dpos[i]][t] = x[i];
+                }
+                x[i] = 0.0;
+            }
+        }
+
+        singular = (dense_lu(&F->D, dperm) != 0);
+        for (size_t t = 0; t < m; t++) {
+            F->prow[k + t] = drow[dperm[t]];
+            pinv[drow[dperm[t]]] = k + t;
+        }
+        free(drow);
+        free(dpos);
+        free(dperm);
+    }
+
+    //L was built with the rows of A; store them as steps instead.
+    for (size_t p = 0; !singular && p < F->Lp[F->ns]; p++) {
+        F->Li[p] = pinv[F->Li[p]];
+    }
+
+    free(x);
+    free(xi);
+    free(mark);
+    free(pinv);
+    delete_SparseMatrix(At);
+    if (singular) {
+        delete_SparseLU(F);
+        return NULL;
+    }
+    return F;
+}
+
+/**
+ * @brief Solves A X = B with a sparse LU factorization
+ *
+ * All the right-hand sides are carried through the substitutions together, so
+ * the factors are read once however many there are.
+ *
+ * @param F a factorization from new_SparseLU
+ * @param B the right-hand sides, one per column, with n rows
+ * @return Matrix* the solutions X or NULL if the operation is invalid
+ */
+Matrix* SparseLU_solve(SparseLU* F, Matrix* B) {
+    Matrix* ret; /* The solutions to return */
+    size_t n, k, ns; /* The order, the number of right-hand sides and sparse steps */
+    double* W; /* The right-hand sides in pivot order, row-major */
+
+    //If the operation is invalid, return NULL.
+    if (F == NULL || B == NULL || B->vals == NULL || B->nrows != F->n) {
+        return NULL;
+    }
+    n = F->n;
+    k = B->ncols;
+    ns = F->ns;
+    W = (double*) malloc(sizeof(double) * (n * k + 1));
+    for (size_t i = 0; i < n; i++) {
+        memcpy(W + i * k, B->vals[F->prow[i]], sizeof(double) * k);
+    }
+
+    //Forward through the sparse columns of L, then the dense factors.
+    for (size_t j = 0; j < ns; j++) {
+        double* wj = W + j * k;
+        for (size_t p = F->Lp[j]; p < F->Lp[j + 1]; p++) {
+            double* wi = W + F->Li[p] * k;
+            for (size_t c = 0; c < k; c++) {
+                wi[c] -= F->Lx[p] * wj[c];
+            }
+        }
+    }
+    if (ns < n) {
+        dense_lu_solve(&F->D, W + ns * k, k);
+    }
+
+    //Backward through the columns of U.
+    for (size_t j = n; j-- > 0; ) {
+        double* wj = W + j * k;
+        if (j < ns) {
+            for (size_t c = 0; c < k; c++) {
+                wj[c] /= F->Udiag[j];
+            }
+        }
+        for (size_t p = F->Up[j]; p < F->Up[j + 1]; p++) {
+            double* wi = W + F->Ui[p] * k;
+            for (size_t c = 0; c < k; c++) {
+                wi[c] -= F->Ux[p] * wj[c];
+            }
+        }
+    }
+
+    ret = new_Matrix(n, k);
+    for (size_t j = 0; j < n; j++) {
+        memcpy(ret->vals[F->q[j]], W + j * k, sizeof(double) * k);
+    }
+    free(W);
+    return ret;
+}
+
+/**
+ * @brief Reports the number of entries stored in a sparse LU factorization
+ *
+ * @param F the factorization
+ * @return size_t the number of entries of L and U, counting the dense part in
+ *         full, or 0 if F is NULL
+ */
+size_t SparseLU_nnz(SparseLU* F) {
+    if (F == NULL) {
+        return 0;
+    }
+    return F->Lp[F->ns] + F->Up[F->n] + F->ns + (F->n - F->ns) * (F->n - F->ns);
+}
+
+/**
+ * @brief Multiplies two sparse matrices
+ *
+ * This is Gustavson's row-by-row method: row i of A*B is the sum of the rows
+ * of B picked out by row i of A, gathered in a dense accumulator. A first pass
+ * counts the entries of every row so the second can write them in place; both
+ * passes split the rows between threads, each with its own accumulator.
+ *
+ * @param A the matrix on the left hand side of the product
+ * @param B the matrix on the right hand side of the product
+ * @return SparseMatrix* the product A*B or NULL if the operation is invalid
+ */
+SparseMatrix* SparseMatrix_mult(SparseMatrix* A, SparseMatrix* B) {
+    SparseMatrix* ret; /* The product to return */
+    size_t* rowptr; /* The row offsets of the product */
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || B == NULL || A->rowptr == NULL || B->rowptr == NULL || A->ncols != B->nrows) {
+        return NULL;
+    }
+
+    //Count the entries of each row.
+    rowptr = (size_t*) calloc(A->nrows + 1, sizeof(size_t));
+#   pragma omp parallel num_threads(2)
+    {
+        size_t* flag = (size_t*) malloc(sizeof(size_t) * (B->ncols + 1)); /* The last row to touch each column */
+
+        for (size_t j = 0; j < B->ncols; j++) {
+            flag[j] = SIZE_MAX;
+        }
+#       pragma omp for schedule(dynamic, 256)
+        for (size_t i = 0; i < A->nrows; i++) {
+            size_t count = 0;
+            for (size_t p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+                size_t k = A->colind[p];
+                for (size_t q = B->rowptr[k]; q < B->rowptr[k + 1]; q++) {
+                    if (flag[B->colind[q]] != i) {
+                        flag[B->colind[q]] = i;
+                        count++;
+                    }
+                }
+            }
+            rowptr[i + 1] = count;
+        }
+        free(flag);
+    }
+    sparse_prefix_sum(rowptr, A->nrows);
+
+    ret = new_SparseMatrix(A->nrows, B->ncols, rowptr[A->nrows]);
+    free(ret->rowptr);
+    ret->rowptr = rowptr;
+
+    //Accumulate each row, then sort it.
+#   pragma omp parallel num_threads(2)
+    {
+        double* acc = (double*) malloc(sizeof(double) * (B->ncols + 1)); /* The dense accumulator */
+        size_t* flag = (size_t*) malloc(sizeof(size_t) * (B->ncols + 1)); /* The last row to touch each column */
+
+        for (size_t j = 0; j < B->ncols; j++) {
+            flag[j] = SIZE_MAX;
+        }
+#       pragma omp for schedule(dynamic, 256)
+        for (size_t i = 0; i < A->nrows; i++) {
+            size_t* cols = ret->colind + rowptr[i];
+            double* vals = ret->vals + rowptr[i];
+            size_t len = 0;
+
+            for (size_t p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+                size_t k = A->colind[p];
+                double a = A->vals[p];
+                for (size_t q = B->rowptr[k]; q < B->rowptr[k + 1]; q++) {
+                    size_t j = B->colind[q];
+                    if (flag[j] != i) {
+                        flag[j] = i;
+                        acc[j] = a * B->vals[q];
+                        cols[len++] = j;
+                    }
+                    else {
+                        acc[j] += a * B->vals[q];
+                    }
+                }
+            }
+            for (size_t t = 0; t < len; t++) {
+                vals[t] = acc[cols[t]];
+            }
+            sparse_sort_row(cols, vals, len);
+        }
+        free(acc);
+        free(flag);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief One level of an algebraic multigrid hierarchy
+ */
+typedef struct {
+    SparseMatrix* A; /* The operator on this level */
+    SparseMatrix* P; /* Prolongation from the next coarser level */
+    SparseMatrix* R; /* Restriction to the next coarser level, P^T */
+    double* dinv; /* The Jacobi weight divided by each diagonal entry */
+    double* x; /* The correction on this level */
+    double* b; /* The right-hand side on this level */
+    double* r; /* The residual on this level */
+} AMGLevel;
+
+/**
+ * @brief A smoothed-aggregation algebraic multigrid hierarchy
+ */
+struct AMG {
+    size_t nlevels; /* The number of levels, the finest first */
+    AMGLevel* levels;
+    Matrix coarse; /* The dense LU factors of the coarsest operator, if small enough */
+    size_t* cperm; /* Their row order */
+};
+
+/**
+ * @brief Estimates the spectral radius of D^-1 A by power iteration
+ *
+ * @param A the matrix
+ * @param d its diagonal
+ * @return double the estimate
+ */
+static double amg_spectral_radius(SparseMatrix* A, const double* d) {
+    const size_t ITERS = 15; /* Power iterations */
+    size_t n = A->nrows;
+    double* x = (double*) calloc(n + 1, sizeof(double));
+    double* y = (double*) malloc(sizeof(double) * (n + 1));
+    double rho = 1.0; /* The estimate */
+
+    for (size_t i = 0; i < n; i++) {
+        x[i] = 1.0 + (double) (i % 7) / 7.0;
+    }
+    for (size_t it = 0; it < ITERS; it++) {
+        double nx = 0.0, ny = 0.0;
+        sparse_spmv(A, x, y);
+#       pragma omp parallel for simd num_threads(2) reduction(+: nx, ny)
+        for (size_t i = 0; i < n; i++) {
+            y[i] /= d[i];
+            nx += x[i] * x[i];
+            ny += y[i] * y[i];
+        }
+        if (ny == 0.0) {
+            break;
+        }
+        rho = sqrt(ny / nx);
+        for (size_t i = 0; i < n; i++) {
+            x[i] = y[i] / sqrt(ny);
+        }
+    }
+
+    free(x);
+    free(y);
+    return rho;
+}
+
+/**
+ * @brief Groups the unknowns of a level into aggregates
+ *
+ * j is strongly connected to i when a_ij^2 >= theta^2 |a_ii a_jj|. The
+ * aggregates are formed in the usual three passes: first every node whose
+ * strong neighbours are all still free claims them, then the remaining nodes
+ * join a neighbouring aggregate, and whatever is left forms new aggregates
+ * with its free neighbours.
+ *
+ * @param A the operator
+ * @param d its diagonal
+ * @param theta the strength threshold
+ * @param agg receives the aggregate of each node
+ * @return size_t the number of aggregates
+ */
+static size_t amg_aggregate(SparseMatrix* A, const double* d, double theta, size_t* agg) {
+    size_t n = A->nrows, nagg = 0;
+    size_t* sptr = (size_t*) calloc(n + 1, sizeof(size_t)); /* The strength graph */
+    size_t* sind;
+    size_t* first; /* The aggregates after the first pass */
+
+    //Build the strength graph in two parallel passes over the rows.
+#   pragma omp parallel for num_threads(2) schedule(dynamic, 256)
+    for (size_t i = 0; i < n; i++) {
+        size_t count = 0;
+        for (size_t p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+            size_t j = A->colind[p];
+            count += (j != i && A->vals[p] * A->vals[p] >= theta * theta * fabs(d[i] * d[j]));
+        }
+        sptr[i + 1] = count;
+    }
+    for (size_t i = 0; i < n; i++) {
+        sptr[i + 1] += sptr[i];
+    }
+    sind = (size_t*) malloc(sizeof(size_t) * (sptr[n] + 1));
+#   pragma omp parallel for num_threads(2) schedule(dynamic, 256)
+    for (size_t i = 0; i < n; i++) {
+        size_t q = sptr[i];
+        for (size_t p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+            size_t j = A->colind[p];
+            if (j != i && A->vals[p] * A->vals[p] >= theta * theta * fabs(d[i] * d[j])) {
+                sind[q++] = j;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        agg[i] = SIZE_MAX;
+    }
+    for (size_t i = 0; i < n; i++) {
+        bool free_nbrs = (agg[i] == SIZE_MAX);
+        for (size_t p = sptr[i]; p < sptr[i + 1] && free_nbrs; p++) {
+            free_nbrs = (agg[sind[p]] == SIZE_MAX);
+        }
+        if (free_nbrs) {
+            agg[i] = nagg;
+            for (size_t p = sptr[i]; p < sptr[i + 1]; p++) {
+                agg[sind[p]] = nagg;
+            }
+            nagg++;
+        }
+    }
+
+    first = (size_t*) malloc(sizeof(size_t) * (n + 1));
+    memcpy(first, agg, sizeof(size_t) * n);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t p = sptr[i]; p < sptr[i + 1] && agg[i] == SIZE_MAX; p++) {
+            agg[i] = first[sind[p]];
+        }
+    }
+    free(first);
+
+    for (size_t i = 0; i < n; i++) {
+        if (agg[i] == SIZE_MAX) {
+            agg[i] = nagg;
+            for (size_t p = sptr[i]; p < sptr[i + 1]; p++) {
+                if (agg[sind[p]] == SIZE_MAX) {
+                    agg[sind[p]] = nagg;
+                }
+            }
+            nagg++;
+        }
+    }
+
+    free(sptr);
+    free(sind);
+    return nagg;
+}
+
+/**
+ * @brief Frees an algebraic multigrid hierarchy
+ *
+ * The finest operator belongs to the caller and is not freed.
+ *
+ * @param M the hierarchy to be deleted
+ */
+void delete_AMG(AMG* M) {
+    //Do nothing if M is NULL.
+    if (M == NULL) {
+        return;
+    }
+
+    for (size_t l = 0; l < M->nlevels; l++) {
+        if (l > 0) {
+            delete_SparseMatrix(M->levels[l].A);
+        }
+        delete_SparseMatrix(M->levels[l].P);
+        delete_SparseMatrix(M->levels[l].R);
+        free(M->levels[l].dinv);
+        free(M->levels[l].x);
+        free(M->levels[l].b);
+        free(M->levels[l].r);
+    }
+    free(M->levels);
+    deinit_Matrix(&M->coarse);
+    free(M->cperm);
+    free(M);
+}
+
+/**
+ * @brief Builds a smoothed-aggregation algebraic multigrid hierarchy
+ *
+ * On each level the unknowns are grouped into aggregates over the graph of
+ * strong connections (see amg_aggregate), with theta halved on each coarser
+ * level since the coarse operators have relatively weaker couplings. The tentative prolongator T maps
+ * each aggregate to a normalized constant on its nodes, and is smoothed by
+ * one damped Jacobi step into P = (I - w D^-1 A) T, w = 4 / (3 rho(D^-1 A)),
+ * using SparseMatrix_mult. The coarse operator is P^T A P, again by
+ * SparseMatrix_mult. Coarsening stops at 500 unknowns, after 25 levels, or
+ * when it no longer shrinks the problem much; a coarsest operator of up to
+ * 4000 unknowns is factored densely.
+ *
+ * The hierarchy keeps a pointer to A, which must outlive it.
+ *
+ * @param A a symmetric positive definite sparse matrix, e.g. from a
+ *        Poisson-like problem
+ * @param theta the strength threshold, typically between 0 and 0.25
+ * @return AMG* the hierarchy or NULL if the arguments are invalid
+ */
+AMG* new_AMG(SparseMatrix* A, double theta) {
+    const size_t COARSE = 500; /* The size at which coarsening stops */
+    const size_t MAX_LEVELS = 25; /* The most levels built */
+    const size_t DENSE_MAX = 4000; /* The largest coarsest level factored densely */
+    AMG* M; /* The hierarchy to return */
+
+    //If the arguments are invalid, return NULL.
+    if (A == NULL || A->rowptr == NULL || A->nrows != A->ncols || A->nrows == 0 || theta < 0.0) {
+        return NULL;
+    }
+    M = (AMG*) calloc(1, sizeof(AMG));
+    M->levels = (AMGLevel*) calloc(MAX_LEVELS, sizeof(AMGLevel));
+    M->levels[0].A = A;
+
+    for (size_t l = 0; ; l++) {
+        AMGLevel* lev = &M->levels[l];
+        SparseMatrix* Af = lev->A;
+        size_t n = Af->nrows, nagg;
+        double* d = (double*) malloc(sizeof(double) * (n + 1));
+        size_t* agg;
+        double omega;
+        SparseMatrix* T, * S, * AP;
+
+        M->nlevels = l + 1;
+        for (size_t i = 0; i < n; i++) {
+            d[i] = SparseMatrix_get(Af, i, i);
+            if (d[i] == 0.0) {
+                d[i] = 1.0;
+            }
+        }
+        lev->dinv = d;
+        lev->x = (double*) malloc(sizeof(double) * (n + 1));
+        lev->b = (double*) malloc(sizeof(double) * (n + 1));
+        lev->r = (double*) malloc(sizeof(double) * (n + 1));
+        if (n <= COARSE || l + 1 == MAX_LEVELS) {
+            break;
+        }
+
+        agg = (size_t*) malloc(sizeof(size_t) * (n + 1));
+        nagg = amg_aggregate(Af, d, theta * pow(0.5, (double) l), agg);
+        if (10 * nagg > 9 * n) {
+            free(agg);
+            break;
+        }
+        omega = 4.0 / (3.0 * amg_spectral_radius(Af, d));
+
+        //Tentative prolongator: one entry per row.
+        T = new_SparseMatrix(n, nagg, n);
+        {
+            size_t* size = (size_t*) calloc(nagg, sizeof(size_t)); /* The size of each aggregate */
+            for (size_t i = 0; i < n; i++) {
+                size[agg[i]]++;
+            }
+            for (size_t i = 0; i < n; i++) {
+                T->rowptr[i + 1] = i + 1;
+                T->colind[i] = agg[i];
+                T->vals[i] = 1.0 / sqrt((double) size[agg[i]]);
+            }
+            free(size);
+        }
+        free(agg);
+
+        //Smoothing operator I - w D^-1 A, with the diagonal always stored.
+        S = new_SparseMatrix(n, n, Af->rowptr[n] + n);
+        for (size_t i = 0; i < n; i++) {
+            size_t q = S->rowptr[i];
+            bool diag = false;
+            for (size_t p = Af->rowptr[i]; p < Af->rowptr[i + 1]; p++) {
+                size_t j = Af->colind[p];
+                if (!diag && j >= i) {
+                    diag = true;
+                    S->colind[q] = i;
+                    S->vals[q++] = 1.0 - ((j == i) ? omega * Af->vals[p] / d[i] : 0.0);
+                    if (j == i) {
+                        continue;
+                    }
+                }
+                S->colind[q] = j;
+                S->vals[q++] = -omega * Af->vals[p] / d[i];
+            }
+            if (!diag) {
+                S->colind[q] = i;
+                S->vals[q++] = 1.0;
+            }
+            S->rowptr[i + 1] = q;
+        }
+        S->nnz = S->rowptr[n];
+
+        lev->P = SparseMatrix_mult(S, T);
+        lev->R = SparseMatrix_transpose(lev->P);
+        AP = SparseMatrix_mult(Af, lev->P);
+        M->levels[l + 1].A = SparseMatrix_mult(lev->R, AP);
+        delete_SparseMatrix(T);
+        delete_SparseMatrix(S);
+        delete_SparseMatrix(AP);
+
+        //Jacobi smoothing on this level uses the same weight.
+        for (size_t i = 0; i < n; i++) {
+            d[i] = omega / d[i];
+        }
+    }
+
+    //The coarsest level: dense LU, or Jacobi if it is too large.
+    {
+        AMGLevel* lev = &M->levels[M->nlevels - 1];
+        size_t n = lev->A->nrows;
+        double omega = 4.0 / (3.0 * amg_spectral_radius(lev->A, lev->dinv));
+
+        if (n <= DENSE_MAX) {
+            Matrix* D = SparseMatrix_to_Matrix(lev->A);
+            M->coarse = *D;
+            free(D);
+            M->cperm = (size_t*) malloc(sizeof(size_t) * n);
+            if (dense_lu(&M->coarse, M->cperm) != 0) {
+                deinit_Matrix(&M->coarse);
+                free(M->cperm);
+                M->cperm = NULL;
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            lev->dinv[i] = omega / lev->dinv[i];
+        }
+    }
+
+    return M;
+}
+
+/**
+ * @brief Applies damped Jacobi sweeps to x for A x = b
+ *
+ * @param lev the level
+ * @param sweeps the number of sweeps
+ * @param zero whether x is zero on entry, which saves the first product
+ */
+static void amg_smooth(AMGLevel* lev, size_t sweeps, bool zero) {
+    size_t n = lev->A->nrows;
+
+    for (size_t s = 0; s < sweeps; s++) {
+        if (s == 0 && zero) {
+#           pragma omp parallel for simd num_threads(2)
+            for (size_t i = 0; i < n; i++) {
+                lev->x[i] = lev->dinv[i] * lev->b[i];
+            }
+            continue;
+        }
+        sparse_spmv(lev->A, lev->x, lev->r);
+#       pragma omp parallel for simd num_threads(2)
+        for (size_t i = 0; i < n; i++) {
+            lev->x[i] += lev->dinv[i] * (lev->b[i] - lev->r[i]);
+        }
+    }
+}
+
+/**
+ * @brief Runs one V-cycle from level l, solving approximately for levels[l].x
+ *
+ * @param M the hierarchy
+ * @param l the level, whose b holds the right-hand side
+ */
+static void amg_vcycle(AMG* M, size_t l) {
+    const size_t SWEEPS = 2; /* Jacobi sweeps before and after the coarse correction */
+    AMGLevel* lev = &M->levels[l];
+    size_t n = lev->A->nrows;
+
+    if (l + 1 == M->nlevels) {
+        if (M->cperm != NULL) {
+            for (size_t i = 0; i < n; i++) {
+                lev->x[i] = lev->b[M->cperm[i]];
+            }
+            dense_lu_solve(&M->coarse, lev->x, 1);
+        }
+        else {
+            amg_smooth(lev, 10 * SWEEPS, true);
+        }
+        return;
+    }
+
+    amg_smooth(lev, SWEEPS, true);
+    sparse_spmv(lev->A, lev->x, lev->r);
+#   pragma omp parallel for simd num_threads(2)
+    for (size_t i = 0; i < n; i++) {
+        lev->r[i] = lev->b[i] - lev->r[i];
+    }
+    sparse_spmv(lev->R, lev->r, M->levels[l + 1].b);
+    amg_vcycle(M, l + 1);
+    sparse_spmv(lev->P, M->levels[l + 1].x, lev->r);
+#   pragma omp parallel for simd num_threads(2)
+    for (size_t i = 0; i < n; i++) {
+        lev->x[i] += lev->r[i];
+    }
+    amg_smooth(lev, SWEEPS, false);
+}
+
+/**
+ * @brief Applies one V-cycle of an algebraic multigrid hierarchy
+ *
+ * Starting from zero, this approximates A^-1 b. The cycle is symmetric, so it
+ * can precondition the conjugate gradient method; see SparseMatrix_cg.
+ *
+ * @param M the hierarchy
+ * @param b a column vector with as many rows as A
+ * @return Matrix* the approximation or NULL if the operation is invalid
+ */
+Matrix* AMG_apply(AMG* M, Matrix* b) {
+    Matrix* ret; /* The approximation to return */
+    AMGLevel* lev; /* The finest level */
+
+    //If the operation is invalid, return NULL.
+    if (M == NULL || b == NULL || b->vals == NULL || b->ncols != 1 || b->nrows != M->levels[0].A->nrows) {
+        return NULL;
+    }
+
+    lev = &M->levels[0];
+    for (size_t i = 0; i < b->nrows; i++) {
+        lev->b[i] = b->vals[i][0];
+    }
+    amg_vcycle(M, 0);
+    ret = new_Matrix(b->nrows, 1);
+    for (size_t i = 0; i < b->nrows; i++) {
+        ret->vals[i][0] = lev->x[i];
+    }
+    return ret;
+}
+
+/**
+ * @brief Reports the number of levels in an algebraic multigrid hierarchy
+ *
+ * @param M the hierarchy
+ * @return size_t the number of levels, or 0 if M is NULL
+ */
+size_t AMG_levels(AMG* M) {
+    return (M == NULL) ? 0 : M->nlevels;
+}
+
+/**
+ * @brief Computes the dot product of two contiguous vectors
+ */
+static double vec_dot(const double* x, const double* y, size_t n) {
+    double ret = 0.0;
+
+#   pragma omp parallel for simd num_threads(2) reduction(+: ret)
+    for (size_t i = 0; i < n; i++) {
+        ret += x[i] * y[i];
+    }
+    return ret;
+}
+
+/**
+ * @brief Solves A x = b by the (preconditioned) conjugate gradient method
+ *
+ * Iteration stops once ||b - A x|| <= tol ||b|| or after maxiter steps. With
+ * an AMG hierarchy for A as the preconditioner, the number of iterations stays
+ * roughly constant as Poisson-like problems grow.
+ *
+ * @param A a symmetric positive definite sparse matrix
+ * @param b the right-hand side, a column vector
+ * @param x the initial guess, overwritten by the solution
+ * @param M an AMG hierarchy built for A, or NULL for no preconditioner
+ * @param tol the relative residual to reach
+ * @param maxiter the most iterations to run
+ * @param iters receives the number of iterations run, unless it is NULL
+ * @return 0 if the iteration converged, otherwise 1
+ */
+int SparseMatrix_cg(SparseMatrix* A, Matrix* b, Matrix* x, AMG* M, double tol, size_t maxiter, size_t* iters) {
+    size_t n, it = 0; /* The order and the iteration count */
+    double* xv, * r, * z, * p, * q; /* The iterate, residual, preconditioned residual, direction and A p */
+    double rz, bnorm, rnorm; /* r.z and the norms */
+    int ret = 1;
+
+    //If the operation is invalid, return 1.
+    if (A == NULL || A->rowptr == NULL || A->nrows != A->ncols || b == NULL || b->vals == NULL || x == NULL || x->vals == NULL) {
+        return 1;
+    }
+    if (b->nrows != A->nrows || b->ncols != 1 || x->nrows != A->nrows || x->ncols != 1) {
+        return 1;
+    }
+    if (M != NULL && M->levels[0].A->nrows != A->nrows) {
+        return 1;
+    }
+
+    n = A->nrows;
+    xv = (double*) calloc(n + 1, sizeof(double));
+    r = (double*) malloc(sizeof(double) * (n + 1));
+    z = (double*) malloc(sizeof(double) * (n + 1));
+    p = (double*) malloc(sizeof(double) * (n + 1));
+    q = (double*) malloc(sizeof(double) * (n + 1));
+    for (size_t i = 0; i < n; i++) {
+        xv[i] = x->vals[i][0];
+        z[i] = b->vals[i][0];
+    }
+    bnorm = sqrt(vec_dot(z, z, n));
+    sparse_spmv(A, xv, r);
+#   pragma omp parallel for simd num_threads(2)
+    for (size_t i = 0; i < n; i++) {
+        r[i] = z[i] - r[i];
+    }
+    rnorm = sqrt(vec_dot(r, r, n));
+
+    rz = 0.0;
+    while (rnorm > tol * bnorm && it < maxiter) {
+        double rz_old = rz, alpha;
+
+        if (M != NULL) {
+            memcpy(M->levels[0].b, r, sizeof(double) * n);
+            amg_vcycle(M, 0);
+            memcpy(z, M->levels[0].x, sizeof(double) * n);
+        }
+        else {
+            memcpy(z, r, sizeof(double) * n);
+        }
+        rz = vec_dot(r, z, n);
+        if (it == 0) {
+            memcpy(p, z, sizeof(double) * n);
+        }
+        else {
+            double beta = rz / rz_old;
+#           pragma omp parallel for simd num_threads(2)
+            for (size_t i = 0; i < n; i++) {
+                p[i] = z[i] + beta * p[i];
+            }
+        }
+
+        sparse_spmv(A, p, q);
+        alpha = rz / vec_dot(p, q, n);
+#       pragma omp parallel for simd num_threads(2)
+        for (size_t i = 0; i < n; i++) {
+            xv[i] += alpha * p[i];
+            r[i] -= alpha * q[i];
+        }
+        rnorm = sqrt(vec_dot(r, r, n));
+        it++;
+    }
+    if (rnorm <= tol * bnorm) {
+        ret = 0;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        x->vals[i][0] = xv[i];
+    }
+    if (iters != NULL) {
+        *iters = it;
+    }
+    free(xv);
+    free(r);
+    free(z);
+    free(p);
+    free(q);
+    return ret;
+}
+
+/**
+ * @brief Computes Y = A*X for a dense block of vectors
+ *
+ * Each entry of A is loaded once and applied to a whole row of X, so the
+ * matrix is streamed once for all the columns.
+ *
+ * @param A the sparse matrix
+ * @param X a matrix with A.ncols rows
+ * @param Y receives the product, A.nrows by X.ncols
+ */
+static void sparse_spmm(SparseMatrix* A, Matrix* X, Matrix* Y) {
+    size_t k = X->ncols; /* The number of vectors */
+
+#   pragma omp parallel for num_threads(2) schedule(dynamic, 256)
+    for (size_t i = 0; i < A->nrows; i++) {
+        double* y = Y->vals[i];
+        for (size_t c = 0; c < k; c++) {
+            y[c] = 0.0;
+        }
+        for (size_t p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+            double a = A->vals[p];
+            double* x = X->vals[A->colind[p]];
+            for (size_t c = 0; c < k; c++) {
+                y[c] += a * x[c];
+            }
+        }
+    }
+}
+
+/**
+ * @brief Multiplies a sparse matrix by a dense matrix
+ *
+ * @param A the sparse matrix
+ * @param X a matrix with A.ncols rows
+ * @return Matrix* the product A*X or NULL if the operation is invalid
+ */
+Matrix* SparseMatrix_mult_matrix(SparseMatrix* A, Matrix* X) {
+    Matrix* ret; /* The product to return */
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || A->rowptr == NULL || X == NULL || X->vals == NULL || X->nrows != A->ncols) {
+        return NULL;
+    }
+
+    ret = new_Matrix(A->nrows, X->ncols);
+    sparse_spmm(A, X, ret);
+    return ret;
+}
+
+/**
+ * @brief Computes C = A^T B for two tall blocks with the same number of rows
+ *
+ * Matrix_gemm handles these shapes, but here the whole k by l product fits in
+ * cache, so the rows are split into one part per thread, each summing
+ * rank-one updates, four rows at a time, into its own copy of C, and the
+ * copies are added in a fixed order at the end so the result does not depend
+ * on which thread finishes first.
+ *
+ * @param A an n by k block
+ * @param B an n by l block
+ * @param C receives the k by l product
+ */
+static void block_gram(Matrix* A, Matrix* B, Matrix* C) {
+    const size_t PARTS = 2; /* Matches num_threads(2) */
+    size_t k = A->ncols, l = B->ncols;
+    double* acc = (double*) calloc(PARTS * k * l + 1, sizeof(double)); /* The copy of C for each part */
+
+#   pragma omp parallel for num_threads(2)
+    for (size_t t = 0; t < PARTS; t++) {
+        double* c = acc + t * k * l;
+        size_t end = (t + 1) * A->nrows / PARTS;
+        for (size_t i0 = t * A->nrows / PARTS; i0 < end; i0 += 4) {
+            if (end - i0 < 4) {
+                for (size_t i = i0; i < end; i++) {
+                    for (size_t a = 0; a < k; a++) {
+                        double x = A->vals[i][a];
+                        for (size_t b = 0; b < l; b++) {
+                            c[a * l + b] += x * B->vals[i][b];
+                        }
+                    }
+                }
+                continue;
+            }
+            double* a0 = A->vals[i0], * a1 = A->vals[i0 + 1], * a2 = A->vals[i0 + 2], * a3 = A->vals[i0 + 3];
+            double* b0 = B->vals[i0], * b1 = B->vals[i0 + 1], * b2 = B->vals[i0 + 2], * b3 = B->vals[i0 + 3];
+            for (size_t a = 0; a < k; a++) {
+                double* ca = c + a * l;
+                double x0 = a0[a], x1 = a1[a], x2 = a2[a], x3 = a3[a];
+                for (size_t b = 0; b < l; b++) {
+                    ca[b] += x0 * b0[b] + x1 * b1[b] + x2 * b2[b] + x3 * b3[b];
+                }
+            }
+        }
+    }
+
+    for (size_t a = 0; a < k; a++) {
+        for (size_t b = 0; b < l; b++) {
+            double sum = 0.0;
+            for (size_t t = 0; t < PARTS; t++) {
+                sum += acc[t * k * l + a * l + b];
+            }
+            C->vals[a][b] = sum;
+        }
+    }
+    free(acc);
+}
+
+/**
+ * @brief Computes Y += alpha P S for a tall block P and a small matrix S
+ *
+ * Each row of Y takes four rows of S at a time, so it is loaded and stored a
+ * quarter as often as in a plain rank-one loop.
+ *
+ * @param alpha the scale applied to P S
+ * @param P an n by k block
+ * @param S a k by l matrix
+ * @param Y an n by l block
+ */
+static void block_update(double alpha, Matrix* P, Matrix* S, Matrix* Y) {
+    size_t k = P->ncols, l = Y->ncols;
+
+#   pragma omp parallel for num_threads(2) schedule(static)
+    for (size_t i = 0; i < Y->nrows; i++) {
+        double* y = Y->vals[i];
+        double* p = P->vals[i];
+        size_t a = 0;
+        for (; a + 4 <= k; a += 4) {
+            double x0 = alpha * p[a], x1 = alpha * p[a + 1], x2 = alpha * p[a + 2], x3 = alpha * p[a + 3];
+            double* s0 = S->vals[a], * s1 = S->vals[a + 1], * s2 = S->vals[a + 2], * s3 = S->vals[a + 3];
+            for (size_t b = 0; b < l; b++) {
+                y[b] += x0 * s0[b] + x1 * s1[b] + x2 * s2[b] + x3 * s3[b];
+            }
+        }
+        for (; a < k; a++) {
+            double x = alpha * p[a];
+            for (size_t b = 0; b < l; b++) {
+                y[b] += x * S->vals[a][b];
+            }
+        }
+    }
+}
+
+/**
+ * @brief Orthonormalizes the columns of a tall block in place
+ *
+ * This is Cholesky QR: the Gram matrix W^T W is one block_gram, and W is then
+ * divided by its Cholesky factor row by row. One pass leaves the columns well
+ * conditioned; a second makes them orthonormal to working precision. A column
+ * that is, to about six digits, a combination of the ones before it is
+ * replaced by zeros and gets a zero row in S, so W = Q S still holds.
+ *
+ * @param W an n by k block, overwritten by Q
+ * @param S receives the k by k upper triangular factor, unless it is NULL
+ * @param passes the number of passes, 1 or 2
+ * @return size_t the number of columns kept
+ */
+static size_t block_orthonormalize(Matrix* W, Matrix* S, size_t passes) {
+    size_t k = W->ncols, rank = 0;
+    Matrix* G = new_Matrix(k, k); /* The Gram matrix */
+    Matrix* R = new_Matrix(k, k); /* Its Cholesky factor */
+    Matrix* T = new_Matrix(k, k); /* The product of the factors so far */
+
+    for (size_t i = 0; i < k; i++) {
+        T->vals[i][i] = 1.0;
+    }
+    for (size_t pass = 0; pass < passes; pass++) {
+        block_gram(W, W, G);
+        rank = 0;
+        for (size_t i = 0; i < k; i++) {
+            double d = G->vals[i][i];
+            for (size_t t = 0; t < i; t++) {
+                d -= R->vals[t][i] * R->vals[t][i];
+            }
+            for (size_t j = 0; j < k; j++) {
+                R->vals[i][j] = 0.0;
+            }
+            if (!(d > 1e-12 * G->vals[i][i])) {
+                continue;
+            }
+            R->vals[i][i] = sqrt(d);
+            for (size_t j = i + 1; j < k; j++) {
+                double s = G->vals[i][j];
+                for (size_t t = 0; t < i; t++) {
+                    s -= R->vals[t][i] * R->vals[t][j];
+                }
+                R->vals[i][j] = s / R->vals[i][i];
+            }
+            rank++;
+        }
+
+#       pragma omp parallel for num_threads(2)
+        for (size_t r = 0; r < W->nrows; r++) {
+            double* w = W->vals[r];
+            for (size_t i = 0; i < k; i++) {
+                double s = w[i];
+                if (R->vals[i][i] == 0.0) {
+                    w[i] = 0.0;
+                    continue;
+                }
+                for (size_t t = 0; t < i; t++) {
+                    s -= w[t] * R->vals[t][i];
+                }
+                w[i] = s / R->vals[i][i];
+            }
+        }
+
+        Matrix_gemm(1.0, R, false, T, false, 0.0, G);
+        for (size_t i = 0; i < k; i++) {
+            memcpy(T->vals[i], G->vals[i], sizeof(double) * k);
+        }
+    }
+
+    if (S != NULL) {
+        for (size_t i = 0; i < k; i++) {
+            memcpy(S->vals[i], T->vals[i], sizeof(double) * k);
+        }
+    }
+    delete_Matrix(G);
+    delete_Matrix(R);
+    delete_Matrix(T);
+    return rank;
+}
+
+/**
+ * @brief Computes X = G^-1 C for small square G
+ *
+ * A zero row and column of G, left by a dropped column of the block, is
+ * treated as the identity so the matching row of X is C's.
+ *
+ * @param G a k by k matrix, which is not modified
+ * @param C a k by m matrix
+ * @param X receives the solution
+ * @return 0 if G was nonsingular, otherwise 1
+ */
+static int block_solve(Matrix* G, Matrix* C, Matrix* X) {
+    size_t k = G->nrows, m = C->ncols;
+    Matrix* LU = new_Matrix(k, k); /* The factors of G */
+    size_t* perm = (size_t*) malloc(sizeof(size_t) * (k + 1));
+    double* W = (double*) malloc(sizeof(double) * (k * m + 1));
+    int ret;
+
+    for (size_t i = 0; i < k; i++) {
+        memcpy(LU->vals[i], G->vals[i], sizeof(double) * k);
+        if (LU->vals[i][i] == 0.0) {
+            LU->vals[i][i] = 1.0;
+        }
+    }
+    ret = dense_lu(LU, perm);
+    if (ret == 0) {
+        for (size_t i = 0; i < k; i++) {
+            memcpy(W + i * m, C->vals[perm[i]], sizeof(double) * m);
+        }
+        dense_lu_solve(LU, W, m);
+        for (size_t i = 0; i < k; i++) {
+            memcpy(X->vals[i], W + i * m, sizeof(double) * m);
+        }
+    }
+
+    delete_Matrix(LU);
+    free(perm);
+    free(W);
+    return ret;
+}
+
+/**
+ * @brief Allocates the per-level blocks used by amg_apply_block
+ *
+ * @param M the hierarchy, or NULL
+ * @param k the number of columns
+ * @return Matrix** three blocks per level (x, b, r), or NULL if M is NULL
+ */
+static Matrix** amg_new_work(AMG* M, size_t k) {
+    Matrix** work;
+
+    if (M == NULL) {
+        return NULL;
+    }
+    work = (Matrix**) malloc(sizeof(Matrix*) * 3 * M->nlevels);
+    for (size_t l = 0; l < 3 * M->nlevels; l++) {
+        work[l] = new_Matrix(M->levels[l / 3].A->nrows, k);
+    }
+    return work;
+}
+
+/**
+ * @brief Frees the blocks from amg_new_work
+ *
+ * @param M the hierarchy, or NULL
+ * @param work the blocks
+ */
+static void amg_delete_work(AMG* M, Matrix** work) {
+    if (M == NULL) {
+        return;
+    }
+    for (size_t l = 0; l < 3 * M->nlevels; l++) {
+        delete_Matrix(work[l]);
+    }
+    free(work);
+}
+
+/**
+ * @brief Applies damped Jacobi sweeps to every column of X for A X = B
+ *
+ * @param lev the level
+ * @param X the iterate
+ * @param B the right-hand sides
+ * @param R work space for A X
+ * @param sweeps the number of sweeps
+ * @param zero whether X is zero on entry, which saves the first product
+ */
+static void amg_smooth_block(AMGLevel* lev, Matrix* X, Matrix* B, Matrix* R, size_t sweeps, bool zero) {
+    size_t k = X->ncols;
+
+    for (size_t s = 0; s < sweeps; s++) {
+        if (!(s == 0 && zero)) {
+            sparse_spmm(lev->A, X, R);
+        }
+#       pragma omp parallel for num_threads(2)
+        for (size_t i = 0; i < X->nrows; i++) {
+            for (size_t c = 0; c < k; c++) {
+                X->vals[i][c] = (s == 0 && zero) ? lev->dinv[i] * B->vals[i][c]
+                                                 : X->vals[i][c] + lev->dinv[i] * (B->vals[i][c] - R->vals[i][c]);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Runs the V-cycle of amg_vcycle on a block of right-hand sides
+ *
+ * Every level's operator and transfers are streamed once for all the columns.
+ *
+ * @param M the hierarchy
+ * @param l the level, whose b block holds the right-hand sides
+ * @param work the blocks from amg_new_work
+ */
+static void amg_vcycle_block(AMG* M, size_t l, Matrix** work) {
+    const size_t SWEEPS = 2; /* Jacobi sweeps before and after the coarse correction */
+    AMGLevel* lev = &M->levels[l];
+    Matrix* X = work[3 * l], * B = work[3 * l + 1], * R = work[3 * l + 2];
+    size_t n = X->nrows, k = X->ncols;
+
+    if (l + 1 == M->nlevels) {
+        if (M->cperm != NULL) {
+            double* W = (double*) malloc(sizeof(double) * (n * k + 1)); /* The right-hand sides, row-major */
+            for (size_t i = 0; i < n; i++) {
+                memcpy(W + i * k, B->vals[M->cperm[i]], sizeof(double) * k);
+            }
+            dense_lu_solve(&M->coarse, W, k);
+            for (size_t i = 0; i < n; i++) {
+                memcpy(X->vals[i], W + i * k, sizeof(double) * k);
+            }
+            free(W);
+        }
+        else {
+            amg_smooth_block(lev, X, B, R, 10 * SWEEPS, true);
+        }
+        return;
+    }
+
+    amg_smooth_block(lev, X, B, R, SWEEPS, true);
+    sparse_spmm(lev->A, X, R);
+#   pragma omp parallel for num_threads(2)
+    for (size_t i = 0; i < n; i++) {
+        for (size_t c = 0; c < k; c++) {
+            R->vals[i][c] = B->vals[i][c] - R->vals[i][c];
+        }
+    }
+    sparse_spmm(lev->R, R, work[3 * l + 4]);
+    amg_vcycle_block(M, l + 1, work);
+    sparse_spmm(lev->P, work[3 * l + 3], R);
+#   pragma omp parallel for num_threads(2)
+    for (size_t i = 0; i < n; i++) {
+        for (size_t c = 0; c < k; c++) {
+            X->vals[i][c] += R->vals[i][c];
+        }
+    }
+    amg_smooth_block(lev, X, B, R, SWEEPS, false);
+}
+
+/**
+ * @brief Applies one V-cycle to every column of R, or copies R if M is NULL
+ *
+ * @param M the hierarchy, or NULL
+ * @param work the blocks from amg_new_work
+ * @param R the block to precondition
+ * @param Z receives the result
+ */
+static void amg_apply_block(AMG* M, Matrix** work, Matrix* R, Matrix* Z) {
+    for (size_t i = 0; i < R->nrows; i++) {
+        memcpy((M == NULL) ? Z->vals[i] : work[1]->vals[i], R->vals[i], sizeof(double) * R->ncols);
+    }
+    if (M == NULL) {
+        return;
+    }
+    amg_vcycle_block(M, 0, work);
+    for (size_t i = 0; i < R->nrows; i++) {
+        memcpy(Z->vals[i], work[0]->vals[i], sizeof(double) * R->ncols);
+    }
+}
+
+/**
+ * @brief Checks whether every column of R is below tol times its column of B
+ *
+ * @param R the residuals
+ * @param B the right-hand sides
+ * @param tol the relative tolerance
+ * @return bool whether every column has converged
+ */
+static bool block_converged(Matrix* R, Matrix* B, double tol) {
+    size_t k = R->ncols;
+    double* norms = (double*) calloc(2 * k, sizeof(double)); /* The squared norms of R, then of B */
+    bool ret = true;
+
+    for (size_t i = 0; i < R->nrows; i++) {
+        for (size_t c = 0; c < k; c++) {
+            norms[c] += R->vals[i][c] * R->vals[i][c];
+            norms[k + c] += B->vals[i][c] * B->vals[i][c];
+        }
+    }
+    for (size_t c = 0; c < k; c++) {
+        ret = ret && (norms[c] <= tol * tol * norms[k + c]);
+    }
+
+    free(norms);
+    return ret;
+}
+
+/**
+ * @brief Checks the arguments shared by the block Krylov solvers
+ *
+ * @return 0 if the arguments are valid, otherwise 1
+ */
+static int block_check(SparseMatrix* A, Matrix* B, Matrix* X, AMG* M) {
+    if (A == NULL || A->rowptr == NULL || A->nrows != A->ncols || B == NULL || B->vals == NULL || X == NULL || X->vals == NULL) {
+        return 1;
+    }
+    if (B->nrows != A->nrows || X->nrows != A->nrows || X->ncols != B->ncols || B->ncols == 0) {
+        return 1;
+    }
+    if (M != NULL && M->levels[0].A->nrows != A->nrows) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Solves A X = B for many right-hand sides by block conjugate gradients
+ *
+ * All the columns are iterated together: each step costs one sparse product
+ * with the whole block (SpMM) in place of one SpMV per column, and the inner
+ * products become k by k GEMMs. The search directions are reconditioned by
+ * one pass of Cholesky QR at every step, which drops directions that have become dependent and keeps
+ * the method stable once some columns converge before others. The shared
+ * Krylov space usually also cuts the number of steps below that of CG on a
+ * single column.
+ *
+ * @param A a symmetric positive definite sparse matrix
+ * @param B the right-hand sides, one per column
+ * @param X the initial guesses, overwritten by the solutions
+ * @param M an AMG hierarchy built for A, or NULL for no preconditioner
+ * @param tol the relative residual every column must reach
+ * @param maxiter the most iterations to run
+ * @param iters receives the number of iterations run, unless it is NULL
+ * @return 0 if every column converged, otherwise 1
+ */
+int SparseMatrix_block_cg(SparseMatrix* A, Matrix* B, Matrix* X, AMG* M, double tol, size_t maxiter, size_t* iters) {
+    size_t n, k, it = 0; /* The order, the block size and the iteration count */
+    Matrix* R, * Z, * P, * Q; /* The residuals, preconditioned residuals, directions and A P */
+    Matrix* G, * C, * S; /* P^T A P, the right-hand sides for it and the step coefficients */
+    Matrix** work; /* The preconditioner's blocks */
+    bool done;
+
+    //If the operation is invalid, return 1.
+    if (block_check(A, B, X, M) != 0) {
+        return 1;
+    }
+
+    n = A->nrows;
+    k = B->ncols;
+    R = new_Matrix(n, k);
+    Z = new_Matrix(n, k);
+    P = new_Matrix(n, k);
+    Q = new_Matrix(n, k);
+    G = new_Matrix(k, k);
+    C = new_Matrix(k, k);
+    S = new_Matrix(k, k);
+    work = amg_new_work(M, k);
+
+    sparse_spmm(A, X, R);
+#   pragma omp parallel for num_threads(2)
+    for (size_t i = 0; i < n; i++) {
+        for (size_t c = 0; c < k; c++) {
+            R->vals[i][c] = B->vals[i][c] - R->vals[i][c];
+        }
+    }
+    amg_apply_block(M, work, R, P);
+    block_orthonormalize(P, NULL, 1);
+
+    done = block_converged(R, B, tol);
+    while (!done && it < maxiter) {
+        //Step along P: X += P G^-1 P^T R, R -= Q G^-1 P^T R.
+        sparse_spmm(A, P, Q);
+        block_gram(P, Q, G);
+        block_gram(P, R, C);
+        if (block_solve(G, C, S) != 0) {
+            break;
+        }
+        block_update(1.0, P, S, X);
+        block_update(-1.0, Q, S, R);
+        it++;
+        done = block_converged(R, B, tol);
+        if (done) {
+            break;
+        }
+
+        //Make the next directions A-orthogonal to P: P = Z - P G^-1 Q^T Z.
+        amg_apply_block(M, work, R, Z);
+        block_gram(Q, Z, C);
+        if (block_solve(G, C, S) != 0) {
+            break;
+        }
+        block_update(-1.0, P, S, Z);
+        for (size_t i = 0; i < n; i++) {
+            double* row = P->vals[i];
+            P->vals[i] = Z->vals[i];
+            Z->vals[i] = row;
+        }
+        if (block_orthonormalize(P, NULL, 1) == 0) {
+            break;
+        }
+    }
+
+    if (iters != NULL) {
+        *iters = it;
+    }
+    delete_Matrix(R);
+    delete_Matrix(Z);
+    delete_Matrix(P);
+    delete_Matrix(Q);
+    delete_Matrix(G);
+    delete_Matrix(C);
+    delete_Matrix(S);
+    amg_delete_work(M, work);
+    return done ? 0 : 1;
+}
+
+/**
+ * @brief Solves A X = B for many right-hand sides by restarted block GMRES
+ *
+ * This is for matrices that are not symmetric positive definite. Each step of
+ * the block Arnoldi process multiplies the newest k by k block of the basis
+ * by A in one SpMM, orthogonalizes it against the earlier blocks with GEMMs
+ * (twice, for stability) and orthonormalizes it with block_orthonormalize.
+ * The least-squares problem is kept triangular by Givens rotations, so the
+ * residual of every column is known at every step. M, if given, is applied
+ * on the right, and the method restarts after restart steps.
+ *
+ * A basis vector that block_orthonormalize drops, because its column of the
+ * residual is zero or has converged, or has become dependent on the others,
+ * stays zero for the rest of the cycle, so the block shrinks. Its column of H
+ * is then zero and takes no row of the triangle: each column is rotated into
+ * the next free row, and the residual is everything below the last one.
+ *
+ * @param A a square sparse matrix
+ * @param B the right-hand sides, one per column
+ * @param X the initial guesses, overwritten by the solutions
+ * @param M an AMG hierarchy built for A, or NULL for no preconditioner
+ * @param restart the number of block steps before each restart
+ * @param tol the relative residual every column must reach
+ * @param maxiter the most block steps to run in total
+ * @param iters receives the number of block steps run, unless it is NULL
+ * @return 0 if every column converged, otherwise 1
+ */
+int SparseMatrix_block_gmres(SparseMatrix* A, Matrix* B, Matrix* X, AMG* M, size_t restart,
+                             double tol, size_t maxiter, size_t* iters) {
+    size_t n, k, m, ld, it = 0; /* The order, the block size, the restart length, the stride of cs and sn and the step count */
+    Matrix** V; /* The block Krylov basis */
+    Matrix* H, * G, * Y, * W, * T; /* The Hessenberg matrix, the rotated right-hand side, its solution and work blocks */
+    double* cs, * sn; /* The Givens rotations, up to (m + 1) k for each column of H */
+    size_t* nrot; /* The number of rotations for each column of H, 0 if it has no row of the triangle */
+    double* bnorm; /* The norm of each column of B */
+    Matrix** work; /* The preconditioner's blocks */
+    bool done = false;
+
+    //If the operation is invalid, return 1.
+    if (block_check(A, B, X, M) != 0 || restart == 0) {
+        return 1;
+    }
+
+    n = A->nrows;
+    k = B->ncols;
+    m = restart;
+    ld = (m + 1) * k;
+    V = (Matrix**) malloc(sizeof(Matrix*) * (m + 1));
+    for (size_t j = 0; j <= m; j++) {
+        V[j] = new_Matrix(n, k);
+    }
+    H = new_Matrix((m + 1) * k, m * k);
+    G = new_Matrix((m + 1) * k, k);
+    Y = new_Matrix(m * k, k);
+    W = new_Matrix(n, k);
+    T = new_Matrix(k, k);
+    cs = (double*) malloc(sizeof(double) * (m * k * ld + 1));
+    sn = (double*) malloc(sizeof(double) * (m * k * ld + 1));
+    nrot = (size_t*) malloc(sizeof(size_t) * (m * k + 1));
+    bnorm = (double*) calloc(k, sizeof(double));
+    work = amg_new_work(M, k);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t c = 0; c < k; c++) {
+            bnorm[c] += B->vals[i][c] * B->vals[i][c];
+        }
+    }
+
+    //Each cycle starts from the true residual, which the recurrence can drift from.
+    while (true) {
+        size_t steps = 0; /* The block steps taken in this cycle */
+        size_t rank = 0; /* The rows of the triangle so far */
+        size_t kept = k; /* The columns kept in the newest block of the basis */
+        bool small = false; /* Whether the recurrence says every column has converged */
+
+        //The residual, as the first block of the basis.
+        sparse_spmm(A, X, V[0]);
+#       pragma omp parallel for num_threads(2)
+        for (size_t i = 0; i < n; i++) {
+            for (size_t c = 0; c < k; c++) {
+                V[0]->vals[i][c] = B->vals[i][c] - V[0]->vals[i][c];
+            }
+        }
+        done = block_converged(V[0], B, tol);
+        if (done || it >= maxiter) {
+            break;
+        }
+        for (size_t i = 0; i < (m + 1) * k; i++) {
+            memset(G->vals[i], 0, sizeof(double) * k);
+            memset(H->vals[i], 0, sizeof(double) * m * k);
+        }
+        block_orthonormalize(V[0], T, 2);
+        for (size_t i = 0; i < k; i++) {
+            memcpy(G->vals[i], T->vals[i], sizeof(double) * k);
+        }
+
+        for (size_t j = 0; j < m && it < maxiter && !small && kept > 0; j++) {
+            //W = A M V_j, then orthogonalize it against V_0 ... V_j twice.
+            amg_apply_block(M, work, V[j], W);
+            sparse_spmm(A, W, V[j + 1]);
+            for (size_t pass = 0; pass < 2; pass++) {
+                for (size_t l = 0; l <= j; l++) {
+                    block_gram(V[l], V[j + 1], T);
+                    block_update(-1.0, V[l], T, V[j + 1]);
+                    for (size_t a = 0; a < k; a++) {
+                        for (size_t b = 0; b < k; b++) {
+                            H->vals[l * k + a][j * k + b] += T->vals[a][b];
+                        }
+                    }
+                }
+            }
+            kept = block_orthonormalize(V[j + 1], T, 2);
+            for (size_t a = 0; a < k; a++) {
+                for (size_t b = 0; b < k; b++) {
+                    H->vals[(j + 1) * k + a][j * k + b] = T->vals[a][b];
+                }
+            }
+
+            //Reduce the new columns of H to triangular form, rotating rows
+            //rank + 1 to col + k of each into row rank.
+            for (size_t b = 0; b < k; b++) {
+                size_t col = j * k + b;
+                double total = 0.0, below = 0.0; /* The squared norms of the column and of its rows from rank on */
+                for (size_t prev = 0; prev < col; prev++) {
+                    for (size_t t = 0; t < nrot[prev]; t++) {
+                        size_t r = prev + k - t;
+                        double c = cs[prev * ld + t], s = sn[prev * ld + t];
+                        double h0 = H->vals[r - 1][col], h1 = H->vals[r][col];
+                        H->vals[r - 1][col] = c * h0 + s * h1;
+                        H->vals[r][col] = -s * h0 + c * h1;
+                    }
+                }
+                for (size_t r = 0; r <= col + k; r++) {
+                    total += H->vals[r][col] * H->vals[r][col];
+                    below += (r >= rank) ? H->vals[r][col] * H->vals[r][col] : 0.0;
+                }
+                //A column with nothing left below the triangle gets no row of it.
+                nrot[col] = 0;
+                if (!(below > 1e-24 * total)) {
+                    continue;
+                }
+                nrot[col] = col + k - rank;
+                for (size_t t = 0; t < nrot[col]; t++) {
+                    size_t r = col + k - t;
+                    double h0 = H->vals[r - 1][col], h1 = H->vals[r][col];
+                    double h = hypot(h0, h1);
+                    double c = (h == 0.0) ? 1.0 : h0 / h, s = (h == 0.0) ? 0.0 : h1 / h;
+                    cs[col * ld + t] = c;
+                    sn[col * ld + t] = s;
+                    H->vals[r - 1][col] = h;
+                    H->vals[r][col] = 0.0;
+                    for (size_t q = 0; q < k; q++) {
+                        double g0 = G->vals[r - 1][q], g1 = G->vals[r][q];
+                        G->vals[r - 1][q] = c * g0 + s * g1;
+                        G->vals[r][q] = -s * g0 + c * g1;
+                    }
+                }
+                rank++;
+            }
+            it++;
+            steps = j + 1;
+
+            //The residual of each column is what is left below the triangle.
+            small = true;
+            for (size_t q = 0; q < k; q++) {
+                double res = 0.0;
+                for (size_t r = rank; r < (j + 2) * k; r++) {
+                    res += G->vals[r][q] * G->vals[r][q];
+                }
+                small = small && (res <= tol * tol * bnorm[q]);
+            }
+        }
+
+        //Solve the triangular system into Y, then X += M V Y. Column col of
+        //H, if it has a row of the triangle, has its diagonal in row rank.
+        for (size_t col = steps * k; col-- > 0; ) {
+            if (nrot[col] == 0) {
+                memset(Y->vals[col], 0, sizeof(double) * k);
+                continue;
+            }
+            rank--;
+            for (size_t q = 0; q < k; q++) {
+                double s = G->vals[rank][q];
+                for (size_t t = col + 1; t < steps * k; t++) {
+                    s -= H->vals[rank][t] * Y->vals[t][q];
+                }
+                Y->vals[col][q] = s / H->vals[rank][col];
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            memset(W->vals[i], 0, sizeof(double) * k);
+        }
+        for (size_t j = 0; j < steps; j++) {
+            Matrix Yj = {k, k, Y->vals + j * k}; /* The coefficients of V_j */
+            block_update(1.0, V[j], &Yj, W);
+        }
+        if (M == NULL) {
+            for (size_t i = 0; i < n; i++) {
+                for (size_t c = 0; c < k; c++) {
+                    X->vals[i][c] += W->vals[i][c];
+                }
+            }
+        }
+        else {
+            amg_apply_block(M, work, W, V[0]);
+            for (size_t i = 0; i < n; i++) {
+                for (size_t c = 0; c < k; c++) {
+                    X->vals[i][c] += V[0]->vals[i][c];
+                }
+            }
+        }
+    }
+
+    if (iters != NULL) {
+        *iters = it;
+    }
+    for (size_t j = 0; j <= m; j++) {
+        delete_Matrix(V[j]);
+    }
+    free(V);
+    delete_Matrix(H);
+    delete_Matrix(G);
+    delete_Matrix(Y);
+    delete_Matrix(W);
+    delete_Matrix(T);
+    free(cs);
+    free(sn);
+    free(nrot);
+    free(bnorm);
+    amg_delete_work(M, work);
+    return done ? 0 : 1;
+}
+
+/**
+ * @brief Computes A*B^T only at the entries of a sparse mask (SDDMM)
+ *
+ * Entry (i, j) of the result is S(i, j) times the dot product of row i of A
+ * with row j of B, for each stored entry of S, so the dense product is never
+ * formed; pass a mask whose values are all 1 to sample A*B^T unscaled. The
+ * rows of S are split between threads. Within a row, row i of A stays in
+ * cache while it is dotted with four rows of B at a time, and the dot
+ * products are vectorized along the inner dimension.
+ *
+ * @param S the mask, A.nrows by B.nrows
+ * @param A an m by k matrix
+ * @param B an n by k matrix
+ * @return SparseMatrix* the result, with the pattern of S, or NULL if the
+ *         operation is invalid
+ */
+SparseMatrix* SparseMatrix_sddmm(SparseMatrix* S, Matrix* A, Matrix* B) {
+    SparseMatrix* ret; /* The result to return */
+    size_t k; /* The inner dimension */
+
+    //If the operation is invalid, return NULL.
+    if (S == NULL || S->rowptr == NULL || A == NULL || A->vals == NULL || B == NULL || B->vals == NULL) {
+        return NULL;
+    }
+    if (S->nrows != A->nrows || S->ncols != B->nrows || A->ncols != B->ncols) {
+        return NULL;
+    }
+
+    k = A->ncols;
+    ret = new_SparseMatrix(S->nrows, S->ncols, S->rowptr[S->nrows]);
+    memcpy(ret->rowptr, S->rowptr, sizeof(size_t) * (S->nrows + 1));
+    if (S->rowptr[S->nrows] > 0) {
+        memcpy(ret->colind, S->colind, sizeof(size_t) * S->rowptr[S->nrows]);
+    }
+
+#   pragma omp parallel for num_threads(2) schedule(dynamic, 64)
+    for (size_t i = 0; i < S->nrows; i++) {
+        const double* a = A->vals[i];
+        size_t p = S->rowptr[i];
+
+        for (; p + 4 <= S->rowptr[i + 1]; p += 4) {
+            const double* b0 = B->vals[S->colind[p]];
+            const double* b1 = B->vals[S->colind[p + 1]];
+            const double* b2 = B->vals[S->colind[p + 2]];
+            const double* b3 = B->vals[S->colind[p + 3]];
+            double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+#           pragma omp simd reduction(+: s0, s1, s2, s3)
+            for (size_t t = 0; t < k; t++) {
+                s0 += a[t] * b0[t];
+                s1 += a[t] * b1[t];
+                s2 += a[t] * b2[t];
+                s3 += a[t] * b3[t];
+            }
+            ret->vals[p] = S->vals[p] * s0;
+            ret->vals[p + 1] = S->vals[p + 1] * s1;
+            ret->vals[p + 2] = S->vals[p + 2] * s2;
+            ret->vals[p + 3] = S->vals[p + 3] * s3;
+        }
+        for (; p < S->rowptr[i + 1]; p++) {
+            const double* b = B->vals[S->colind[p]];
+            double s = 0.0;
+#           pragma omp simd reduction(+: s)
+            for (size_t t = 0; t < k; t++) {
+                s += a[t] * b[t];
+            }
+            ret->vals[p] = S->vals[p] * s;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Allocate memory and initialize a new hypersparse matrix
+ *
+ * @param nrows the number of rows in the new matrix
+ * @param ncols the number of columns in the new matrix
+ * @param nzrows the number of non-empty rows to make room for
+ * @param nnz the number of entries to make room for
+ * @return HypersparseMatrix* a pointer to the newly created matrix
+ */
+HypersparseMatrix* new_HypersparseMatrix(size_t nrows, size_t ncols, size_t nzrows, size_t nnz) {
+    //Create and return the matrix.
+    HypersparseMatrix* H = (HypersparseMatrix*) malloc(sizeof(HypersparseMatrix)); /* The matrix to return. */
+    init_HypersparseMatrix(H, nrows, ncols, nzrows, nnz);
+    return H;
+}
+
+/**
+ * @brief Initialize a hypersparse matrix with room for nzrows rows and nnz entries
+ *
+ * rowptr is filled with zeros; the caller fills in rowind, rowptr, colind and
+ * vals. rowind is NULL when nzrows is 0, and colind and vals are NULL when nnz
+ * is 0.
+ *
+ * @param H the matrix to be initialized
+ * @param nrows the number of rows in the matrix
+ * @param ncols the number of columns in the matrix
+ * @param nzrows the number of non-empty rows to make room for
+ * @param nnz the number of entries to make room for
+ */
+void init_HypersparseMatrix(HypersparseMatrix* H, size_t nrows, size_t ncols, size_t nzrows, size_t nnz) {
+    //If H is NULL, nothing else can be done.
+    if (H == NULL) {
+        return;
+    }
+
+    H->nrows = nrows;
+    H->ncols = ncols;
+    H->nzrows = nzrows;
+    H->nnz = nnz;
+    H->rowind = (nzrows > 0) ? (size_t*) malloc(sizeof(size_t) * nzrows) : NULL;
+    H->rowptr = (size_t*) calloc(nzrows + 1, sizeof(size_t));
+    H->colind = (nnz > 0) ? (size_t*) malloc(sizeof(size_t) * nnz) : NULL;
+    H->vals = (nnz > 0) ? (double*) malloc(sizeof(double) * nnz) : NULL;
+}
+
+/**
+ * @brief Clean up any dynamic memory allocated by init_HypersparseMatrix
+ *
+ * This function does nothing if H or H.rowptr is NULL
+ *
+ * @param H the matrix to be cleaned in preparation for deletion
+ */
+void deinit_HypersparseMatrix(HypersparseMatrix* H) {
+    //If the matrix or its rowptr field are null, do nothing.
+    if (H == NULL || H->rowptr == NULL) {
+        return;
+    }
+
+    free(H->rowind);
+    free(H->rowptr);
+    free(H->colind);
+    free(H->vals);
+    H->rowind = NULL;
+    H->rowptr = NULL;
+    H->colind = NULL;
+    H->vals = NULL;
+    H->nrows = 0;
+    H->ncols = 0;
+    H->nzrows = 0;
+    H->nnz = 0;
+}
+
+/**
+ * @brief Frees dynamic memory and deletes a HypersparseMatrix created by new_HypersparseMatrix
+ *
+ * @param H the matrix to be deleted safely
+ */
+void delete_HypersparseMatrix(HypersparseMatrix* H) {
+    //Do nothing if H is NULL.
+    if (H == NULL) {
+        return;
+    }
+
+    deinit_HypersparseMatrix(H);
+    free(H);
+}
+
+/**
+ * @brief Converts a CSR matrix to hypersparse (DCSR) form
+ *
+ * The non-empty rows are flagged in parallel and numbered with a prefix sum.
+ *
+ * @param S the matrix to convert
+ * @return HypersparseMatrix* the copy or NULL if S is invalid
+ */
+HypersparseMatrix* SparseMatrix_to_HypersparseMatrix(SparseMatrix* S) {
+    HypersparseMatrix* H; /* The copy to return */
+    size_t* slot; /* One more than the number of non-empty rows before each row */
+    size_t nnz;
+
+    //If the arguments are invalid, return NULL.
+    if (S == NULL || S->rowptr == NULL) {
+        return NULL;
+    }
+
+    slot = (size_t*) malloc(sizeof(size_t) * (S->nrows + 1));
+    slot[0] = 0;
+#   pragma omp parallel for simd num_threads(2)
+    for (size_t i = 0; i < S->nrows; i++) {
+        slot[i + 1] = (S->rowptr[i + 1] > S->rowptr[i]);
+    }
+    sparse_prefix_sum(slot, S->nrows);
+
+    nnz = S->rowptr[S->nrows];
+    H = new_HypersparseMatrix(S->nrows, S->ncols, slot[S->nrows], nnz);
+#   pragma omp parallel for num_threads(2)
+    for (size_t i = 0; i < S->nrows; i++) {
+        if (slot[i + 1] > slot[i]) {
+            H->rowind[slot[i]] = i;
+            H->rowptr[slot[i] + 1] = S->rowptr[i + 1];
+        }
+    }
+    if (nnz > 0) {
+        memcpy(H->colind, S->colind, sizeof(size_t) * nnz);
+        memcpy(H->vals, S->vals, sizeof(double) * nnz);
+    }
+
+    free(slot);
+    return H;
+}
+
+/**
+ * @brief Converts a hypersparse (DCSR) matrix to CSR form
+ *
+ * @param H the matrix to convert
+ * @return SparseMatrix* the copy or NULL if H is invalid
+ */
+SparseMatrix* HypersparseMatrix_to_SparseMatrix(HypersparseMatrix* H) {
+    SparseMatrix* S; /* The copy to return */
+
+    //If the arguments are invalid, return NULL.
+    if (H == NULL || H->rowptr == NULL) {
+        return NULL;
+    }
+
+    S = new_SparseMatrix(H->nrows, H->ncols, H->rowptr[H->nzrows]);
+    for (size_t r = 0; r < H->nzrows; r++) {
+        S->rowptr[H->rowind[r] + 1] = H->rowptr[r + 1] - H->rowptr[r];
+    }
+    sparse_prefix_sum(S->rowptr, H->nrows);
+    if (S->nnz > 0) {
+        memcpy(S->colind, H->colind, sizeof(size_t) * S->nnz);
+        memcpy(S->vals, H->vals, sizeof(double) * S->nnz);
+    }
+    return S;
+}
+
+/**
+ * @brief Multiplies a hypersparse matrix by a column vector
+ *
+ * Only the non-empty rows are visited; the rest of the result is zero.
+ *
+ * @param H the hypersparse matrix
+ * @param x a column vector with H.ncols rows
+ * @return Matrix* the column vector H*x or NULL if the operation is invalid
+ */
+Matrix* HypersparseMatrix_mult_vec(HypersparseMatrix* H, Matrix* x) {
+    Matrix* ret; /* The product to return */
+
+    //If the operation is invalid, return NULL.
+    if (H == NULL || H->rowptr == NULL || x == NULL || x->vals == NULL) {
+        return NULL;
+    }
+    if (x->nrows != H->ncols || x->ncols != 1) {
+        return NULL;
+    }
+
+    ret = new_Matrix(H->nrows, 1);
+#   pragma omp parallel for num_threads(2) schedule(dynamic, 256)
+    for (size_t r = 0; r < H->nzrows; r++) {
+        double sum = 0.0;
+        for (size_t p = H->rowptr[r]; p < H->rowptr[r + 1]; p++) {
+            sum += H->vals[p] * x->vals[H->colind[p]][0];
+        }
+        ret->vals[H->rowind[r]][0] = sum;
+    }
+    return ret;
+}
+
+/**
+ * @brief Finds the position of row i among the non-empty rows of H
+ *
+ * @param H the hypersparse matrix
+ * @param i the row
+ * @return size_t its position, or SIZE_MAX if row i is empty
+ */
+static size_t hypersparse_find_row(HypersparseMatrix* H, size_t i) {
+    size_t lo = 0, hi = H->nzrows;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (H->rowind[mid] < i) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return (lo < H->nzrows && H->rowind[lo] == i) ? lo : SIZE_MAX;
+}
+
+/**
+ * @brief Multiplies two hypersparse matrices
+ *
+ * Nothing here is proportional to the number of rows or columns. The rows of
+ * B are found by binary search over its non-empty rows, and each row of the
+ * product is gathered as a list of partial products that is then sorted and
+ * merged, in place of the dense accumulator of SparseMatrix_mult. A first
+ * pass counts the partial products of every row so each gets its own slice
+ * of one buffer, and the rows are split between threads.
+ *
+ * @param A the matrix on the left hand side of the product
+ * @param B the matrix on the right hand side of the product
+ * @return HypersparseMatrix* the product A*B or NULL if the operation is invalid
+ */
+HypersparseMatrix* HypersparseMatrix_mult(HypersparseMatrix* A, HypersparseMatrix* B) {
+    HypersparseMatrix* ret; /* The product to return */
+    size_t* start; /* Where the partial products of each row of A begin */
+    size_t* count; /* The entries of each row of the product, then their offsets */
+    size_t* slot; /* The number of non-empty rows of the product before each row of A */
+    size_t* tcols; /* The partial products */
+    double* tvals;
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || B == NULL || A->rowptr == NULL || B->rowptr == NULL || A->ncols != B->nrows) {
+        return NULL;
+    }
+
+    //Count the partial products of each row.
+    start = (size_t*) calloc(A->nzrows + 1, sizeof(size_t));
+#   pragma omp parallel for num_threads(2) schedule(dynamic, 256)
+    for (size_t r = 0; r < A->nzrows; r++) {
+        size_t total = 0;
+        for (size_t p = A->rowptr[r]; p < A->rowptr[r + 1]; p++) {
+            size_t q = hypersparse_find_row(B, A->colind[p]);
+            total += (q == SIZE_MAX) ? 0 : B->rowptr[q + 1] - B->rowptr[q];
+        }
+        start[r + 1] = total;
+    }
+    sparse_prefix_sum(start, A->nzrows);
+
+    //Gather, sort and merge each row.
+    tcols = (size_t*) malloc(sizeof(size_t) * (start[A->nzrows] + 1));
+    tvals = (double*) malloc(sizeof(double) * (start[A->nzrows] + 1));
+    count = (size_t*) calloc(A->nzrows + 1, sizeof(size_t));
+    slot = (size_t*) calloc(A->nzrows + 1, sizeof(size_t));
+#   pragma omp parallel for num_threads(2) schedule(dynamic, 256)
+    for (size_t r = 0; r < A->nzrows; r++) {
+        size_t* cols = tcols + start[r];
+        double* vals = tvals + start[r];
+        size_t len = 0, out = 0;
+
+        for (size_t p = A->rowptr[r]; p < A->rowptr[r + 1]; p++) {
+            size_t q = hypersparse_find_row(B, A->colind[p]);
+            if (q == SIZE_MAX) {
+                continue;
+            }
+            for (size_t t = B->rowptr[q]; t < B->rowptr[q + 1]; t++) {
+                cols[len] = B->colind[t];
+                vals[len++] = A->vals[p] * B->vals[t];
+            }
+        }
+        sparse_sort_row(cols, vals, len);
+        for (size_t t = 0; t < len; t++) {
+            if (out > 0 && cols[out - 1] == cols[t]) {
+                vals[out - 1] += vals[t];
+            }
+            else {
+                cols[out] = cols[t];
+                vals[out++] = vals[t];
+            }
+        }
+        count[r + 1] = out;
+        slot[r + 1] = (out > 0);
+    }
+    sparse_prefix_sum(count, A->nzrows);
+    sparse_prefix_sum(slot, A->nzrows);
+
+    //Copy the rows that are not empty.
+    ret = new_HypersparseMatrix(A->nrows, B->ncols, slot[A->nzrows], count[A->nzrows]);
+#   pragma omp parallel for num_threads(2) schedule(dynamic, 256)
+    for (size_t r = 0; r < A->nzrows; r++) {
+        size_t len = count[r + 1] - count[r];
+        if (len == 0) {
+            continue;
+        }
+        ret->rowind[slot[r]] = A->rowind[r];
+        ret->rowptr[slot[r] + 1] = count[r + 1];
+        memcpy(ret->colind + count[r], tcols + start[r], sizeof(size_t) * len);
+        memcpy(ret->vals + count[r], tvals + start[r], sizeof(double) * len);
+    }
+
+    free(start);
+    free(count);
+    free(slot);
+    free(tcols);
+    free(tvals);
+    return ret;
+}
+
+/**
+ * @brief Generates a Householder reflector that zeroes A[i0+1..m-1][j]
+ *
+ * On return A[i0][j] holds beta and A[i0+1..m-1][j] the tail of the vector v
+ * (whose head is 1), with (I - tau v v^T) x = beta e1 for the original column x.
+ *
+ * @param A the matrix
+ * @param i0 the first row of the column
+ * @param j the column
+ * @return double tau, 0 if the column is already zero below row i0
+ */
+static double householder_column(Matrix* A, size_t i0, size_t j) {
+    double alpha = A->vals[i0][j], xnorm = 0.0, beta, scale;
+
+    for (size_t i = i0 + 1; i < A->nrows; i++) {
+        xnorm = hypot(xnorm, A->vals[i][j]);
+    }
+    if (xnorm == 0.0) {
+        return 0.0;
+    }
+    beta = (alpha >= 0.0) ? -hypot(alpha, xnorm) : hypot(alpha, xnorm);
+    scale = 1.0 / (alpha - beta);
+    for (size_t i = i0 + 1; i < A->nrows; i++) {
+        A->vals[i][j] *= scale;
+    }
+    A->vals[i0][j] = beta;
+    return (beta - alpha) / beta;
+}
+
+/**
+ * @brief Swaps columns j and k of a matrix
+ */
+static void swap_columns(Matrix* A, size_t j, size_t k) {
+    for (size_t i = 0; i < A->nrows; i++) {
+        double t = A->vals[i][j];
+        A->vals[i][j] = A->vals[i][k];
+        A->vals[i][k] = t;
+    }
+}
+
+/**
+ * @brief Computes a QR factorization with column pivoting, A P = Q R
+ *
+ * This is the blocked algorithm of LAPACK's xGEQP3. Within a block of NB
+ * columns, each step picks the remaining column of largest norm, and only
+ * that column and its row of R are brought up to date; the rest of the
+ * trailing matrix is updated once per block with a single Matrix_gemm. The
+ * column norms are downdated at each step and recomputed when cancellation
+ * makes the downdate unreliable, which also ends the block early.
+ *
+ * Since the pivots pick the largest remaining column, |R(k,k)| decreases,
+ * and the factorization stops at the first step k at which every remaining
+ * column has norm at most tol |R(0,0)|. k is the numerical rank, and the
+ * remaining block of A then holds the trailing part of R, whose norm is
+ * small. tol = 0 factors the whole matrix, stopping only at exact zeros.
+ *
+ * On return the upper triangle of A (the first rank rows of it if stopped
+ * early) holds R. The Householder vectors are stored below the diagonal, with
+ * implicit unit heads: Q = H(0) H(1) ... H(rank-1), H(k) = I - tau[k] v v^T.
+ *
+ * @param A the m by n matrix, overwritten by the factorization
+ * @param tau receives min(m, n) scales; those from rank on are set to 0
+ * @param perm receives the n column indices, column j of A P being column
+ *        perm[j] of A
+ * @param tol the relative tolerance, 0 for the complete factorization
+ * @param rank receives the numerical rank, unless it is NULL
+ * @return 0 if the operation was successful, otherwise 1
+ */
+int Matrix_qrcp(Matrix* A, double* tau, size_t* perm, double tol, size_t* rank) {
+    const size_t NB = 32; /* Columns per block */
+    const double TOL3Z = sqrt(DBL_EPSILON); /* When a downdated norm must be recomputed */
+    size_t m, n, mn, c0; /* The shape, the number of reflectors and the first column of the block */
+    double* vn1, * vn2; /* The downdated norms and the norms they were last recomputed at */
+    double ref; /* |R(0,0)|, the reference for tol */
+    Matrix* Ft; /* The block's accumulated updates, stored by rows: A22 -= V Ft */
+    double* aux; /* Work space */
+    double** lrows, ** rrows, ** frows; /* Row pointers for the block update */
+    bool stop = false;
+
+    //If the arguments are invalid, return 1.
+    if (A == NULL || A->vals == NULL || tau == NULL || perm == NULL || tol < 0.0) {
+        return 1;
+    }
+
+    m = A->nrows;
+    n = A->ncols;
+    mn = (m < n) ? m : n;
+    vn1 = (double*) calloc(n + 1, sizeof(double));
+    vn2 = (double*) malloc(sizeof(double) * (n + 1));
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) {
+            vn1[j] += A->vals[i][j] * A->vals[i][j];
+        }
+    }
+    ref = 0.0;
+    for (size_t j = 0; j < n; j++) {
+        perm[j] = j;
+        vn1[j] = sqrt(vn1[j]);
+        vn2[j] = vn1[j];
+        ref = fmax(ref, vn1[j]);
+    }
+
+    Ft = new_Matrix(NB, n + 1);
+    aux = (double*) malloc(sizeof(double) * (n + NB + 1));
+    lrows = (double**) malloc(sizeof(double*) * (m + 1));
+    rrows = (double**) malloc(sizeof(double*) * (m + 1));
+    frows = (double**) malloc(sizeof(double*) * NB);
+
+    for (c0 = 0; c0 < mn && !stop; ) {
+        size_t nb = (mn - c0 < NB) ? mn - c0 : NB, kb = 0, g; /* The block size, the steps taken and the current step */
+        bool recompute = false;
+
+        for (size_t k = 0; k < nb && !recompute; k++) {
+            size_t pvt = g = c0 + k;
+            double akk, t;
+
+            //Pivot, and stop if every remaining column is small enough.
+            for (size_t j = g + 1; j < n; j++) {
+                if (vn1[j] > vn1[pvt]) {
+                    pvt = j;
+                }
+            }
+            if (vn1[pvt] <= tol * ref) {
+                stop = true;
+                break;
+            }
+            if (pvt != g) {
+                size_t p = perm[pvt];
+                swap_columns(A, pvt, g);
+                for (size_t t2 = 0; t2 < k; t2++) {
+                    double f = Ft->vals[t2][pvt - c0];
+                    Ft->vals[t2][pvt - c0] = Ft->vals[t2][k];
+                    Ft->vals[t2][k] = f;
+                }
+                perm[pvt] = perm[g];
+                perm[g] = p;
+                vn1[pvt] = vn1[g];
+                vn2[pvt] = vn2[g];
+            }
+
+            //Bring column g up to date and reduce it.
+            for (size_t t2 = 0; t2 < k; t2++) {
+                aux[t2] = Ft->vals[t2][k];
+            }
+            for (size_t i = g; i < m && k > 0; i++) {
+                double s = 0.0;
+                for (size_t t2 = 0; t2 < k; t2++) {
+                    s += A->vals[i][c0 + t2] * aux[t2];
+                }
+                A->vals[i][g] -= s;
+            }
+            tau[g] = householder_column(A, g, g);
+            akk = A->vals[g][g];
+            A->vals[g][g] = 1.0;
+            t = tau[g];
+
+            //Ft(k, :) = tau v^T A(g:m, c0:n), less the earlier reflectors' part.
+            memset(Ft->vals[k], 0, sizeof(double) * (k + 1));
+#           pragma omp parallel for num_threads(2) schedule(static)
+            for (size_t j0 = g + 1; j0 < n; j0 += 256) {
+                size_t j1 = (j0 + 256 < n) ? j0 + 256 : n;
+                double* f = Ft->vals[k] + (j0 - c0);
+                for (size_t j = 0; j < j1 - j0; j++) {
+                    f[j] = 0.0;
+                }
+                for (size_t i = g; i < m; i++) {
+                    double v = t * A->vals[i][g];
+                    double* a = A->vals[i] + j0;
+                    if (v == 0.0) {
+                        continue;
+                    }
+                    for (size_t j = 0; j < j1 - j0; j++) {
+                        f[j] += v * a[j];
+                    }
+                }
+            }
+            if (k > 0) {
+                memset(aux, 0, sizeof(double) * k);
+                for (size_t i = g; i < m; i++) {
+                    double v = -t * A->vals[i][g];
+                    for (size_t t2 = 0; t2 < k; t2++) {
+                        aux[t2] += v * A->vals[i][c0 + t2];
+                    }
+                }
+                for (size_t t2 = 0; t2 < k; t2++) {
+                    double* f = Ft->vals[t2];
+                    double* fk = Ft->vals[k];
+                    for (size_t j = 0; j < n - c0; j++) {
+                        fk[j] += aux[t2] * f[j];
+                    }
+                }
+            }
+
+            //Bring row g up to date.
+            for (size_t t2 = 0; t2 <= k; t2++) {
+                double a = A->vals[g][c0 + t2];
+                double* f = Ft->vals[t2] + (k + 1);
+                double* row = A->vals[g] + (g + 1);
+                for (size_t j = 0; j < n - g - 1; j++) {
+                    row[j] -= a * f[j];
+                }
+            }
+
+            //Downdate the norms of the remaining columns.
+            for (size_t j = g + 1; j < n && g + 1 < m; j++) {
+                double r, r2;
+                if (vn1[j] == 0.0) {
+                    continue;
+                }
+                r = fabs(A->vals[g][j]) / vn1[j];
+                r = fmax(0.0, (1.0 + r) * (1.0 - r));
+                r2 = r * (vn1[j] / vn2[j]) * (vn1[j] / vn2[j]);
+                if (r2 <= TOL3Z) {
+                    vn2[j] = -1.0;
+                    recompute = true;
+                }
+                else {
+                    vn1[j] *= sqrt(r);
+                }
+            }
+            A->vals[g][g] = akk;
+            kb = k + 1;
+        }
+
+        //Update the trailing matrix with one product.
+        g = c0 + kb;
+        if (kb > 0 && g < m && g < n) {
+            Matrix L = {m - g, kb, lrows}; /* A(g:m, c0:g) */
+            Matrix F = {kb, n - g, frows}; /* Ft(:, g - c0:) */
+            Matrix R = {m - g, n - g, rrows}; /* A(g:m, g:n) */
+            for (size_t i = g; i < m; i++) {
+                lrows[i - g] = A->vals[i] + c0;
+                rrows[i - g] = A->vals[i] + g;
+            }
+            for (size_t t2 = 0; t2 < kb; t2++) {
+                frows[t2] = Ft->vals[t2] + kb;
+            }
+            Matrix_gemm(-1.0, &L, false, &F, false, 1.0, &R);
+        }
+        for (size_t j = g; j < n; j++) {
+            if (vn2[j] < 0.0) {
+                vn1[j] = 0.0;
+                for (size_t i = g; i < m; i++) {
+                    vn1[j] = hypot(vn1[j], A->vals[i][j]);
+                }
+                vn2[j] = vn1[j];
+            }
+        }
+        c0 = g;
+    }
+
+    for (size_t k = c0; k < mn; k++) {
+        tau[k] = 0.0;
+    }
+    if (rank != NULL) {
+        *rank = c0;
+    }
+    free(vn1);
+    free(vn2);
+    delete_Matrix(Ft);
+    free(aux);
+    free(lrows);
+    free(rrows);
+    free(frows);
+    return 0;
+}
+
+/**
+ * @brief Solves a possibly rank-deficient least-squares problem min ||A X - B||
+ *
+ * A is factored by Matrix_qrcp, which stops at the numerical rank r. The
+ * basic solution is returned: it solves the problem restricted to the r
+ * columns chosen as pivots, and is zero in the others. Unlike the normal
+ * equations or QR without pivoting, this stays well-behaved when the columns
+ * of A are nearly dependent.
+ *
+ * @param A an m by n matrix, which is not modified
+ * @param B an m by k matrix of right-hand sides
+ * @param tol the relative tolerance for the rank, or 0 for max(m, n) times
+ *        the machine epsilon
+ * @param rank receives the numerical rank, unless it is NULL
+ * @return Matrix* the n by k solution or NULL if the operation is invalid
+ */
+Matrix* Matrix_lstsq(Matrix* A, Matrix* B, double tol, size_t* rank) {
+    Matrix* QR, * W, * ret; /* The factorization, Q^T B and the solution */
+    double* tau; /* The reflectors' scales */
+    size_t* perm; /* The column order */
+    size_t r, m, n, k; /* The rank and the shapes */
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || A->vals == NULL || B == NULL || B->vals == NULL || B->nrows != A->nrows || tol < 0.0) {
+        return NULL;
+    }
+
+    m = A->nrows;
+    n = A->ncols;
+    k = B->ncols;
+    if (tol == 0.0) {
+        tol = (double) ((m > n) ? m : n) * DBL_EPSILON;
+    }
+    QR = new_Matrix(m, n);
+    W = new_Matrix(m, k);
+    for (size_t i = 0; i < m; i++) {
+        memcpy(QR->vals[i], A->vals[i], sizeof(double) * n);
+        memcpy(W->vals[i], B->vals[i], sizeof(double) * k);
+    }
+    tau = (double*) malloc(sizeof(double) * (n + 1));
+    perm = (size_t*) malloc(sizeof(size_t) * (n + 1));
+    Matrix_qrcp(QR, tau, perm, tol, &r);
+
+    //W = Q^T B, one reflector at a time.
+    for (size_t j = 0; j < r; j++) {
+        double* s = (double*) calloc(k + 1, sizeof(double)); /* v^T W */
+        for (size_t c = 0; c < k; c++) {
+            s[c] = W->vals[j][c];
+        }
+        for (size_t i = j + 1; i < m; i++) {
+            for (size_t c = 0; c < k; c++) {
+                s[c] += QR->vals[i][j] * W->vals[i][c];
+            }
+        }
+        for (size_t c = 0; c < k; c++) {
+            W->vals[j][c] -= tau[j] * s[c];
+        }
+        for (size_t i = j + 1; i < m; i++) {
+            for (size_t c = 0; c < k; c++) {
+                W->vals[i][c] -= tau[j] * QR->vals[i][j] * s[c];
+            }
+        }
+        free(s);
+    }
+
+    //Back-substitute with R(0:r, 0:r) and undo the column order.
+    for (size_t i = r; i-- > 0; ) {
+        for (size_t t = i + 1; t < r; t++) {
+            for (size_t c = 0; c < k; c++) {
+                W->vals[i][c] -= QR->vals[i][t] * W->vals[t][c];
+            }
+        }
+        for (size_t c = 0; c < k; c++) {
+            W->vals[i][c] /= QR->vals[i][i];
+        }
+    }
+    ret = new_Matrix(n, k);
+    for (size_t i = 0; i < r; i++) {
+        memcpy(ret->vals[perm[i]], W->vals[i], sizeof(double) * k);
+    }
+
+    if (rank != NULL) {
+        *rank = r;
+    }
+    delete_Matrix(QR);
+    delete_Matrix(W);
+    free(tau);
+    free(perm);
+    return ret;
+}
+
+/**
+ * @brief Computes column i of the triangular factor of a block reflector
+ *
+ * With H(j) = I - tau[j] v_j v_j^T and V = [v_0 ... v_{k-1}], the product
+ * H(0) H(1) ... H(k-1) is I - V T V^T for an upper triangular T, which is
+ * built one column at a time (LAPACK's xLARFT).
+ *
+ * @param V the vectors, stored explicitly with their unit heads and zeros
+ * @param tau the scales
+ * @param T the k by k triangular factor; columns 0 to i-1 must be filled
+ * @param i the column to compute
+ */
+static void reflector_triangle_column(Matrix* V, double* tau, Matrix* T, size_t i) {
+    for (size_t j = 0; j < i; j++) {
+        T->vals[j][i] = 0.0;
+    }
+    for (size_t r = i; r < V->nrows; r++) {
+        double v = V->vals[r][i];
+        for (size_t j = 0; j < i; j++) {
+            T->vals[j][i] += V->vals[r][j] * v;
+        }
+    }
+    for (size_t j = 0; j < i; j++) {
+        double s = 0.0;
+        for (size_t t = j; t < i; t++) {
+            s += T->vals[j][t] * T->vals[t][i];
+        }
+        T->vals[j][i] = -tau[i] * s;
+    }
+    T->vals[i][i] = tau[i];
+}
+
+/**
+ * @brief Applies a block reflector from the left, C = (I - V op(T) V^T) C
+ *
+ * @param V the vectors of the block reflector
+ * @param T the triangular factor from reflector_triangle_column
+ * @param trans whether to use T^T, which applies the transpose of the product
+ * @param C the matrix to update
+ */
+static void block_reflector_left(Matrix* V, Matrix* T, bool trans, Matrix* C) {
+    Matrix* W = new_Matrix(V->ncols, C->ncols); /* V^T C */
+    Matrix* S = new_Matrix(V->ncols, C->ncols); /* op(T) V^T C */
+
+    Matrix_gemm(1.0, V, true, C, false, 0.0, W);
+    Matrix_gemm(1.0, T, trans, W, false, 0.0, S);
+    Matrix_gemm(-1.0, V, false, S, false, 1.0, C);
+    delete_Matrix(W);
+    delete_Matrix(S);
+}
+
+/**
+ * @brief Reduces NB columns of a matrix to Hessenberg form (LAPACK's xLAHR2)
+ *
+ * Columns p to p+nb-1 are reduced, bringing each up to date with the
+ * reflectors before it as it is reached; the rest of A is left alone. On
+ * return V holds the reflectors explicitly (row r being row p+1+r of A), T
+ * their triangular factor and Y = A V T, from which the caller applies the
+ * block to the rest of A with matrix products.
+ *
+ * @param A the n by n matrix
+ * @param p the first column of the panel
+ * @param nb the number of columns in the panel
+ * @param tau receives the nb scales
+ * @param V an n-p-1 by nb matrix of zeros
+ * @param T an nb by nb matrix
+ * @param Y an n by nb matrix
+ */
+static void hessenberg_panel(Matrix* A, size_t p, size_t nb, double* tau, Matrix* V, Matrix* T, Matrix* Y) {
+    size_t n = A->nrows, m = n - p - 1; /* The size and the length of the reflectors */
+    double* w = (double*) malloc(sizeof(double) * (nb + 1)); /* Work space */
+    double* v = (double*) malloc(sizeof(double) * m); /* The current reflector */
+    double** rows = (double**) malloc(sizeof(double*) * (p + 1)); /* Row pointers for Y(0:p+1, :) */
+
+    for (size_t i = 0; i < nb; i++) {
+        size_t c = p + i; /* The column being reduced */
+
+        if (i > 0) {
+            //Apply the earlier reflectors from the right, A(p+1:n, c) -= Y V(i-1, :)^T.
+            for (size_t r = p + 1; r < n; r++) {
+                double s = 0.0;
+                for (size_t j = 0; j < i; j++) {
+                    s += Y->vals[r][j] * V->vals[i - 1][j];
+                }
+                A->vals[r][c] -= s;
+            }
+
+            //And from the left, A(p+1:n, c) -= V T^T V^T A(p+1:n, c).
+            memset(w, 0, sizeof(double) * i);
+            for (size_t r = 0; r < m; r++) {
+                double a = A->vals[p + 1 + r][c];
+                for (size_t j = 0; j < i; j++) {
+                    w[j] += V->vals[r][j] * a;
+                }
+            }
+            for (size_t j = i; j-- > 0; ) {
+                double s = 0.0;
+                for (size_t t = 0; t <= j; t++) {
+                    s += T->vals[t][j] * w[t];
+                }
+                w[j] = s;
+            }
+            for (size_t r = 0; r < m; r++) {
+                double s = 0.0;
+                for (size_t j = 0; j < i; j++) {
+                    s += V->vals[r][j] * w[j];
+                }
+                A->vals[p + 1 + r][c] -= s;
+            }
+        }
+
+        //Generate the reflector and store it in V, and contiguously in v.
+        tau[i] = householder_column(A, c + 1, c);
+        V->vals[i][i] = v[0] = 1.0;
+        for (size_t r = i + 1; r < m; r++) {
+            V->vals[r][i] = v[r - i] = A->vals[p + 1 + r][c];
+        }
+
+        //Y(p+1:n, i) = tau (A(p+1:n, c+1:n) v - Y T(0:i, i)), with T(0:i, i) = V^T v for now.
+        reflector_triangle_column(V, tau, T, i);
+        for (size_t j = 0; j < i; j++) {
+            w[j] = 0.0;
+            for (size_t r = i; r < m; r++) {
+                w[j] += V->vals[r][j] * V->vals[r][i];
+            }
+        }
+#       pragma omp parallel for num_threads(2) if(n > 256)
+        for (size_t r = p + 1; r < n; r++) {
+            double* a = A->vals[r] + c + 1;
+            double s = 0.0;
+            for (size_t q = 0; q < m - i; q++) {
+                s += a[q] * v[q];
+            }
+            for (size_t j = 0; j < i; j++) {
+                s -= Y->vals[r][j] * w[j];
+            }
+            Y->vals[r][i] = tau[i] * s;
+        }
+    }
+
+    //Y(0:p+1, :) = A(0:p+1, p+1:n) V T.
+    {
+        Matrix R = {p + 1, m, rows}; /* A(0:p+1, p+1:n) */
+        Matrix* AV = new_Matrix(p + 1, nb);
+        Matrix Yt = {p + 1, nb, Y->vals}; /* Y(0:p+1, :) */
+
+        for (size_t r = 0; r <= p; r++) {
+            rows[r] = A->vals[r] + p + 1;
+        }
+        Matrix_gemm(1.0, &R, false, V, false, 0.0, AV);
+        Matrix_gemm(1.0, AV, false, T, false, 0.0, &Yt);
+        delete_Matrix(AV);
+    }
+
+    free(w);
+    free(v);
+    free(rows);
+}
+
+/**
+ * @brief Reduces a square matrix to upper Hessenberg form, A = Q H Q^T
+ *
+ * This is the blocked algorithm of LAPACK's xGEHRD. Each panel of NB columns
+ * is reduced by hessenberg_panel, and the rest of the matrix is then updated
+ * from both sides with matrix products, so most of the work runs in
+ * Matrix_gemm. The last columns, and small matrices, are reduced one
+ * reflector at a time.
+ *
+ * @param A the matrix, overwritten by H (with zeros below the subdiagonal)
+ * @param Q receives the orthogonal factor unless it is NULL, in which case it
+ *        is not formed; it must be as large as A
+ * @return 0 if the operation was successful, otherwise 1
+ */
+int Matrix_hessenberg(Matrix* A, Matrix* Q) {
+    const size_t NB = 32; /* Columns per panel */
+    const size_t NX = 128; /* Columns left for the unblocked code */
+    size_t n, p; /* The size and the first column not yet reduced */
+    double* tau; /* The reflectors' scales */
+    double** rows, ** vrows; /* Row pointers for the block updates */
+
+    //If the arguments are invalid, return 1.
+    if (A == NULL || A->vals == NULL || A->nrows != A->ncols) {
+        return 1;
+    }
+    if (Q != NULL && (Q->vals == NULL || Q->nrows != A->nrows || Q->ncols != A->ncols)) {
+        return 1;
+    }
+
+    n = A->nrows;
+    tau = (double*) calloc(n + 1, sizeof(double));
+    rows = (double**) malloc(sizeof(double*) * (n + 1));
+    vrows = (double**) malloc(sizeof(double*) * (n + 1));
+
+    //Blocked reduction.
+    for (p = 0; n > NX && p + NX < n - 1; p += NB) {
+        size_t nb = (n - 1 - p < NB) ? n - 1 - p : NB, m = n - p - 1; /* The panel size and length of the reflectors */
+        Matrix* V = new_Matrix(m, nb);
+        Matrix* T = new_Matrix(nb, nb);
+        Matrix* Y = new_Matrix(n, nb);
+
+        hessenberg_panel(A, p, nb, tau + p, V, T, Y);
+
+        //A(:, p+nb:n) -= Y V(nb-1:, :)^T.
+        {
+            Matrix C = {n, n - p - nb, rows}; /* A(:, p+nb:n) */
+            Matrix Vb = {m - nb + 1, nb, V->vals + nb - 1}; /* Rows p+nb to n of the reflectors */
+            for (size_t r = 0; r < n; r++) {
+                rows[r] = A->vals[r] + p + nb;
+            }
+            Matrix_gemm(-1.0, Y, false, &Vb, true, 1.0, &C);
+        }
+
+        //A(0:p+1, p+1:p+nb) -= Y(0:p+1, 0:nb-1) V(0:nb-1, 0:nb-1)^T.
+        if (nb > 1) {
+            Matrix C = {p + 1, nb - 1, rows}; /* A(0:p+1, p+1:p+nb) */
+            Matrix Yt = {p + 1, nb - 1, Y->vals}; /* Y(0:p+1, 0:nb-1) */
+            Matrix L = {nb - 1, nb - 1, V->vals}; /* The unit lower triangle of V */
+            for (size_t r = 0; r <= p; r++) {
+                rows[r] = A->vals[r] + p + 1;
+            }
+            Matrix_gemm(-1.0, &Yt, false, &L, true, 1.0, &C);
+        }
+
+        //A(p+1:n, p+nb:n) = (I - V T V^T)^T A(p+1:n, p+nb:n).
+        {
+            Matrix C = {m, n - p - nb, rows}; /* A(p+1:n, p+nb:n) */
+            for (size_t r = 0; r < m; r++) {
+                rows[r] = A->vals[p + 1 + r] + p + nb;
+            }
+            block_reflector_left(V, T, true, &C);
+        }
+
+        delete_Matrix(V);
+        delete_Matrix(T);
+        delete_Matrix(Y);
+    }
+
+    //Unblocked reduction of the rest.
+    for (size_t c = p; c + 1 < n; c++) {
+        double t = tau[c] = householder_column(A, c + 1, c);
+        double* v, * w; /* The reflector, from row c+1, and v^T A(c+1:n, c+1:n) */
+
+        if (t == 0.0) {
+            continue;
+        }
+        v = (double*) malloc(sizeof(double) * (n - c - 1));
+        v[0] = 1.0;
+        for (size_t r = c + 2; r < n; r++) {
+            v[r - c - 1] = A->vals[r][c];
+        }
+
+        //From the right, on all rows.
+#       pragma omp parallel for num_threads(2) if(n > 256)
+        for (size_t r = 0; r < n; r++) {
+            double* a = A->vals[r] + c + 1;
+            double s = 0.0;
+            for (size_t q = 0; q < n - c - 1; q++) {
+                s += a[q] * v[q];
+            }
+            s *= t;
+            for (size_t q = 0; q < n - c - 1; q++) {
+                a[q] -= s * v[q];
+            }
+        }
+
+        //From the left.
+        w = (double*) calloc(n, sizeof(double));
+        for (size_t r = c + 1; r < n; r++) {
+            for (size_t q = c + 1; q < n; q++) {
+                w[q] += v[r - c - 1] * A->vals[r][q];
+            }
+        }
+        for (size_t r = c + 1; r < n; r++) {
+            double tv = t * v[r - c - 1];
+            for (size_t q = c + 1; q < n; q++) {
+                A->vals[r][q] -= tv * w[q];
+            }
+        }
+        free(v);
+        free(w);
+    }
+
+    //Form Q = H(0) H(1) ... H(n-2) a block at a time, from the last block back.
+    if (Q != NULL) {
+        for (size_t i = 0; i < n; i++) {
+            memset(Q->vals[i], 0, sizeof(double) * n);
+            Q->vals[i][i] = 1.0;
+        }
+        for (size_t j0 = (n < 2) ? 0 : ((n - 2) / NB) * NB; n > 2; j0 -= NB) {
+            size_t kb = (n - 2 - j0 < NB) ? n - 2 - j0 : NB, m = n - j0 - 1; /* The block size and length of the reflectors */
+            Matrix* V = new_Matrix(m, kb);
+            Matrix* T = new_Matrix(kb, kb);
+            Matrix C = {m, m, vrows}; /* Q(j0+1:n, j0+1:n) */
+
+            for (size_t j = 0; j < kb; j++) {
+                V->vals[j][j] = 1.0;
+                for (size_t r = j + 1; r < m; r++) {
+                    V->vals[r][j] = A->vals[j0 + 1 + r][j0 + j];
+                }
+                reflector_triangle_column(V, tau + j0, T, j);
+            }
+            for (size_t r = 0; r < m; r++) {
+                vrows[r] = Q->vals[j0 + 1 + r] + j0 + 1;
+            }
+            if (kb > 0) {
+                block_reflector_left(V, T, false, &C);
+            }
+            delete_Matrix(V);
+            delete_Matrix(T);
+            if (j0 == 0) {
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 2; i < n; i++) {
+        memset(A->vals[i], 0, sizeof(double) * (i - 1));
+    }
+    free(tau);
+    free(rows);
+    free(vrows);
+    return 0;
+}
+
+/**
+ * @brief Puts a 2 by 2 block into standard Schur form (LAPACK's xLANV2)
+ *
+ * On return either c = 0 and the eigenvalues a and d are real, or a = d and
+ * b c < 0, giving the complex pair a +- i sqrt(-b c). The rotation [cs sn;
+ * -sn cs] applied to the rows (and its transpose to the columns) of the
+ * original block produces the new one.
+ *
+ * @param a, b, c, d the block [a b; c d], updated in place
+ * @param rt1r, rt1i, rt2r, rt2i receive the eigenvalues, the one with the
+ *        positive imaginary part first
+ * @param cs, sn receive the rotation
+ */
+static void schur_2x2(double* a, double* b, double* c, double* d, double* rt1r, double* rt1i,
+                      double* rt2r, double* rt2i, double* cs, double* sn) {
+    const double MULTPL = 4.0;
+
+    if (*c == 0.0) {
+        *cs = 1.0;
+        *sn = 0.0;
+    }
+    else if (*b == 0.0) {
+        //Swap the rows and columns.
+        double t = *d;
+        *cs = 0.0;
+        *sn = 1.0;
+        *d = *a;
+        *a = t;
+        *b = -*c;
+        *c = 0.0;
+    }
+    else if (*a - *d == 0.0 && (*b > 0.0) != (*c > 0.0)) {
+        *cs = 1.0;
+        *sn = 0.0;
+    }
+    else {
+        double temp = *a - *d, p = 0.5 * temp;
+        double bcmax = fmax(fabs(*b), fabs(*c));
+        double bcmis = fmin(fabs(*b), fabs(*c)) * copysign(1.0, *b) * copysign(1.0, *c);
+        double scale = fmax(fabs(p), bcmax);
+        double z = (p / scale) * p + (bcmax / scale) * bcmis;
+
+        if (z >= MULTPL * DBL_EPSILON) {
+            //Real eigenvalues: make the block upper triangular.
+            double tau;
+            z = p + copysign(sqrt(scale) * sqrt(z), p);
+            *a = *d + z;
+            *d -= (bcmax / z) * bcmis;
+            tau = hypot(*c, z);
+            *cs = z / tau;
+            *sn = *c / tau;
+            *b -= *c;
+            *c = 0.0;
+        }
+        else {
+            //Complex or nearly equal real eigenvalues: make the diagonal equal.
+            double sigma = *b + *c, tau = hypot(sigma, temp);
+            double aa, bb, cc, dd;
+
+            *cs = sqrt(0.5 * (1.0 + fabs(sigma) / tau));
+            *sn = -(p / (tau * *cs)) * copysign(1.0, sigma);
+            aa = *a * *cs + *b * *sn;
+            bb = -*a * *sn + *b * *cs;
+            cc = *c * *cs + *d * *sn;
+            dd = -*c * *sn + *d * *cs;
+            *a = aa * *cs + cc * *sn;
+            *b = bb * *cs + dd * *sn;
+            *c = -aa * *sn + cc * *cs;
+            *d = -bb * *sn + dd * *cs;
+            temp = 0.5 * (*a + *d);
+            *a = temp;
+            *d = temp;
+            if (*c != 0.0) {
+                if (*b != 0.0) {
+                    if ((*b > 0.0) == (*c > 0.0)) {
+                        //Real eigenvalues after all.
+                        double sab = sqrt(fabs(*b)), sac = sqrt(fabs(*c));
+                        double cs1, sn1;
+                        p = copysign(sab * sac, *c);
+                        tau = 1.0 / sqrt(fabs(*b + *c));
+                        *a = temp + p;
+                        *d = temp - p;
+                        *b -= *c;
+                        *c = 0.0;
+                        cs1 = sab * tau;
+                        sn1 = sac * tau;
+                        temp = *cs * cs1 - *sn * sn1;
+                        *sn = *cs * sn1 + *sn * cs1;
+                        *cs = temp;
+                    }
+                }
+                else {
+                    *b = -*c;
+                    *c = 0.0;
+                    temp = *cs;
+                    *cs = -*sn;
+                    *sn = temp;
+                }
+            }
+        }
+    }
+
+    *rt1r = *a;
+    *rt2r = *d;
+    if (*c == 0.0) {
+        *rt1i = 0.0;
+        *rt2i = 0.0;
+    }
+    else {
+        *rt1i = sqrt(fabs(*b)) * sqrt(fabs(*c));
+        *rt2i = -*rt1i;
+    }
+}
+
+/**
+ * @brief Generates a Householder reflector for a short vector
+ *
+ * @param x n values; on return x[0] is beta and x[1..n-1] the tail of v
+ * @param n the length, 2 or 3
+ * @return double tau, 0 if x is already a multiple of e1
+ */
+static double householder_vector(double* x, size_t n) {
+    double xnorm = (n == 3) ? hypot(x[1], x[2]) : fabs(x[1]), beta;
+
+    if (xnorm == 0.0) {
+        return 0.0;
+    }
+    beta = (x[0] >= 0.0) ? -hypot(x[0], xnorm) : hypot(x[0], xnorm);
+    for (size_t i = 1; i < n; i++) {
+        x[i] /= x[0] - beta;
+    }
+    xnorm = (beta - x[0]) / beta;
+    x[0] = beta;
+    return xnorm;
+}
+
+/**
+ * @brief Applies one implicit double-shift QR sweep to H(l:i+1, l:i+1)
+ *
+ * The bulge made by the shifts (sr1 + i si1, sr2 + i si2), a real pair or a
+ * complex conjugate pair, is started at the lowest row m at which it can be
+ * (where two consecutive subdiagonal entries are small enough) and chased to
+ * the bottom with 3 by 3 reflectors.
+ *
+ * @param H the Hessenberg matrix
+ * @param Z the accumulated transformations, or NULL
+ * @param l the first row of the active block
+ * @param i the last row of the active block, at least l+2
+ * @param sr1, si1, sr2, si2 the shifts
+ * @param wantt whether to update all of H, which is needed for the Schur form
+ */
+static void francis_sweep(Matrix* H, Matrix* Z, size_t l, size_t i, double sr1, double si1,
+                          double sr2, double si2, bool wantt) {
+    size_t n = H->nrows, m; /* The size and the row the bulge starts at */
+    size_t i1 = wantt ? 0 : l, i2 = wantt ? n - 1 : i; /* The rows and columns to update */
+    double** h = H->vals;
+    double v[3];
+
+    //Look for two consecutive small subdiagonal entries.
+    for (m = i - 2; ; m--) {
+        double h21s = h[m + 1][m], s = fabs(h[m][m] - sr2) + fabs(si2) + fabs(h21s);
+        h21s = h[m + 1][m] / s;
+        v[0] = h21s * h[m][m + 1] + (h[m][m] - sr1) * ((h[m][m] - sr2) / s) - si1 * (si2 / s);
+        v[1] = h21s * (h[m][m] + h[m + 1][m + 1] - sr1 - sr2);
+        v[2] = h21s * h[m + 2][m + 1];
+        s = fabs(v[0]) + fabs(v[1]) + fabs(v[2]);
+        v[0] /= s;
+        v[1] /= s;
+        v[2] /= s;
+        if (m == l) {
+            break;
+        }
+        if (fabs(h[m][m - 1]) * (fabs(v[1]) + fabs(v[2])) <=
+            DBL_EPSILON * fabs(v[0]) * (fabs(h[m - 1][m - 1]) + fabs(h[m][m]) + fabs(h[m + 1][m + 1]))) {
+            break;
+        }
+    }
+
+    //Chase the bulge.
+    for (size_t k = m; k < i; k++) {
+        size_t nr = (i - k + 1 < 3) ? i - k + 1 : 3, jmax = (k + 3 < i) ? k + 3 : i;
+        double t1, t2, t3, v2, v3;
+
+        if (k > m) {
+            for (size_t r = 0; r < nr; r++) {
+                v[r] = h[k + r][k - 1];
+            }
+        }
+        t1 = householder_vector(v, nr);
+        if (k > m) {
+            h[k][k - 1] = v[0];
+            h[k + 1][k - 1] = 0.0;
+            if (k + 1 < i) {
+                h[k + 2][k - 1] = 0.0;
+            }
+        }
+        else if (m > l) {
+            h[k][k - 1] *= 1.0 - t1;
+        }
+        v2 = v[1];
+        t2 = t1 * v2;
+        if (nr == 3) {
+            v3 = v[2];
+            t3 = t1 * v3;
+            for (size_t j = k; j <= i2; j++) {
+                double s = h[k][j] + v2 * h[k + 1][j] + v3 * h[k + 2][j];
+                h[k][j] -= s * t1;
+                h[k + 1][j] -= s * t2;
+                h[k + 2][j] -= s * t3;
+            }
+            for (size_t j = i1; j <= jmax; j++) {
+                double s = h[j][k] + v2 * h[j][k + 1] + v3 * h[j][k + 2];
+                h[j][k] -= s * t1;
+                h[j][k + 1] -= s * t2;
+                h[j][k + 2] -= s * t3;
+            }
+            for (size_t j = 0; Z != NULL && j < Z->nrows; j++) {
+                double* z = Z->vals[j];
+                double s = z[k] + v2 * z[k + 1] + v3 * z[k + 2];
+                z[k] -= s * t1;
+                z[k + 1] -= s * t2;
+                z[k + 2] -= s * t3;
+            }
+        }
+        else {
+            for (size_t j = k; j <= i2; j++) {
+                double s = h[k][j] + v2 * h[k + 1][j];
+                h[k][j] -= s * t1;
+                h[k + 1][j] -= s * t2;
+            }
+            for (size_t j = i1; j <= i; j++) {
+                double s = h[j][k] + v2 * h[j][k + 1];
+                h[j][k] -= s * t1;
+                h[j][k + 1] -= s * t2;
+            }
+            for (size_t j = 0; Z != NULL && j < Z->nrows; j++) {
+                double* z = Z->vals[j];
+                double s = z[k] + v2 * z[k + 1];
+                z[k] -= s * t1;
+                z[k + 1] -= s * t2;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Finishes a converged 1 by 1 or 2 by 2 block at rows l to i
+ *
+ * A 2 by 2 block is put into standard form, the rotation being applied to
+ * the rest of H and to Z as needed.
+ */
+static void schur_deflate(Matrix* H, Matrix* Z, size_t l, size_t i, double* wr, double* wi, bool wantt) {
+    double** h = H->vals;
+    double cs, sn;
+
+    if (l == i) {
+        wr[i] = h[i][i];
+        wi[i] = 0.0;
+        return;
+    }
+    schur_2x2(&h[l][l], &h[l][i], &h[i][l], &h[i][i], &wr[l], &wi[l], &wr[i], &wi[i], &cs, &sn);
+    if (wantt) {
+        for (size_t j = i + 1; j < H->ncols; j++) {
+            double x = h[l][j], y = h[i][j];
+            h[l][j] = cs * x + sn * y;
+            h[i][j] = cs * y - sn * x;
+        }
+        for (size_t j = 0; j < l; j++) {
+            double x = h[j][l], y = h[j][i];
+            h[j][l] = cs * x + sn * y;
+            h[j][i] = cs * y - sn * x;
+        }
+    }
+    for (size_t j = 0; Z != NULL && j < Z->nrows; j++) {
+        double x = Z->vals[j][l], y = Z->vals[j][i];
+        Z->vals[j][l] = cs * x + sn * y;
+        Z->vals[j][i] = cs * y - sn * x;
+    }
+}
+
+/**
+ * @brief Checks whether the subdiagonal entry H(k, k-1) is negligible
+ *
+ * This is the test of Ahues and Tisseur used by LAPACK's xLAHQR, which can
+ * deflate more than comparing with the neighboring diagonal alone.
+ */
+static bool schur_negligible(Matrix* H, size_t k, size_t ilo, size_t ihi, double smlnum) {
+    double** h = H->vals;
+    double hk = fabs(h[k][k - 1]), tst, ab, ba, aa, bb, s;
+
+    if (hk <= smlnum) {
+        return true;
+    }
+    tst = fabs(h[k - 1][k - 1]) + fabs(h[k][k]);
+    if (tst == 0.0) {
+        if (k >= ilo + 2) {
+            tst += fabs(h[k - 1][k - 2]);
+        }
+        if (k + 1 <= ihi) {
+            tst += fabs(h[k + 1][k]);
+        }
+    }
+    if (hk > DBL_EPSILON * tst) {
+        return false;
+    }
+    ab = fmax(hk, fabs(h[k - 1][k]));
+    ba = fmin(hk, fabs(h[k - 1][k]));
+    aa = fmax(fabs(h[k][k]), fabs(h[k - 1][k - 1] - h[k][k]));
+    bb = fmin(fabs(h[k][k]), fabs(h[k - 1][k - 1] - h[k][k]));
+    s = aa + ab;
+    return ba * (ab / s) <= fmax(smlnum, DBL_EPSILON * (bb * (aa / s)));
+}
+
+/**
+ * @brief The double-shift QR algorithm for small Hessenberg matrices (LAPACK's xLAHQR)
+ *
+ * Computes the eigenvalues of H(ilo:ihi+1, ilo:ihi+1), which must already be
+ * split from the rest of H, and its Schur form if wantt is set. Each sweep
+ * uses the eigenvalues of the trailing 2 by 2 block as shifts, with
+ * exceptional shifts every 10 sweeps without a deflation.
+ *
+ * @return 0 if the iteration converged, otherwise 1
+ */
+static int schur_small(Matrix* H, Matrix* Z, size_t ilo, size_t ihi, double* wr, double* wi, bool wantt) {
+    const size_t KEXSH = 10; /* Sweeps between exceptional shifts */
+    const double DAT1 = 0.75, DAT2 = -0.4375; /* The exceptional shifts' weights */
+    size_t nh = ihi - ilo + 1, itmax = 30 * ((nh > 10) ? nh : 10), kdefl = 0;
+    size_t end = ihi + 1; /* One past the last row not yet deflated */
+    double smlnum = DBL_MIN * ((double) nh / DBL_EPSILON);
+    double** h = H->vals;
+
+    for (size_t j = ilo; j + 3 <= ihi; j++) {
+        h[j + 2][j] = 0.0;
+        h[j + 3][j] = 0.0;
+    }
+    if (ilo + 2 <= ihi) {
+        h[ihi][ihi - 2] = 0.0;
+    }
+
+    while (end > ilo) {
+        size_t i = end - 1, l = ilo, its;
+
+        for (its = 0; its <= itmax; its++) {
+            size_t k;
+            double h11, h12, h21, h22, s, rt1r, rt1i, rt2r, rt2i;
+
+            //Look for a single small subdiagonal entry.
+            for (k = i; k > l && !schur_negligible(H, k, ilo, ihi, smlnum); k--);
+            l = k;
+            if (l > ilo) {
+                h[l][l - 1] = 0.0;
+            }
+            if (l + 1 >= i) {
+                break;
+            }
+            kdefl++;
+
+            //Choose the shifts.
+            if (kdefl % (2 * KEXSH) == 0) {
+                s = fabs(h[i][i - 1]) + fabs(h[i - 1][i - 2]);
+                h11 = DAT1 * s + h[i][i];
+                h12 = DAT2 * s;
+                h21 = s;
+                h22 = h11;
+            }
+            else if (kdefl % KEXSH == 0) {
+                s = fabs(h[l + 1][l]) + fabs(h[l + 2][l + 1]);
+                h11 = DAT1 * s + h[l][l];
+                h12 = DAT2 * s;
+                h21 = s;
+                h22 = h11;
+            }
+            else {
+                h11 = h[i - 1][i - 1];
+                h21 = h[i][i - 1];
+                h12 = h[i - 1][i];
+                h22 = h[i][i];
+            }
+            s = fabs(h11) + fabs(h12) + fabs(h21) + fabs(h22);
+            if (s == 0.0) {
+                rt1r = rt1i = rt2r = rt2i = 0.0;
+            }
+            else {
+                double tr, det, rtdisc;
+                h11 /= s;
+                h21 /= s;
+                h12 /= s;
+                h22 /= s;
+                tr = (h11 + h22) / 2.0;
+                det = (h11 - tr) * (h22 - tr) - h12 * h21;
+                rtdisc = sqrt(fabs(det));
+                if (det >= 0.0) {
+                    rt1r = rt2r = tr * s;
+                    rt1i = rtdisc * s;
+                    rt2i = -rt1i;
+                }
+                else {
+                    //Real shifts: use the one closer to h22 twice.
+                    rt1r = tr + rtdisc;
+                    rt2r = tr - rtdisc;
+                    rt1r = rt2r = (fabs(rt1r - h22) <= fabs(rt2r - h22)) ? rt1r * s : rt2r * s;
+                    rt1i = rt2i = 0.0;
+                }
+            }
+            francis_sweep(H, Z, l, i, rt1r, rt1i, rt2r, rt2i, wantt);
+        }
+        if (its > itmax) {
+            return 1;
+        }
+
+        schur_deflate(H, Z, l, i, wr, wi, wantt);
+        kdefl = 0;
+        end = l;
+    }
+    return 0;
+}
+
+/**
+ * @brief Aggressive early deflation on the trailing window of H(ktop:kbot+1, ktop:kbot+1)
+ *
+ * The nw by nw window at the bottom is reduced to Schur form by schur_small.
+ * Its similarity turns the single subdiagonal entry s above the window into
+ * the spike s V(0, :), and every eigenvalue at the bottom of the window
+ * whose spike entries are negligible is deflated at once, often long before
+ * its subdiagonal entry would have become small under QR sweeps. The rest of
+ * the window is returned to Hessenberg form with Matrix_hessenberg and the
+ * transformations are applied to the rest of H and to Z with Matrix_gemm.
+ *
+ * Unlike LAPACK's xLAQR3, the Schur form is not reordered to move an
+ * eigenvalue that fails the test out of the way, so deflation stops at the
+ * first one that does.
+ *
+ * @param sr, si receive the eigenvalues of the window; those left undeflated
+ *        (the first nsl) are the shifts for the next sweeps
+ * @param ndefl receives the number of eigenvalues deflated, whose values are
+ *        stored in wr and wi
+ * @param nsl receives the number left in the window
+ * @return 0 if the operation was successful, otherwise 1
+ */
+static int schur_aed(Matrix* H, Matrix* Z, size_t ktop, size_t kbot, size_t nw, double* wr, double* wi,
+                     bool wantt, double* sr, double* si, size_t* ndefl, size_t* nsl) {
+    size_t n = H->nrows, kwtop = kbot + 1 - nw, ns = nw; /* The size, the top of the window and the eigenvalues left */
+    double s = (kwtop > ktop) ? H->vals[kwtop][kwtop - 1] : 0.0; /* The subdiagonal entry above the window */
+    double smlnum = DBL_MIN * ((double) (kbot - ktop + 1) / DBL_EPSILON);
+    double spike; /* The entry left above the window */
+    double** rows = (double**) malloc(sizeof(double*) * (n + 1)); /* Row pointers for the updates */
+    Matrix* W = new_Matrix(nw, nw); /* The window */
+    Matrix* V = new_Matrix(nw, nw); /* Its transformations */
+
+    for (size_t i = 0; i < nw; i++) {
+        memcpy(W->vals[i], H->vals[kwtop + i] + kwtop, sizeof(double) * nw);
+        V->vals[i][i] = 1.0;
+    }
+    if (schur_small(W, V, 0, nw - 1, sr, si, true) != 0) {
+        delete_Matrix(W);
+        delete_Matrix(V);
+        free(rows);
+        return 1;
+    }
+
+    //Deflate from the bottom while the spike is negligible.
+    while (ns > 0) {
+        size_t k = (si[ns - 1] == 0.0) ? 1 : 2; /* The size of the bottom block */
+        double foo = fabs(W->vals[ns - 1][ns - 1]), big = fabs(s * V->vals[0][ns - 1]);
+        if (k == 2) {
+            foo += sqrt(fabs(W->vals[ns - 1][ns - 2])) * sqrt(fabs(W->vals[ns - 2][ns - 1]));
+            big = fmax(big, fabs(s * V->vals[0][ns - 2]));
+        }
+        if (foo == 0.0) {
+            foo = fabs(s);
+        }
+        if (big > fmax(smlnum, DBL_EPSILON * foo)) {
+            break;
+        }
+        ns -= k;
+    }
+    *ndefl = nw - ns;
+    *nsl = ns;
+    if (ns == nw && s != 0.0) {
+        //Nothing deflated; leave H as it was.
+        delete_Matrix(W);
+        delete_Matrix(V);
+        free(rows);
+        return 0;
+    }
+
+    //Return the rest of the window to Hessenberg form.
+    spike = (ns > 0) ? s * V->vals[0][0] : 0.0;
+    if (ns > 1) {
+        Matrix* S = new_Matrix(ns, 1); /* The spike */
+        Matrix* Hs = new_Matrix(ns, ns);
+        Matrix* Qs = new_Matrix(ns, ns);
+        Matrix* tmp = new_Matrix(nw, nw);
+        Matrix Wt = {ns, nw, W->vals}; /* W(0:ns, :) */
+        Matrix Tt = {ns, nw, tmp->vals};
+        Matrix Vl = {nw, ns, V->vals}; /* V(:, 0:ns) */
+        Matrix Tl = {nw, ns, tmp->vals};
+        double tau;
+
+        //A reflector takes the spike to a multiple of e1...
+        for (size_t i = 0; i < ns; i++) {
+            S->vals[i][0] = s * V->vals[0][i];
+        }
+        tau = householder_column(S, 0, 0);
+        spike = S->vals[0][0];
+        S->vals[0][0] = 1.0;
+        for (size_t j = 0; j < nw; j++) {
+            double d = 0.0;
+            for (size_t i = 0; i < ns; i++) {
+                d += S->vals[i][0] * W->vals[i][j];
+            }
+            for (size_t i = 0; i < ns; i++) {
+                W->vals[i][j] -= tau * S->vals[i][0] * d;
+            }
+        }
+        for (size_t i = 0; i < nw; i++) {
+            double* rowp = (i < ns) ? W->vals[i] : NULL;
+            double d = 0.0, e = 0.0;
+            for (size_t j = 0; j < ns; j++) {
+                d += V->vals[i][j] * S->vals[j][0];
+                e += (rowp != NULL) ? rowp[j] * S->vals[j][0] : 0.0;
+            }
+            for (size_t j = 0; j < ns; j++) {
+                V->vals[i][j] -= tau * d * S->vals[j][0];
+                if (rowp != NULL) {
+                    rowp[j] -= tau * e * S->vals[j][0];
+                }
+            }
+        }
+
+        //...which leaves W(0:ns, 0:ns) full, so it is reduced again.
+        for (size_t i = 0; i < ns; i++) {
+            memcpy(Hs->vals[i], W->vals[i], sizeof(double) * ns);
+        }
+        Matrix_hessenberg(Hs, Qs);
+        Matrix_gemm(1.0, Qs, true, &Wt, false, 0.0, &Tt);
+        for (size_t i = 0; i < ns; i++) {
+            memcpy(W->vals[i], Hs->vals[i], sizeof(double) * ns);
+            memcpy(W->vals[i] + ns, tmp->vals[i] + ns, sizeof(double) * (nw - ns));
+        }
+        Matrix_gemm(1.0, &Vl, false, Qs, false, 0.0, &Tl);
+        for (size_t i = 0; i < nw; i++) {
+            memcpy(V->vals[i], tmp->vals[i], sizeof(double) * ns);
+        }
+
+        delete_Matrix(S);
+        delete_Matrix(Hs);
+        delete_Matrix(Qs);
+        delete_Matrix(tmp);
+    }
+
+    //Put the window back and apply V to the rest of H and to Z.
+    for (size_t i = 0; i < nw; i++) {
+        memcpy(H->vals[kwtop + i] + kwtop, W->vals[i], sizeof(double) * nw);
+    }
+    if (kwtop > ktop) {
+        H->vals[kwtop][kwtop - 1] = spike;
+    }
+    for (size_t j = ns; j < nw; j++) {
+        wr[kwtop + j] = sr[j];
+        wi[kwtop + j] = si[j];
+    }
+    {
+        size_t r0 = wantt ? 0 : ktop; /* The first row above the window to update */
+
+        if (kwtop > r0) {
+            Matrix C = {kwtop - r0, nw, rows}; /* H(r0:kwtop, kwtop:kbot+1) */
+            Matrix* R = new_Matrix(kwtop - r0, nw);
+            for (size_t i = r0; i < kwtop; i++) {
+                rows[i - r0] = H->vals[i] + kwtop;
+            }
+            Matrix_gemm(1.0, &C, false, V, false, 0.0, R);
+            for (size_t i = r0; i < kwtop; i++) {
+                memcpy(rows[i - r0], R->vals[i - r0], sizeof(double) * nw);
+            }
+            delete_Matrix(R);
+        }
+        if (wantt && kbot + 1 < n) {
+            Matrix C = {nw, n - kbot - 1, rows}; /* H(kwtop:kbot+1, kbot+1:n) */
+            Matrix* R = new_Matrix(nw, n - kbot - 1);
+            for (size_t i = 0; i < nw; i++) {
+                rows[i] = H->vals[kwtop + i] + kbot + 1;
+            }
+            Matrix_gemm(1.0, V, true, &C, false, 0.0, R);
+            for (size_t i = 0; i < nw; i++) {
+                memcpy(rows[i], R->vals[i], sizeof(double) * (n - kbot - 1));
+            }
+            delete_Matrix(R);
+        }
+        if (Z != NULL) {
+            Matrix C = {Z->nrows, nw, rows}; /* Z(:, kwtop:kbot+1) */
+            Matrix* R = new_Matrix(Z->nrows, nw);
+            for (size_t i = 0; i < Z->nrows; i++) {
+                rows[i] = Z->vals[i] + kwtop;
+            }
+            Matrix_gemm(1.0, &C, false, V, false, 0.0, R);
+            for (size_t i = 0; i < Z->nrows; i++) {
+                memcpy(rows[i], R->vals[i], sizeof(double) * nw);
+            }
+            delete_Matrix(R);
+        }
+    }
+
+    delete_Matrix(W);
+    delete_Matrix(V);
+    free(rows);
+    return 0;
+}
+
+/**
+ * @brief Computes the eigenvalues, and optionally the Schur form, of a Hessenberg matrix
+ *
+ * This follows LAPACK's xLAQR0. Small matrices, and blocks that split off
+ * small, go to schur_small. Otherwise each iteration first tries aggressive
+ * early deflation on a window at the bottom of the active block, and unless
+ * that deflated enough to be worth trying again straight away, the
+ * eigenvalues left in the window are used as shifts for a run of
+ * double-shift sweeps. The shifts are chased one pair per sweep rather than
+ * as a chain of bulges, but each run of sweeps uses the many shifts the
+ * window provides, which with the deflation brings the number of sweeps far
+ * below that of schur_small.
+ *
+ * @param H the Hessenberg matrix, overwritten by the Schur form if wantt is set
+ * @param Z the transformations are accumulated into Z unless it is NULL
+ * @param wr, wi receive the eigenvalues
+ * @param wantt whether the Schur form is wanted
+ * @return 0 if the iteration converged, otherwise 1
+ */
+static int schur_qr(Matrix* H, Matrix* Z, double* wr, double* wi, bool wantt) {
+    const size_t NMIN = 75; /* Smaller blocks go to schur_small */
+    const size_t NIBBLE = 14; /* Percentage of the window deflated to skip the sweeps */
+    const size_t KEXSH = 6; /* Iterations without deflation between exceptional shifts */
+    size_t n = H->nrows, end = n, kdefl = 0; /* The size, one past the active block and iterations since a deflation */
+    size_t itmax = 30 * ((n > 10) ? n : 10), its = 0;
+    double smlnum = DBL_MIN * ((double) n / DBL_EPSILON);
+    double* sr, * si; /* The eigenvalues of the window */
+    double* pr, * pi; /* The shifts, in pairs */
+    double** h = H->vals;
+    int status = 0;
+
+    if (n < NMIN) {
+        return schur_small(H, Z, 0, n - 1, wr, wi, wantt);
+    }
+    sr = (double*) malloc(sizeof(double) * n);
+    si = (double*) malloc(sizeof(double) * n);
+    pr = (double*) malloc(sizeof(double) * n);
+    pi = (double*) malloc(sizeof(double) * n);
+
+    while (end > 0 && status == 0) {
+        size_t kbot = end - 1, ktop, nh, ns, nw, ndefl, nsl, npairs = 0;
+
+        //Split off the active block.
+        for (ktop = kbot; ktop > 0 && !schur_negligible(H, ktop, 0, n - 1, smlnum); ktop--);
+        if (ktop > 0) {
+            h[ktop][ktop - 1] = 0.0;
+        }
+        nh = kbot - ktop + 1;
+        if (nh < NMIN) {
+            status = schur_small(H, Z, ktop, kbot, wr, wi, wantt);
+            end = ktop;
+            kdefl = 0;
+            continue;
+        }
+        if (++its > itmax) {
+            status = 1;
+            break;
+        }
+
+        //The number of shifts and window size of LAPACK's xIPARMQ.
+        if (nh < 150) {
+            ns = 10;
+        }
+        else if (nh < 590) {
+            ns = nh / (size_t) round(log2((double) nh));
+        }
+        else if (nh < 3000) {
+            ns = 64;
+        }
+        else if (nh < 6000) {
+            ns = 128;
+        }
+        else {
+            ns = 256;
+        }
+        ns -= ns % 2;
+        nw = (nh <= 500) ? ns : 3 * ns / 2;
+
+        if (schur_aed(H, Z, ktop, kbot, nw, wr, wi, wantt, sr, si, &ndefl, &nsl) != 0) {
+            status = schur_small(H, Z, ktop, kbot, wr, wi, wantt);
+            end = ktop;
+            continue;
+        }
+        end -= ndefl;
+        kdefl = (ndefl > 0) ? 0 : kdefl + 1;
+        if ((ndefl > 0 && 100 * ndefl > NIBBLE * nw) || end - ktop < NMIN) {
+            continue;
+        }
+
+        //Pair up the shifts from the bottom of the window.
+        if (kdefl > 0 && kdefl % KEXSH == 0) {
+            double ss = fabs(h[end - 1][end - 2]) + fabs(h[end - 2][end - 3]);
+            double aa = 0.75 * ss + h[end - 1][end - 1], bb = ss, cc = -0.4375 * ss, dd = aa, cs, sn;
+            schur_2x2(&aa, &bb, &cc, &dd, &pr[0], &pi[0], &pr[1], &pi[1], &cs, &sn);
+            npairs = 1;
+        }
+        for (size_t j = nsl; j > 0 && 2 * npairs < ns; npairs++) {
+            if (si[j - 1] != 0.0) {
+                //A complex conjugate pair.
+                pr[2 * npairs] = pr[2 * npairs + 1] = sr[j - 1];
+                pi[2 * npairs] = si[j - 2];
+                pi[2 * npairs + 1] = si[j - 1];
+                j -= 2;
+            }
+            else if (j == 1 || si[j - 2] != 0.0) {
+                //A real shift with no real one above it, used twice.
+                pr[2 * npairs] = pr[2 * npairs + 1] = sr[j - 1];
+                pi[2 * npairs] = pi[2 * npairs + 1] = 0.0;
+                j--;
+            }
+            else {
+                pr[2 * npairs] = sr[j - 1];
+                pr[2 * npairs + 1] = sr[j - 2];
+                pi[2 * npairs] = pi[2 * npairs + 1] = 0.0;
+                j -= 2;
+            }
+        }
+        for (size_t p = 0; p < npairs; p++) {
+            francis_sweep(H, Z, ktop, end - 1, pr[2 * p], pi[2 * p], pr[2 * p + 1], pi[2 * p + 1], wantt);
+        }
+    }
+
+    free(sr);
+    free(si);
+    free(pr);
+    free(pi);
+    return status;
+}
+
+/**
+ * @brief Divides complex numbers, (cr + i ci) = (ar + i ai) / (br + i bi), by Smith's method
+ */
+static void complex_div(double ar, double ai, double br, double bi, double* cr, double* ci) {
+    if (fabs(br) >= fabs(bi)) {
+        double r = bi / br, d = br + bi * r;
+        *cr = (ar + ai * r) / d;
+        *ci = (ai - ar * r) / d;
+    }
+    else {
+        double r = br / bi, d = bi + br * r;
+        *cr = (ar * r + ai) / d;
+        *ci = (ai * r - ar) / d;
+    }
+}
+
+/**
+ * @brief Scales a vector down when one of its entries has grown past 1e100
+ *
+ * Back-substitution with a (nearly) singular T - lambda I can grow by up to
+ * 1 / smin per step, which would soon overflow for a defective eigenvalue.
+ * Only the direction matters, so the vector is scaled to keep it finite.
+ */
+static void schur_rescale(double* xr, double* xi, size_t n, double big) {
+    if (big <= 1e100) {
+        return;
+    }
+    for (size_t k = 0; k < n; k++) {
+        xr[k] /= big;
+        xi[k] /= big;
+    }
+}
+
+/**
+ * @brief Computes the eigenvectors of a matrix in Schur form (LAPACK's xTREVC)
+ *
+ * Each eigenvector is found by back-substitution with T - lambda I, using
+ * complex arithmetic for complex lambda, and with the divisors kept from
+ * going below a small multiple of |lambda| when eigenvalues are (nearly)
+ * repeated, and the vector rescaled as it grows (see schur_rescale). For a
+ * complex pair with wi[j] > 0, columns j and j+1 of X receive the real and
+ * imaginary parts of the eigenvector of wr[j] + i wi[j].
+ *
+ * @param T the quasi-triangular Schur form, with standard 2 by 2 blocks
+ * @param wr, wi its eigenvalues
+ * @param X a matrix of zeros as large as T, which receives the eigenvectors
+ */
+static void schur_vectors(Matrix* T, double* wr, double* wi, Matrix* X) {
+    size_t n = T->nrows;
+    double smlnum = DBL_MIN * ((double) n / DBL_EPSILON);
+    double* xr = (double*) malloc(sizeof(double) * n); /* The eigenvector's real part */
+    double* xi = (double*) malloc(sizeof(double) * n); /* And its imaginary part */
+    double** t = T->vals;
+
+    for (size_t ki = n; ki-- > 0; ) {
+        size_t top; /* The rows above the eigenvalue's block */
+        double lr, li, smin;
+
+        memset(xr, 0, sizeof(double) * n);
+        memset(xi, 0, sizeof(double) * n);
+        if (wi[ki] == 0.0) {
+            lr = wr[ki];
+            li = 0.0;
+            top = ki;
+            xr[ki] = 1.0;
+            for (size_t k = 0; k < ki; k++) {
+                xr[k] = -t[k][ki];
+            }
+        }
+        else {
+            //The 2 by 2 block [a b; c a] has the eigenvector (1, i wi / b) or (-wi / c, i).
+            lr = wr[ki - 1];
+            li = wi[ki - 1];
+            top = ki - 1;
+            if (fabs(t[ki - 1][ki]) >= fabs(t[ki][ki - 1])) {
+                xr[ki - 1] = 1.0;
+                xi[ki] = li / t[ki - 1][ki];
+            }
+            else {
+                xr[ki - 1] = -li / t[ki][ki - 1];
+                xi[ki] = 1.0;
+            }
+            for (size_t k = 0; k < ki - 1; k++) {
+                xr[k] = -xr[ki - 1] * t[k][ki - 1];
+                xi[k] = -xi[ki] * t[k][ki];
+            }
+        }
+        smin = fmax(DBL_EPSILON * (fabs(lr) + fabs(li)), smlnum);
+
+        //Back-substitute with T(0:top, 0:top) - lambda I.
+        for (size_t k = top; k-- > 0; ) {
+            if (k > 0 && wi[k] < 0.0) {
+                //A 2 by 2 block in rows k-1 and k, solved by Cramer's rule.
+                double a11r = t[k - 1][k - 1] - lr, a22r = t[k][k] - lr, a12 = t[k - 1][k], a21 = t[k][k - 1];
+                double detr = a11r * a22r - li * li - a12 * a21, deti = -li * (a11r + a22r);
+                double scale = fmax(fmax(fabs(a11r), fabs(a22r)) + fabs(li), fmax(fabs(a12), fabs(a21)));
+                double r1r, r1i, r2r, r2i;
+                if (hypot(detr, deti) < smin * scale) {
+                    detr = smin * scale;
+                    deti = 0.0;
+                }
+                r1r = a22r * xr[k - 1] + li * xi[k - 1] - a12 * xr[k];
+                r1i = a22r * xi[k - 1] - li * xr[k - 1] - a12 * xi[k];
+                r2r = a11r * xr[k] + li * xi[k] - a21 * xr[k - 1];
+                r2i = a11r * xi[k] - li * xr[k] - a21 * xi[k - 1];
+                complex_div(r1r, r1i, detr, deti, &xr[k - 1], &xi[k - 1]);
+                complex_div(r2r, r2i, detr, deti, &xr[k], &xi[k]);
+                schur_rescale(xr, xi, top + 1, fmax(fabs(xr[k - 1]) + fabs(xi[k - 1]), fabs(xr[k]) + fabs(xi[k])));
+                for (size_t j = 0; j + 1 < k; j++) {
+                    xr[j] -= t[j][k - 1] * xr[k - 1] + t[j][k] * xr[k];
+                    xi[j] -= t[j][k - 1] * xi[k - 1] + t[j][k] * xi[k];
+                }
+                k--;
+            }
+            else {
+                double dr = t[k][k] - lr, di = -li;
+                if (fabs(dr) + fabs(di) < smin) {
+                    dr = smin;
+                    di = 0.0;
+                }
+                complex_div(xr[k], xi[k], dr, di, &xr[k], &xi[k]);
+                schur_rescale(xr, xi, top + 1, fabs(xr[k]) + fabs(xi[k]));
+                for (size_t j = 0; j < k; j++) {
+                    xr[j] -= t[j][k] * xr[k];
+                    xi[j] -= t[j][k] * xi[k];
+                }
+            }
+        }
+
+        if (li == 0.0) {
+            for (size_t k = 0; k <= ki; k++) {
+                X->vals[k][ki] = xr[k];
+            }
+        }
+        else {
+            for (size_t k = 0; k <= ki; k++) {
+                X->vals[k][ki - 1] = xr[k];
+                X->vals[k][ki] = xi[k];
+            }
+            ki--;
+        }
+    }
+
+    free(xr);
+    free(xi);
+}
+
+/**
+ * @brief Computes the eigenvalues of a general square matrix, and optionally
+ *        its real Schur form and eigenvectors
+ *
+ * A is reduced to Hessenberg form by Matrix_hessenberg and then to the real
+ * Schur form A = Z T Z^T by the QR algorithm with aggressive early deflation
+ * (see schur_qr). T is upper quasi-triangular: its 2 by 2 diagonal blocks
+ * hold the complex conjugate pairs, in the standard form [a b; c a] with
+ * b c < 0. The eigenvectors are found from T by back-substitution and
+ * transformed back with Z.
+ *
+ * The eigenvalues are stored in the order they appear on the diagonal of T,
+ * each complex pair as consecutive entries with the positive imaginary part
+ * first. For a real eigenvalue wr[j], column j of V is its eigenvector; for a
+ * pair wr[j] +- i wi[j], columns j and j+1 of V are the real and imaginary
+ * parts of the eigenvector of wr[j] + i wi[j], whose conjugate is the
+ * eigenvector of wr[j] - i wi[j]. Each eigenvector is scaled to have a
+ * Euclidean norm of 1.
+ *
+ * @param A the square matrix, which is not modified
+ * @param wr receives the real parts of the A.nrows eigenvalues
+ * @param wi receives their imaginary parts
+ * @param T receives the Schur form unless it is NULL
+ * @param Z receives the Schur vectors unless it is NULL
+ * @param V receives the eigenvectors unless it is NULL
+ * @return 0 if the operation was successful, otherwise 1 (including when the
+ *         QR algorithm fails to converge)
+ */
+int Matrix_eig(Matrix* A, double* wr, double* wi, Matrix* T, Matrix* Z, Matrix* V) {
+    Matrix* outs[3] = {T, Z, V};
+    Matrix* H, * Q; /* The Hessenberg matrix and the transformations */
+    size_t n;
+    bool wantt = (T != NULL || Z != NULL || V != NULL);
+    int status;
+
+    //If the arguments are invalid, return 1.
+    if (A == NULL || A->vals == NULL || A->nrows != A->ncols || wr == NULL || wi == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < 3; i++) {
+        if (outs[i] != NULL && (outs[i]->vals == NULL || outs[i]->nrows != A->nrows || outs[i]->ncols != A->ncols)) {
+            return 1;
+        }
+    }
+
+    n = A->nrows;
+    H = new_Matrix(n, n);
+    for (size_t i = 0; i < n; i++) {
+        memcpy(H->vals[i], A->vals[i], sizeof(double) * n);
+    }
+    Q = (Z != NULL) ? Z : ((V != NULL) ? new_Matrix(n, n) : NULL);
+    Matrix_hessenberg(H, Q);
+    status = schur_qr(H, Q, wr, wi, wantt);
+
+    if (status == 0 && wantt) {
+        for (size_t i = 2; i < n; i++) {
+            memset(H->vals[i], 0, sizeof(double) * (i - 1));
+        }
+        for (size_t i = 0; i + 1 < n; i++) {
+            if (wi[i] <= 0.0) {
+                H->vals[i + 1][i] = 0.0;
+            }
+        }
+        for (size_t i = 0; T != NULL && i < n; i++) {
+            memcpy(T->vals[i], H->vals[i], sizeof(double) * n);
+        }
+    }
+    if (status == 0 && V != NULL) {
+        Matrix* X = new_Matrix(n, n); /* The eigenvectors of H */
+        double* norm = (double*) calloc(n, sizeof(double));
+
+        schur_vectors(H, wr, wi, X);
+        Matrix_gemm(1.0, Q, false, X, false, 0.0, V);
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < n; j++) {
+                norm[j] += V->vals[i][j] * V->vals[i][j];
+            }
+        }
+        for (size_t j = 0; j < n; j++) {
+            if (wi[j] > 0.0) {
+                norm[j] = norm[j + 1] = norm[j] + norm[j + 1];
+                j++;
+            }
+        }
+        for (size_t j = 0; j < n; j++) {
+            norm[j] = (norm[j] > 0.0) ? 1.0 / sqrt(norm[j]) : 1.0;
+        }
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < n; j++) {
+                V->vals[i][j] *= norm[j];
+            }
+        }
+        delete_Matrix(X);
+        free(norm);
+    }
+
+    delete_Matrix(H);
+    if (Q != Z) {
+        delete_Matrix(Q);
+    }
+    return status;
+}
+
+/**
+ * @brief Solves a small system M x = b in place by Gaussian elimination with partial pivoting
+ *
+ * Pivots smaller than smin are replaced by smin, so a (nearly) singular
+ * system still gets a solution, as in LAPACK's xLASY2.
+ *
+ * @param M the n by n matrix, stored by rows, which is destroyed
+ * @param b the right-hand side, overwritten by x
+ * @param n the size, at most 4
+ * @param smin the smallest pivot allowed
+ */
+static void sylvester_small_solve(double* M, double* b, size_t n, double smin) {
+    for (size_t k = 0; k < n; k++) {
+        size_t p = k;
+        for (size_t i = k + 1; i < n; i++) {
+            if (fabs(M[i * n + k]) > fabs(M[p * n + k])) {
+                p = i;
+            }
+        }
+        if (p != k) {
+            double t = b[p];
+            b[p] = b[k];
+            b[k] = t;
+            for (size_t j = 0; j < n; j++) {
+                t = M[p * n + j];
+                M[p * n + j] = M[k * n + j];
+                M[k * n + j] = t;
+            }
+        }
+        if (fabs(M[k * n + k]) < smin) {
+            M[k * n + k] = smin;
+        }
+        for (size_t i = k + 1; i < n; i++) {
+            double f = M[i * n + k] / M[k * n + k];
+            for (size_t j = k; j < n; j++) {
+                M[i * n + j] -= f * M[k * n + j];
+            }
+            b[i] -= f * b[k];
+        }
+    }
+    for (size_t k = n; k-- > 0; ) {
+        for (size_t j = k + 1; j < n; j++) {
+            b[k] -= M[k * n + j] * b[j];
+        }
+        b[k] /= M[k * n + k];
+    }
+}
+
+/**
+ * @brief Solves R X + X S = F for small quasi-triangular R and S (LAPACK's xTRSYL)
+ *
+ * X is found one diagonal block of R and S at a time, the blocks of R from
+ * the bottom up and those of S from left to right, each a system of at most
+ * 4 unknowns.
+ *
+ * @param R the m by m upper quasi-triangular matrix
+ * @param S the n by n upper quasi-triangular matrix
+ * @param F the m by n right-hand side, overwritten by X
+ * @param smin the smallest pivot allowed
+ */
+static void sylvester_base(Matrix* R, Matrix* S, Matrix* F, double smin) {
+    size_t m = R->nrows, n = S->nrows;
+    double** r = R->vals, ** s = S->vals, ** f = F->vals;
+
+    for (size_t l1 = 0; l1 < n; ) {
+        size_t dl = (l1 + 1 < n && s[l1 + 1][l1] != 0.0) ? 2 : 1; /* The size of this block of S */
+
+        for (size_t k2 = m; k2 > 0; ) {
+            size_t dk = (k2 > 1 && r[k2 - 1][k2 - 2] != 0.0) ? 2 : 1; /* The size of this block of R */
+            size_t k1 = k2 - dk, nu = dk * dl; /* The first row of the block and the number of unknowns */
+            double M[16], b[4];
+
+            memset(M, 0, sizeof(M));
+            for (size_t a = 0; a < dk; a++) {
+                for (size_t c = 0; c < dl; c++) {
+                    double rhs = f[k1 + a][l1 + c];
+                    for (size_t j = k2; j < m; j++) {
+                        rhs -= r[k1 + a][j] * f[j][l1 + c];
+                    }
+                    for (size_t j = 0; j < l1; j++) {
+                        rhs -= f[k1 + a][j] * s[j][l1 + c];
+                    }
+                    b[a * dl + c] = rhs;
+                    for (size_t t = 0; t < dk; t++) {
+                        M[(a * dl + c) * nu + t * dl + c] += r[k1 + a][k1 + t];
+                    }
+                    for (size_t t = 0; t < dl; t++) {
+                        M[(a * dl + c) * nu + a * dl + t] += s[l1 + t][l1 + c];
+                    }
+                }
+            }
+            sylvester_small_solve(M, b, nu, smin);
+            for (size_t a = 0; a < dk; a++) {
+                for (size_t c = 0; c < dl; c++) {
+                    f[k1 + a][l1 + c] = b[a * dl + c];
+                }
+            }
+            k2 = k1;
+        }
+        l1 += dl;
+    }
+}
+
+/**
+ * @brief The recursive blocked solver of R X + X S = F behind Matrix_sylvester_schur
+ *
+ * The larger of R and S is split in two (never inside a 2 by 2 block),
+ * giving two half-size equations coupled by a single Matrix_gemm, as in
+ * Jonsson and Kagstrom's RECSY. Nearly all of the work ends up in the
+ * products, and only blocks below BASE in both dimensions are solved
+ * directly by sylvester_base.
+ */
+static void sylvester_recursive(Matrix* R, Matrix* S, Matrix* F, double smin) {
+    const size_t BASE = 32; /* The largest size solved directly */
+    size_t m = R->nrows, n = S->nrows, k; /* The sizes and the split */
+    double** rows1, ** rows2, ** rows3; /* Row pointers for the views */
+
+    if (m <= BASE && n <= BASE) {
+        sylvester_base(R, S, F, smin);
+        return;
+    }
+
+    if (m >= n) {
+        //[R11 R12; 0 R22] [X1; X2] + [X1; X2] S = [F1; F2]: X2 first, then X1.
+        k = m / 2;
+        k -= (R->vals[k][k - 1] != 0.0);
+        rows1 = (double**) malloc(sizeof(double*) * k);
+        rows2 = (double**) malloc(sizeof(double*) * (m - k));
+        for (size_t i = 0; i < k; i++) {
+            rows1[i] = R->vals[i] + k;
+        }
+        for (size_t i = 0; i < m - k; i++) {
+            rows2[i] = R->vals[k + i] + k;
+        }
+        {
+            Matrix R11 = {k, k, R->vals}, R12 = {k, m - k, rows1}, R22 = {m - k, m - k, rows2};
+            Matrix F1 = {k, n, F->vals}, F2 = {m - k, n, F->vals + k};
+            sylvester_recursive(&R22, S, &F2, smin);
+            Matrix_gemm(-1.0, &R12, false, &F2, false, 1.0, &F1);
+            sylvester_recursive(&R11, S, &F1, smin);
+        }
+        free(rows1);
+        free(rows2);
+    }
+    else {
+        //R [X1 X2] + [X1 X2] [S11 S12; 0 S22] = [F1 F2]: X1 first, then X2.
+        k = n / 2;
+        k -= (S->vals[k][k - 1] != 0.0);
+        rows1 = (double**) malloc(sizeof(double*) * k);
+        rows2 = (double**) malloc(sizeof(double*) * (n - k));
+        rows3 = (double**) malloc(sizeof(double*) * m);
+        for (size_t i = 0; i < k; i++) {
+            rows1[i] = S->vals[i] + k;
+        }
+        for (size_t i = 0; i < n - k; i++) {
+            rows2[i] = S->vals[k + i] + k;
+        }
+        for (size_t i = 0; i < m; i++) {
+            rows3[i] = F->vals[i] + k;
+        }
+        {
+            Matrix S11 = {k, k, S->vals}, S12 = {k, n - k, rows1}, S22 = {n - k, n - k, rows2};
+            Matrix F1 = {m, k, F->vals}, F2 = {m, n - k, rows3};
+            sylvester_recursive(R, &S11, &F1, smin);
+            Matrix_gemm(-1.0, &F1, false, &S12, false, 1.0, &F2);
+            sylvester_recursive(R, &S22, &F2, smin);
+        }
+        free(rows1);
+        free(rows2);
+        free(rows3);
+    }
+}
+
+/**
+ * @brief Solves the Sylvester equation R X + X S = F for quasi-triangular R and S
+ *
+ * R and S must be upper quasi-triangular, as the Schur forms from Matrix_eig
+ * are. The solver is recursive and blocked (see sylvester_recursive), so it
+ * takes O(m n (m + n)) operations, nearly all in Matrix_gemm. When the Schur
+ * forms do not change, as when the coefficients stay fixed and only the
+ * right-hand side does, this is all that needs to be done for each new F.
+ *
+ * The equation is singular when an eigenvalue of R is the negative of one of
+ * S. Divisors smaller than eps max(|R|, |S|) are then replaced by it, as in
+ * LAPACK's xTRSYL, so the solution is large but finite.
+ *
+ * @param R the m by m upper quasi-triangular matrix
+ * @param S the n by n upper quasi-triangular matrix
+ * @param F the m by n right-hand side, overwritten by the solution X
+ * @return 0 if the operation was successful, otherwise 1
+ */
+int Matrix_sylvester_schur(Matrix* R, Matrix* S, Matrix* F) {
+    double big = 0.0; /* The largest entry of R and S */
+
+    //If the arguments are invalid, return 1.
+    if (R == NULL || S == NULL || F == NULL || R->vals == NULL || S->vals == NULL || F->vals == NULL) {
+        return 1;
+    }
+    if (R->nrows != R->ncols || S->nrows != S->ncols || F->nrows != R->nrows || F->ncols != S->nrows) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < R->nrows; i++) {
+        for (size_t j = 0; j < R->ncols; j++) {
+            big = fmax(big, fabs(R->vals[i][j]));
+        }
+    }
+    for (size_t i = 0; i < S->nrows; i++) {
+        for (size_t j = 0; j < S->ncols; j++) {
+            big = fmax(big, fabs(S->vals[i][j]));
+        }
+    }
+    sylvester_recursive(R, S, F, fmax(DBL_EPSILON * big, DBL_MIN));
+    return 0;
+}
+
+/**
+ * @brief Solves the Sylvester equation A X + X B = C by the Bartels-Stewart method
+ *
+ * With the Schur forms A = U R U^T and B = V S V^T from Matrix_eig, the
+ * equation becomes R Y + Y S = U^T C V with X = U Y V^T, which
+ * Matrix_sylvester_schur solves. The cost is O(m^3 + n^3 + m n (m + n)),
+ * against O(m^3 n^3) for the m n by m n linear system of the vectorized
+ * equation. See Matrix_sylvester_schur for the singular case.
+ *
+ * @param A an m by m matrix
+ * @param B an n by n matrix
+ * @param C the m by n right-hand side
+ * @return Matrix* the m by n solution X or NULL if the operation is invalid
+ *         or the Schur form of A or B could not be computed
+ */
+Matrix* Matrix_sylvester(Matrix* A, Matrix* B, Matrix* C) {
+    Matrix* R, * U, * S, * V, * W, * ret; /* The Schur forms, their vectors, work space and the solution */
+    double* wr, * wi; /* The eigenvalues, which are not needed */
+    size_t m, n;
+    int status;
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || B == NULL || C == NULL || A->vals == NULL || B->vals == NULL || C->vals == NULL) {
+        return NULL;
+    }
+    if (A->nrows != A->ncols || B->nrows != B->ncols || C->nrows != A->nrows || C->ncols != B->nrows) {
+        return NULL;
+    }
+
+    m = A->nrows;
+    n = B->nrows;
+    R = new_Matrix(m, m);
+    U = new_Matrix(m, m);
+    S = new_Matrix(n, n);
+    V = new_Matrix(n, n);
+    wr = (double*) malloc(sizeof(double) * (m + n));
+    wi = (double*) malloc(sizeof(double) * (m + n));
+    status = Matrix_eig(A, wr, wi, R, U, NULL);
+    status |= Matrix_eig(B, wr + m, wi + m, S, V, NULL);
+    free(wr);
+    free(wi);
+
+    ret = NULL;
+    if (status == 0) {
+        W = new_Matrix(m, n);
+        ret = new_Matrix(m, n);
+        Matrix_gemm(1.0, U, true, C, false, 0.0, W);
+        Matrix_gemm(1.0, W, false, V, false, 0.0, ret);
+        Matrix_sylvester_schur(R, S, ret);
+        Matrix_gemm(1.0, U, false, ret, false, 0.0, W);
+        Matrix_gemm(1.0, W, false, V, true, 0.0, ret);
+        delete_Matrix(W);
+    }
+
+    delete_Matrix(R);
+    delete_Matrix(U);
+    delete_Matrix(S);
+    delete_Matrix(V);
+    return ret;
+}
+
+/**
+ * @brief Solves the Lyapunov equation A X + X A^T = C by the Bartels-Stewart method
+ *
+ * Only one Schur form, A = U T U^T, is needed, giving T Y + Y T^T = U^T C U
+ * with X = U Y U^T. T^T is lower quasi-triangular, but reversing the order
+ * of its rows and columns makes it upper quasi-triangular, so with the
+ * columns of Y reversed to match, Matrix_sylvester_schur applies. For the
+ * usual form A X + X A^T + Q = 0, pass C = -Q. X is symmetric when C is, up
+ * to rounding.
+ *
+ * @param A an n by n matrix
+ * @param C the n by n right-hand side
+ * @return Matrix* the n by n solution X or NULL if the operation is invalid
+ *         or the Schur form of A could not be computed
+ */
+Matrix* Matrix_lyapunov(Matrix* A, Matrix* C) {
+    Matrix* T, * U, * S, * W, * ret; /* The Schur form, its vectors, T^T reversed, work space and the solution */
+    double* wr, * wi; /* The eigenvalues, which are not needed */
+    size_t n;
+    int status;
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || C == NULL || A->vals == NULL || C->vals == NULL) {
+        return NULL;
+    }
+    if (A->nrows != A->ncols || C->nrows != A->nrows || C->ncols != A->nrows) {
+        return NULL;
+    }
+
+    n = A->nrows;
+    T = new_Matrix(n, n);
+    U = new_Matrix(n, n);
+    wr = (double*) malloc(sizeof(double) * n);
+    wi = (double*) malloc(sizeof(double) * n);
+    status = Matrix_eig(A, wr, wi, T, U, NULL);
+    free(wr);
+    free(wi);
+    if (status != 0) {
+        delete_Matrix(T);
+        delete_Matrix(U);
+        return NULL;
+    }
+
+    //S(i, j) = T(n-1-j, n-1-i), and W = U^T C U with its columns reversed.
+    S = new_Matrix(n, n);
+    W = new_Matrix(n, n);
+    ret = new_Matrix(n, n);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            S->vals[i][j] = T->vals[n - 1 - j][n - 1 - i];
+        }
+    }
+    Matrix_gemm(1.0, U, true, C, false, 0.0, W);
+    Matrix_gemm(1.0, W, false, U, false, 0.0, ret);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            W->vals[i][j] = ret->vals[i][n - 1 - j];
+        }
+    }
+    Matrix_sylvester_schur(T, S, W);
+
+    //X = U Y U^T, undoing the column reversal.
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            ret->vals[i][j] = W->vals[i][n - 1 - j];
+        }
+    }
+    Matrix_gemm(1.0, U, false, ret, false, 0.0, W);
+    Matrix_gemm(1.0, W, false, U, true, 0.0, ret);
+
+    delete_Matrix(T);
+    delete_Matrix(U);
+    delete_Matrix(S);
+    delete_Matrix(W);
+    return ret;
+}
+
+/**
+ * @brief Multiplies by the orthogonal factor of a QR factorization, C = Q C
+ *
+ * Q = H(0) H(1) ... H(k-1) as stored by Matrix_qrcp. The reflectors are
+ * applied 32 at a time, from the last block back, each block with
+ * block_reflector_left.
+ *
+ * @param QR the factorization, with the reflectors below the diagonal
+ * @param tau their scales
+ * @param k the number of reflectors
+ * @param C the matrix to multiply, with as many rows as QR
+ */
+static void qr_apply_q(Matrix* QR, double* tau, size_t k, Matrix* C) {
+    const size_t NB = 32; /* Reflectors per block */
+    size_t m = QR->nrows;
+    double** rows = (double**) malloc(sizeof(double*) * (m + 1)); /* Row pointers for C(j0:m, :) */
+
+    for (size_t b = (k + NB - 1) / NB; b-- > 0; ) {
+        size_t j0 = b * NB, kb = (k - j0 < NB) ? k - j0 : NB; /* The block's first reflector and size */
+        Matrix* V = new_Matrix(m - j0, kb);
+        Matrix* T = new_Matrix(kb, kb);
+        Matrix Cb = {m - j0, C->ncols, rows}; /* C(j0:m, :) */
+
+        for (size_t j = 0; j < kb; j++) {
+            V->vals[j][j] = 1.0;
+            for (size_t i = j + 1; i < m - j0; i++) {
+                V->vals[i][j] = QR->vals[j0 + i][j0 + j];
+            }
+            reflector_triangle_column(V, tau + j0, T, j);
+        }
+        for (size_t i = 0; i < m - j0; i++) {
+            rows[i] = C->vals[j0 + i];
+        }
+        block_reflector_left(V, T, false, &Cb);
+        delete_Matrix(V);
+        delete_Matrix(T);
+    }
+    free(rows);
+}
+
+/**
+ * @brief Orthogonalizes the rows of W by one-sided Jacobi rotations
+ *
+ * Each sweep rotates every pair of rows to make them orthogonal, skipping
+ * pairs that already are to working precision, until a sweep rotates none.
+ * The pairs are visited in round-robin order, which splits a sweep into
+ * rounds of disjoint pairs that can be rotated in parallel. The rotations are
+ * also applied to the rows of G.
+ *
+ * On return the rows are sorted by decreasing norm, with the norms (the
+ * singular values of W) in s, and normalized. A row that is exactly zero is
+ * replaced by a unit vector orthogonal to the ones above it.
+ *
+ * @param W the k by p matrix, k <= p
+ * @param G a k by k matrix, normally the identity, or NULL
+ * @param s receives the k norms
+ * @return 0 if the sweeps converged, otherwise 1
+ */
+static int svd_jacobi(Matrix* W, Matrix* G, double* s) {
+    const size_t MAXSWEEPS = 60;
+    size_t k = W->nrows, p = W->ncols, kk = k + (k % 2); /* The sizes, with a dummy row when k is odd */
+    double tol = sqrt((double) p) * DBL_EPSILON; /* When two rows count as orthogonal */
+    size_t* order = (size_t*) malloc(sizeof(size_t) * (kk + 1)); /* The round-robin positions, then the sorted rows */
+    double** rows = (double**) malloc(sizeof(double*) * (k + 1)); /* The rows in sorted order */
+    size_t rotated = 1;
+    int status = 0;
+
+    for (size_t i = 0; i < kk; i++) {
+        order[i] = i;
+    }
+    for (size_t sweep = 0; rotated > 0; sweep++) {
+        if (sweep == MAXSWEEPS) {
+            status = 1;
+            break;
+        }
+        rotated = 0;
+        for (size_t round = 0; round + 1 < kk; round++) {
+            size_t last = order[kk - 1];
+
+#           pragma omp parallel for num_threads(2) reduction(+: rotated) if(p > 64)
+            for (size_t t = 0; t < kk / 2; t++) {
+                size_t i = order[t], j = order[kk - 1 - t];
+                double a = 0.0, b = 0.0, g = 0.0, zeta, tn, c, sn;
+                double* wi, * wj;
+
+                if (i >= k || j >= k) {
+                    continue;
+                }
+                wi = W->vals[i];
+                wj = W->vals[j];
+                for (size_t q = 0; q < p; q++) {
+                    a += wi[q] * wi[q];
+                    b += wj[q] * wj[q];
+                    g += wi[q] * wj[q];
+                }
+                if (fabs(g) <= tol * sqrt(a) * sqrt(b)) {
+                    continue;
+                }
+
+                //The rotation that makes rows i and j orthogonal.
+                zeta = (b - a) / (2.0 * g);
+                tn = copysign(1.0, zeta) / (fabs(zeta) + hypot(1.0, zeta));
+                c = 1.0 / sqrt(1.0 + tn * tn);
+                sn = c * tn;
+                for (size_t q = 0; q < p; q++) {
+                    double x = wi[q], y = wj[q];
+                    wi[q] = c * x - sn * y;
+                    wj[q] = sn * x + c * y;
+                }
+                for (size_t q = 0; G != NULL && q < k; q++) {
+                    double x = G->vals[i][q], y = G->vals[j][q];
+                    G->vals[i][q] = c * x - sn * y;
+                    G->vals[j][q] = sn * x + c * y;
+                }
+                rotated++;
+            }
+
+            //Keep order[0] in place and move the rest along by one.
+            memmove(order + 2, order + 1, sizeof(size_t) * (kk - 2));
+            order[1] = last;
+        }
+    }
+
+    //Sort the rows by decreasing norm.
+    for (size_t i = 0; i < k; i++) {
+        double sum = 0.0;
+        for (size_t q = 0; q < p; q++) {
+            sum += W->vals[i][q] * W->vals[i][q];
+        }
+        s[i] = sqrt(sum);
+        order[i] = i;
+    }
+    for (size_t i = 1; i < k; i++) {
+        size_t cur = order[i], j = i;
+        while (j > 0 && s[order[j - 1]] < s[cur]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = cur;
+    }
+    for (size_t i = 0; i < k; i++) {
+        rows[i] = W->vals[order[i]];
+    }
+    memcpy(W->vals, rows, sizeof(double*) * k);
+    for (size_t i = 0; G != NULL && i < k; i++) {
+        rows[i] = G->vals[order[i]];
+    }
+    if (G != NULL) {
+        memcpy(G->vals, rows, sizeof(double*) * k);
+    }
+
+    //Normalize the rows, completing the basis where they are zero.
+    for (size_t i = 0; i < k; i++) {
+        double* w = W->vals[i];
+        double sum = 0.0;
+
+        for (size_t q = 0; q < p; q++) {
+            sum += w[q] * w[q];
+        }
+        s[i] = sqrt(sum);
+        if (s[i] > 0.0) {
+            for (size_t q = 0; q < p; q++) {
+                w[q] /= s[i];
+            }
+            continue;
+        }
+        for (size_t e = 0; e < p; e++) {
+            memset(w, 0, sizeof(double) * p);
+            w[e] = 1.0;
+            for (size_t pass = 0; pass < 2; pass++) {
+                for (size_t j = 0; j < i; j++) {
+                    double d = vec_dot(W->vals[j], w, p);
+                    for (size_t q = 0; q < p; q++) {
+                        w[q] -= d * W->vals[j][q];
+                    }
+                }
+            }
+            sum = sqrt(vec_dot(w, w, p));
+            if (sum > 0.5) {
+                for (size_t q = 0; q < p; q++) {
+                    w[q] /= sum;
+                }
+                break;
+            }
+        }
+    }
+
+    free(order);
+    free(rows);
+    return status;
+}
+
+/**
+ * @brief Computes the thin singular value decomposition A = U diag(s) V^T
+ *
+ * With m >= n (otherwise A^T is decomposed and the roles of U and V swap),
+ * A is first factored as A P = Q R by Matrix_qrcp. The rows of R are then
+ * orthogonalized by one-sided Jacobi rotations (see svd_jacobi), G R = D W
+ * with G orthogonal, D diagonal and the rows of W orthonormal, so that
+ * U = Q G^T and V = P W^T. The pivoted QR shrinks the Jacobi problem to n by n
+ * and orders its rows so that few sweeps are needed.
+ *
+ * @param A the m by n matrix, which is not modified
+ * @param s receives the r = min(m, n) singular values, in decreasing order
+ * @param U receives the m by r left singular vectors unless it is NULL
+ * @param V receives the n by r right singular vectors unless it is NULL
+ * @return 0 if the operation was successful, otherwise 1 (including when the
+ *         Jacobi sweeps fail to converge)
+ */
+int Matrix_svd(Matrix* A, double* s, Matrix* U, Matrix* V) {
+    Matrix* B, * W, * G; /* The factored copy, the rows being orthogonalized and their rotations */
+    Matrix* left, * right; /* U and V, swapped when A is wide */
+    double* tau; /* The reflectors' scales */
+    size_t* perm; /* The column order */
+    size_t m, n, rank; /* The shape of B and the number of reflectors */
+    bool trans;
+    int status;
+
+    //If the arguments are invalid, return 1.
+    if (A == NULL || A->vals == NULL || s == NULL) {
+        return 1;
+    }
+    trans = (A->nrows < A->ncols);
+    m = trans ? A->ncols : A->nrows;
+    n = trans ? A->nrows : A->ncols;
+    if (U != NULL && (U->vals == NULL || U->nrows != A->nrows || U->ncols != n)) {
+        return 1;
+    }
+    if (V != NULL && (V->vals == NULL || V->nrows != A->ncols || V->ncols != n)) {
+        return 1;
+    }
+
+    B = new_Matrix(m, n);
+    for (size_t i = 0; i < A->nrows; i++) {
+        for (size_t j = 0; j < A->ncols; j++) {
+            if (trans) {
+                B->vals[j][i] = A->vals[i][j];
+            }
+            else {
+                B->vals[i][j] = A->vals[i][j];
+            }
+        }
+    }
+    tau = (double*) malloc(sizeof(double) * (n + 1));
+    perm = (size_t*) malloc(sizeof(size_t) * (n + 1));
+    Matrix_qrcp(B, tau, perm, 0.0, &rank);
+
+    left = trans ? V : U;
+    right = trans ? U : V;
+    W = new_Matrix(n, n);
+    for (size_t i = 0; i < rank; i++) {
+        memcpy(W->vals[i] + i, B->vals[i] + i, sizeof(double) * (n - i));
+    }
+    G = NULL;
+    if (left != NULL) {
+        G = new_Matrix(n, n);
+        for (size_t i = 0; i < n; i++) {
+            G->vals[i][i] = 1.0;
+        }
+    }
+    status = svd_jacobi(W, G, s);
+
+    //U = Q [G^T; 0] and V = P W^T.
+    if (left != NULL) {
+        for (size_t i = 0; i < m; i++) {
+            memset(left->vals[i], 0, sizeof(double) * n);
+        }
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < n; j++) {
+                left->vals[i][j] = G->vals[j][i];
+            }
+        }
+        qr_apply_q(B, tau, rank, left);
+    }
+    if (right != NULL) {
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < n; j++) {
+                right->vals[perm[j]][i] = W->vals[i][j];
+            }
+        }
+    }
+
+    delete_Matrix(B);
+    delete_Matrix(W);
+    delete_Matrix(G);
+    free(tau);
+    free(perm);
+    return status;
+}
+
+/**
+ * @brief Computes the Moore-Penrose pseudo-inverse of a matrix
+ *
+ * A^+ = V diag(1/s) U^T from Matrix_svd, where the singular values at or
+ * below tol times the largest are treated as zero. This gives the
+ * minimum-norm least-squares solution x = A^+ b of A x = b.
+ *
+ * @param A the m by n matrix, which is not modified
+ * @param tol the relative tolerance, or 0 for max(m, n) times the machine
+ *        epsilon
+ * @return Matrix* the n by m pseudo-inverse or NULL if the operation is
+ *         invalid or the SVD fails
+ */
+Matrix* Matrix_pinv(Matrix* A, double tol) {
+    Matrix* U, * V, * ret; /* The singular vectors and the pseudo-inverse */
+    double* s; /* The singular values */
+    size_t r, k; /* The number of singular values and how many are kept */
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || A->vals == NULL || tol < 0.0) {
+        return NULL;
+    }
+
+    r = (A->nrows < A->ncols) ? A->nrows : A->ncols;
+    if (tol == 0.0) {
+        tol = (double) ((A->nrows > A->ncols) ? A->nrows : A->ncols) * DBL_EPSILON;
+    }
+    s = (double*) malloc(sizeof(double) * r);
+    U = new_Matrix(A->nrows, r);
+    V = new_Matrix(A->ncols, r);
+    ret = NULL;
+    if (Matrix_svd(A, s, U, V) == 0) {
+        for (k = 0; k < r && s[k] > tol * s[0]; k++);
+        for (size_t i = 0; i < A->ncols; i++) {
+            for (size_t j = 0; j < k; j++) {
+                V->vals[i][j] /= s[j];
+            }
+        }
+        ret = new_Matrix(A->ncols, A->nrows);
+        if (k > 0) {
+            Matrix Vk = {A->ncols, k, V->vals}; /* The kept columns of V and U */
+            Matrix Uk = {A->nrows, k, U->vals};
+            Matrix_gemm(1.0, &Vk, false, &Uk, true, 0.0, ret);
+        }
+    }
+
+    free(s);
+    delete_Matrix(U);
+    delete_Matrix(V);
+    return ret;
+}
+
+/**
+ * @brief A thin singular value decomposition kept for solving many problems
+ *        with the same matrix
+ */
+struct SVD {
+    size_t r; /* The number of singular values */
+    double* s; /* The singular values, in decreasing order */
+    Matrix* U; /* The left singular vectors */
+    Matrix* V; /* The right singular vectors */
+};
+
+/**
+ * @brief Computes and stores the thin singular value decomposition of a matrix
+ *
+ * See Matrix_svd. The factorization can then solve least-squares problems
+ * with any number of right-hand sides and regularization parameters, each
+ * for the cost of a few matrix products.
+ *
+ * @param A the m by n matrix, which is not modified
+ * @return SVD* the factorization or NULL if A is invalid or the SVD fails
+ */
+SVD* new_SVD(Matrix* A) {
+    SVD* F; /* The factorization to return */
+
+    //If the arguments are invalid, return NULL.
+    if (A == NULL || A->vals == NULL) {
+        return NULL;
+    }
+
+    F = (SVD*) malloc(sizeof(SVD));
+    F->r = (A->nrows < A->ncols) ? A->nrows : A->ncols;
+    F->s = (double*) malloc(sizeof(double) * F->r);
+    F->U = new_Matrix(A->nrows, F->r);
+    F->V = new_Matrix(A->ncols, F->r);
+    if (Matrix_svd(A, F->s, F->U, F->V) != 0) {
+        delete_SVD(F);
+        return NULL;
+    }
+    return F;
+}
+
+/**
+ * @brief Frees everything held by a singular value decomposition
+ *
+ * @param F the factorization to be deleted
+ */
+void delete_SVD(SVD* F) {
+    //Do nothing if F is NULL.
+    if (F == NULL) {
+        return;
+    }
+
+    free(F->s);
+    delete_Matrix(F->U);
+    delete_Matrix(F->V);
+    free(F);
+}
+
+/**
+ * @brief Reports the singular values of a stored decomposition
+ *
+ * @param F the factorization
+ * @return const double* the min(m, n) singular values in decreasing order,
+ *         or NULL if F is NULL
+ */
+const double* SVD_values(SVD* F) {
+    return (F == NULL) ? NULL : F->s;
+}
+
+/**
+ * @brief Solves a Tikhonov-regularized least-squares problem with a stored SVD
+ *
+ * X minimizes ||A X - B||^2 + lambda ||X||^2 (ridge regression), that is
+ * X = V diag(s / (s^2 + lambda)) U^T B. Singular values at or below tol
+ * times the largest are dropped, so lambda = 0 gives the minimum-norm
+ * least-squares solution A^+ B. Unlike the normal equations
+ * (A^T A + lambda I) X = A^T B, this does not square the condition number.
+ *
+ * @param F the factorization of the m by n matrix A
+ * @param B an m by k matrix of right-hand sides
+ * @param lambda the regularization parameter, at least 0
+ * @param tol the relative tolerance, or 0 for max(m, n) times the machine
+ *        epsilon
+ * @return Matrix* the n by k solution or NULL if the operation is invalid
+ */
+Matrix* SVD_solve(SVD* F, Matrix* B, double lambda, double tol) {
+    Matrix* C, * ret; /* U^T B, filtered, and the solution */
+    size_t m, n;
+
+    //If the operation is invalid, return NULL.
+    if (F == NULL || B == NULL || B->vals == NULL || B->nrows != F->U->nrows || lambda < 0.0 || tol < 0.0) {
+        return NULL;
+    }
+
+    m = F->U->nrows;
+    n = F->V->nrows;
+    if (tol == 0.0) {
+        tol = (double) ((m > n) ? m : n) * DBL_EPSILON;
+    }
+    C = new_Matrix(F->r, B->ncols);
+    ret = new_Matrix(n, B->ncols);
+    Matrix_gemm(1.0, F->U, true, B, false, 0.0, C);
+    for (size_t i = 0; i < F->r; i++) {
+        double s = F->s[i];
+        double f = (s > tol * F->s[0]) ? s / (s * s + lambda) : 0.0; /* The filter factor */
+        for (size_t j = 0; j < B->ncols; j++) {
+            C->vals[i][j] *= f;
+        }
+    }
+    Matrix_gemm(1.0, F->V, false, C, false, 0.0, ret);
+
+    delete_Matrix(C);
+    return ret;
+}
+
+/**
+ * @brief Solves a ridge regression for many regularization parameters at once
+ *
+ * Column c of the result minimizes ||A x - b||^2 + lambda[c] ||x||^2, as
+ * SVD_solve with the default tolerance. U^T b is computed once and the
+ * solutions come from a single product with V, so a whole regularization
+ * path costs about as much as one solve.
+ *
+ * @param F the factorization of the m by n matrix A
+ * @param b a column vector with m rows
+ * @param lambda the count regularization parameters, each at least 0
+ * @param count the number of parameters
+ * @return Matrix* the n by count solutions or NULL if the operation is invalid
+ */
+Matrix* SVD_ridge_path(SVD* F, Matrix* b, const double* lambda, size_t count) {
+    Matrix* c, * D, * ret; /* U^T b, its filtered copies and the solutions */
+    size_t m, n;
+    double tol;
+
+    //If the operation is invalid, return NULL.
+    if (F == NULL || b == NULL || b->vals == NULL || b->nrows != F->U->nrows || b->ncols != 1 ||
+        lambda == NULL || count == 0) {
+        return NULL;
+    }
+    for (size_t j = 0; j < count; j++) {
+        if (!(lambda[j] >= 0.0)) {
+            return NULL;
+        }
+    }
+
+    m = F->U->nrows;
+    n = F->V->nrows;
+    tol = (double) ((m > n) ? m : n) * DBL_EPSILON;
+    c = new_Matrix(F->r, 1);
+    D = new_Matrix(F->r, count);
+    ret = new_Matrix(n, count);
+    Matrix_gemm(1.0, F->U, true, b, false, 0.0, c);
+    for (size_t i = 0; i < F->r; i++) {
+        double s = F->s[i];
+        if (s <= tol * F->s[0]) {
+            continue;
+        }
+        for (size_t j = 0; j < count; j++) {
+            D->vals[i][j] = s / (s * s + lambda[j]) * c->vals[i][0];
+        }
+    }
+    Matrix_gemm(1.0, F->V, false, D, false, 0.0, ret);
+
+    delete_Matrix(c);
+    delete_Matrix(D);
+    return ret;
+}
+
+/**
+ * @brief Updates one factor of a nonnegative matrix factorization in place
+ *
+ * Both factors are updated the same way, with H handled as its transpose:
+ * for W, P = X H^T and G = H H^T; for H^T, P = X^T W and G = W^T W. The
+ * update of each row only involves that row, so the rows are split between
+ * threads and each is updated in a single pass, without forming F G.
+ *
+ * The multiplicative update is F(i,c) *= P(i,c) / (F G)(i,c). HALS updates
+ * one column at a time, F(i,c) += (P(i,c) - (F G)(i,c)) / G(c,c), each step
+ * using the columns already updated, which is the usual column-by-column
+ * HALS sweep taken one row at a time. Entries are kept at least FLOOR so
+ * none gets stuck at zero.
+ *
+ * @param F the factor, with k columns
+ * @param P the product of the data with the other factor, shaped like F
+ * @param G the k by k Gram matrix of the other factor
+ * @param hals whether to use HALS rather than the multiplicative update
+ */
+static void nmf_update(Matrix* F, Matrix* P, Matrix* G, bool hals) {
+    const double FLOOR = 1e-16; /* The smallest entry kept */
+    size_t k = F->ncols;
+
+#   pragma omp parallel num_threads(2)
+    {
+        double* den = (double*) malloc(sizeof(double) * (k + 1)); /* This row of F G */
+
+#       pragma omp for schedule(static)
+        for (size_t i = 0; i < F->nrows; i++) {
+            double* f = F->vals[i];
+            double* p = P->vals[i];
+
+            if (hals) {
+                for (size_t c = 0; c < k; c++) {
+                    double* g = G->vals[c]; /* G is symmetric, so this is column c */
+                    double s = 0.0;
+                    if (g[c] <= 0.0) {
+                        continue;
+                    }
+#                   pragma omp simd reduction(+: s)
+                    for (size_t j = 0; j < k; j++) {
+                        s += f[j] * g[j];
+                    }
+                    f[c] = fmax(FLOOR, f[c] + (p[c] - s) / g[c]);
+                }
+                continue;
+            }
+
+            for (size_t c = 0; c < k; c++) {
+                den[c] = 0.0;
+            }
+            for (size_t j = 0; j < k; j++) {
+                double x = f[j];
+                double* g = G->vals[j];
+#               pragma omp simd
+                for (size_t c = 0; c < k; c++) {
+                    den[c] += x * g[c];
+                }
+            }
+            for (size_t c = 0; c < k; c++) {
+                f[c] = (den[c] > 0.0) ? fmax(FLOOR, f[c] * p[c] / den[c]) : f[c];
+            }
+        }
+        free(den);
+    }
+}
+
+/**
+ * @brief Multiplies the data of a nonnegative matrix factorization by a factor
+ *
+ * @param Xd the dense data, or NULL
+ * @param Xs the sparse data if Xd is NULL
+ * @param Xst the transpose of Xs
+ * @param trans whether to multiply by the transpose of the data
+ * @param F the factor
+ * @param P receives X F or X^T F
+ */
+static void nmf_product(Matrix* Xd, SparseMatrix* Xs, SparseMatrix* Xst, bool trans, Matrix* F, Matrix* P) {
+    if (Xd != NULL) {
+        Matrix_gemm(1.0, Xd, trans, F, false, 0.0, P);
+    }
+    else {
+        sparse_spmm(trans ? Xst : Xs, F, P);
+    }
+}
+
+/**
+ * @brief Runs the alternating updates of a nonnegative matrix factorization
+ *
+ * See Matrix_nmf. The squared error ||X - W H||^2 is tracked without
+ * forming W H, as ||X||^2 - 2 <W, X H^T> + <W^T W, H H^T>, from the
+ * products the next update needs anyway.
+ */
+static int nmf_run(Matrix* Xd, SparseMatrix* Xs, SparseMatrix* Xst, double xnorm2, Matrix* W, Matrix* H,
+                   bool hals, double tol, size_t maxiter, size_t* iters) {
+    size_t m = W->nrows, n = H->ncols, k = W->ncols;
+    Matrix* Ht = new_Matrix(n, k); /* H, transposed so both factors are updated by rows */
+    Matrix* PW = new_Matrix(m, k); /* X H^T */
+    Matrix* PH = new_Matrix(n, k); /* X^T W */
+    Matrix* GW = new_Matrix(k, k); /* W^T W */
+    Matrix* GH = new_Matrix(k, k); /* H H^T */
+    double prev = INFINITY; /* The last relative error */
+    size_t it;
+    bool done = false;
+
+    for (size_t i = 0; i < k; i++) {
+        for (size_t j = 0; j < n; j++) {
+            Ht->vals[j][i] = H->vals[i][j];
+        }
+    }
+    block_gram(W, W, GW);
+
+    for (it = 0; it < maxiter && !done; it++) {
+        double err = xnorm2; /* The squared error */
+
+        nmf_product(Xd, Xs, Xst, true, W, PH);
+        nmf_update(Ht, PH, GW, hals);
+        nmf_product(Xd, Xs, Xst, false, Ht, PW);
+        block_gram(Ht, Ht, GH);
+        nmf_update(W, PW, GH, hals);
+        block_gram(W, W, GW);
+
+#       pragma omp parallel for num_threads(2) reduction(-: err)
+        for (size_t i = 0; i < m; i++) {
+            for (size_t c = 0; c < k; c++) {
+                err -= 2.0 * W->vals[i][c] * PW->vals[i][c];
+            }
+        }
+        for (size_t a = 0; a < k; a++) {
+            for (size_t b = 0; b < k; b++) {
+                err += GW->vals[a][b] * GH->vals[a][b];
+            }
+        }
+        err = (xnorm2 > 0.0) ? sqrt(fmax(err, 0.0) / xnorm2) : 0.0;
+        done = (it > 0 && prev - err <= tol * prev);
+        prev = err;
+    }
+
+    for (size_t i = 0; i < k; i++) {
+        for (size_t j = 0; j < n; j++) {
+            H->vals[i][j] = Ht->vals[j][i];
+        }
+    }
+    if (iters != NULL) {
+        *iters = it;
+    }
+    delete_Matrix(Ht);
+    delete_Matrix(PW);
+    delete_Matrix(PH);
+    delete_Matrix(GW);
+    delete_Matrix(GH);
+    return done ? 0 : 1;
+}
+
+/**
+ * @brief Computes a nonnegative matrix factorization X ~ W H
+ *
+ * W and H are updated alternately, either by the multiplicative updates of
+ * Lee and Seung or by hierarchical alternating least squares (HALS), which
+ * usually needs far fewer iterations for the same cost per iteration. Each
+ * update costs one product with X, done with Matrix_gemm, and a k by k Gram
+ * matrix; the update itself is a fused pass over the rows of the factor (see
+ * nmf_update). The iteration stops once an update lowers the relative error
+ * ||X - W H|| / ||X|| by no more than tol times its value.
+ *
+ * @param X the m by n nonnegative data
+ * @param W the m by k initial guess, nonnegative, overwritten by the result
+ * @param H the k by n initial guess, nonnegative, overwritten by the result
+ * @param hals whether to use HALS rather than the multiplicative updates
+ * @param tol the relative decrease in the error at which to stop
+ * @param maxiter the most iterations to run
+ * @param iters receives the number of iterations run, unless it is NULL
+ * @return 0 if the iteration converged, otherwise 1
+ */
+int Matrix_nmf(Matrix* X, Matrix* W, Matrix* H, bool hals, double tol, size_t maxiter, size_t* iters) {
+    double xnorm2 = 0.0; /* ||X||^2 */
+
+    //If the arguments are invalid, return 1.
+    if (X == NULL || X->vals == NULL || W == NULL || W->vals == NULL || H == NULL || H->vals == NULL) {
+        return 1;
+    }
+    if (W->nrows != X->nrows || H->ncols != X->ncols || W->ncols != H->nrows || tol < 0.0) {
+        return 1;
+    }
+
+#   pragma omp parallel for num_threads(2) reduction(+: xnorm2)
+    for (size_t i = 0; i < X->nrows; i++) {
+        for (size_t j = 0; j < X->ncols; j++) {
+            xnorm2 += X->vals[i][j] * X->vals[i][j];
+        }
+    }
+    return nmf_run(X, NULL, NULL, xnorm2, W, H, hals, tol, maxiter, iters);
+}
+
+/**
+ * @brief Computes a nonnegative matrix factorization X ~ W H of sparse data
+ *
+ * As Matrix_nmf, with the products taken by sparse_spmm against X and its
+ * transpose, which is formed once, so the cost per iteration is
+ * proportional to the number of stored entries times k.
+ *
+ * @param X the m by n nonnegative data
+ * @param W the m by k initial guess, nonnegative, overwritten by the result
+ * @param H the k by n initial guess, nonnegative, overwritten by the result
+ * @param hals whether to use HALS rather than the multiplicative updates
+ * @param tol the relative decrease in the error at which to stop
+ * @param maxiter the most iterations to run
+ * @param iters receives the number of iterations run, unless it is NULL
+ * @return 0 if the iteration converged, otherwise 1
+ */
+int SparseMatrix_nmf(SparseMatrix* X, Matrix* W, Matrix* H, bool hals, double tol, size_t maxiter, size_t* iters) {
+    SparseMatrix* Xt; /* The transpose of X */
+    int status;
+
+    //If the arguments are invalid, return 1.
+    if (X == NULL || X->rowptr == NULL || W == NULL || W->vals == NULL || H == NULL || H->vals == NULL) {
+        return 1;
+    }
+    if (W->nrows != X->nrows || H->ncols != X->ncols || W->ncols != H->nrows || tol < 0.0) {
+        return 1;
+    }
+
+    Xt = SparseMatrix_transpose(X);
+    status = nmf_run(NULL, X, Xt, vec_dot(X->vals, X->vals, X->rowptr[X->nrows]), W, H, hals, tol, maxiter, iters);
+    delete_SparseMatrix(Xt);
+    return status;
+}
+
+/**
+ * @brief Reinterprets the bits of a double as an integer
+ */
+static inline uint64_t double_bits(double x) {
+    uint64_t u;
+    memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+/**
+ * @brief Reinterprets the bits of an integer as a double
+ */
+static inline double bits_double(uint64_t u) {
+    double x;
+    memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+/**
+ * @brief Computes exp(x) - 1 and exp(x) for one entry, without special cases
+ *
+ * x = k ln(2) + r with |r| <= ln(2)/2, the product k ln(2) being split in
+ * two parts so that r is exact (Cody and Waite). k is rounded by adding
+ * 1.5 2^52, which leaves it in the low bits of the sum, and 2^k is built from
+ * those bits directly, so there is no conversion between integers and
+ * doubles to stop the loop from vectorizing. exp(r) - 1 is a Taylor
+ * polynomial of degree 13, or 7 when fast.
+ *
+ * Only valid for |x| <= 708, where 2^k is a normal number.
+ *
+ * @param x the argument
+ * @param fast whether to use the shorter polynomial
+ * @param em1 receives exp(x) - 1
+ * @return double exp(x)
+ */
+static inline double exp_kernel(double x, bool fast, double* em1) {
+    const double SHIFT = 0x1.8p52; /* Rounds to an integer, kept in the low bits */
+    const double LN2HI = 0x1.62e42fee00000p-1, LN2LO = 0x1.a39ef35793c76p-33; /* ln(2) in two parts */
+    double kd = x * 0x1.71547652b82fep0 + SHIFT; /* k = round(x / ln(2)), plus SHIFT */
+    uint64_t ki = double_bits(kd);
+    double scale = bits_double((ki + 1023) << 52); /* 2^k */
+    double r, p;
+
+    kd -= SHIFT;
+    r = (x - kd * LN2HI) - kd * LN2LO;
+    if (fast) {
+        p = 1.0 / 5040;
+        p = p * r + 1.0 / 720;
+        p = p * r + 1.0 / 120;
+        p = p * r + 1.0 / 24;
+        p = p * r + 1.0 / 6;
+        p = p * r + 0.5;
+    }
+    else {
+        p = 1.0 / 6227020800;
+        p = p * r + 1.0 / 479001600;
+        p = p * r + 1.0 / 39916800;
+        p = p * r + 1.0 / 3628800;
+        p = p * r + 1.0 / 362880;
+        p = p * r + 1.0 / 40320;
+        p = p * r + 1.0 / 5040;
+        p = p * r + 1.0 / 720;
+        p = p * r + 1.0 / 120;
+        p = p * r + 1.0 / 24;
+        p = p * r + 1.0 / 6;
+        p = p * r + 0.5;
+    }
+    p = r + r * r * p; /* exp(r) - 1 */
+    *em1 = scale * p + (scale - 1.0);
+    return scale * p + scale;
+}
+
+/**
+ * @brief Computes exp over a row
+ *
+ * Every entry goes through exp_kernel, with no branches in the loop to keep
+ * it from vectorizing, and those beyond +-708, where the kernel is not
+ * valid, are then redone by the C library.
+ */
+static void exp_row(const double* x, double* y, size_t n, bool fast) {
+    double em1;
+
+    if (fast) {
+#       pragma omp simd private(em1)
+        for (size_t j = 0; j < n; j++) {
+            y[j] = exp_kernel(x[j], true, &em1);
+        }
+    }
+    else {
+#       pragma omp simd private(em1)
+        for (size_t j = 0; j < n; j++) {
+            y[j] = exp_kernel(x[j], false, &em1);
+        }
+    }
+    for (size_t j = 0; j < n; j++) {
+        if (!(fabs(x[j]) <= 708.0)) {
+            y[j] = exp(x[j]);
+        }
+    }
+}
+
+/**
+ * @brief Computes log(x) for one positive normal number
+ *
+ * x = 2^k z with sqrt(1/2) <= z < sqrt(2), both taken from the bits of x.
+ * With f = z - 1 and s = f / (2 + f), log(z) = 2 atanh(s) = f - s (f - R),
+ * where R = 2 s^2/3 + 2 s^4/5 + ... + 2 s^18/19 (up to 2 s^8/9 when fast)
+ * and |s| < 0.172.
+ *
+ * @param x the argument
+ * @param fast whether to use the shorter polynomial
+ * @return double log(x)
+ */
+static inline double log_kernel(double x, bool fast) {
+    const double LN2HI = 0x1.62e42fee00000p-1, LN2LO = 0x1.a39ef35793c76p-33; /* ln(2) in two parts */
+    const uint64_t ONE = 0x3ff0000000000000ULL; /* The bits of 1 */
+    uint64_t ix = double_bits(x);
+    uint64_t w = ix + (ONE - 0x3fe6a09e667f3bcdULL); /* Less the bits of sqrt(1/2), so the exponent field is k + 1023 */
+    double k = bits_double((w >> 52) | 0x4330000000000000ULL) - (0x1p52 + 1023.0);
+    double f = bits_double(ix - (w & 0xfff0000000000000ULL) + ONE) - 1.0;
+    double s = f / (2.0 + f);
+    double z = s * s;
+    double p;
+
+    if (fast) {
+        p = 2.0 / 9;
+        p = p * z + 2.0 / 7;
+        p = p * z + 2.0 / 5;
+        p = p * z + 2.0 / 3;
+    }
+    else {
+        p = 2.0 / 19;
+        p = p * z + 2.0 / 17;
+        p = p * z + 2.0 / 15;
+        p = p * z + 2.0 / 13;
+        p = p * z + 2.0 / 11;
+        p = p * z + 2.0 / 9;
+        p = p * z + 2.0 / 7;
+        p = p * z + 2.0 / 5;
+        p = p * z + 2.0 / 3;
+    }
+    return k * LN2HI + (f + (k * LN2LO - s * (f - z * p)));
+}
+
+/**
+ * @brief Computes log over a row
+ *
+ * Zero, negative, subnormal and non-finite entries are passed to the C
+ * library; log_kernel handles the rest.
+ */
+static void log_row(const double* x, double* y, size_t n, bool fast) {
+    if (fast) {
+#       pragma omp simd
+        for (size_t j = 0; j < n; j++) {
+            y[j] = log_kernel(x[j], true);
+        }
+    }
+    else {
+#       pragma omp simd
+        for (size_t j = 0; j < n; j++) {
+            y[j] = log_kernel(x[j], false);
+        }
+    }
+    for (size_t j = 0; j < n; j++) {
+        if (!(x[j] >= DBL_MIN && x[j] <= DBL_MAX)) {
+            y[j] = log(x[j]);
+        }
+    }
+}
+
+/**
+ * @brief Computes sqrt over a row
+ *
+ * The C library's sqrt is correctly rounded and compiles to the hardware
+ * instruction. Compilers do not vectorize it unless told that errno is not
+ * needed, but a Newton iteration for 1/sqrt(x) that does vectorize was
+ * measured to be no faster, so there is no separate fast kernel.
+ */
+static void sqrt_row(const double* x, double* y, size_t n, bool fast) {
+    //There is no fast kernel, as explained above.
+    (void) fast;
+    for (size_t j = 0; j < n; j++) {
+        y[j] = sqrt(x[j]);
+    }
+}
+
+/**
+ * @brief Computes tanh over a row
+ *
+ * tanh(|x|) = e / (e + 2) with e = exp(2|x|) - 1 from exp_kernel, which
+ * stays accurate for small x. For |x| > 20, and NaN, the C library's tanh is
+ * used; it is 1 to double precision there.
+ */
+static void tanh_row(const double* x, double* y, size_t n, bool fast) {
+    double e;
+
+    if (fast) {
+#       pragma omp simd private(e)
+        for (size_t j = 0; j < n; j++) {
+            exp_kernel(2.0 * fabs(x[j]), true, &e);
+            y[j] = copysign(e / (e + 2.0), x[j]);
+        }
+    }
+    else {
+#       pragma omp simd private(e)
+        for (size_t j = 0; j < n; j++) {
+            exp_kernel(2.0 * fabs(x[j]), false, &e);
+            y[j] = copysign(e / (e + 2.0), x[j]);
+        }
+    }
+    for (size_t j = 0; j < n; j++) {
+        if (!(fabs(x[j]) <= 20.0)) {
+            y[j] = tanh(x[j]);
+        }
+    }
+}
+
+/**
+ * @brief Applies a row kernel to every row of a matrix
+ *
+ * @param A the matrix
+ * @param fast whether to use the faster, less accurate kernel
+ * @param row the kernel
+ * @return Matrix* the result or NULL if A is invalid
+ */
+static Matrix* elementwise_math(Matrix* A, bool fast, void (*row)(const double*, double*, size_t, bool)) {
+    Matrix* ret; /* The result to return */
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || A->vals == NULL) {
+        return NULL;
+    }
+
+    ret = new_Matrix(A->nrows, A->ncols);
+#   pragma omp parallel for num_threads(2) schedule(static)
+    for (size_t i = 0; i < A->nrows; i++) {
+        row(A->vals[i], ret->vals[i], A->ncols, fast);
+    }
+    return ret;
+}
+
+/**
+ * @brief Computes the exponential of every entry of a matrix
+ *
+ * The rows are split between threads and each is evaluated by a loop the
+ * compiler vectorizes (see exp_kernel). The error is at most about 1 ULP,
+ * or a relative 1e-8 when fast. Entries beyond +-708 are passed to the C
+ * library's exp, so overflow, underflow and NaN behave as usual.
+ *
+ * @param A the matrix
+ * @param fast whether to use the faster, less accurate kernel
+ * @return Matrix* the matrix of exp(A(i,j)) or NULL if A is invalid
+ */
+Matrix* Matrix_exp(Matrix* A, bool fast) {
+    return elementwise_math(A, fast, exp_row);
+}
+
+/**
+ * @brief Computes the natural logarithm of every entry of a matrix
+ *
+ * Vectorized like Matrix_exp (see log_row). The error is at most about
+ * 1 ULP, or a relative 3e-9 when fast. Entries that are not positive normal
+ * numbers are passed to the C library's log, so log(0) is -infinity and
+ * negative entries give NaN.
+ *
+ * @param A the matrix
+ * @param fast whether to use the faster, less accurate kernel
+ * @return Matrix* the matrix of log(A(i,j)) or NULL if A is invalid
+ */
+Matrix* Matrix_log(Matrix* A, bool fast) {
+    return elementwise_math(A, fast, log_row);
+}
+
+/**
+ * @brief Computes the square root of every entry of a matrix
+ *
+ * The result is correctly rounded (0.5 ULP), whether or not fast is set
+ * (see sqrt_row).
+ *
+ * @param A the matrix
+ * @param fast accepted for symmetry with Matrix_exp; it has no effect
+ * @return Matrix* the matrix of sqrt(A(i,j)) or NULL if A is invalid
+ */
+Matrix* Matrix_sqrt(Matrix* A, bool fast) {
+    return elementwise_math(A, fast, sqrt_row);
+}
+
+/**
+ * @brief Computes the hyperbolic tangent of every entry of a matrix
+ *
+ * Vectorized like Matrix_exp (see tanh_row). The error is below 3 ULP, or a
+ * relative 3e-8 when fast.
+ *
+ * @param A the matrix
+ * @param fast whether to use the faster, less accurate kernel
+ * @return Matrix* the matrix of tanh(A(i,j)) or NULL if A is invalid
+ */
+Matrix* Matrix_tanh(Matrix* A, bool fast) {
+    return elementwise_math(A, fast, tanh_row);
+}
+
+/**
+ * @brief Splits a matrix into the batches handed to a map callback
+ *
+ * A batch is a run of at most MATRIX_MAP_CHUNK entries. Rows at least that
+ * long are cut into several batches, used in place; shorter rows are copied
+ * together, as many whole rows as fit, into a contiguous buffer.
+ *
+ * @param A the matrix
+ * @param rows receives the number of rows per batch; 1 means in place
+ * @param per receives the number of batches per row when rows is 1
+ * @return size_t the number of batches
+ */
+static size_t map_plan(Matrix* A, size_t* rows, size_t* per) {
+    *rows = (A->ncols >= MATRIX_MAP_CHUNK) ? 1 : MATRIX_MAP_CHUNK / A->ncols;
+    *per = (*rows == 1) ? (A->ncols + MATRIX_MAP_CHUNK - 1) / MATRIX_MAP_CHUNK : 1;
+    return (*rows == 1) ? A->nrows * *per : (A->nrows + *rows - 1) / *rows;
+}
+
+/**
+ * @brief Copies rows i0 to i0+count-1 of a matrix into a contiguous buffer
+ */
+static void map_gather(Matrix* A, size_t i0, size_t count, double* buf) {
+    for (size_t i = 0; i < count; i++) {
+        memcpy(buf + i * A->ncols, A->vals[i0 + i], sizeof(double) * A->ncols);
+    }
+}
+
+/**
+ * @brief Copies a contiguous buffer back into rows i0 to i0+count-1 of a matrix
+ */
+static void map_scatter(Matrix* A, size_t i0, size_t count, const double* buf) {
+    for (size_t i = 0; i < count; i++) {
+        memcpy(A->vals[i0 + i], buf + i * A->ncols, sizeof(double) * A->ncols);
+    }
+}
+
+/**
+ * @brief Applies a user function to every entry of a matrix
+ *
+ * f is called on contiguous batches of up to MATRIX_MAP_CHUNK entries (see
+ * map_plan) rather than once per entry, so the cost of the call is spread
+ * over the batch and f's own loop can be vectorized. The batches are split
+ * between threads, so f must be safe to call concurrently; ctx is passed
+ * through unchanged.
+ *
+ * @param A the matrix
+ * @param f the function, which sets y[t] from x[t] for t < n
+ * @param ctx passed to every call of f
+ * @return Matrix* the result or NULL if the operation is invalid
+ */
+Matrix* Matrix_map(Matrix* A, MatrixMapFunc f, void* ctx) {
+    Matrix* ret; /* The result to return */
+    size_t rows, per, total; /* The batches; see map_plan */
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || A->vals == NULL || f == NULL) {
+        return NULL;
+    }
+
+    ret = new_Matrix(A->nrows, A->ncols);
+    total = map_plan(A, &rows, &per);
+#   pragma omp parallel num_threads(2)
+    {
+        double* x = (rows > 1) ? (double*) malloc(sizeof(double) * MATRIX_MAP_CHUNK) : NULL; /* Gathered input */
+        double* y = (rows > 1) ? (double*) malloc(sizeof(double) * MATRIX_MAP_CHUNK) : NULL; /* Output to scatter */
+
+#       pragma omp for schedule(static)
+        for (size_t c = 0; c < total; c++) {
+            if (rows == 1) {
+                size_t i = c / per, j0 = (c % per) * MATRIX_MAP_CHUNK;
+                size_t len = (A->ncols - j0 < MATRIX_MAP_CHUNK) ? A->ncols - j0 : MATRIX_MAP_CHUNK;
+                f(A->vals[i] + j0, ret->vals[i] + j0, len, ctx);
+            }
+            else {
+                size_t i0 = c * rows, count = (A->nrows - i0 < rows) ? A->nrows - i0 : rows;
+                map_gather(A, i0, count, x);
+                f(x, y, count * A->ncols, ctx);
+                map_scatter(ret, i0, count, y);
+            }
+        }
+        free(x);
+        free(y);
+    }
+    return ret;
+}
+
+/**
+ * @brief Applies a user function to the matching entries of two matrices
+ *
+ * As Matrix_map, with f given the same batch of both A and B.
+ *
+ * @param A the first matrix
+ * @param B the second matrix, the same shape as A
+ * @param f the function, which sets z[t] from x[t] and y[t] for t < n
+ * @param ctx passed to every call of f
+ * @return Matrix* the result or NULL if the operation is invalid
+ */
+Matrix* Matrix_zip_map(Matrix* A, Matrix* B, MatrixZipMapFunc f, void* ctx) {
+    Matrix* ret; /* The result to return */
+    size_t rows, per, total; /* The batches; see map_plan */
+
+    //If the operation is invalid, return NULL.
+    if (A == NULL || A->vals == NULL || B == NULL || B->vals == NULL || f == NULL) {
+        return NULL;
+    }
+    if (A->nrows != B->nrows || A->ncols != B->ncols) {
+        return NULL;
+    }
+
+    ret = new_Matrix(A->nrows, A->ncols);
+    total = map_plan(A, &rows, &per);
+#   pragma omp parallel num_threads(2)
+    {
+        double* x = (rows > 1) ? (double*) malloc(sizeof(double) * MATRIX_MAP_CHUNK) : NULL; /* Gathered inputs */
+        double* y = (rows > 1) ? (double*) malloc(sizeof(double) * MATRIX_MAP_CHUNK) : NULL;
+        double* z = (rows > 1) ? (double*) malloc(sizeof(double) * MATRIX_MAP_CHUNK) : NULL; /* Output to scatter */
+
+#       pragma omp for schedule(static)
+        for (size_t c = 0; c < total; c++) {
+            if (rows == 1) {
+                size_t i = c / per, j0 = (c % per) * MATRIX_MAP_CHUNK;
+                size_t len = (A->ncols - j0 < MATRIX_MAP_CHUNK) ? A->ncols - j0 : MATRIX_MAP_CHUNK;
+                f(A->vals[i] + j0, B->vals[i] + j0, ret->vals[i] + j0, len, ctx);
+            }
+            else {
+                size_t i0 = c * rows, count = (A->nrows - i0 < rows) ? A->nrows - i0 : rows;
+                map_gather(A, i0, count, x);
+                map_gather(B, i0, count, y);
+                f(x, y, z, count * A->ncols, ctx);
+                map_scatter(ret, i0, count, z);
+            }
+        }
+        free(x);
+        free(y);
+        free(z);
+    }
+    return ret;
+}
+
+/**
+ * @brief Maps every entry of a matrix and combines the results
+ *
+ * f maps a batch (see Matrix_map) and reduces it to one value, and combine
+ * joins those values: the result is init combined with the value of every
+ * batch, in order. The batches are mapped in parallel but combined in a
+ * fixed order, so the result does not depend on the number of threads even
+ * when combine is only approximately associative, as floating-point
+ * addition is.
+ *
+ * @param A the matrix
+ * @param f the function, which reduces x[t] for t < n to one value
+ * @param combine joins two values, as in combine(so_far, batch)
+ * @param init the value to start from, normally the identity of combine
+ * @param ctx passed to every call of f
+ * @return double the result, or 0 with errno set to EINVAL if the
+ *         arguments are invalid
+ */
+double Matrix_map_reduce(Matrix* A, MatrixMapReduceFunc f, double (*combine)(double, double), double init,
+                         void* ctx) {
+    double* part; /* The value of each batch */
+    size_t rows, per, total; /* The batches; see map_plan */
+    double ret = init;
+
+    //If the arguments are invalid, set errno and return 0.
+    if (A == NULL || A->vals == NULL || f == NULL || combine == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    total = map_plan(A, &rows, &per);
+    part = (double*) malloc(sizeof(double) * (total + 1));
+#   pragma omp parallel num_threads(2)
+    {
+        double* x = (rows > 1) ? (double*) malloc(sizeof(double) * MATRIX_MAP_CHUNK) : NULL; /* Gathered input */
+
+#       pragma omp for schedule(static)
+        for (size_t c = 0; c < total; c++) {
+            if (rows == 1) {
+                size_t i = c / per, j0 = (c % per) * MATRIX_MAP_CHUNK;
+                size_t len = (A->ncols - j0 < MATRIX_MAP_CHUNK) ? A->ncols - j0 : MATRIX_MAP_CHUNK;
+                part[c] = f(A->vals[i] + j0, len, ctx);
+            }
+            else {
+                size_t i0 = c * rows, count = (A->nrows - i0 < rows) ? A->nrows - i0 : rows;
+                map_gather(A, i0, count, x);
+                part[c] = f(x, count * A->ncols, ctx);
+            }
+        }
+        free(x);
+    }
+    for (size_t c = 0; c < total; c++) {
+        ret = combine(ret, part[c]);
+    }
+
+    free(part);
+    return ret;
+}
+
+/**
+ * @brief Computes one block of the Philox4x32-10 generator
+ *
+ * Philox (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3") is
+ * counter-based: the output is a keyed bijection of the counter, ten rounds
+ * of 32 by 32 bit multiplications whose high halves are mixed with the key,
+ * so any block can be computed directly from its index, in any order. There
+ * are no branches or tables, so a loop over counters vectorizes.
+ *
+ * @param ctr the counter
+ * @param key the key, which selects the stream
+ * @param a receives the first two words of the block
+ * @param b receives the last two words of the block
+ */
+static inline void philox(uint64_t ctr, uint64_t key, uint64_t* a, uint64_t* b) {
+    uint32_t c0 = (uint32_t) ctr, c1 = (uint32_t) (ctr >> 32), c2 = 0, c3 = 0; /* The counter words */
+    uint32_t k0 = (uint32_t) key, k1 = (uint32_t) (key >> 32); /* The round key */
+
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t) 0xD2511F53u * c0;
+        uint64_t p1 = (uint64_t) 0xCD9E8D57u * c2;
+        c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t) p1;
+        c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t) p0;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    *a = ((uint64_t) c1 << 32) | c0;
+    *b = ((uint64_t) c3 << 32) | c2;
+}
+
+/**
+ * @brief Turns 52 random bits into a double in [1, 2)
+ *
+ * The bits become the mantissa of a number with the exponent of 1, which
+ * avoids a conversion from a 64-bit integer that most vector units lack.
+ */
+static inline double random_mantissa(uint64_t bits) {
+    return bits_double(0x3ff0000000000000ULL | (bits >> 12));
+}
+
+/**
+ * @brief Computes sin(x) for |x| <= pi/2
+ *
+ * The Taylor polynomial of degree 21, whose error there is below 2e-18.
+ */
+static inline double sin_kernel(double x) {
+    double z = x * x;
+    double p = -1.0 / 51090942171709440000.0;
+
+    p = p * z + 1.0 / 121645100408832000.0;
+    p = p * z - 1.0 / 355687428096000.0;
+    p = p * z + 1.0 / 1307674368000.0;
+    p = p * z - 1.0 / 6227020800.0;
+    p = p * z + 1.0 / 39916800.0;
+    p = p * z - 1.0 / 362880.0;
+    p = p * z + 1.0 / 5040.0;
+    p = p * z - 1.0 / 120.0;
+    p = p * z + 1.0 / 6.0;
+    return x - x * z * p;
+}
+
+/**
+ * @brief The number of entries random_normal_row transforms per pass
+ */
+#define RANDOM_CHUNK 256
+
+/**
+ * @brief Fills entries first to first+n-1 of the uniform stream into y
+ */
+static void random_uniform_row(double* y, size_t n, uint64_t first, uint64_t seed, double lo, double width) {
+    uint64_t a, b;
+
+#   pragma omp simd private(a, b)
+    for (size_t j = 0; j < n; j++) {
+        philox(first + j, seed, &a, &b);
+        y[j] = lo + width * (random_mantissa(a) - 1.0);
+    }
+}
+
+/**
+ * @brief Fills entries first to first+n-1 of the normal stream into y
+ *
+ * Box-Muller, z = sqrt(-2 log(u)) cos(2 pi v), with u in (0, 1] and v in
+ * [-1/2, 1/2) from the two halves of the block. With w = |v| - 1/4,
+ * cos(2 pi v) = -sin(2 pi w) and |2 pi w| <= pi/2, so sin_kernel applies
+ * without further reduction, and u is a normal number, so log_kernel needs
+ * no special cases. The square root is taken in a separate pass, since
+ * compilers only vectorize it when errno is disabled.
+ */
+static void random_normal_row(double* y, size_t n, uint64_t first, uint64_t seed, double mean, double sd) {
+    const double TWOPI = 6.283185307179586476925;
+    double r[RANDOM_CHUNK]; /* -2 log(u) for each entry of the piece */
+    double c[RANDOM_CHUNK]; /* sd cos(2 pi v) for each entry of the piece */
+    uint64_t a, b;
+
+    for (size_t j0 = 0; j0 < n; j0 += RANDOM_CHUNK) {
+        size_t len = (n - j0 < RANDOM_CHUNK) ? n - j0 : RANDOM_CHUNK;
+
+#       pragma omp simd private(a, b)
+        for (size_t t = 0; t < len; t++) {
+            philox(first + j0 + t, seed, &a, &b);
+            r[t] = -2.0 * log_kernel(2.0 - random_mantissa(a), false);
+            c[t] = -sd * sin_kernel(TWOPI * (fabs(random_mantissa(b) - 1.5) - 0.25));
+        }
+        for (size_t t = 0; t < len; t++) {
+            y[j0 + t] = mean + sqrt(r[t]) * c[t];
+        }
+    }
+}
+
+/**
+ * @brief Fills a matrix with uniformly distributed random numbers
+ *
+ * Each entry is lo + (hi - lo) u, with u one of the 2^52 multiples of 2^-52
+ * in [0, 1), taken from a Philox4x32-10 stream keyed by seed (see
+ * philox). The rows are filled in parallel by a vectorized loop, and the
+ * result depends only on seed and the shape of A, never on the number of
+ * threads; different seeds give independent streams.
+ *
+ * @param A the matrix to fill
+ * @param lo the lower end of the range
+ * @param hi the upper end of the range
+ * @param seed selects the stream
+ * @return 0 if successful, otherwise 1
+ */
+int Matrix_random_uniform(Matrix* A, double lo, double hi, uint64_t seed) {
+    //If the arguments are invalid, return 1.
+    if (A == NULL || A->vals == NULL) {
+        return 1;
+    }
+
+#   pragma omp parallel for num_threads(2) schedule(static)
+    for (size_t i = 0; i < A->nrows; i++) {
+        random_uniform_row(A->vals[i], A->ncols, (uint64_t) i * A->ncols, seed, lo, hi - lo);
+    }
+    return 0;
+}
+
+/**
+ * @brief Fills a matrix with normally distributed random numbers
+ *
+ * As Matrix_random_uniform, with each entry transformed by Box-Muller (see
+ * random_normal_row) from the 128 bits of its own Philox block. The tails
+ * are cut off at about 8.5 standard deviations, where u reaches 2^-52.
+ *
+ * @param A the matrix to fill
+ * @param mean the mean
+ * @param sd the standard deviation
+ * @param seed selects the stream
+ * @return 0 if successful, otherwise 1
+ */
+int Matrix_random_normal(Matrix* A, double mean, double sd, uint64_t seed) {
+    //If the arguments are invalid, return 1.
+    if (A == NULL || A->vals == NULL || sd < 0.0) {
+        return 1;
+    }
+
+#   pragma omp parallel for num_threads(2) schedule(static)
+    for (size_t i = 0; i < A->nrows; i++) {
+        random_normal_row(A->vals[i], A->ncols, (uint64_t) i * A->ncols, seed, mean, sd);
+    }
+    return 0;
 }
\ No newline at end of file